@@ -0,0 +1,52 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <atomic>
+#include <cstdarg>
+
+typedef enum LogLevel
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} LogLevel;
+
+// calls above this level are compiled out, define it on the command line to keep debug in release builds
+#ifndef LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define LOG_MAX_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// each thread formats into its own lock-free ring, a background thread drains every ring to stderr
+void log_message(LogLevel level, const char *fmt, ...);
+void log_vmessage(LogLevel level, const char *fmt, va_list args);
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_debug(...)                                                                                                 \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG && log_enabled(LOG_LEVEL_DEBUG))                                          \
+            log_message(LOG_LEVEL_DEBUG, __VA_ARGS__);                                                                 \
+    } while (0)
+
+extern std::atomic<int> log_runtime_level;
+
+// runtime filter, info by default
+void log_set_level(LogLevel level);
+
+static inline int log_enabled(LogLevel level)
+{
+    return level <= log_runtime_level.load(std::memory_order_relaxed);
+}
+
+int log_parse_level(const char *name, LogLevel *level);
+
+// writes out everything logged so far, for paths that leave through _exit
+void log_flush(void);
+
+#endif // ASYNC_LOG_H
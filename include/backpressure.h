@@ -0,0 +1,51 @@
+#ifndef BACKPRESSURE_H
+#define BACKPRESSURE_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// what a live transcode gives up, in order, when the encoder cannot keep up with the input
+typedef enum DegradeLevel
+{
+    DEGRADE_NONE,
+    // the decoder skips frames nothing else references
+    DEGRADE_SKIP_NONREF,
+    // every other frame is dropped before the encoder
+    DEGRADE_HALF_RATE,
+    // the encoder is reopened with the fastest preset, only for outputs without global headers
+    DEGRADE_FAST_PRESET,
+    DEGRADE_LEVELS,
+} DegradeLevel;
+
+typedef struct BackpressureParams
+{
+    int enabled;
+    // seconds behind the input clock that trigger the last level, the earlier ones start at a quarter and a half
+    double max_lag;
+    // seconds a level is held before the next change, twice that below a quarter of max_lag steps back down
+    double settle;
+    // JSON counters and the list of level changes, NULL only logs them
+    const char *metrics_path;
+} BackpressureParams;
+
+typedef struct Backpressure Backpressure;
+
+typedef struct StreamingContext StreamingContext;
+typedef struct StreamingParams StreamingParams;
+
+void backpressure_default_params(BackpressureParams *params);
+
+// sp is what the video encoder was opened with, a faster preset reopens it the same way
+Backpressure *backpressure_alloc(const BackpressureParams *params, AVRational time_base, const StreamingParams *sp);
+
+// paces frames that arrive ahead of the input clock and degrades the pipeline when they arrive late;
+// returns 1 when the frame must not be encoded, -1 when reopening the encoder failed
+int backpressure_frame(Backpressure *bp, StreamingContext *decoder, StreamingContext *encoder, const AVFrame *frame);
+
+void backpressure_report(const Backpressure *bp);
+
+void backpressure_free(Backpressure **bp);
+
+#endif // BACKPRESSURE_H
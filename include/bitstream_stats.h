@@ -0,0 +1,28 @@
+#ifndef BITSTREAM_STATS_H
+#define BITSTREAM_STATS_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+typedef struct BitstreamParams
+{
+    // length of the sliding bitrate window
+    double window_seconds;
+    // VBV model in bits and bits per second, defaults follow prepare_video_encoder
+    int64_t vbv_buffer_size;
+    int64_t vbv_max_rate;
+    // buffer fullness before the first packet is removed, 0..1
+    double vbv_initial_fullness;
+    // optional JSON report, NULL to only log
+    const char *report_path;
+} BitstreamParams;
+
+void bitstream_default_params(BitstreamParams *params);
+
+// walks the packets of one stream with av_read_frame and a parser, nothing is decoded.
+// returns 1 when the VBV model underflowed, 0 when it held and -1 on error
+int probe_bitstream(AVFormatContext *avfc, int stream_index, const BitstreamParams *params);
+
+#endif // BITSTREAM_STATS_H
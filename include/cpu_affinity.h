@@ -0,0 +1,60 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <sched.h>
+
+typedef enum AffinityMode
+{
+    AFFINITY_OFF,
+    // the job's threads float over the CPUs of one node and its memory comes from that node
+    AFFINITY_NODE,
+    // as AFFINITY_NODE, and the demux thread gets one CPU of the node to itself
+    AFFINITY_PIN,
+} AffinityMode;
+
+typedef struct AffinityParams
+{
+    AffinityMode mode;
+    // -1 spreads jobs over the nodes
+    int node;
+} AffinityParams;
+
+typedef struct Placement
+{
+    AffinityMode mode;
+    int node;
+    int nodes;
+    // what the codec threads run on, the node minus demux_cpu
+    cpu_set_t cpus;
+    // -1 unless the mode is AFFINITY_PIN
+    int demux_cpu;
+    int memory_bound;
+    // the calling thread's mask before the job moved it
+    cpu_set_t previous;
+} Placement;
+
+void affinity_default_params(AffinityParams *params);
+
+int affinity_parse_mode(const char *name, AffinityMode *mode);
+
+// "auto" or a node number
+int affinity_parse_node(const char *value, int *node);
+
+int affinity_node_count(void);
+
+// picks a node, prefers its memory and restricts the calling thread to placement->cpus; call before
+// avcodec_open2 since codec threads and forked children inherit both
+int affinity_place_job(const AffinityParams *params, Placement *placement);
+
+// once the codecs are open, moves the calling thread onto demux_cpu
+int affinity_pin_demux(const Placement *placement);
+
+// for threads the job starts itself
+int affinity_join(const Placement *placement);
+
+// puts the calling thread back where it was before affinity_place_job, for threads that run more jobs
+void affinity_release(const Placement *placement);
+
+void affinity_report(const Placement *placement);
+
+#endif // CPU_AFFINITY_H
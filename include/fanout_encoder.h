@@ -0,0 +1,33 @@
+#ifndef FANOUT_ENCODER_H
+#define FANOUT_ENCODER_H
+
+#include <sys/types.h>
+
+#include "frame_ring.h"
+#include "video_process.h"
+
+#define FANOUT_MAX_TARGETS 8
+
+// one extra video-only output encoded in its own process from the shared decoded frames
+typedef struct FanoutTarget
+{
+    char *video_codec;
+    char *filename;
+    pid_t pid;
+} FanoutTarget;
+
+// "libx264:out.mp4"
+int fanout_parse_target(const char *spec, FanoutTarget *target);
+
+// forks one encoder process per target before the first packet is decoded, frames then reach
+// them through decoder->frame_ring
+int fanout_start(StreamingContext *decoder, const CropRect *crop, StreamingParams sp, FanoutTarget *targets,
+                 int count);
+
+// ends the stream and waits for every encoder, returns the number that failed
+int fanout_finish(StreamingContext *decoder, FanoutTarget *targets, int count);
+
+// stops and reaps every encoder after the transcode failed, their outputs stay incomplete
+void fanout_abort(StreamingContext *decoder, FanoutTarget *targets, int count);
+
+#endif // FANOUT_ENCODER_H
@@ -0,0 +1,45 @@
+#ifndef FASTSTART_H
+#define FASTSTART_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "mem_output.h"
+
+// how a non-fragmented MP4 gets moov in front of mdat without a second pass over the file on disk
+typedef enum FaststartMode
+{
+    FASTSTART_NONE,
+    // mdat is written straight to the file behind header space sized from the input
+    FASTSTART_RESERVE,
+    // the whole file is muxed in memory, moved in place there and written out once
+    FASTSTART_MEMORY,
+} FaststartMode;
+
+typedef struct FaststartParams
+{
+    FaststartMode mode;
+    int64_t memory_cap;
+} FaststartParams;
+
+typedef struct FaststartOutput
+{
+    FaststartMode mode;
+    MemOutput *memory;
+} FaststartOutput;
+
+int faststart_parse_mode(const char *name, FaststartMode *mode);
+
+// moov bytes the input's packets will need in the output index, with headroom
+int64_t faststart_estimate_moov_size(const AVFormatContext *input);
+
+// call before avio_open; returns 1 when the output pb is provided and must not be opened or closed by the caller
+int faststart_setup(FaststartOutput *out, const FaststartParams *params, AVFormatContext *output,
+                    const AVFormatContext *input, AVDictionary **muxer_opts);
+
+// after av_write_trailer, a NULL filename only releases the memory of a failed run
+int faststart_finish(FaststartOutput *out, const char *filename);
+
+#endif // FASTSTART_H
@@ -0,0 +1,50 @@
+#ifndef FRAME_ANALYSIS_H
+#define FRAME_ANALYSIS_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+typedef struct FrameAnalysisParams
+{
+    // frames whose luma mean and standard deviation stay below these are black (8-bit scale)
+    double black_luma;
+    double black_max_stddev;
+    double black_min_duration;
+    // mean absolute luma difference to the previous frame below which video counts as frozen
+    double freeze_max_difference;
+    double freeze_min_duration;
+    // rows and columns whose mean luma stays below this are treated as bars
+    double crop_luma;
+    // crop width and height are rounded down to a multiple of this
+    int crop_round;
+} FrameAnalysisParams;
+
+typedef struct CropRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} CropRect;
+
+typedef struct FrameAnalyzer FrameAnalyzer;
+
+void frame_analysis_default_params(FrameAnalysisParams *params);
+
+FrameAnalyzer *frame_analyzer_alloc(const FrameAnalysisParams *params, AVRational time_base);
+
+int frame_analyzer_push(FrameAnalyzer *fa, const AVFrame *frame);
+
+// closes open segments, call once after the last frame
+void frame_analyzer_finish(FrameAnalyzer *fa);
+
+// returns 1 and fills crop when bars were found, 0 when the whole picture is active
+int frame_analyzer_crop(const FrameAnalyzer *fa, CropRect *crop);
+
+int frame_analyzer_write_timeline(const FrameAnalyzer *fa, const char *path);
+
+void frame_analyzer_free(FrameAnalyzer **fa);
+
+#endif // FRAME_ANALYSIS_H
@@ -0,0 +1,41 @@
+#ifndef FRAME_DECIMATOR_H
+#define FRAME_DECIMATOR_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+typedef struct DecimateParams
+{
+    int enabled;
+    // mean absolute luma difference of a 16x16 block (8-bit scale) above which the frame is new
+    double block_max;
+    // blocks above this count as changed, more than changed_fraction of them also make the frame new
+    double block_changed;
+    double changed_fraction;
+    // most frames dropped in a row, 0 drops every duplicate
+    int max_drops;
+} DecimateParams;
+
+typedef struct FrameDecimator FrameDecimator;
+
+void decimate_default_params(DecimateParams *params);
+
+FrameDecimator *frame_decimator_alloc(const DecimateParams *params);
+
+// returns 1 when the frame repeats the last kept one closely enough to drop it; the kept frames keep their
+// timestamps, so each one lasts until the next. Frames in formats without a planar luma plane are kept, and
+// the first frame after a size or format change is kept as the new reference.
+int frame_decimator_push(FrameDecimator *fd, const AVFrame *frame);
+
+// the last dropped frame when the stream ends on duplicates, encoding it keeps the output as long as the
+// input; NULL otherwise. It was already pushed, so it goes straight to the encoder. Every frame pushed after
+// this is kept.
+AVFrame *frame_decimator_flush(FrameDecimator *fd);
+
+void frame_decimator_report(const FrameDecimator *fd);
+
+void frame_decimator_free(FrameDecimator **fd);
+
+#endif // FRAME_DECIMATOR_H
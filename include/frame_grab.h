@@ -0,0 +1,28 @@
+#ifndef FRAME_GRAB_H
+#define FRAME_GRAB_H
+
+#include "frame_pool.h"
+#include "frame_sink.h"
+
+typedef struct FrameGrabParams
+{
+    // independent demuxer + decoder instances serving one burst in parallel
+    int decoders;
+    // decoded frames kept across bursts, grouped by the GOP run that produced them
+    int max_cached_frames;
+    // shared by all decoders, NULL keeps the default allocator
+    FramePool *frame_pool;
+} FrameGrabParams;
+
+typedef struct FrameGrabService FrameGrabService;
+
+void frame_grab_default_params(FrameGrabParams *params);
+
+FrameGrabService *frame_grab_open(const char *filename, int stream_index, const FrameGrabParams *params);
+
+// pushes the frame displayed at each time (seconds from the stream start) to sink, numbered first_number + i
+int frame_grab_request(FrameGrabService *service, const double *times, int count, FrameSink *sink, int first_number);
+
+void frame_grab_close(FrameGrabService **service);
+
+#endif // FRAME_GRAB_H
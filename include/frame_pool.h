@@ -0,0 +1,49 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// decoder frame buffers recycled through size classes, shared by every decoder of a session
+typedef struct FramePool FramePool;
+
+typedef struct FramePoolStats
+{
+    int64_t requests;
+    // requests served from a recycled buffer
+    int64_t reused;
+    // requests the pool could not serve (hardware, palette or non-DR1 decoders)
+    int64_t fallbacks;
+    int64_t blocks;
+    int64_t bytes_reserved;
+    int64_t bytes_in_use;
+    int64_t peak_bytes_in_use;
+    int64_t hugepage_bytes;
+} FramePoolStats;
+
+typedef enum FramePoolMode
+{
+    FRAME_POOL_OFF,
+    FRAME_POOL_ON,
+    // large buffers are 2 MiB aligned and advised as transparent huge pages
+    FRAME_POOL_HUGEPAGE,
+} FramePoolMode;
+
+int frame_pool_parse_mode(const char *name, FramePoolMode *mode);
+
+// NULL for FRAME_POOL_OFF
+FramePool *frame_pool_alloc(FramePoolMode mode);
+
+// installs the pool's get_buffer2 on a decoder, call before avcodec_open2; a NULL pool keeps the default
+void frame_pool_attach(FramePool *pool, AVCodecContext *avcc);
+
+void frame_pool_stats(FramePool *pool, FramePoolStats *stats);
+
+void frame_pool_report(FramePool *pool);
+
+// frames still referencing pool buffers stay valid, their memory goes when they are freed
+void frame_pool_free(FramePool **pool);
+
+#endif // FRAME_POOL_H
@@ -0,0 +1,37 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <sys/types.h>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+#define FRAME_RING_MAX_CONSUMERS 32
+
+// decoded frames in a memfd mapping shared by one producer and up to FRAME_RING_MAX_CONSUMERS
+// forked consumer processes; each slot stays allocated until every live consumer released it
+typedef struct FrameRing FrameRing;
+
+FrameRing *frame_ring_create(int slots, int consumers, int width, int height, enum AVPixelFormat format);
+
+int frame_ring_fd(const FrameRing *ring);
+
+// consumers that exit or crash are detached, so a dead encoder never blocks the producer
+void frame_ring_set_consumer_pid(FrameRing *ring, int consumer, pid_t pid);
+
+// copies the frame into the next slot, waits while the slowest consumer still holds it
+int frame_ring_publish(FrameRing *ring, const AVFrame *frame);
+
+void frame_ring_finish(FrameRing *ring);
+
+// maps the next slot into frame without copying, unreferencing the frame releases the slot;
+// returns AVERROR_EOF after the last frame
+int frame_ring_acquire(FrameRing *ring, int consumer, AVFrame *frame);
+
+void frame_ring_detach(FrameRing *ring, int consumer);
+
+void frame_ring_free(FrameRing **ring);
+
+#endif // FRAME_RING_H
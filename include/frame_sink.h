@@ -0,0 +1,45 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+typedef enum FrameSinkFormat
+{
+    FRAME_SINK_PNG,
+    FRAME_SINK_PGM,
+    FRAME_SINK_Y4M,
+} FrameSinkFormat;
+
+typedef struct FrameSinkParams
+{
+    FrameSinkFormat format;
+    const char *directory;
+    const char *prefix;
+    // writer threads, 0 uses one per core (y4m always uses a single ordered writer)
+    int threads;
+    // frames a writer takes off the queue per wakeup
+    int batch_size;
+    // frames queued before frame_sink_push waits for the writers, 0 means unbounded
+    int max_pending;
+    // only used for the y4m stream header
+    AVRational frame_rate;
+} FrameSinkParams;
+
+typedef struct FrameSink FrameSink;
+
+void frame_sink_default_params(FrameSinkParams *params);
+
+int frame_sink_parse_format(const char *name, FrameSinkFormat *format);
+
+FrameSink *frame_sink_open(const FrameSinkParams *params);
+
+// takes a new reference to the frame buffers, the caller keeps ownership of frame
+int frame_sink_push(FrameSink *sink, const AVFrame *frame, int number);
+
+// drains the queue, joins the writers and frees the sink
+int frame_sink_close(FrameSink **sink);
+
+#endif // FRAME_SINK_H
@@ -0,0 +1,68 @@
+#ifndef INTERLEAVER_H
+#define INTERLEAVER_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+// what happens when a stream stops delivering and the others hit a limit
+typedef enum InterleaverStallPolicy
+{
+    // write the buffered packets out of order across streams, each stream stays in dts order
+    INTERLEAVER_FLUSH,
+    // discard the oldest buffered packets
+    INTERLEAVER_DROP,
+    // stop the mux with AVERROR(ENOBUFS)
+    INTERLEAVER_FAIL,
+} InterleaverStallPolicy;
+
+typedef struct InterleaverParams
+{
+    int64_t max_delay_us;
+    int64_t max_bytes;
+    InterleaverStallPolicy policy;
+} InterleaverParams;
+
+typedef struct InterleaverStreamStats
+{
+    int64_t buffered_packets;
+    int64_t buffered_bytes;
+    int64_t buffered_delay_us;
+    int64_t peak_bytes;
+    int64_t peak_delay_us;
+    int64_t written;
+    int64_t dropped;
+    int64_t stalls;
+} InterleaverStreamStats;
+
+// a dts ordered queue in front of av_write_frame whose memory and delay are capped
+typedef struct Interleaver Interleaver;
+
+void interleaver_default_params(InterleaverParams *params);
+
+int interleaver_parse_policy(const char *name, InterleaverStallPolicy *policy);
+
+// call after avformat_write_header, the output time bases are final by then
+Interleaver *interleaver_alloc(AVFormatContext *avfc, const InterleaverParams *params);
+
+// takes over the packet's reference and leaves it blank, like av_interleaved_write_frame
+int interleaver_write(Interleaver *interleaver, AVPacket *pkt);
+
+// the stream sends nothing more, the others are no longer held back or dropped waiting for it
+int interleaver_end_stream(Interleaver *interleaver, int stream_index);
+
+// whether an input packet reaches the end of its stream's known duration, the demuxer only reports
+// eof once every stream is done
+int packet_ends_stream(const AVStream *stream, const AVPacket *pkt);
+
+// writes everything still buffered, call before av_write_trailer
+int interleaver_flush(Interleaver *interleaver);
+
+int interleaver_stream_stats(const Interleaver *interleaver, int stream_index, InterleaverStreamStats *stats);
+
+void interleaver_report(const Interleaver *interleaver);
+
+void interleaver_free(Interleaver **interleaver);
+
+#endif // INTERLEAVER_H
@@ -0,0 +1,22 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+
+// caps the number of reads and writes in flight on each block device, shared by every job of a run
+typedef struct IoScheduler IoScheduler;
+
+IoScheduler *io_scheduler_create(int max_reads_per_device, int max_writes_per_device, int buffer_size);
+
+// AVIO contexts over plain files whose syscalls take a slot on the file's device
+int io_scheduler_open(IoScheduler *io, const char *filename, int flags, AVIOContext **pb);
+
+// frees the context and returns the bytes it transferred
+int64_t io_scheduler_close(AVIOContext **pb);
+
+void io_scheduler_destroy(IoScheduler **io);
+
+#endif // IO_SCHEDULER_H
@@ -0,0 +1,23 @@
+#ifndef LIVE_REMUX_H
+#define LIVE_REMUX_H
+
+typedef struct LiveParams
+{
+    // a FIFO path or a udp:// url carrying MPEG-TS
+    const char *input;
+    // receives init-<period>.mp4, seg-<period>-<n>.m4s and live.m3u8
+    const char *output_dir;
+    double segment_seconds;
+    int keep_segments;
+} LiveParams;
+
+void live_default_params(LiveParams *params);
+
+// runs until SIGINT/SIGTERM, reopening the input whenever it ends or keeps failing
+int live_remux(const LiveParams *params);
+
+// paces a TS file out to a FIFO or udp:// target in real time; wrap_seconds > 0 starts the
+// timestamps that far before the 33-bit wrap
+int live_replay(const char *in_filename, const char *target, int loop, double wrap_seconds);
+
+#endif // LIVE_REMUX_H
@@ -0,0 +1,37 @@
+#ifndef LOUDNESS_METER_H
+#define LOUDNESS_METER_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// EBU R128 / ITU-R BS.1770 measurement, loudness values in LUFS, range in LU, peaks in dBFS / dBTP
+typedef struct LoudnessResult
+{
+    double momentary;
+    double momentary_max;
+    double short_term;
+    double short_term_max;
+    double integrated;
+    double range;
+    double sample_peak;
+    double true_peak;
+    double seconds;
+} LoudnessResult;
+
+typedef struct LoudnessMeter LoudnessMeter;
+
+LoudnessMeter *loudness_meter_alloc(int sample_rate, int channels, uint64_t channel_layout);
+
+// accepts every packed and planar integer or floating point sample format
+int loudness_meter_push(LoudnessMeter *meter, const AVFrame *frame);
+
+void loudness_meter_result(const LoudnessMeter *meter, LoudnessResult *result);
+
+// logs the result and, unless path is NULL or "-", also writes it as JSON
+int loudness_meter_report(const LoudnessMeter *meter, const char *path);
+
+void loudness_meter_free(LoudnessMeter **meter);
+
+#endif // LOUDNESS_METER_H
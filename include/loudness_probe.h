@@ -0,0 +1,12 @@
+#ifndef LOUDNESS_PROBE_H
+#define LOUDNESS_PROBE_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+// decodes one audio stream through the loudness meter, other streams are discarded at the demuxer
+int probe_loudness(AVFormatContext *avfc, int stream_index, const char *report_path);
+
+#endif // LOUDNESS_PROBE_H
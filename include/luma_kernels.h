@@ -0,0 +1,30 @@
+#ifndef LUMA_KERNELS_H
+#define LUMA_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct LumaRowStats
+{
+    uint64_t sum;
+    uint64_t sum_sq;
+    uint64_t sad;
+} LumaRowStats;
+
+// one fused pass over a row: sum, sum of squares, SAD against prev (may be NULL)
+// and per-column sums added into column_sums (may be NULL)
+void luma_row_scan_u8(const uint8_t *row, const uint8_t *prev, int width, uint32_t *column_sums,
+                      LumaRowStats *stats);
+
+// same for 9 to 16 bit samples, values are shifted down to the 8-bit scale first
+void luma_row_scan_u16(const uint16_t *row, const uint16_t *prev, int width, int shift, uint32_t *column_sums,
+                       LumaRowStats *stats);
+
+// sum of absolute differences between two width x height blocks, strides count samples
+uint64_t luma_block_sad_u8(const uint8_t *a, ptrdiff_t a_stride, const uint8_t *b, ptrdiff_t b_stride, int width,
+                           int height);
+
+uint64_t luma_block_sad_u16(const uint16_t *a, ptrdiff_t a_stride, const uint16_t *b, ptrdiff_t b_stride, int width,
+                            int height, int shift);
+
+#endif // LUMA_KERNELS_H
@@ -0,0 +1,41 @@
+#ifndef MEM_OUTPUT_H
+#define MEM_OUTPUT_H
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+// an in-memory output file: a seekable arena of fixed chunks that grows up to cap bytes, or a
+// straight pass-through of the muxed bytes to a callback
+typedef struct MemOutput MemOutput;
+
+// receives the muxed bytes in order, a negative AVERROR fails the write
+typedef int (*MemOutputWrite)(void *opaque, const uint8_t *data, int size);
+
+MemOutput *mem_output_alloc(int64_t cap);
+
+// not seekable, so only muxers that stream (fragmented mp4, mpegts, ...) can write to it
+MemOutput *mem_output_alloc_callback(MemOutputWrite write, void *opaque);
+
+// points avfc->pb at the memory and serves the muxer's own re-open of avfc->url (the faststart shift)
+// from it; the pb stays owned by the MemOutput, never avio_closep it
+int mem_output_attach(MemOutput *mem, AVFormatContext *avfc);
+
+// gives avfc its own io callbacks back, call before avformat_free_context when the memory outlives it
+void mem_output_detach(MemOutput *mem);
+
+int64_t mem_output_size(const MemOutput *mem);
+
+// copies up to size bytes at offset out of the arena, returns the number copied
+int mem_output_read(MemOutput *mem, int64_t offset, uint8_t *buf, int size);
+
+// empties the output for the next file and keeps the arena's chunks allocated
+void mem_output_reset(MemOutput *mem);
+
+// one sequential write of the finished file
+int mem_output_write_file(MemOutput *mem, const char *filename);
+
+void mem_output_free(MemOutput **mem);
+
+#endif // MEM_OUTPUT_H
@@ -0,0 +1,25 @@
+#ifndef PROXY_SCALER_H
+#define PROXY_SCALER_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// shrinks frames to a small proxy size: 2x2 averaging steps while the picture is at least twice the target,
+// then a bilinear fit to the exact size. Only 8-bit planar formats.
+typedef struct ProxyScaler ProxyScaler;
+
+int proxy_scaler_supported(enum AVPixelFormat format);
+
+// the proxy is width wide and keeps the source aspect ratio, both rounded to even
+ProxyScaler *proxy_scaler_alloc(int src_width, int src_height, enum AVPixelFormat format, int width);
+
+void proxy_scaler_size(const ProxyScaler *ps, int *width, int *height);
+
+// the result belongs to the scaler and stays valid until the next call
+AVFrame *proxy_scaler_scale(ProxyScaler *ps, const AVFrame *frame);
+
+void proxy_scaler_free(ProxyScaler **ps);
+
+#endif // PROXY_SCALER_H
@@ -0,0 +1,47 @@
+#ifndef REMUX_JOB_H
+#define REMUX_JOB_H
+
+#include <stdint.h>
+
+#include "faststart.h"
+#include "interleaver.h"
+#include "io_scheduler.h"
+
+typedef struct RemuxJob
+{
+    const char *in_filename;
+    const char *out_filename;
+    int fragmented;
+    // seconds from the start of the input, end_time <= 0 runs to the end of the file
+    double start_time;
+    double end_time;
+    // comma separated stream specifiers ("v,a:0,2"), NULL keeps every audio, video and subtitle stream
+    const char *streams;
+    FaststartParams faststart;
+    InterleaverParams interleave;
+} RemuxJob;
+
+typedef struct RemuxStats
+{
+    double seconds;
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t packets;
+    int result;
+} RemuxStats;
+
+// io may be NULL to let libavformat open the files itself
+int remux_file(const RemuxJob *job, IoScheduler *io, RemuxStats *stats);
+
+// joins inputs with identical codec parameters into one output, timestamps continue across the seams
+int remux_concat(const char **in_filenames, int count, const char *out_filename, int fragmented, RemuxStats *stats);
+
+// demuxes once and writes every output on its own thread, specs look like "[f=mpegts:opt=value]out.ts"
+int remux_tee(const char *in_filename, const char **output_specs, int count, RemuxStats *stats);
+
+// muxes the input's packets into memory iterations times and reports the muxing cost alone,
+// out_filename only picks the container and is never written
+int remux_bench_mux(const char *in_filename, const char *out_filename, int fragmented, int iterations,
+                    int callback_sink);
+
+#endif // REMUX_JOB_H
@@ -0,0 +1,52 @@
+#ifndef SYNTH_SOURCE_H
+#define SYNTH_SOURCE_H
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+}
+
+#define SYNTH_PREFIX "synth://"
+
+// deterministic generated input: diagonal gradients that drift every frame, optional luma noise,
+// a cut every scene_seconds that changes gradients and tone, and one sine tone per audio channel
+typedef struct SynthParams
+{
+    int width;
+    int height;
+    AVRational frame_rate;
+    // any planar format with 8 bit or native endian 9-16 bit samples
+    enum AVPixelFormat pix_fmt;
+    double duration;
+    // peak luma noise in 8-bit steps, 0 keeps the picture smooth
+    int noise;
+    double scene_seconds;
+    // 0 leaves the source without audio
+    int sample_rate;
+    int channels;
+    enum AVSampleFormat sample_fmt;
+    int samples_per_frame;
+    double tone_hz;
+} SynthParams;
+
+typedef struct SynthSource SynthSource;
+
+void synth_default_params(SynthParams *params);
+
+int synth_is_source(const char *filename);
+
+// "synth://?size=3840x2160&rate=60&pix_fmt=yuv420p10le&duration=10&noise=4&scene=2&audio=48000&tone=440"
+int synth_parse(const char *spec, SynthParams *params);
+
+int64_t synth_video_frames(const SynthParams *params);
+
+SynthSource *synth_source_alloc(const SynthParams *params);
+
+// video and audio frames in presentation order, pts count frames and samples; AVERROR_EOF after
+// the last one
+int synth_source_read(SynthSource *src, AVFrame *frame, enum AVMediaType *type);
+
+void synth_source_free(SynthSource **src);
+
+#endif // SYNTH_SOURCE_H
@@ -0,0 +1,34 @@
+#ifndef THREAD_BUDGET_H
+#define THREAD_BUDGET_H
+
+// splits a fixed number of threads between the codecs of the jobs running in one process
+typedef struct ThreadBudget ThreadBudget;
+
+typedef struct ThreadGrant
+{
+    // also the frame-thread depth of a frame threaded decoder
+    int decoder_threads;
+    int encoder_threads;
+    // frames an encoder works on at once, x265 frame-threads
+    int encoder_frame_threads;
+} ThreadGrant;
+
+// threads <= 0 uses the CPUs this process may run on
+ThreadBudget *thread_budget_create(int threads);
+
+int thread_budget_size(const ThreadBudget *budget);
+
+// announces jobs that will acquire soon so the first of them does not take every thread
+void thread_budget_expect(ThreadBudget *budget, int jobs);
+
+// a share of what is free, divided between the jobs still expected; codecs keep their threads until
+// release, so later jobs get what finished jobs hand back
+void thread_budget_acquire(ThreadBudget *budget, ThreadGrant *grant);
+
+void thread_budget_release(ThreadBudget *budget, ThreadGrant *grant);
+
+void thread_budget_report(const ThreadBudget *budget);
+
+void thread_budget_free(ThreadBudget **budget);
+
+#endif // THREAD_BUDGET_H
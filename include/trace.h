@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Chrome trace-event recording, open the file in chrome://tracing or ui.perfetto.dev
+extern std::atomic<int> trace_active;
+
+int trace_start(const char *path);
+
+// writes the file, call once the traced threads are done; a forked child writes <path>.<pid>.
+// trace_start registers it with atexit as well, so any return from main writes the file
+int trace_stop(void);
+
+static inline int trace_enabled(void)
+{
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+int64_t trace_now(void);
+
+// spans: start = trace_begin(); ...; trace_end("decode", start, frame_number); frame < 0 leaves it out
+static inline int64_t trace_begin(void)
+{
+    return trace_enabled() ? trace_now() : 0;
+}
+
+void trace_end(const char *name, int64_t start, int64_t frame);
+
+// labels the calling thread in the timeline
+void trace_thread_name(const char *name);
+
+#endif // TRACE_H
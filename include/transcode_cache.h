@@ -0,0 +1,43 @@
+#ifndef TRANSCODE_CACHE_H
+#define TRANSCODE_CACHE_H
+
+#include <stdint.h>
+
+#include "video_process.h"
+
+// 128 bits as hex
+#define TRANSCODE_CACHE_KEY_SIZE 33
+
+typedef enum CacheHashMode
+{
+    // the first and last MiB and 32 blocks in between, together with size and mtime
+    CACHE_HASH_SAMPLED,
+    // every byte with the size; copies of the same file share their entries
+    CACHE_HASH_FULL,
+} CacheHashMode;
+
+typedef struct CacheParams
+{
+    // NULL turns the cache off
+    const char *dir;
+    CacheHashMode hash;
+    // least recently used entries are evicted above this
+    int64_t max_bytes;
+} CacheParams;
+
+void cache_default_params(CacheParams *params);
+
+int cache_parse_hash(const char *name, CacheHashMode *mode);
+
+// hashes the input together with everything in sp that changes the output; returns 0 and logs why when the job
+// cannot come from the cache (side outputs, live pacing), 1 with key filled, -1 when the input cannot be read
+int transcode_cache_key(const CacheParams *params, const char *in_filename, const StreamingParams *sp,
+                        const char *out_filename, char *key);
+
+// copies a cached output to out_filename, 1 on a hit and 0 on a miss
+int transcode_cache_fetch(const CacheParams *params, const char *key, const char *out_filename);
+
+// copies a finished output into the cache under key and evicts down to max_bytes
+int transcode_cache_publish(const CacheParams *params, const char *key, const char *out_filename);
+
+#endif // TRANSCODE_CACHE_H
@@ -0,0 +1,41 @@
+#ifndef TRANSCODE_JOB_H
+#define TRANSCODE_JOB_H
+
+#include "fanout_encoder.h"
+#include "thread_budget.h"
+#include "transcode_cache.h"
+#include "video_process.h"
+
+typedef struct TranscodeJob
+{
+    // a file or a synth:// spec
+    const char *in_filename;
+    // sp.output_extension is appended
+    const char *out_filename;
+    StreamingParams sp;
+    FanoutTarget *fanout;
+    int fanout_count;
+    FramePoolMode frame_pool_mode;
+    // NULL lets every codec size its own threads
+    ThreadBudget *budget;
+    // a hit copies the earlier output instead of transcoding
+    CacheParams cache;
+} TranscodeJob;
+
+typedef struct TranscodeStats
+{
+    double seconds;
+    int64_t video_frames;
+    ThreadGrant threads;
+    int result;
+    // outputs that did not finish, the main output is complete when the job failed only through these
+    int fanout_failed;
+} TranscodeStats;
+
+int transcode_file(const TranscodeJob *job, TranscodeStats *stats);
+
+// runs counts[i] copies of the job at once for every i, each with its codecs sizing their own threads
+// and then sharing one budget, and reports the aggregate frame rate; outputs go to out-<n>.ext
+int transcode_bench_jobs(const TranscodeJob *job, const int *counts, int n, int budget_threads);
+
+#endif // TRANSCODE_JOB_H
@@ -9,6 +9,9 @@ extern "C"
 #include <libavformat/avformat.h>
 }
 
+#include "async_log.h"
+
+// info level through the asynchronous logger
 void logging(const char *fmt, ...);
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt);
 void print_timing(char *name, AVFormatContext *avf, AVCodecContext *avc, AVStream *avs);
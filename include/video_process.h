@@ -3,11 +3,38 @@
 
 extern "C"
 {
+#include <libavutil/avstring.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 }
 
+#include "backpressure.h"
+#include "cpu_affinity.h"
+#include "faststart.h"
+#include "frame_analysis.h"
+#include "frame_decimator.h"
+#include "frame_pool.h"
+#include "frame_ring.h"
+#include "interleaver.h"
+#include "loudness_meter.h"
+#include "proxy_scaler.h"
+#include "synth_source.h"
+#include "thread_budget.h"
+#include "trace.h"
 #include "video_debug.h"
 
+// rate control applied by prepare_video_encoder, also the defaults of the probe VBV check
+#define VIDEO_BIT_RATE (2 * 1000 * 1000)
+#define VIDEO_RC_BUFFER_SIZE (4 * 1000 * 1000)
+#define VIDEO_RC_MAX_RATE (2 * 1000 * 1000)
+
+typedef struct PreviewParams
+{
+    int enabled;
+    // proxy width, the height follows the aspect ratio
+    int width;
+} PreviewParams;
+
 typedef struct StreamingParams
 {
     char copy_video;
@@ -19,6 +46,17 @@ typedef struct StreamingParams
     char *audio_codec;
     char *codec_priv_key;
     char *codec_priv_value;
+    char *timeline_path;
+    double auto_crop_seconds;
+    char *loudness_path;
+    FaststartParams faststart;
+    InterleaverParams interleave;
+    AffinityParams affinity;
+    BackpressureParams backpressure;
+    DecimateParams decimate;
+    PreviewParams preview;
+    // in source pixels, a zero width keeps the whole picture
+    CropRect roi;
 } StreamingParams;
 
 typedef struct StreamingContext
@@ -33,27 +71,74 @@ typedef struct StreamingContext
     int video_index;
     int audio_index;
     char *filename;
+    FrameAnalyzer *video_analyzer;
+    FrameDecimator *decimator;
+    LoudnessMeter *loudness_meter;
+    CropRect crop;
+    Interleaver *interleaver;
+    FrameRing *frame_ring;
+    FramePool *frame_pool;
+    // zero counts let every codec size its own threads
+    ThreadGrant threads;
+    // only on the encoder of a live transcode
+    Backpressure *backpressure;
+    // decoders: cheaper decoding for proxies, lowres down towards this width and no loop filter
+    int preview_width;
+    // encoders: the proxy size frames are shrunk to before encoding
+    ProxyScaler *scaler;
+    // encoders: packets remuxed per stream, they number the mux spans of copied streams
+    int64_t video_copied;
+    int64_t audio_copied;
+    // encoders: frames taken by video encoders reopened since, frame_number restarts with each one
+    int64_t earlier_video_frames;
 } StreamingContext;
 
 int open_media(const char *in_filename, AVFormatContext **avfc);
 
 int prepare_decoder(StreamingContext *sc);
 
-int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc);
+// opens a decoder, for video with sc's frame pool, its thread grant and preview hints
+int fill_stream_info(StreamingContext *sc, AVStream *avs, AVCodec **avc, AVCodecContext **avcc);
+
+// stands in for open_media and prepare_decoder, frames then come from a SynthSource instead of packets
+int prepare_synth_decoder(StreamingContext *sc, const SynthParams *params);
+
+int detect_crop(StreamingContext *decoder, double seconds, CropRect *crop);
 
 int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate,
                           StreamingParams sp);
 
+// frames reach the encoder as decoded, there is no pixel format conversion in between
+int encoder_accepts_pix_fmt(const AVCodec *codec, enum AVPixelFormat format);
+
+// only the codec context, the output stream is left to the caller; keeps the decoder's pixel format
+// when the encoder takes it
+int open_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate,
+                       StreamingParams sp, const char *preset);
+
 int prepare_audio_encoder(StreamingContext *sc, int sample_rate, StreamingParams sp);
 
 int prepare_copy(AVFormatContext *avfc, AVStream **avs, AVCodecParameters *decoder_par);
 
-int remux(AVPacket **pkt, AVFormatContext **avfc, AVRational decoder_tb, AVRational encoder_tb);
+// goes through the encoder's interleaver when it has one, frame numbers the mux span
+int write_packet(StreamingContext *encoder, AVPacket *pkt, int64_t frame);
+
+int remux(AVPacket **pkt, StreamingContext *encoder, AVRational decoder_tb, AVRational encoder_tb);
 
 int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame);
 
 int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame);
 
+int measure_audio(StreamingContext *decoder, AVPacket *input_packet, AVFrame *input_frame);
+
+// everything a decoded frame goes through on its way into the encoder
+int process_audio_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame);
+
+int process_video_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame);
+
+// the part of process_video_frame after analysis, crop, fanout and decimation: pacing, proxy and encode
+int encode_video_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame);
+
 int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame);
 
 int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame);
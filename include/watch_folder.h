@@ -0,0 +1,45 @@
+#ifndef WATCH_FOLDER_H
+#define WATCH_FOLDER_H
+
+#include <string>
+#include <vector>
+
+typedef enum WatchTool
+{
+    WATCH_PROBE,
+    WATCH_REMUX,
+    WATCH_TRANSCODE,
+} WatchTool;
+
+typedef struct WatchRule
+{
+    std::string folder;
+    WatchTool tool;
+    // remux and transcode write <output_dir>/<name>, probe writes its report to <output_dir>/<name>.txt
+    std::string output_dir;
+    // passed to the tool after the input and output paths
+    std::vector<std::string> options;
+} WatchRule;
+
+typedef struct WatchParams
+{
+    const char *rules_path;
+    const char *journal_path;
+    // holds the probe, remux and transcode binaries
+    const char *tools_dir;
+    int workers;
+    // seconds a file's size and mtime must hold still when no close-write or rename says it is complete
+    double settle;
+    // seconds between full scans of every folder for files inotify could not report, 0 scans only at startup
+    double rescan;
+} WatchParams;
+
+void watch_default_params(WatchParams *params);
+
+// one rule per line: <folder> <probe|remux|transcode> <output dir> [tool options...], '#' starts a comment
+int watch_read_rules(const char *path, std::vector<WatchRule> &rules);
+
+// runs until SIGINT/SIGTERM, then waits for the running jobs; queued and failed ones run after the next start
+int watch_folders(const WatchParams *params, const std::vector<WatchRule> &rules);
+
+#endif // WATCH_FOLDER_H
@@ -0,0 +1,32 @@
+#ifndef WATCH_JOURNAL_H
+#define WATCH_JOURNAL_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+typedef struct JournalEntry
+{
+    // wall clock seconds when the file was first seen
+    double landed;
+    int done;
+    int ok;
+    // of the input when its job finished, a changed file is processed again
+    int64_t size;
+    int64_t mtime_ns;
+} JournalEntry;
+
+// append-only record of queued and finished jobs, one line each; not thread safe
+typedef struct WatchJournal WatchJournal;
+
+// replays an existing journal into entries keyed by input path, drops inputs that are gone and rewrites it compacted
+WatchJournal *watch_journal_open(const char *path, std::map<std::string, JournalEntry> &entries);
+
+int watch_journal_queued(WatchJournal *wj, const std::string &path, const JournalEntry &entry);
+
+int watch_journal_done(WatchJournal *wj, const std::string &path, const JournalEntry &entry);
+
+void watch_journal_close(WatchJournal **wj);
+
+#endif // WATCH_JOURNAL_H
@@ -0,0 +1,20 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <functional>
+
+typedef struct WorkerPool WorkerPool;
+
+// threads <= 0 uses one thread per core
+WorkerPool *worker_pool_create(int threads);
+
+int worker_pool_size(const WorkerPool *pool);
+
+void worker_pool_submit(WorkerPool *pool, std::function<void()> task);
+
+// blocks until every task submitted so far has finished
+void worker_pool_wait(WorkerPool *pool);
+
+void worker_pool_destroy(WorkerPool **pool);
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "async_log.h"
+
+#define LOG_RING_RECORDS 256
+#define LOG_RECORD_TEXT 244
+// a single message may take at most this many records, longer ones are cut
+#define LOG_MAX_PARTS (LOG_RING_RECORDS / 4)
+#define LOG_IDLE_MIN_US 1000
+#define LOG_IDLE_MAX_US 20000
+
+typedef struct LogRecord
+{
+    int64_t time_us;
+    uint8_t level;
+    // set on every part of a long message except the last
+    uint8_t more;
+    uint16_t length;
+    char text[LOG_RECORD_TEXT];
+} LogRecord;
+
+// single producer (the owning thread), single consumer (whoever holds drain_lock)
+typedef struct LogRing
+{
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<int> retired;
+    LogRecord records[LOG_RING_RECORDS];
+} LogRing;
+
+std::atomic<int> log_runtime_level(LOG_LEVEL_INFO);
+
+static std::mutex registry_lock;
+static std::mutex drain_lock;
+static std::vector<LogRing *> rings;
+static std::thread *drainer;
+static std::atomic<int> drainer_running;
+static std::atomic<int> stopping;
+static std::atomic<int64_t> dropped;
+
+static const char *level_prefix[] = {"error: ", "warning: ", "", "debug: "};
+
+static int64_t now_us(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// takes every complete message out of the rings oldest first, one write for the whole batch
+static int drain(void)
+{
+    std::vector<LogRing *> snapshot;
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        snapshot = rings;
+    }
+
+    std::string out;
+    while (true)
+    {
+        LogRing *oldest = NULL;
+        for (LogRing *ring : snapshot)
+        {
+            uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+            if (tail == ring->head.load(std::memory_order_acquire))
+                continue;
+            if (!oldest || ring->records[tail % LOG_RING_RECORDS].time_us <
+                               oldest->records[oldest->tail.load(std::memory_order_relaxed) % LOG_RING_RECORDS].time_us)
+                oldest = ring;
+        }
+        if (!oldest)
+            break;
+
+        uint32_t tail = oldest->tail.load(std::memory_order_relaxed);
+        const LogRecord *record = &oldest->records[tail % LOG_RING_RECORDS];
+        out += "LOG: ";
+        out += level_prefix[record->level];
+        while (true)
+        {
+            record = &oldest->records[tail++ % LOG_RING_RECORDS];
+            out.append(record->text, record->length);
+            if (!record->more)
+                break;
+        }
+        out += '\n';
+        oldest->tail.store(tail, std::memory_order_release);
+    }
+
+    if (!out.empty())
+    {
+        fwrite(out.data(), 1, out.size(), stderr);
+        fflush(stderr);
+    }
+
+    // rings of finished threads go once they are empty
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (size_t i = 0; i < rings.size();)
+    {
+        LogRing *ring = rings[i];
+        if (ring->retired.load() && ring->tail.load() == ring->head.load())
+        {
+            rings.erase(rings.begin() + i);
+            delete ring;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return !out.empty();
+}
+
+static void drain_loop(void)
+{
+    int idle_us = LOG_IDLE_MIN_US;
+    while (!stopping.load())
+    {
+        int wrote;
+        {
+            std::lock_guard<std::mutex> guard(drain_lock);
+            wrote = drain();
+        }
+        idle_us = wrote ? LOG_IDLE_MIN_US : std::min(idle_us * 2, LOG_IDLE_MAX_US);
+        usleep(idle_us);
+    }
+}
+
+static void shutdown_logger(void)
+{
+    stopping.store(1);
+    if (drainer)
+    {
+        drainer->join();
+        delete drainer;
+        drainer = NULL;
+    }
+    log_flush();
+    if (dropped.load())
+        fprintf(stderr, "LOG: %lld debug messages dropped\n", (long long)dropped.load());
+}
+
+static void before_fork(void)
+{
+    drain_lock.lock();
+    registry_lock.lock();
+}
+
+static void after_fork_parent(void)
+{
+    registry_lock.unlock();
+    drain_lock.unlock();
+}
+
+// only the forking thread lives on in the child, what is queued belongs to the parent and is printed there
+static void after_fork_child(void)
+{
+    registry_lock.unlock();
+    drain_lock.unlock();
+    for (LogRing *ring : rings)
+        ring->tail.store(ring->head.load());
+    drainer = NULL;
+    drainer_running.store(0);
+}
+
+static void start_drainer(void)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        atexit(shutdown_logger);
+    });
+    std::lock_guard<std::mutex> guard(registry_lock);
+    if (!drainer && !stopping.load())
+    {
+        drainer = new std::thread(drain_loop);
+        drainer_running.store(1);
+    }
+}
+
+typedef struct RingOwner
+{
+    LogRing *ring;
+    ~RingOwner()
+    {
+        if (ring)
+            ring->retired.store(1);
+        ring = NULL;
+    }
+} RingOwner;
+
+static thread_local RingOwner owner;
+
+static LogRing *thread_ring(void)
+{
+    if (owner.ring)
+        return owner.ring;
+    LogRing *ring = new LogRing();
+    std::lock_guard<std::mutex> guard(registry_lock);
+    rings.push_back(ring);
+    owner.ring = ring;
+    return ring;
+}
+
+void log_set_level(LogLevel level)
+{
+    log_runtime_level.store(level);
+}
+
+int log_parse_level(const char *name, LogLevel *level)
+{
+    static const char *names[] = {"error", "warning", "info", "debug"};
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            *level = (LogLevel)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "LOG: error: unknown log level %s, use error, warning, info or debug\n", name);
+    return -1;
+}
+
+// debug messages are dropped while the ring is full, everything else waits for the drainer
+static int ring_space(LogRing *ring, uint32_t head, int parts, LogLevel level)
+{
+    while (head - ring->tail.load(std::memory_order_acquire) + parts > LOG_RING_RECORDS)
+    {
+        if (level == LOG_LEVEL_DEBUG || stopping.load())
+        {
+            dropped++;
+            return -1;
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+void log_vmessage(LogLevel level, const char *fmt, va_list args)
+{
+    if (!log_enabled(level))
+        return;
+
+    // at exit the drainer is gone, the last words go out directly
+    if (stopping.load())
+    {
+        char line[LOG_RECORD_TEXT * 4];
+        vsnprintf(line, sizeof(line), fmt, args);
+        fprintf(stderr, "LOG: %s%s\n", level_prefix[level], line);
+        return;
+    }
+
+    LogRing *ring = thread_ring();
+    if (!drainer_running.load(std::memory_order_relaxed))
+        start_drainer();
+
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (ring_space(ring, head, 1, level) < 0)
+        return;
+
+    // short messages are formatted straight into the ring, long ones once more on the heap
+    int64_t time_us = now_us();
+    LogRecord *record = &ring->records[head % LOG_RING_RECORDS];
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(record->text, LOG_RECORD_TEXT, fmt, copy);
+    va_end(copy);
+    if (length < 0)
+        return;
+    if (length < LOG_RECORD_TEXT)
+    {
+        record->time_us = time_us;
+        record->level = level;
+        record->more = 0;
+        record->length = length;
+        ring->head.store(head + 1, std::memory_order_release);
+        return;
+    }
+
+    char *text = (char *)malloc(length + 1);
+    if (!text)
+        return;
+    vsnprintf(text, length + 1, fmt, args);
+    int parts = std::min((length + LOG_RECORD_TEXT - 1) / LOG_RECORD_TEXT, LOG_MAX_PARTS);
+    if (ring_space(ring, head, parts, level) == 0)
+    {
+        for (int i = 0; i < parts; i++)
+        {
+            record = &ring->records[(head + i) % LOG_RING_RECORDS];
+            int size = std::min(length - i * LOG_RECORD_TEXT, LOG_RECORD_TEXT);
+            record->time_us = time_us;
+            record->level = level;
+            record->more = i + 1 < parts;
+            record->length = size;
+            memcpy(record->text, text + i * LOG_RECORD_TEXT, size);
+        }
+        ring->head.store(head + parts, std::memory_order_release);
+    }
+    free(text);
+}
+
+void log_message(LogLevel level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_vmessage(level, fmt, args);
+    va_end(args);
+}
+
+void log_flush(void)
+{
+    std::lock_guard<std::mutex> guard(drain_lock);
+    drain();
+}
@@ -0,0 +1,255 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cpu_affinity.h"
+#include "video_debug.h"
+
+#define AFFINITY_MAX_NODES 1024
+#define NODE_MASK_WORDS (AFFINITY_MAX_NODES / (8 * sizeof(unsigned long)))
+
+// jobs of one process take the nodes in turn, starting from one picked by pid so processes spread too
+static std::atomic<int> next_job(-1);
+
+// "0-3,8,10-11"
+static int parse_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p && *p != '\n')
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        for (long i = first; i <= last && i < CPU_SETSIZE; i++)
+            CPU_SET(i, set);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+static int read_list(const char *path, cpu_set_t *set)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    char line[4096];
+    int ret = fgets(line, sizeof(line), file) ? parse_list(line, set) : -1;
+    fclose(file);
+    return ret;
+}
+
+static int node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, cpus);
+}
+
+static void format_list(const cpu_set_t *set, char *out, size_t size)
+{
+    int written = 0;
+    out[0] = '\0';
+    for (int i = 0; i < CPU_SETSIZE && written < (int)size; i++)
+    {
+        if (!CPU_ISSET(i, set))
+            continue;
+        int last = i;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        written += last > i ? snprintf(out + written, size - written, "%s%d-%d", written ? "," : "", i, last)
+                            : snprintf(out + written, size - written, "%s%d", written ? "," : "", i);
+        i = last;
+    }
+}
+
+void affinity_default_params(AffinityParams *params)
+{
+    params->mode = AFFINITY_OFF;
+    params->node = -1;
+}
+
+int affinity_parse_mode(const char *name, AffinityMode *mode)
+{
+    if (!strcmp(name, "off"))
+        *mode = AFFINITY_OFF;
+    else if (!strcmp(name, "node"))
+        *mode = AFFINITY_NODE;
+    else if (!strcmp(name, "pin"))
+        *mode = AFFINITY_PIN;
+    else
+    {
+        logging("unknown affinity mode %s, use off, node or pin", name);
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_parse_node(const char *value, int *node)
+{
+    if (!strcmp(value, "auto"))
+    {
+        *node = -1;
+        return 0;
+    }
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end || n < 0 || n >= AFFINITY_MAX_NODES)
+    {
+        logging("invalid NUMA node %s, use auto or a node number", value);
+        return -1;
+    }
+    *node = (int)n;
+    return 0;
+}
+
+int affinity_node_count(void)
+{
+    cpu_set_t online;
+    if (read_list("/sys/devices/system/node/online", &online) < 0)
+        return 1;
+    int last = 0;
+    for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (CPU_ISSET(i, &online))
+            last = i;
+    }
+    return last + 1;
+}
+
+static int bind_memory(int node)
+{
+#ifdef SYS_set_mempolicy
+    if (node < 0)
+        return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) == 0;
+    unsigned long mask[NODE_MASK_WORDS] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    // preferred rather than bound, a full node spills over instead of failing allocations
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, AFFINITY_MAX_NODES) == 0;
+#else
+    return 0;
+#endif
+}
+
+int affinity_place_job(const AffinityParams *params, Placement *placement)
+{
+    memset(placement, 0, sizeof(*placement));
+    placement->mode = params->mode;
+    placement->node = -1;
+    placement->demux_cpu = -1;
+    placement->nodes = affinity_node_count();
+    if (params->mode == AFFINITY_OFF)
+        return 0;
+
+    int node = params->node;
+    if (node < 0)
+    {
+        int expected = -1;
+        next_job.compare_exchange_strong(expected, (int)(getpid() % placement->nodes));
+        node = next_job.fetch_add(1) % placement->nodes;
+    }
+    if (node >= placement->nodes)
+    {
+        logging("NUMA node %d does not exist, this host has %d", node, placement->nodes);
+        return -1;
+    }
+
+    if (sched_getaffinity(0, sizeof(placement->previous), &placement->previous) < 0)
+    {
+        logging("failed to read the CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+    // without sysfs the host counts as one node made of whatever CPUs we may use
+    if (node_cpus(node, &placement->cpus) < 0)
+        placement->cpus = placement->previous;
+    CPU_AND(&placement->cpus, &placement->cpus, &placement->previous);
+    if (CPU_COUNT(&placement->cpus) == 0)
+    {
+        logging("NUMA node %d has no CPU this process may run on", node);
+        return -1;
+    }
+    placement->node = node;
+
+    if (params->mode == AFFINITY_PIN && CPU_COUNT(&placement->cpus) > 1)
+    {
+        for (int i = 0; i < CPU_SETSIZE && placement->demux_cpu < 0; i++)
+        {
+            if (CPU_ISSET(i, &placement->cpus))
+                placement->demux_cpu = i;
+        }
+        CPU_CLR(placement->demux_cpu, &placement->cpus);
+    }
+
+    if (sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) < 0)
+    {
+        logging("failed to move the job onto NUMA node %d: %s", node, strerror(errno));
+        return -1;
+    }
+    placement->memory_bound = placement->nodes > 1 && bind_memory(node);
+    return 0;
+}
+
+int affinity_pin_demux(const Placement *placement)
+{
+    if (placement->demux_cpu < 0)
+        return 0;
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(placement->demux_cpu, &cpu);
+    if (sched_setaffinity(0, sizeof(cpu), &cpu) < 0)
+    {
+        logging("failed to pin the demux thread to CPU %d: %s", placement->demux_cpu, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_join(const Placement *placement)
+{
+    if (placement->mode == AFFINITY_OFF)
+        return 0;
+    if (sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) < 0)
+        return -1;
+    if (placement->memory_bound)
+        bind_memory(placement->node);
+    return 0;
+}
+
+void affinity_release(const Placement *placement)
+{
+    if (placement->node < 0)
+        return;
+    sched_setaffinity(0, sizeof(placement->previous), &placement->previous);
+    if (placement->memory_bound)
+        bind_memory(-1);
+}
+
+void affinity_report(const Placement *placement)
+{
+    if (placement->mode == AFFINITY_OFF)
+        return;
+    char cpus[256];
+    format_list(&placement->cpus, cpus, sizeof(cpus));
+    if (placement->demux_cpu >= 0)
+        logging("placement: node %d of %d, demux on cpu %d, codecs on cpus %s, memory %s, finished on cpu %d",
+                placement->node, placement->nodes, placement->demux_cpu, cpus,
+                placement->memory_bound ? "preferred on the node" : "unbound", sched_getcpu());
+    else
+        logging("placement: node %d of %d, cpus %s, memory %s, finished on cpu %d", placement->node,
+                placement->nodes, cpus, placement->memory_bound ? "preferred on the node" : "unbound",
+                sched_getcpu());
+}
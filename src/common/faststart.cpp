@@ -0,0 +1,124 @@
+#include <cstring>
+
+#include "faststart.h"
+#include "video_debug.h"
+
+// stsz, stts, ctts and stco entries a sample can cost in the worst case
+#define MOOV_BYTES_PER_SAMPLE 24
+#define MOOV_BYTES_PER_STREAM 2048
+#define MOOV_BYTES_BASE 8192
+
+static int is_mov_family(const AVOutputFormat *oformat)
+{
+    static const char *names[] = {"mov", "mp4", "ipod", "ismv", "3gp", "3g2", "psp", "f4v"};
+    for (const char *name : names)
+    {
+        if (!strcmp(oformat->name, name))
+            return 1;
+    }
+    return 0;
+}
+
+int faststart_parse_mode(const char *name, FaststartMode *mode)
+{
+    if (!strcmp(name, "reserve"))
+        *mode = FASTSTART_RESERVE;
+    else if (!strcmp(name, "memory"))
+        *mode = FASTSTART_MEMORY;
+    else if (!strcmp(name, "none"))
+        *mode = FASTSTART_NONE;
+    else
+    {
+        logging("unknown faststart mode %s, expected reserve, memory or none", name);
+        return -1;
+    }
+    return 0;
+}
+
+int64_t faststart_estimate_moov_size(const AVFormatContext *input)
+{
+    int64_t size = MOOV_BYTES_BASE;
+    for (unsigned int i = 0; i < input->nb_streams; i++)
+    {
+        const AVStream *stream = input->streams[i];
+        const AVCodecParameters *par = stream->codecpar;
+        double seconds = stream->duration != AV_NOPTS_VALUE ? stream->duration * av_q2d(stream->time_base)
+                                                            : input->duration / (double)AV_TIME_BASE;
+        double samples = stream->nb_frames;
+
+        if (samples <= 0)
+        {
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                AVRational rate = stream->avg_frame_rate.num ? stream->avg_frame_rate : stream->r_frame_rate;
+                samples = seconds * (rate.num ? av_q2d(rate) : 60);
+            }
+            else if (par->codec_type == AVMEDIA_TYPE_AUDIO)
+                samples = seconds * par->sample_rate / (par->frame_size > 0 ? par->frame_size : 1024);
+            else
+                samples = seconds * 10;
+        }
+        size += MOOV_BYTES_PER_STREAM + (int64_t)FFMAX(samples, 0) * MOOV_BYTES_PER_SAMPLE;
+    }
+    return size + size / 5;
+}
+
+int faststart_setup(FaststartOutput *out, const FaststartParams *params, AVFormatContext *output,
+                    const AVFormatContext *input, AVDictionary **muxer_opts)
+{
+    out->mode = FASTSTART_NONE;
+    out->memory = NULL;
+    if (params->mode == FASTSTART_NONE)
+        return 0;
+
+    AVDictionaryEntry *movflags = av_dict_get(*muxer_opts, "movflags", NULL, 0);
+    if (!is_mov_family(output->oformat))
+    {
+        logging("faststart only applies to mov/mp4 output, %s is written as is", output->oformat->name);
+        return 0;
+    }
+    if (movflags && (strstr(movflags->value, "frag") || strstr(movflags->value, "empty_moov")))
+    {
+        logging("fragmented output already starts with moov, ignoring faststart");
+        return 0;
+    }
+
+    out->mode = params->mode;
+    if (params->mode == FASTSTART_RESERVE)
+    {
+        if (!input || input->duration == AV_NOPTS_VALUE)
+        {
+            logging("the input duration is unknown, cannot size the reserved moov");
+            return -1;
+        }
+        int64_t moov_size = faststart_estimate_moov_size(input);
+        logging("reserving %" PRId64 " bytes for moov", moov_size);
+        av_dict_set_int(muxer_opts, "moov_size", moov_size, 0);
+        return 0;
+    }
+
+    out->memory = mem_output_alloc(params->memory_cap);
+    if (!out->memory || mem_output_attach(out->memory, output) < 0)
+    {
+        mem_output_free(&out->memory);
+        return -1;
+    }
+    av_dict_set(muxer_opts, "movflags", movflags ? "+faststart" : "faststart", movflags ? AV_DICT_APPEND : 0);
+    return 1;
+}
+
+int faststart_finish(FaststartOutput *out, const char *filename)
+{
+    if (out->mode != FASTSTART_MEMORY)
+        return 0;
+    if (!filename)
+    {
+        mem_output_free(&out->memory);
+        return 0;
+    }
+
+    logging("writing %" PRId64 " bytes to %s", mem_output_size(out->memory), filename);
+    int ret = mem_output_write_file(out->memory, filename);
+    mem_output_free(&out->memory);
+    return ret;
+}
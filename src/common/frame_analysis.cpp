@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_analysis.h"
+#include "luma_kernels.h"
+#include "video_debug.h"
+
+typedef struct AnalysisSegment
+{
+    const char *type;
+    double start;
+    double end;
+} AnalysisSegment;
+
+struct FrameAnalyzer
+{
+    FrameAnalysisParams params;
+    AVRational time_base;
+
+    AVFrame *prev;
+    std::vector<uint32_t> column_sums;
+    std::vector<double> row_means;
+
+    int width;
+    int height;
+    int64_t frames;
+    double first_time;
+    double last_time;
+    double frame_duration;
+
+    std::vector<AnalysisSegment> segments;
+    int in_black;
+    double black_start;
+    int in_freeze;
+    double freeze_start;
+
+    // union of the active picture area over all non-black frames
+    int crop_frames;
+    int active_left;
+    int active_right;
+    int active_top;
+    int active_bottom;
+};
+
+static double frame_time(FrameAnalyzer *fa, const AVFrame *frame)
+{
+    int64_t ts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+    if (ts == AV_NOPTS_VALUE)
+        return fa->frames ? fa->last_time + fa->frame_duration : 0;
+    return ts * av_q2d(fa->time_base);
+}
+
+static void close_segment(FrameAnalyzer *fa, const char *type, double start, double end, double min_duration)
+{
+    if (end - start >= min_duration)
+        fa->segments.push_back({type, start, end});
+}
+
+static void reset_geometry(FrameAnalyzer *fa, const AVFrame *frame)
+{
+    av_frame_free(&fa->prev);
+    fa->width = frame->width;
+    fa->height = frame->height;
+    fa->column_sums.assign(frame->width + 16, 0);
+    fa->row_means.assign(frame->height, 0);
+}
+
+static void update_active_area(FrameAnalyzer *fa)
+{
+    double limit = fa->params.crop_luma;
+    int top = 0, bottom = fa->height - 1, left = 0, right = fa->width - 1;
+
+    while (top <= bottom && fa->row_means[top] <= limit)
+        top++;
+    if (top > bottom)
+        return;
+    while (fa->row_means[bottom] <= limit)
+        bottom--;
+
+    while (left <= right && fa->column_sums[left] <= limit * fa->height)
+        left++;
+    if (left > right)
+        return;
+    while (fa->column_sums[right] <= limit * fa->height)
+        right--;
+
+    if (!fa->crop_frames)
+    {
+        fa->active_left = left;
+        fa->active_right = right;
+        fa->active_top = top;
+        fa->active_bottom = bottom;
+    }
+    else
+    {
+        fa->active_left = FFMIN(fa->active_left, left);
+        fa->active_right = FFMAX(fa->active_right, right);
+        fa->active_top = FFMIN(fa->active_top, top);
+        fa->active_bottom = FFMAX(fa->active_bottom, bottom);
+    }
+    fa->crop_frames++;
+}
+
+void frame_analysis_default_params(FrameAnalysisParams *params)
+{
+    params->black_luma = 32;
+    params->black_max_stddev = 8;
+    params->black_min_duration = 0.5;
+    params->freeze_max_difference = 0.5;
+    params->freeze_min_duration = 2.0;
+    params->crop_luma = 24;
+    params->crop_round = 16;
+}
+
+FrameAnalyzer *frame_analyzer_alloc(const FrameAnalysisParams *params, AVRational time_base)
+{
+    FrameAnalyzer *fa = new FrameAnalyzer();
+    fa->params = *params;
+    fa->time_base = time_base;
+    return fa;
+}
+
+int frame_analyzer_push(FrameAnalyzer *fa, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].step != (desc->comp[0].depth + 7) / 8)
+    {
+        logging("frame analysis: unsupported pixel format %d", frame->format);
+        return -1;
+    }
+
+    if (frame->width != fa->width || frame->height != fa->height)
+        reset_geometry(fa, frame);
+
+    int depth = desc->comp[0].depth;
+    const AVFrame *prev = fa->prev;
+    std::fill(fa->column_sums.begin(), fa->column_sums.end(), 0);
+
+    uint64_t sum = 0, sum_sq = 0, sad = 0;
+    for (int y = 0; y < frame->height; y++)
+    {
+        LumaRowStats row;
+        const uint8_t *line = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        const uint8_t *prev_line = prev ? prev->data[0] + (ptrdiff_t)y * prev->linesize[0] : NULL;
+
+        if (depth <= 8)
+            luma_row_scan_u8(line, prev_line, frame->width, fa->column_sums.data(), &row);
+        else
+            luma_row_scan_u16((const uint16_t *)line, (const uint16_t *)prev_line, frame->width, depth - 8,
+                              fa->column_sums.data(), &row);
+
+        sum += row.sum;
+        sum_sq += row.sum_sq;
+        sad += row.sad;
+        fa->row_means[y] = (double)row.sum / frame->width;
+    }
+
+    double pixels = (double)frame->width * frame->height;
+    double mean = sum / pixels;
+    double stddev = sqrt(FFMAX(sum_sq / pixels - mean * mean, 0.0));
+    double difference = prev ? sad / pixels : -1;
+
+    double time = frame_time(fa, frame);
+    if (fa->frames)
+    {
+        if (time > fa->last_time)
+            fa->frame_duration = time - fa->last_time;
+    }
+    else
+    {
+        fa->first_time = time;
+    }
+
+    int black = mean <= fa->params.black_luma && stddev <= fa->params.black_max_stddev;
+    if (black && !fa->in_black)
+    {
+        fa->in_black = 1;
+        fa->black_start = time;
+    }
+    else if (!black && fa->in_black)
+    {
+        fa->in_black = 0;
+        close_segment(fa, "black", fa->black_start, time, fa->params.black_min_duration);
+    }
+
+    int frozen = difference >= 0 && difference <= fa->params.freeze_max_difference;
+    if (frozen && !fa->in_freeze)
+    {
+        // the frame before this one is the first frozen picture
+        fa->in_freeze = 1;
+        fa->freeze_start = fa->last_time;
+    }
+    else if (!frozen && fa->in_freeze)
+    {
+        fa->in_freeze = 0;
+        close_segment(fa, "freeze", fa->freeze_start, time, fa->params.freeze_min_duration);
+    }
+
+    if (!black)
+        update_active_area(fa);
+
+    av_frame_free(&fa->prev);
+    fa->prev = av_frame_clone(frame);
+    fa->last_time = time;
+    fa->frames++;
+    return 0;
+}
+
+void frame_analyzer_finish(FrameAnalyzer *fa)
+{
+    double end = fa->last_time + fa->frame_duration;
+    if (fa->in_black)
+        close_segment(fa, "black", fa->black_start, end, fa->params.black_min_duration);
+    if (fa->in_freeze)
+        close_segment(fa, "freeze", fa->freeze_start, end, fa->params.freeze_min_duration);
+    fa->in_black = 0;
+    fa->in_freeze = 0;
+
+    std::sort(fa->segments.begin(), fa->segments.end(),
+              [](const AnalysisSegment &a, const AnalysisSegment &b) { return a.start < b.start; });
+}
+
+int frame_analyzer_crop(const FrameAnalyzer *fa, CropRect *crop)
+{
+    if (!fa->crop_frames)
+        return 0;
+
+    int round = FFMAX(fa->params.crop_round, 2);
+    int x = fa->active_left & ~1;
+    int y = fa->active_top & ~1;
+    int width = fa->active_right + 1 - x;
+    int height = fa->active_bottom + 1 - y;
+
+    // shrink to the rounding step, keeping the active area centered
+    int rounded_width = width / round * round;
+    int rounded_height = height / round * round;
+    x += ((width - rounded_width) / 2) & ~1;
+    y += ((height - rounded_height) / 2) & ~1;
+
+    if (rounded_width <= 0 || rounded_height <= 0)
+        return 0;
+    if (fa->width - rounded_width < round && fa->height - rounded_height < round)
+        return 0;
+
+    crop->x = x;
+    crop->y = y;
+    crop->width = rounded_width;
+    crop->height = rounded_height;
+    return 1;
+}
+
+int frame_analyzer_write_timeline(const FrameAnalyzer *fa, const char *path)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!f)
+    {
+        logging("frame analysis: could not open timeline %s", path);
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"frames\": %lld,\n  \"start\": %.6f,\n  \"end\": %.6f,\n  \"width\": %d,\n  \"height\": %d,\n",
+            (long long)fa->frames, fa->first_time, fa->last_time + fa->frame_duration, fa->width, fa->height);
+
+    CropRect crop;
+    if (frame_analyzer_crop(fa, &crop))
+        fprintf(f, "  \"crop\": {\"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d},\n", crop.x, crop.y, crop.width,
+                crop.height);
+    else
+        fprintf(f, "  \"crop\": null,\n");
+
+    fprintf(f, "  \"segments\": [");
+    for (size_t i = 0; i < fa->segments.size(); i++)
+    {
+        const AnalysisSegment &s = fa->segments[i];
+        fprintf(f, "%s\n    {\"type\": \"%s\", \"start\": %.6f, \"end\": %.6f, \"duration\": %.6f}", i ? "," : "",
+                s.type, s.start, s.end, s.end - s.start);
+    }
+    fprintf(f, "%s]\n}\n", fa->segments.empty() ? "" : "\n  ");
+
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
+
+void frame_analyzer_free(FrameAnalyzer **fa)
+{
+    if (!*fa)
+        return;
+    av_frame_free(&(*fa)->prev);
+    delete *fa;
+    *fa = NULL;
+}
@@ -0,0 +1,159 @@
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_decimator.h"
+#include "luma_kernels.h"
+#include "video_debug.h"
+
+#define DECIMATE_BLOCK 16
+
+struct FrameDecimator
+{
+    DecimateParams params;
+    // compared against instead of the previous frame so a slow fade cannot creep past the thresholds
+    AVFrame *kept;
+    AVFrame *held;
+    int flushed;
+    int run;
+    int64_t frames;
+    int64_t dropped;
+    int longest_run;
+    int unsupported;
+};
+
+void decimate_default_params(DecimateParams *params)
+{
+    params->enabled = 0;
+    params->block_max = 12;
+    params->block_changed = 5;
+    params->changed_fraction = 0.33;
+    params->max_drops = 0;
+}
+
+FrameDecimator *frame_decimator_alloc(const DecimateParams *params)
+{
+    FrameDecimator *fd = new FrameDecimator();
+    fd->params = *params;
+    fd->kept = av_frame_alloc();
+    fd->held = av_frame_alloc();
+    fd->flushed = 0;
+    fd->run = 0;
+    fd->frames = 0;
+    fd->dropped = 0;
+    fd->longest_run = 0;
+    fd->unsupported = 0;
+    if (!fd->kept || !fd->held)
+        frame_decimator_free(&fd);
+    return fd;
+}
+
+static int luma_depth(const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].step != (desc->comp[0].depth + 7) / 8)
+        return 0;
+    return desc->comp[0].depth;
+}
+
+static int is_duplicate(const FrameDecimator *fd, const AVFrame *frame, int depth)
+{
+    const AVFrame *kept = fd->kept;
+    int blocks = 0, changed = 0;
+    for (int y = 0; y < frame->height; y += DECIMATE_BLOCK)
+    {
+        int h = FFMIN(DECIMATE_BLOCK, frame->height - y);
+        for (int x = 0; x < frame->width; x += DECIMATE_BLOCK)
+        {
+            int w = FFMIN(DECIMATE_BLOCK, frame->width - x);
+            uint64_t sad;
+            if (depth <= 8)
+                sad = luma_block_sad_u8(frame->data[0] + (ptrdiff_t)y * frame->linesize[0] + x, frame->linesize[0],
+                                        kept->data[0] + (ptrdiff_t)y * kept->linesize[0] + x, kept->linesize[0], w, h);
+            else
+                sad = luma_block_sad_u16((const uint16_t *)(frame->data[0] + (ptrdiff_t)y * frame->linesize[0]) + x,
+                                         frame->linesize[0] / 2,
+                                         (const uint16_t *)(kept->data[0] + (ptrdiff_t)y * kept->linesize[0]) + x,
+                                         kept->linesize[0] / 2, w, h, depth - 8);
+
+            double difference = (double)sad / (w * h);
+            // one clearly changed block is enough, a moving cursor is a new frame
+            if (difference > fd->params.block_max)
+                return 0;
+            changed += difference > fd->params.block_changed;
+            blocks++;
+        }
+    }
+    return changed <= fd->params.changed_fraction * blocks;
+}
+
+int frame_decimator_push(FrameDecimator *fd, const AVFrame *frame)
+{
+    fd->frames++;
+    int depth = luma_depth(frame);
+    int unsupported = !depth;
+    if (unsupported != fd->unsupported)
+    {
+        if (depth)
+            logging("decimate: pixel format %d has planar luma again, comparing frames", frame->format);
+        else
+            logging("decimate: pixel format %d has no planar luma, keeping these frames", frame->format);
+        fd->unsupported = unsupported;
+    }
+    // a lowres preview decoder or a resolution switch mid-stream, the new size starts its own comparisons
+    if (depth && fd->kept->data[0] &&
+        (frame->format != fd->kept->format || frame->width != fd->kept->width || frame->height != fd->kept->height))
+    {
+        logging("decimate: frames changed from %s %dx%d to %s %dx%d, comparing against the new ones",
+                av_get_pix_fmt_name((enum AVPixelFormat)fd->kept->format), fd->kept->width, fd->kept->height,
+                av_get_pix_fmt_name((enum AVPixelFormat)frame->format), frame->width, frame->height);
+        av_frame_unref(fd->kept);
+    }
+
+    int drop = !fd->flushed && depth && fd->kept->data[0] &&
+               (!fd->params.max_drops || fd->run < fd->params.max_drops) && is_duplicate(fd, frame, depth);
+    if (drop)
+    {
+        fd->dropped++;
+        fd->longest_run = FFMAX(fd->longest_run, ++fd->run);
+        av_frame_unref(fd->held);
+        if (av_frame_ref(fd->held, frame) < 0)
+            return 0;
+        return 1;
+    }
+
+    fd->run = 0;
+    av_frame_unref(fd->kept);
+    if (depth && av_frame_ref(fd->kept, frame) < 0)
+        av_frame_unref(fd->kept);
+    av_frame_unref(fd->held);
+    return 0;
+}
+
+AVFrame *frame_decimator_flush(FrameDecimator *fd)
+{
+    fd->flushed = 1;
+    if (!fd->held->data[0])
+        return NULL;
+    // it goes out after all
+    fd->dropped--;
+    return fd->held;
+}
+
+void frame_decimator_report(const FrameDecimator *fd)
+{
+    logging("decimate: %lld frames, %lld dropped as duplicates (%.1f%%), longest run %d", (long long)fd->frames,
+            (long long)fd->dropped, fd->frames ? 100.0 * fd->dropped / fd->frames : 0.0, fd->longest_run);
+}
+
+void frame_decimator_free(FrameDecimator **fd)
+{
+    if (!*fd)
+        return;
+    av_frame_free(&(*fd)->kept);
+    av_frame_free(&(*fd)->held);
+    delete *fd;
+    *fd = NULL;
+}
@@ -0,0 +1,254 @@
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_pool.h"
+#include "video_debug.h"
+
+// rows start on a 64 byte boundary so every SIMD width can use aligned loads
+#define FRAME_POOL_ALIGN 64
+// buffers up to a huge page are rounded to 64 KiB classes, larger ones to whole huge pages
+#define FRAME_POOL_SMALL_CLASS (64 * 1024)
+#define FRAME_POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+// libavcodec reads up to 16 bytes past the end of a plane
+#define FRAME_POOL_PADDING 16
+
+typedef struct PoolBlock
+{
+    FramePool *pool;
+    size_t size;
+    uint8_t *data;
+} PoolBlock;
+
+struct FramePool
+{
+    std::mutex lock;
+    FramePoolMode mode;
+    std::map<size_t, std::vector<PoolBlock *>> idle;
+    FramePoolStats stats;
+    int64_t outstanding;
+    int closed;
+};
+
+int frame_pool_parse_mode(const char *name, FramePoolMode *mode)
+{
+    if (!strcmp(name, "off"))
+        *mode = FRAME_POOL_OFF;
+    else if (!strcmp(name, "on"))
+        *mode = FRAME_POOL_ON;
+    else if (!strcmp(name, "hugepage"))
+        *mode = FRAME_POOL_HUGEPAGE;
+    else
+    {
+        logging("unknown frame pool mode %s, use off, on or hugepage", name);
+        return -1;
+    }
+    return 0;
+}
+
+FramePool *frame_pool_alloc(FramePoolMode mode)
+{
+    if (mode == FRAME_POOL_OFF)
+        return NULL;
+    FramePool *pool = new FramePool();
+    pool->mode = mode;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->outstanding = 0;
+    pool->closed = 0;
+    return pool;
+}
+
+static size_t class_size(size_t size)
+{
+    size_t step = size <= FRAME_POOL_HUGEPAGE_SIZE ? FRAME_POOL_SMALL_CLASS : FRAME_POOL_HUGEPAGE_SIZE;
+    return (size + step - 1) / step * step;
+}
+
+static PoolBlock *new_block(FramePool *pool, size_t size)
+{
+    int huge = pool->mode == FRAME_POOL_HUGEPAGE && size >= FRAME_POOL_HUGEPAGE_SIZE;
+    void *data = NULL;
+    if (posix_memalign(&data, huge ? FRAME_POOL_HUGEPAGE_SIZE : FRAME_POOL_ALIGN, size))
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    huge = huge && madvise(data, size, MADV_HUGEPAGE) == 0;
+#else
+    huge = 0;
+#endif
+
+    PoolBlock *block = new PoolBlock();
+    block->pool = pool;
+    block->size = size;
+    block->data = (uint8_t *)data;
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->stats.blocks++;
+    pool->stats.bytes_reserved += size;
+    if (huge)
+        pool->stats.hugepage_bytes += size;
+    return block;
+}
+
+static void delete_block(PoolBlock *block)
+{
+    free(block->data);
+    delete block;
+}
+
+static PoolBlock *get_block(FramePool *pool, size_t size)
+{
+    PoolBlock *block = NULL;
+    size = class_size(size);
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        std::vector<PoolBlock *> &idle = pool->idle[size];
+        pool->stats.requests++;
+        if (!idle.empty())
+        {
+            block = idle.back();
+            idle.pop_back();
+            pool->stats.reused++;
+        }
+    }
+    if (!block && !(block = new_block(pool, size)))
+        return NULL;
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->outstanding++;
+    pool->stats.bytes_in_use += size;
+    pool->stats.peak_bytes_in_use = FFMAX(pool->stats.peak_bytes_in_use, pool->stats.bytes_in_use);
+    return block;
+}
+
+// the last buffer to come back after frame_pool_free takes the pool with it
+static void release_block(void *opaque, uint8_t *)
+{
+    PoolBlock *block = (PoolBlock *)opaque;
+    FramePool *pool = block->pool;
+    std::unique_lock<std::mutex> guard(pool->lock);
+    pool->outstanding--;
+    pool->stats.bytes_in_use -= block->size;
+    if (!pool->closed)
+    {
+        pool->idle[block->size].push_back(block);
+        return;
+    }
+    int last = pool->outstanding == 0;
+    guard.unlock();
+    delete_block(block);
+    if (last)
+        delete pool;
+}
+
+static int pool_get_buffer2(AVCodecContext *avcc, AVFrame *frame, int flags)
+{
+    FramePool *pool = (FramePool *)avcc->opaque;
+    enum AVPixelFormat format = (enum AVPixelFormat)frame->format;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (avcc->codec_type != AVMEDIA_TYPE_VIDEO || !(avcc->codec->capabilities & AV_CODEC_CAP_DR1) || !desc ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)))
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->stats.fallbacks++;
+        return avcodec_default_get_buffer2(avcc, frame, flags);
+    }
+
+    // same geometry rules as the default allocator, with wider row alignment
+    int width = frame->width, height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    int linesize[4];
+    avcodec_align_dimensions2(avcc, &width, &height, linesize_align);
+    int unaligned;
+    do
+    {
+        if (av_image_fill_linesizes(linesize, format, width) < 0)
+            return AVERROR(EINVAL);
+        unaligned = 0;
+        for (int i = 0; i < 4; i++)
+            unaligned |= linesize[i] % FFMAX(linesize_align[i], FRAME_POOL_ALIGN);
+        width += width & ~(width - 1);
+    } while (unaligned);
+
+    uint8_t *data[4];
+    int size = av_image_fill_pointers(data, format, height, NULL, linesize);
+    if (size < 0)
+        return size;
+
+    PoolBlock *block = get_block(pool, size + FRAME_POOL_PADDING + FRAME_POOL_ALIGN - 1);
+    if (!block)
+        return AVERROR(ENOMEM);
+    frame->buf[0] = av_buffer_create(block->data, block->size, release_block, block, 0);
+    if (!frame->buf[0])
+    {
+        release_block(block, NULL);
+        return AVERROR(ENOMEM);
+    }
+
+    av_image_fill_pointers(frame->data, format, height, block->data, linesize);
+    for (int i = 0; i < 4; i++)
+        frame->linesize[i] = linesize[i];
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+void frame_pool_attach(FramePool *pool, AVCodecContext *avcc)
+{
+    if (!pool)
+        return;
+    avcc->opaque = pool;
+    avcc->get_buffer2 = pool_get_buffer2;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+    // frame threads call get_buffer2 themselves instead of queueing on the main thread
+    avcc->thread_safe_callbacks = 1;
+#endif
+}
+
+void frame_pool_stats(FramePool *pool, FramePoolStats *stats)
+{
+    std::lock_guard<std::mutex> guard(pool->lock);
+    *stats = pool->stats;
+}
+
+void frame_pool_report(FramePool *pool)
+{
+    if (!pool)
+        return;
+    FramePoolStats stats;
+    frame_pool_stats(pool, &stats);
+    logging("frame pool: %lld requests, %.1f%% reused, %lld fallbacks, %lld buffers, %.1f MiB reserved "
+            "(%.1f MiB huge pages), peak %.1f MiB in use",
+            (long long)stats.requests, stats.requests ? 100.0 * stats.reused / stats.requests : 0.0,
+            (long long)stats.fallbacks, (long long)stats.blocks, stats.bytes_reserved / 1048576.0,
+            stats.hugepage_bytes / 1048576.0, stats.peak_bytes_in_use / 1048576.0);
+}
+
+void frame_pool_free(FramePool **pool)
+{
+    FramePool *p = *pool;
+    if (!p)
+        return;
+    *pool = NULL;
+
+    std::unique_lock<std::mutex> guard(p->lock);
+    for (auto &entry : p->idle)
+    {
+        for (PoolBlock *block : entry.second)
+            delete_block(block);
+    }
+    p->idle.clear();
+    p->closed = 1;
+    int last = p->outstanding == 0;
+    guard.unlock();
+    if (last)
+        delete p;
+}
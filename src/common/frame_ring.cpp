@@ -0,0 +1,356 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_ring.h"
+#include "trace.h"
+#include "video_debug.h"
+
+#define FRAME_RING_ALIGN 64
+#define FRAME_RING_POLL_NS (100 * 1000 * 1000)
+
+typedef struct RingSlot
+{
+    // one bit per consumer that has not released this slot yet
+    uint32_t holders;
+    int64_t sequence;
+    int64_t pts;
+    int64_t pkt_dts;
+    int key_frame;
+    int pict_type;
+    AVRational sample_aspect_ratio;
+} RingSlot;
+
+typedef struct RingHeader
+{
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    pthread_cond_t released;
+    int slot_count;
+    int consumers;
+    int width;
+    int height;
+    int format;
+    size_t slot_size;
+    size_t data_offset;
+    pid_t producer;
+    uint32_t alive;
+    int finished;
+    int64_t write_sequence;
+    int64_t read_sequence[FRAME_RING_MAX_CONSUMERS];
+    pid_t consumer_pids[FRAME_RING_MAX_CONSUMERS];
+    RingSlot slots[];
+} RingHeader;
+
+struct FrameRing
+{
+    int fd;
+    size_t map_size;
+    RingHeader *header;
+    uint8_t *data;
+    int orphaned;
+};
+
+typedef struct SlotRelease
+{
+    FrameRing *ring;
+    int consumer;
+    int slot;
+} SlotRelease;
+
+static size_t align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// a consumer that died while holding the lock leaves it inconsistent, the survivor repairs it
+static void ring_lock(RingHeader *header)
+{
+    if (pthread_mutex_lock(&header->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&header->lock);
+}
+
+static int ring_wait(pthread_cond_t *cond, RingHeader *header)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FRAME_RING_POLL_NS;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int ret = pthread_cond_timedwait(cond, &header->lock, &deadline);
+    if (ret == EOWNERDEAD)
+        pthread_mutex_consistent(&header->lock);
+    return ret;
+}
+
+static void detach_locked(RingHeader *header, int consumer)
+{
+    uint32_t bit = 1u << consumer;
+    header->alive &= ~bit;
+    for (int i = 0; i < header->slot_count; i++)
+        header->slots[i].holders &= ~bit;
+    pthread_cond_broadcast(&header->released);
+}
+
+// the producer looks for consumers that are gone without reaping them, the caller still waits for them
+static void reap_dead_consumers(RingHeader *header)
+{
+    for (int i = 0; i < header->consumers; i++)
+    {
+        uint32_t bit = 1u << i;
+        if (!(header->alive & bit) || header->consumer_pids[i] <= 0)
+            continue;
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, header->consumer_pids[i], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid)
+        {
+            logging("frame ring consumer %d (pid %d) exited, releasing its frames", i, (int)info.si_pid);
+            detach_locked(header, i);
+        }
+    }
+}
+
+FrameRing *frame_ring_create(int slots, int consumers, int width, int height, enum AVPixelFormat format)
+{
+    if (consumers < 1 || consumers > FRAME_RING_MAX_CONSUMERS || slots < 1)
+    {
+        logging("frame ring needs 1 to %d consumers and at least one slot", FRAME_RING_MAX_CONSUMERS);
+        return NULL;
+    }
+
+    int frame_size = av_image_get_buffer_size(format, width, height, FRAME_RING_ALIGN);
+    if (frame_size < 0)
+    {
+        logging("unsupported frame ring format %dx%d %s", width, height, av_get_pix_fmt_name(format));
+        return NULL;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t header_size = align_up(sizeof(RingHeader) + slots * sizeof(RingSlot), page);
+    size_t slot_size = align_up(frame_size, page);
+    size_t map_size = header_size + slot_size * slots;
+
+    int fd = memfd_create("frame-ring", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, map_size) < 0)
+    {
+        logging("failed to create the frame ring memory: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        logging("failed to map the frame ring: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    RingHeader *header = (RingHeader *)map;
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&header->published, &cond_attr);
+    pthread_cond_init(&header->released, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    header->slot_count = slots;
+    header->consumers = consumers;
+    header->width = width;
+    header->height = height;
+    header->format = format;
+    header->slot_size = slot_size;
+    header->data_offset = header_size;
+    header->producer = getpid();
+    header->alive = consumers == 32 ? 0xffffffffu : (1u << consumers) - 1;
+
+    FrameRing *ring = (FrameRing *)av_mallocz(sizeof(FrameRing));
+    if (!ring)
+    {
+        munmap(map, map_size);
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->map_size = map_size;
+    ring->header = header;
+    ring->data = (uint8_t *)map + header_size;
+    return ring;
+}
+
+int frame_ring_fd(const FrameRing *ring)
+{
+    return ring->fd;
+}
+
+void frame_ring_set_consumer_pid(FrameRing *ring, int consumer, pid_t pid)
+{
+    ring_lock(ring->header);
+    ring->header->consumer_pids[consumer] = pid;
+    pthread_mutex_unlock(&ring->header->lock);
+}
+
+int frame_ring_publish(FrameRing *ring, const AVFrame *frame)
+{
+    RingHeader *header = ring->header;
+    if (frame->width != header->width || frame->height != header->height || frame->format != header->format)
+    {
+        logging("frame %dx%d does not fit the frame ring %dx%d", frame->width, frame->height, header->width,
+                header->height);
+        return -1;
+    }
+
+    int64_t start = trace_begin();
+    ring_lock(header);
+    int index = header->write_sequence % header->slot_count;
+    RingSlot *slot = &header->slots[index];
+    while (slot->holders & header->alive)
+    {
+        if (ring_wait(&header->released, header) == ETIMEDOUT)
+            reap_dead_consumers(header);
+    }
+    uint32_t alive = header->alive;
+    pthread_mutex_unlock(&header->lock);
+    trace_end("ring wait", start, frame->pts);
+
+    if (!alive)
+    {
+        // the producer's own work goes on without the crashed consumers
+        if (!ring->orphaned)
+            logging("every frame ring consumer is gone");
+        ring->orphaned = 1;
+        return 0;
+    }
+
+    // the only copy: decoder output into shared memory, consumers map the slot as is
+    uint8_t *data[4];
+    int linesize[4];
+    av_image_fill_arrays(data, linesize, ring->data + index * header->slot_size, (enum AVPixelFormat)header->format,
+                         header->width, header->height, FRAME_RING_ALIGN);
+    av_image_copy(data, linesize, (const uint8_t **)frame->data, frame->linesize, (enum AVPixelFormat)header->format,
+                  header->width, header->height);
+
+    ring_lock(header);
+    slot->sequence = header->write_sequence;
+    slot->pts = frame->pts;
+    slot->pkt_dts = frame->pkt_dts;
+    slot->key_frame = frame->key_frame;
+    slot->pict_type = frame->pict_type;
+    slot->sample_aspect_ratio = frame->sample_aspect_ratio;
+    slot->holders = header->alive;
+    header->write_sequence++;
+    pthread_cond_broadcast(&header->published);
+    pthread_mutex_unlock(&header->lock);
+    return 0;
+}
+
+void frame_ring_finish(FrameRing *ring)
+{
+    ring_lock(ring->header);
+    ring->header->finished = 1;
+    pthread_cond_broadcast(&ring->header->published);
+    pthread_mutex_unlock(&ring->header->lock);
+}
+
+static void release_slot(void *opaque, uint8_t *)
+{
+    SlotRelease *release = (SlotRelease *)opaque;
+    RingHeader *header = release->ring->header;
+    ring_lock(header);
+    header->slots[release->slot].holders &= ~(1u << release->consumer);
+    pthread_cond_broadcast(&header->released);
+    pthread_mutex_unlock(&header->lock);
+    av_free(release);
+}
+
+int frame_ring_acquire(FrameRing *ring, int consumer, AVFrame *frame)
+{
+    RingHeader *header = ring->header;
+    ring_lock(header);
+    while (header->read_sequence[consumer] >= header->write_sequence && !header->finished)
+    {
+        if (ring_wait(&header->published, header) == ETIMEDOUT && kill(header->producer, 0) < 0)
+        {
+            pthread_mutex_unlock(&header->lock);
+            logging("the frame ring producer is gone");
+            return AVERROR(EPIPE);
+        }
+    }
+    if (header->read_sequence[consumer] >= header->write_sequence)
+    {
+        pthread_mutex_unlock(&header->lock);
+        return AVERROR_EOF;
+    }
+
+    int index = header->read_sequence[consumer] % header->slot_count;
+    RingSlot slot = header->slots[index];
+    header->read_sequence[consumer]++;
+    pthread_mutex_unlock(&header->lock);
+
+    SlotRelease *release = (SlotRelease *)av_malloc(sizeof(SlotRelease));
+    if (!release)
+        return AVERROR(ENOMEM);
+    release->ring = ring;
+    release->consumer = consumer;
+    release->slot = index;
+
+    uint8_t *base = ring->data + index * header->slot_size;
+    frame->buf[0] = av_buffer_create(base, header->slot_size, release_slot, release, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0])
+    {
+        release_slot(release, NULL);
+        return AVERROR(ENOMEM);
+    }
+    av_image_fill_arrays(frame->data, frame->linesize, base, (enum AVPixelFormat)header->format, header->width,
+                         header->height, FRAME_RING_ALIGN);
+    frame->extended_data = frame->data;
+    frame->width = header->width;
+    frame->height = header->height;
+    frame->format = header->format;
+    frame->pts = slot.pts;
+    frame->pkt_dts = slot.pkt_dts;
+    frame->key_frame = slot.key_frame;
+    frame->pict_type = (enum AVPictureType)slot.pict_type;
+    frame->sample_aspect_ratio = slot.sample_aspect_ratio;
+    return 0;
+}
+
+void frame_ring_detach(FrameRing *ring, int consumer)
+{
+    ring_lock(ring->header);
+    detach_locked(ring->header, consumer);
+    pthread_mutex_unlock(&ring->header->lock);
+}
+
+void frame_ring_free(FrameRing **ring)
+{
+    FrameRing *r = *ring;
+    if (!r)
+        return;
+    munmap(r->header, r->map_size);
+    close(r->fd);
+    av_freep(ring);
+}
@@ -0,0 +1,522 @@
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_sink.h"
+#include "trace.h"
+#include "video_debug.h"
+
+typedef struct FrameSinkJob
+{
+    AVFrame *frame;
+    int number;
+} FrameSinkJob;
+
+typedef struct FrameSinkWriter
+{
+    AVCodecContext *png_avcc;
+    AVPacket *packet;
+    std::vector<uint8_t> scratch;
+} FrameSinkWriter;
+
+struct FrameSink
+{
+    FrameSinkParams params;
+    int dir_fd;
+    int y4m_fd;
+    int y4m_header_written;
+    int gray_warning_logged;
+
+    std::mutex lock;
+    std::condition_variable has_work;
+    std::condition_variable has_space;
+    std::deque<FrameSinkJob> queue;
+    std::vector<std::thread> writers;
+    bool closing;
+
+    int errors;
+    int frames_written;
+    int64_t bytes_written;
+};
+
+static const char *frame_sink_extension(FrameSinkFormat format)
+{
+    switch (format)
+    {
+    case FRAME_SINK_PGM:
+        return "pgm";
+    case FRAME_SINK_Y4M:
+        return "y4m";
+    default:
+        return "png";
+    }
+}
+
+static const char *y4m_colorspace(enum AVPixelFormat pix_fmt)
+{
+    switch (pix_fmt)
+    {
+    case AV_PIX_FMT_GRAY8:
+        return "mono";
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return "420jpeg";
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        return "422";
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        return "444";
+    case AV_PIX_FMT_YUV420P10LE:
+        return "420p10";
+    case AV_PIX_FMT_YUV422P10LE:
+        return "422p10";
+    case AV_PIX_FMT_YUV444P10LE:
+        return "444p10";
+    default:
+        return NULL;
+    }
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, FFMIN(count, IOV_MAX));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && written >= (ssize_t)iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int luma_is_gray8(FrameSink *sink, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    if (desc && !(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->comp[0].depth == 8)
+        return 1;
+
+    std::lock_guard<std::mutex> guard(sink->lock);
+    if (!sink->gray_warning_logged)
+    {
+        logging("frame sink: pixel format %s has no 8-bit luma plane, frames are skipped",
+                desc ? desc->name : "unknown");
+        sink->gray_warning_logged = 1;
+    }
+    return 0;
+}
+
+static int encode_pgm(const AVFrame *frame, std::vector<uint8_t> &out)
+{
+    char header[64];
+    int header_size = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", frame->width, frame->height, 255);
+
+    out.resize(header_size + (size_t)frame->width * frame->height);
+    memcpy(out.data(), header, header_size);
+    uint8_t *dst = out.data() + header_size;
+    for (int y = 0; y < frame->height; y++)
+    {
+        memcpy(dst, frame->data[0] + (ptrdiff_t)y * frame->linesize[0], frame->width);
+        dst += frame->width;
+    }
+    return 0;
+}
+
+static int open_png_encoder(FrameSinkWriter *writer, const AVFrame *frame)
+{
+    if (writer->png_avcc && writer->png_avcc->width == frame->width && writer->png_avcc->height == frame->height)
+        return 0;
+
+    avcodec_free_context(&writer->png_avcc);
+
+    const AVCodec *png = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!png)
+    {
+        logging("frame sink: png encoder not available");
+        return -1;
+    }
+
+    writer->png_avcc = avcodec_alloc_context3(png);
+    if (!writer->png_avcc)
+    {
+        logging("frame sink: could not allocate png encoder");
+        return -1;
+    }
+
+    writer->png_avcc->width = frame->width;
+    writer->png_avcc->height = frame->height;
+    writer->png_avcc->pix_fmt = AV_PIX_FMT_GRAY8;
+    writer->png_avcc->time_base = (AVRational){1, 25};
+
+    if (avcodec_open2(writer->png_avcc, png, NULL) < 0)
+    {
+        logging("frame sink: could not open png encoder");
+        avcodec_free_context(&writer->png_avcc);
+        return -1;
+    }
+    return 0;
+}
+
+static int encode_png(FrameSinkWriter *writer, const AVFrame *frame)
+{
+    if (open_png_encoder(writer, frame))
+        return -1;
+
+    // view the luma plane as a gray picture, sharing the decoder buffer
+    AVFrame *gray = av_frame_alloc();
+    if (!gray)
+        return -1;
+
+    gray->format = AV_PIX_FMT_GRAY8;
+    gray->width = frame->width;
+    gray->height = frame->height;
+    gray->data[0] = frame->data[0];
+    gray->linesize[0] = frame->linesize[0];
+    if (frame->buf[0])
+        gray->buf[0] = av_buffer_ref(frame->buf[0]);
+
+    int response = avcodec_send_frame(writer->png_avcc, gray);
+    av_frame_free(&gray);
+    if (response < 0)
+    {
+        logging("frame sink: error while sending frame to png encoder");
+        return -1;
+    }
+
+    av_packet_unref(writer->packet);
+    response = avcodec_receive_packet(writer->png_avcc, writer->packet);
+    if (response < 0)
+    {
+        logging("frame sink: error while receiving png from encoder");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_image_batch(FrameSink *sink, FrameSinkWriter *writer, std::vector<FrameSinkJob> &batch)
+{
+    int errors = 0;
+    char filename[256];
+
+    for (FrameSinkJob &job : batch)
+    {
+        if (!luma_is_gray8(sink, job.frame))
+            continue;
+
+        const uint8_t *data;
+        size_t size;
+        if (sink->params.format == FRAME_SINK_PNG)
+        {
+            if (encode_png(writer, job.frame))
+            {
+                errors++;
+                continue;
+            }
+            data = writer->packet->data;
+            size = writer->packet->size;
+        }
+        else
+        {
+            encode_pgm(job.frame, writer->scratch);
+            data = writer->scratch.data();
+            size = writer->scratch.size();
+        }
+
+        snprintf(filename, sizeof(filename), "%s-%d.%s", sink->params.prefix, job.number,
+                 frame_sink_extension(sink->params.format));
+
+        int fd = openat(sink->dir_fd, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || write_all(fd, data, size))
+        {
+            logging("frame sink: could not write %s/%s", sink->params.directory, filename);
+            errors++;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> guard(sink->lock);
+            sink->frames_written++;
+            sink->bytes_written += size;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    return errors;
+}
+
+static int write_y4m_batch(FrameSink *sink, std::vector<FrameSinkJob> &batch)
+{
+    std::vector<struct iovec> iov;
+    char header[256];
+    static char frame_marker[] = "FRAME\n";
+    int64_t bytes = 0;
+
+    for (FrameSinkJob &job : batch)
+    {
+        const AVFrame *frame = job.frame;
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+        const char *colorspace = y4m_colorspace((enum AVPixelFormat)frame->format);
+        if (!colorspace || !desc)
+        {
+            logging("frame sink: pixel format %d cannot be stored as y4m", frame->format);
+            return 1;
+        }
+
+        if (!sink->y4m_header_written)
+        {
+            AVRational sar = frame->sample_aspect_ratio;
+            int header_size = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C%s\n",
+                                       frame->width, frame->height, sink->params.frame_rate.num,
+                                       sink->params.frame_rate.den, sar.num, sar.den, colorspace);
+            iov.push_back({header, (size_t)header_size});
+            bytes += header_size;
+            sink->y4m_header_written = 1;
+        }
+
+        iov.push_back({frame_marker, sizeof(frame_marker) - 1});
+        bytes += sizeof(frame_marker) - 1;
+
+        int bytes_per_sample = (desc->comp[0].depth + 7) / 8;
+        int planes = desc->nb_components == 1 ? 1 : 3;
+        for (int plane = 0; plane < planes; plane++)
+        {
+            int width = plane ? -((-frame->width) >> desc->log2_chroma_w) : frame->width;
+            int height = plane ? -((-frame->height) >> desc->log2_chroma_h) : frame->height;
+            size_t row_bytes = (size_t)width * bytes_per_sample;
+
+            if ((size_t)frame->linesize[plane] == row_bytes)
+            {
+                iov.push_back({frame->data[plane], row_bytes * height});
+            }
+            else
+            {
+                for (int y = 0; y < height; y++)
+                    iov.push_back({frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane], row_bytes});
+            }
+            bytes += row_bytes * height;
+        }
+    }
+
+    if (writev_all(sink->y4m_fd, iov.data(), iov.size()))
+    {
+        logging("frame sink: could not write y4m stream");
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> guard(sink->lock);
+    sink->frames_written += batch.size();
+    sink->bytes_written += bytes;
+    return 0;
+}
+
+static void frame_sink_writer_loop(FrameSink *sink)
+{
+    FrameSinkWriter writer = {};
+    std::vector<FrameSinkJob> batch;
+    trace_thread_name("frame sink");
+
+    writer.packet = av_packet_alloc();
+    if (!writer.packet)
+    {
+        logging("frame sink: could not allocate writer packet");
+        std::lock_guard<std::mutex> guard(sink->lock);
+        sink->errors++;
+        return;
+    }
+
+    while (true)
+    {
+        int64_t start = trace_begin();
+        {
+            std::unique_lock<std::mutex> guard(sink->lock);
+            sink->has_work.wait(guard, [sink] { return !sink->queue.empty() || sink->closing; });
+            trace_end("queue wait", start, -1);
+            if (sink->queue.empty())
+                break;
+
+            while (!sink->queue.empty() && (int)batch.size() < sink->params.batch_size)
+            {
+                batch.push_back(sink->queue.front());
+                sink->queue.pop_front();
+            }
+        }
+        sink->has_space.notify_all();
+
+        int errors;
+        start = trace_begin();
+        if (sink->params.format == FRAME_SINK_Y4M)
+            errors = write_y4m_batch(sink, batch);
+        else
+            errors = write_image_batch(sink, &writer, batch);
+        trace_end("write frames", start, batch.front().number);
+
+        for (FrameSinkJob &job : batch)
+            av_frame_free(&job.frame);
+        batch.clear();
+
+        if (errors)
+        {
+            std::lock_guard<std::mutex> guard(sink->lock);
+            sink->errors += errors;
+        }
+    }
+
+    avcodec_free_context(&writer.png_avcc);
+    av_packet_free(&writer.packet);
+}
+
+void frame_sink_default_params(FrameSinkParams *params)
+{
+    params->format = FRAME_SINK_PNG;
+    params->directory = "frame";
+    params->prefix = "frame";
+    params->threads = 0;
+    params->batch_size = 8;
+    params->max_pending = 256;
+    params->frame_rate = (AVRational){25, 1};
+}
+
+int frame_sink_parse_format(const char *name, FrameSinkFormat *format)
+{
+    if (!strcmp(name, "png"))
+        *format = FRAME_SINK_PNG;
+    else if (!strcmp(name, "pgm"))
+        *format = FRAME_SINK_PGM;
+    else if (!strcmp(name, "y4m"))
+        *format = FRAME_SINK_Y4M;
+    else
+        return -1;
+    return 0;
+}
+
+FrameSink *frame_sink_open(const FrameSinkParams *params)
+{
+    FrameSink *sink = new FrameSink();
+    sink->params = *params;
+    sink->y4m_fd = -1;
+    sink->closing = false;
+
+    if (sink->params.batch_size < 1)
+        sink->params.batch_size = 1;
+    if (sink->params.frame_rate.num <= 0 || sink->params.frame_rate.den <= 0)
+        sink->params.frame_rate = (AVRational){25, 1};
+
+    sink->dir_fd = open(params->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sink->dir_fd < 0)
+    {
+        logging("frame sink: could not open output directory %s", params->directory);
+        delete sink;
+        return NULL;
+    }
+
+    int threads = params->threads > 0 ? params->threads : (int)std::thread::hardware_concurrency();
+    if (params->format == FRAME_SINK_Y4M)
+    {
+        std::string filename = std::string(params->prefix) + ".y4m";
+        sink->y4m_fd = openat(sink->dir_fd, filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (sink->y4m_fd < 0)
+        {
+            logging("frame sink: could not create %s/%s", params->directory, filename.c_str());
+            close(sink->dir_fd);
+            delete sink;
+            return NULL;
+        }
+        threads = 1;
+    }
+
+    for (int i = 0; i < FFMAX(threads, 1); i++)
+        sink->writers.emplace_back(frame_sink_writer_loop, sink);
+
+    return sink;
+}
+
+int frame_sink_push(FrameSink *sink, const AVFrame *frame, int number)
+{
+    AVFrame *ref = av_frame_clone(frame);
+    if (!ref)
+    {
+        logging("frame sink: could not reference frame %d", number);
+        return -1;
+    }
+
+    int64_t start = trace_begin();
+    {
+        std::unique_lock<std::mutex> guard(sink->lock);
+        if (sink->params.max_pending > 0)
+            sink->has_space.wait(guard, [sink] { return (int)sink->queue.size() < sink->params.max_pending; });
+        trace_end("queue wait", start, number);
+        sink->queue.push_back({ref, number});
+    }
+    sink->has_work.notify_one();
+    return 0;
+}
+
+int frame_sink_close(FrameSink **sink)
+{
+    FrameSink *s = *sink;
+    if (!s)
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->closing = true;
+    }
+    s->has_work.notify_all();
+    for (std::thread &writer : s->writers)
+        writer.join();
+
+    logging("frame sink: %d frames, %lld bytes written to %s", s->frames_written, (long long)s->bytes_written,
+            s->params.directory);
+
+    if (s->y4m_fd >= 0)
+        close(s->y4m_fd);
+    close(s->dir_fd);
+
+    int errors = s->errors;
+    delete s;
+    *sink = NULL;
+    return errors ? -1 : 0;
+}
@@ -0,0 +1,290 @@
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "interleaver.h"
+#include "video_debug.h"
+
+typedef struct QueuedPacket
+{
+    AVPacket *pkt;
+    int64_t time_us;
+} QueuedPacket;
+
+typedef struct InterleaverStream
+{
+    std::deque<QueuedPacket> queue;
+    // sparse streams such as subtitles are never waited for
+    int waited_for;
+    // ended before the output, its empty queue no longer holds the others back
+    int finished;
+    int64_t last_time_us;
+    InterleaverStreamStats stats;
+} InterleaverStream;
+
+struct Interleaver
+{
+    AVFormatContext *avfc;
+    InterleaverParams params;
+    std::vector<InterleaverStream> streams;
+    int64_t buffered_bytes;
+    int64_t newest_us;
+    int stalled;
+};
+
+void interleaver_default_params(InterleaverParams *params)
+{
+    params->max_delay_us = 10 * (int64_t)AV_TIME_BASE;
+    params->max_bytes = (int64_t)64 << 20;
+    params->policy = INTERLEAVER_FLUSH;
+}
+
+int interleaver_parse_policy(const char *name, InterleaverStallPolicy *policy)
+{
+    if (!strcmp(name, "flush"))
+        *policy = INTERLEAVER_FLUSH;
+    else if (!strcmp(name, "drop"))
+        *policy = INTERLEAVER_DROP;
+    else if (!strcmp(name, "fail"))
+        *policy = INTERLEAVER_FAIL;
+    else
+    {
+        logging("unknown stall policy %s, expected flush, drop or fail", name);
+        return -1;
+    }
+    return 0;
+}
+
+Interleaver *interleaver_alloc(AVFormatContext *avfc, const InterleaverParams *params)
+{
+    Interleaver *interleaver = new Interleaver();
+    interleaver->avfc = avfc;
+    interleaver->params = *params;
+    interleaver->streams.resize(avfc->nb_streams);
+    interleaver->buffered_bytes = 0;
+    interleaver->newest_us = AV_NOPTS_VALUE;
+    interleaver->stalled = 0;
+
+    for (unsigned int i = 0; i < avfc->nb_streams; i++)
+    {
+        enum AVMediaType type = avfc->streams[i]->codecpar->codec_type;
+        InterleaverStream &stream = interleaver->streams[i];
+        stream.waited_for = type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO;
+        stream.finished = 0;
+        stream.last_time_us = AV_NOPTS_VALUE;
+        memset(&stream.stats, 0, sizeof(stream.stats));
+    }
+    return interleaver;
+}
+
+// the stream whose head packet is the oldest, -1 when nothing is buffered
+static int oldest_stream(const Interleaver *interleaver)
+{
+    int oldest = -1;
+    for (size_t i = 0; i < interleaver->streams.size(); i++)
+    {
+        const InterleaverStream &stream = interleaver->streams[i];
+        if (!stream.queue.empty() &&
+            (oldest < 0 || stream.queue.front().time_us < interleaver->streams[oldest].queue.front().time_us))
+            oldest = i;
+    }
+    return oldest;
+}
+
+static int all_waited_streams_ready(const Interleaver *interleaver)
+{
+    for (const InterleaverStream &stream : interleaver->streams)
+    {
+        if (stream.waited_for && !stream.finished && stream.queue.empty())
+            return 0;
+    }
+    return 1;
+}
+
+static QueuedPacket pop_packet(Interleaver *interleaver, int index)
+{
+    InterleaverStream &stream = interleaver->streams[index];
+    QueuedPacket queued = stream.queue.front();
+    stream.queue.pop_front();
+    stream.stats.buffered_packets--;
+    stream.stats.buffered_bytes -= queued.pkt->size;
+    interleaver->buffered_bytes -= queued.pkt->size;
+    return queued;
+}
+
+static int write_oldest(Interleaver *interleaver, int index)
+{
+    QueuedPacket queued = pop_packet(interleaver, index);
+    int ret = av_write_frame(interleaver->avfc, queued.pkt);
+    av_packet_free(&queued.pkt);
+    if (ret < 0)
+    {
+        logging("error while writing packet of stream %d", index);
+        return ret;
+    }
+    interleaver->streams[index].stats.written++;
+    return 0;
+}
+
+static void begin_stall(Interleaver *interleaver, int64_t delay)
+{
+    if (interleaver->stalled)
+        return;
+    interleaver->stalled = 1;
+    for (size_t i = 0; i < interleaver->streams.size(); i++)
+    {
+        InterleaverStream &stream = interleaver->streams[i];
+        if (stream.waited_for && !stream.finished && stream.queue.empty())
+        {
+            stream.stats.stalls++;
+            logging("stream %d stalled with %" PRId64 " bytes and %" PRId64 " ms buffered", (int)i,
+                    interleaver->buffered_bytes, delay / 1000);
+        }
+    }
+}
+
+static int drain(Interleaver *interleaver)
+{
+    while (true)
+    {
+        int index = oldest_stream(interleaver);
+        if (index < 0)
+            return 0;
+
+        if (all_waited_streams_ready(interleaver))
+        {
+            interleaver->stalled = 0;
+            int ret = write_oldest(interleaver, index);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        int64_t delay = interleaver->newest_us - interleaver->streams[index].queue.front().time_us;
+        if (interleaver->buffered_bytes <= interleaver->params.max_bytes && delay <= interleaver->params.max_delay_us)
+            return 0;
+
+        begin_stall(interleaver, delay);
+        if (interleaver->params.policy == INTERLEAVER_FAIL)
+        {
+            logging("interleaving limits exceeded: %" PRId64 " bytes, %" PRId64 " ms", interleaver->buffered_bytes,
+                    delay / 1000);
+            return AVERROR(ENOBUFS);
+        }
+        if (interleaver->params.policy == INTERLEAVER_DROP)
+        {
+            QueuedPacket queued = pop_packet(interleaver, index);
+            av_packet_free(&queued.pkt);
+            interleaver->streams[index].stats.dropped++;
+            continue;
+        }
+        int ret = write_oldest(interleaver, index);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+int interleaver_write(Interleaver *interleaver, AVPacket *pkt)
+{
+    if (pkt->stream_index < 0 || pkt->stream_index >= (int)interleaver->streams.size())
+    {
+        av_packet_unref(pkt);
+        return AVERROR(EINVAL);
+    }
+
+    InterleaverStream &stream = interleaver->streams[pkt->stream_index];
+    int64_t time = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (time != AV_NOPTS_VALUE)
+        time = av_rescale_q(time, interleaver->avfc->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q);
+    else
+        time = stream.last_time_us != AV_NOPTS_VALUE ? stream.last_time_us : 0;
+    stream.last_time_us = time;
+    if (interleaver->newest_us == AV_NOPTS_VALUE || time > interleaver->newest_us)
+        interleaver->newest_us = time;
+
+    QueuedPacket queued;
+    queued.pkt = av_packet_alloc();
+    queued.time_us = time;
+    if (!queued.pkt)
+    {
+        av_packet_unref(pkt);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(queued.pkt, pkt);
+    stream.queue.push_back(queued);
+
+    InterleaverStreamStats &stats = stream.stats;
+    stats.buffered_packets++;
+    stats.buffered_bytes += queued.pkt->size;
+    stats.peak_bytes = FFMAX(stats.peak_bytes, stats.buffered_bytes);
+    stats.peak_delay_us = FFMAX(stats.peak_delay_us, interleaver->newest_us - stream.queue.front().time_us);
+    interleaver->buffered_bytes += queued.pkt->size;
+
+    return drain(interleaver);
+}
+
+int interleaver_end_stream(Interleaver *interleaver, int stream_index)
+{
+    if (stream_index < 0 || stream_index >= (int)interleaver->streams.size())
+        return AVERROR(EINVAL);
+    interleaver->streams[stream_index].finished = 1;
+    return drain(interleaver);
+}
+
+int packet_ends_stream(const AVStream *stream, const AVPacket *pkt)
+{
+    int64_t time = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (stream->duration <= 0 || stream->duration == AV_NOPTS_VALUE || time == AV_NOPTS_VALUE)
+        return 0;
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    return time + pkt->duration >= start + stream->duration;
+}
+
+int interleaver_flush(Interleaver *interleaver)
+{
+    int index;
+    while ((index = oldest_stream(interleaver)) >= 0)
+    {
+        int ret = write_oldest(interleaver, index);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int interleaver_stream_stats(const Interleaver *interleaver, int stream_index, InterleaverStreamStats *stats)
+{
+    if (stream_index < 0 || stream_index >= (int)interleaver->streams.size())
+        return -1;
+    const InterleaverStream &stream = interleaver->streams[stream_index];
+    *stats = stream.stats;
+    stats->buffered_delay_us = stream.queue.empty() ? 0 : interleaver->newest_us - stream.queue.front().time_us;
+    return 0;
+}
+
+void interleaver_report(const Interleaver *interleaver)
+{
+    for (size_t i = 0; i < interleaver->streams.size(); i++)
+    {
+        InterleaverStreamStats stats;
+        interleaver_stream_stats(interleaver, i, &stats);
+        logging("interleaver stream %d: written=%" PRId64 " dropped=%" PRId64 " stalls=%" PRId64
+                " peak_bytes=%" PRId64 " peak_delay_ms=%" PRId64 " buffered_bytes=%" PRId64,
+                (int)i, stats.written, stats.dropped, stats.stalls, stats.peak_bytes, stats.peak_delay_us / 1000,
+                stats.buffered_bytes);
+    }
+}
+
+void interleaver_free(Interleaver **interleaver)
+{
+    Interleaver *i = *interleaver;
+    if (!i)
+        return;
+    for (InterleaverStream &stream : i->streams)
+    {
+        for (QueuedPacket &queued : stream.queue)
+            av_packet_free(&queued.pkt);
+    }
+    delete i;
+    *interleaver = NULL;
+}
@@ -0,0 +1,193 @@
+#include <cerrno>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_scheduler.h"
+
+typedef struct DeviceSlots
+{
+    int reads;
+    int writes;
+} DeviceSlots;
+
+struct IoScheduler
+{
+    int max_reads;
+    int max_writes;
+    int buffer_size;
+    std::mutex lock;
+    std::condition_variable released;
+    std::map<dev_t, DeviceSlots> devices;
+};
+
+typedef struct IoFile
+{
+    IoScheduler *io;
+    int fd;
+    dev_t device;
+    int64_t bytes;
+} IoFile;
+
+static void acquire(IoFile *file, int write)
+{
+    IoScheduler *io = file->io;
+    std::unique_lock<std::mutex> guard(io->lock);
+    DeviceSlots &slots = io->devices[file->device];
+    if (write)
+    {
+        io->released.wait(guard, [&] { return slots.writes < io->max_writes; });
+        slots.writes++;
+    }
+    else
+    {
+        io->released.wait(guard, [&] { return slots.reads < io->max_reads; });
+        slots.reads++;
+    }
+}
+
+static void release(IoFile *file, int write)
+{
+    IoScheduler *io = file->io;
+    {
+        std::lock_guard<std::mutex> guard(io->lock);
+        DeviceSlots &slots = io->devices[file->device];
+        if (write)
+            slots.writes--;
+        else
+            slots.reads--;
+    }
+    io->released.notify_all();
+}
+
+static int read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    IoFile *file = (IoFile *)opaque;
+    acquire(file, 0);
+    ssize_t size;
+    do
+    {
+        size = read(file->fd, buf, buf_size);
+    } while (size < 0 && errno == EINTR);
+    release(file, 0);
+
+    if (size < 0)
+        return AVERROR(errno);
+    if (size == 0)
+        return AVERROR_EOF;
+    file->bytes += size;
+    return size;
+}
+
+static int write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    IoFile *file = (IoFile *)opaque;
+    int done = 0;
+    acquire(file, 1);
+    while (done < buf_size)
+    {
+        ssize_t size = write(file->fd, buf + done, buf_size - done);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0)
+        {
+            int error = errno;
+            release(file, 1);
+            return AVERROR(error);
+        }
+        done += size;
+    }
+    release(file, 1);
+    file->bytes += done;
+    return done;
+}
+
+static int64_t seek_file(void *opaque, int64_t offset, int whence)
+{
+    IoFile *file = (IoFile *)opaque;
+    if (whence & AVSEEK_SIZE)
+    {
+        struct stat st;
+        return fstat(file->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+    }
+    int64_t position = lseek(file->fd, offset, whence & ~AVSEEK_FORCE);
+    return position < 0 ? AVERROR(errno) : position;
+}
+
+static dev_t device_of(const char *filename, int write)
+{
+    struct stat st;
+    if (stat(filename, &st) == 0)
+        return st.st_dev;
+
+    // a new output file lives on the device of its directory
+    std::string directory = filename;
+    size_t slash = directory.rfind('/');
+    directory = slash == std::string::npos ? "." : directory.substr(0, FFMAX(slash, (size_t)1));
+    if (write && stat(directory.c_str(), &st) == 0)
+        return st.st_dev;
+    return 0;
+}
+
+IoScheduler *io_scheduler_create(int max_reads_per_device, int max_writes_per_device, int buffer_size)
+{
+    IoScheduler *io = new IoScheduler();
+    io->max_reads = FFMAX(max_reads_per_device, 1);
+    io->max_writes = FFMAX(max_writes_per_device, 1);
+    io->buffer_size = buffer_size > 0 ? buffer_size : 1 << 20;
+    return io;
+}
+
+int io_scheduler_open(IoScheduler *io, const char *filename, int flags, AVIOContext **pb)
+{
+    int write = flags & AVIO_FLAG_WRITE;
+    int fd = write ? open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    IoFile *file = new IoFile();
+    file->io = io;
+    file->fd = fd;
+    file->device = device_of(filename, write);
+    file->bytes = 0;
+
+    unsigned char *buffer = (unsigned char *)av_malloc(io->buffer_size);
+    *pb = buffer ? avio_alloc_context(buffer, io->buffer_size, write ? 1 : 0, file, write ? NULL : read_packet,
+                                      write ? write_packet : NULL, seek_file)
+                 : NULL;
+    if (!*pb)
+    {
+        av_free(buffer);
+        close(fd);
+        delete file;
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+int64_t io_scheduler_close(AVIOContext **pb)
+{
+    if (!*pb)
+        return 0;
+
+    avio_flush(*pb);
+    IoFile *file = (IoFile *)(*pb)->opaque;
+    int64_t bytes = file->bytes;
+
+    close(file->fd);
+    delete file;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    return bytes;
+}
+
+void io_scheduler_destroy(IoScheduler **io)
+{
+    delete *io;
+    *io = NULL;
+}
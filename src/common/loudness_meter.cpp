@@ -0,0 +1,513 @@
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include "loudness_meter.h"
+#include "video_debug.h"
+
+#define SUBBLOCKS_PER_SECOND 10
+#define MOMENTARY_SUBBLOCKS 4
+#define SHORT_TERM_SUBBLOCKS 30
+#define ABSOLUTE_GATE -70.0
+#define INTEGRATED_RELATIVE_GATE -10.0
+#define RANGE_RELATIVE_GATE -20.0
+
+// 4x oversampling for true peak, 48 tap windowed sinc split into 4 phases
+#define TRUE_PEAK_FACTOR 4
+#define TRUE_PEAK_TAPS 12
+
+typedef struct Biquad
+{
+    double b0, b1, b2, a1, a2;
+} Biquad;
+
+// two channels run side by side in the lanes of one SSE2 register
+typedef struct ChannelPair
+{
+    int first;
+    int count;
+    double weight[2];
+    double state[2][2][2];
+    double energy[2];
+} ChannelPair;
+
+struct LoudnessMeter
+{
+    int sample_rate;
+    int channels;
+    Biquad stage[2];
+    std::vector<ChannelPair> pairs;
+    std::vector<double> weights;
+
+    std::vector<double> filter_input;
+    std::vector<std::vector<float>> peak_input;
+    float peak_coeffs[TRUE_PEAK_FACTOR][TRUE_PEAK_TAPS];
+
+    int subblock_samples;
+    int subblock_fill;
+    std::deque<double> recent;
+    std::vector<double> momentary_blocks;
+    std::vector<double> short_term_blocks;
+    double momentary_max;
+    double short_term_max;
+
+    double sample_peak;
+    double true_peak;
+    int64_t samples;
+};
+
+static double power_to_lufs(double power)
+{
+    return power > 0 ? -0.691 + 10 * log10(power) : -HUGE_VAL;
+}
+
+static double lufs_to_power(double lufs)
+{
+    return pow(10, (lufs + 0.691) / 10);
+}
+
+// K-weighting (BS.1770 high shelf followed by the RLB high pass) for any sample rate
+static void k_weighting(int sample_rate, Biquad stage[2])
+{
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sample_rate);
+    double vh = pow(10, gain / 20);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1 + k / q + k * k;
+
+    stage[0].b0 = (vh + vb * k / q + k * k) / a0;
+    stage[0].b1 = 2 * (k * k - vh) / a0;
+    stage[0].b2 = (vh - vb * k / q + k * k) / a0;
+    stage[0].a1 = 2 * (k * k - 1) / a0;
+    stage[0].a2 = (1 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sample_rate);
+    a0 = 1 + k / q + k * k;
+
+    stage[1].b0 = 1;
+    stage[1].b1 = -2;
+    stage[1].b2 = 1;
+    stage[1].a1 = 2 * (k * k - 1) / a0;
+    stage[1].a2 = (1 - k / q + k * k) / a0;
+}
+
+static void true_peak_coefficients(float coeffs[TRUE_PEAK_FACTOR][TRUE_PEAK_TAPS])
+{
+    const int taps = TRUE_PEAK_FACTOR * TRUE_PEAK_TAPS;
+    for (int phase = 0; phase < TRUE_PEAK_FACTOR; phase++)
+    {
+        for (int j = 0; j < TRUE_PEAK_TAPS; j++)
+        {
+            int n = phase + TRUE_PEAK_FACTOR * j;
+            double t = (n - (taps - 1) / 2.0) / TRUE_PEAK_FACTOR;
+            double sinc = t == 0 ? 1 : sin(M_PI * t) / (M_PI * t);
+            double window = 0.5 - 0.5 * cos(2 * M_PI * (n + 0.5) / taps);
+            // stored newest sample last so a window of the input can be multiplied directly
+            coeffs[phase][TRUE_PEAK_TAPS - 1 - j] = (float)(sinc * window);
+        }
+    }
+}
+
+static double channel_weight(uint64_t layout, int channels, int index)
+{
+    if (av_get_channel_layout_nb_channels(layout) != channels)
+        return 1.0;
+
+    int position = 0;
+    for (int bit = 0; bit < 64; bit++)
+    {
+        uint64_t channel = 1ULL << bit;
+        if (!(layout & channel))
+            continue;
+        if (position++ != index)
+            continue;
+        if (channel == AV_CH_LOW_FREQUENCY || channel == AV_CH_LOW_FREQUENCY_2)
+            return 0.0;
+        if (channel == AV_CH_BACK_LEFT || channel == AV_CH_BACK_RIGHT || channel == AV_CH_SIDE_LEFT ||
+            channel == AV_CH_SIDE_RIGHT)
+            return 1.41;
+        return 1.0;
+    }
+    return 1.0;
+}
+
+// converts one channel to doubles at dst[i * stride] and floats at peak[i], returns the sample peak
+static double convert_channel(const AVFrame *frame, int channel, int channels, double *dst, int stride, float *peak)
+{
+    enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+    int planar = av_sample_fmt_is_planar(format);
+    const uint8_t *src = planar ? frame->extended_data[channel] : frame->extended_data[0];
+    int step = planar ? 1 : channels;
+    int offset = planar ? 0 : channel;
+    double max = 0;
+
+#define CONVERT(type, expr)                                                                                            \
+    for (int i = 0; i < frame->nb_samples; i++)                                                                        \
+    {                                                                                                                  \
+        type s = ((const type *)src)[offset + i * step];                                                               \
+        double v = (expr);                                                                                             \
+        dst[i * stride] = v;                                                                                           \
+        peak[i] = (float)v;                                                                                            \
+        max = FFMAX(max, fabs(v));                                                                                     \
+    }
+
+    switch (format)
+    {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_U8P:
+        CONVERT(uint8_t, (s - 128) / 128.0);
+        break;
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S16P:
+        CONVERT(int16_t, s / 32768.0);
+        break;
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S32P:
+        CONVERT(int32_t, s / 2147483648.0);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_FLTP:
+        CONVERT(float, s);
+        break;
+    case AV_SAMPLE_FMT_DBL:
+    case AV_SAMPLE_FMT_DBLP:
+        CONVERT(double, s);
+        break;
+    default:
+        return -1;
+    }
+#undef CONVERT
+    return max;
+}
+
+static void filter_pair(LoudnessMeter *meter, ChannelPair *pair, const double *input, int count)
+{
+    const Biquad *s0 = &meter->stage[0];
+    const Biquad *s1 = &meter->stage[1];
+
+#if defined(__SSE2__)
+    __m128d b0 = _mm_set1_pd(s0->b0), b1 = _mm_set1_pd(s0->b1), b2 = _mm_set1_pd(s0->b2);
+    __m128d a1 = _mm_set1_pd(s0->a1), a2 = _mm_set1_pd(s0->a2);
+    __m128d c0 = _mm_set1_pd(s1->b0), c1 = _mm_set1_pd(s1->b1), c2 = _mm_set1_pd(s1->b2);
+    __m128d d1 = _mm_set1_pd(s1->a1), d2 = _mm_set1_pd(s1->a2);
+    __m128d z10 = _mm_loadu_pd(pair->state[0][0]), z11 = _mm_loadu_pd(pair->state[0][1]);
+    __m128d z20 = _mm_loadu_pd(pair->state[1][0]), z21 = _mm_loadu_pd(pair->state[1][1]);
+    __m128d energy = _mm_loadu_pd(pair->energy);
+
+    for (int i = 0; i < count; i++)
+    {
+        // transposed direct form II, both stages
+        __m128d x = _mm_loadu_pd(input + 2 * i);
+        __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), z10);
+        z10 = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(b1, x), z11), _mm_mul_pd(a1, y));
+        z11 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+
+        __m128d w = _mm_add_pd(_mm_mul_pd(c0, y), z20);
+        z20 = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(c1, y), z21), _mm_mul_pd(d1, w));
+        z21 = _mm_sub_pd(_mm_mul_pd(c2, y), _mm_mul_pd(d2, w));
+
+        energy = _mm_add_pd(energy, _mm_mul_pd(w, w));
+    }
+
+    _mm_storeu_pd(pair->state[0][0], z10);
+    _mm_storeu_pd(pair->state[0][1], z11);
+    _mm_storeu_pd(pair->state[1][0], z20);
+    _mm_storeu_pd(pair->state[1][1], z21);
+    _mm_storeu_pd(pair->energy, energy);
+#else
+    for (int lane = 0; lane < 2; lane++)
+    {
+        double(*z)[2][2] = pair->state;
+        for (int i = 0; i < count; i++)
+        {
+            double x = input[2 * i + lane];
+            double y = s0->b0 * x + z[0][0][lane];
+            z[0][0][lane] = s0->b1 * x + z[0][1][lane] - s0->a1 * y;
+            z[0][1][lane] = s0->b2 * x - s0->a2 * y;
+
+            double w = s1->b0 * y + z[1][0][lane];
+            z[1][0][lane] = s1->b1 * y + z[1][1][lane] - s1->a1 * w;
+            z[1][1][lane] = s1->b2 * y - s1->a2 * w;
+
+            pair->energy[lane] += w * w;
+        }
+    }
+#endif
+}
+
+static float true_peak_channel(LoudnessMeter *meter, const float *window, int count)
+{
+#if defined(__SSE2__)
+    __m128 c[TRUE_PEAK_FACTOR][3];
+    for (int phase = 0; phase < TRUE_PEAK_FACTOR; phase++)
+        for (int k = 0; k < 3; k++)
+            c[phase][k] = _mm_loadu_ps(meter->peak_coeffs[phase] + 4 * k);
+
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 peak = _mm_setzero_ps();
+
+    for (int i = 0; i < count; i++)
+    {
+        __m128 v0 = _mm_loadu_ps(window + i);
+        __m128 v1 = _mm_loadu_ps(window + i + 4);
+        __m128 v2 = _mm_loadu_ps(window + i + 8);
+        __m128 p[TRUE_PEAK_FACTOR];
+        for (int phase = 0; phase < TRUE_PEAK_FACTOR; phase++)
+            p[phase] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, c[phase][0]), _mm_mul_ps(v1, c[phase][1])),
+                                  _mm_mul_ps(v2, c[phase][2]));
+
+        // transpose so one add chain yields the four interpolated samples in one register
+        _MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+        __m128 out = _mm_add_ps(_mm_add_ps(p[0], p[1]), _mm_add_ps(p[2], p[3]));
+        peak = _mm_max_ps(peak, _mm_and_ps(out, abs_mask));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak);
+    return FFMAX(FFMAX(lanes[0], lanes[1]), FFMAX(lanes[2], lanes[3]));
+#else
+    float peak = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int phase = 0; phase < TRUE_PEAK_FACTOR; phase++)
+        {
+            float sum = 0;
+            for (int j = 0; j < TRUE_PEAK_TAPS; j++)
+                sum += window[i + j] * meter->peak_coeffs[phase][j];
+            peak = FFMAX(peak, fabsf(sum));
+        }
+    }
+    return peak;
+#endif
+}
+
+static void finish_subblock(LoudnessMeter *meter)
+{
+    double power = 0;
+    for (ChannelPair &pair : meter->pairs)
+    {
+        for (int lane = 0; lane < pair.count; lane++)
+            power += pair.weight[lane] * pair.energy[lane] / meter->subblock_samples;
+        pair.energy[0] = pair.energy[1] = 0;
+    }
+
+    meter->recent.push_back(power);
+    if ((int)meter->recent.size() > SHORT_TERM_SUBBLOCKS)
+        meter->recent.pop_front();
+
+    int available = meter->recent.size();
+    if (available >= MOMENTARY_SUBBLOCKS)
+    {
+        double sum = 0;
+        for (int i = available - MOMENTARY_SUBBLOCKS; i < available; i++)
+            sum += meter->recent[i];
+        double momentary = sum / MOMENTARY_SUBBLOCKS;
+        meter->momentary_blocks.push_back(momentary);
+        meter->momentary_max = FFMAX(meter->momentary_max, momentary);
+    }
+    if (available >= SHORT_TERM_SUBBLOCKS)
+    {
+        double sum = 0;
+        for (double p : meter->recent)
+            sum += p;
+        double short_term = sum / SHORT_TERM_SUBBLOCKS;
+        meter->short_term_blocks.push_back(short_term);
+        meter->short_term_max = FFMAX(meter->short_term_max, short_term);
+    }
+}
+
+LoudnessMeter *loudness_meter_alloc(int sample_rate, int channels, uint64_t channel_layout)
+{
+    if (sample_rate <= 0 || channels <= 0)
+    {
+        logging("loudness: invalid audio parameters %d Hz, %d channels", sample_rate, channels);
+        return NULL;
+    }
+
+    LoudnessMeter *meter = new LoudnessMeter();
+    meter->sample_rate = sample_rate;
+    meter->channels = channels;
+    meter->subblock_samples = sample_rate / SUBBLOCKS_PER_SECOND;
+    k_weighting(sample_rate, meter->stage);
+    true_peak_coefficients(meter->peak_coeffs);
+
+    if (!channel_layout)
+        channel_layout = av_get_default_channel_layout(channels);
+
+    for (int c = 0; c < channels; c += 2)
+    {
+        ChannelPair pair = {};
+        pair.first = c;
+        pair.count = FFMIN(2, channels - c);
+        for (int lane = 0; lane < pair.count; lane++)
+            pair.weight[lane] = channel_weight(channel_layout, channels, c + lane);
+        meter->pairs.push_back(pair);
+    }
+
+    // each channel keeps the last TRUE_PEAK_TAPS - 1 samples in front of the new ones
+    meter->peak_input.assign(channels, std::vector<float>(TRUE_PEAK_TAPS - 1, 0.0f));
+    return meter;
+}
+
+int loudness_meter_push(LoudnessMeter *meter, const AVFrame *frame)
+{
+    int count = frame->nb_samples;
+    if (frame->channels != meter->channels || frame->sample_rate != meter->sample_rate)
+    {
+        logging("loudness: audio parameters changed mid-stream, frame ignored");
+        return -1;
+    }
+
+    meter->filter_input.assign((size_t)meter->pairs.size() * 2 * count, 0.0);
+    for (size_t p = 0; p < meter->pairs.size(); p++)
+    {
+        ChannelPair &pair = meter->pairs[p];
+        for (int lane = 0; lane < pair.count; lane++)
+        {
+            int channel = pair.first + lane;
+            std::vector<float> &peak = meter->peak_input[channel];
+            peak.resize(TRUE_PEAK_TAPS - 1 + count);
+
+            double max = convert_channel(frame, channel, meter->channels, meter->filter_input.data() + p * 2 * count + lane,
+                                         2, peak.data() + TRUE_PEAK_TAPS - 1);
+            if (max < 0)
+            {
+                logging("loudness: unsupported sample format %d", frame->format);
+                return -1;
+            }
+            meter->sample_peak = FFMAX(meter->sample_peak, max);
+            meter->true_peak = FFMAX(meter->true_peak, (double)true_peak_channel(meter, peak.data(), count));
+
+            peak.erase(peak.begin(), peak.begin() + count);
+        }
+    }
+
+    int done = 0;
+    while (done < count)
+    {
+        int chunk = FFMIN(count - done, meter->subblock_samples - meter->subblock_fill);
+        for (size_t p = 0; p < meter->pairs.size(); p++)
+            filter_pair(meter, &meter->pairs[p], meter->filter_input.data() + p * 2 * count + 2 * done, chunk);
+
+        done += chunk;
+        meter->subblock_fill += chunk;
+        if (meter->subblock_fill == meter->subblock_samples)
+        {
+            finish_subblock(meter);
+            meter->subblock_fill = 0;
+        }
+    }
+
+    meter->samples += count;
+    return 0;
+}
+
+static double gated_mean(const std::vector<double> &blocks, double threshold)
+{
+    double sum = 0;
+    int count = 0;
+    for (double power : blocks)
+    {
+        if (power > threshold)
+        {
+            sum += power;
+            count++;
+        }
+    }
+    return count ? sum / count : 0;
+}
+
+void loudness_meter_result(const LoudnessMeter *meter, LoudnessResult *result)
+{
+    double absolute = lufs_to_power(ABSOLUTE_GATE);
+
+    double ungated = gated_mean(meter->momentary_blocks, absolute);
+    double relative = ungated * pow(10, INTEGRATED_RELATIVE_GATE / 10);
+    result->integrated = power_to_lufs(gated_mean(meter->momentary_blocks, FFMAX(absolute, relative)));
+
+    // EBU Tech 3342: short-term values above both gates, spread between the 10th and 95th percentile
+    double range_gate = gated_mean(meter->short_term_blocks, absolute) * pow(10, RANGE_RELATIVE_GATE / 10);
+    std::vector<double> levels;
+    for (double power : meter->short_term_blocks)
+    {
+        if (power > absolute && power > range_gate)
+            levels.push_back(power_to_lufs(power));
+    }
+    std::sort(levels.begin(), levels.end());
+    result->range = levels.empty() ? 0
+                                    : levels[(size_t)(0.95 * (levels.size() - 1) + 0.5)] -
+                                          levels[(size_t)(0.10 * (levels.size() - 1) + 0.5)];
+
+    result->momentary = power_to_lufs(meter->momentary_blocks.empty() ? 0 : meter->momentary_blocks.back());
+    result->momentary_max = power_to_lufs(meter->momentary_max);
+    result->short_term = power_to_lufs(meter->short_term_blocks.empty() ? 0 : meter->short_term_blocks.back());
+    result->short_term_max = power_to_lufs(meter->short_term_max);
+    result->sample_peak = meter->sample_peak > 0 ? 20 * log10(meter->sample_peak) : -HUGE_VAL;
+    double true_peak = FFMAX(meter->true_peak, meter->sample_peak);
+    result->true_peak = true_peak > 0 ? 20 * log10(true_peak) : -HUGE_VAL;
+    result->seconds = (double)meter->samples / meter->sample_rate;
+}
+
+static void print_json_number(FILE *f, const char *key, double value, int last)
+{
+    if (std::isfinite(value))
+        fprintf(f, "  \"%s\": %.2f%s\n", key, value, last ? "" : ",");
+    else
+        fprintf(f, "  \"%s\": null%s\n", key, last ? "" : ",");
+}
+
+int loudness_meter_report(const LoudnessMeter *meter, const char *path)
+{
+    LoudnessResult r;
+    loudness_meter_result(meter, &r);
+
+    logging("loudness: %.1f s, integrated %.1f LUFS, range %.1f LU, true peak %.1f dBTP", r.seconds, r.integrated,
+            r.range, r.true_peak);
+    logging("loudness: momentary max %.1f LUFS, short-term max %.1f LUFS, sample peak %.1f dBFS", r.momentary_max,
+            r.short_term_max, r.sample_peak);
+
+    if (!path || !strcmp(path, "-"))
+        return 0;
+
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        logging("loudness: could not open report %s", path);
+        return -1;
+    }
+    fprintf(f, "{\n");
+    print_json_number(f, "seconds", r.seconds, 0);
+    print_json_number(f, "integrated", r.integrated, 0);
+    print_json_number(f, "range", r.range, 0);
+    print_json_number(f, "momentary", r.momentary, 0);
+    print_json_number(f, "momentary_max", r.momentary_max, 0);
+    print_json_number(f, "short_term", r.short_term, 0);
+    print_json_number(f, "short_term_max", r.short_term_max, 0);
+    print_json_number(f, "sample_peak", r.sample_peak, 0);
+    print_json_number(f, "true_peak", r.true_peak, 1);
+    fprintf(f, "}\n");
+    fclose(f);
+    return 0;
+}
+
+void loudness_meter_free(LoudnessMeter **meter)
+{
+    delete *meter;
+    *meter = NULL;
+}
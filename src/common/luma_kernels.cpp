@@ -0,0 +1,133 @@
+#include "luma_kernels.h"
+
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void luma_row_scan_u8(const uint8_t *row, const uint8_t *prev, int width, uint32_t *column_sums,
+                      LumaRowStats *stats)
+{
+    uint64_t sum = 0, sum_sq = 0, sad = 0;
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc_sum = zero, acc_sq = zero, acc_sad = zero;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+        acc_sum = _mm_add_epi64(acc_sum, _mm_sad_epu8(v, zero));
+        acc_sq = _mm_add_epi32(acc_sq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+
+        if (prev)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(prev + x));
+            acc_sad = _mm_add_epi64(acc_sad, _mm_sad_epu8(v, p));
+        }
+
+        if (column_sums)
+        {
+            __m128i *c = (__m128i *)(column_sums + x);
+            _mm_storeu_si128(c + 0, _mm_add_epi32(_mm_loadu_si128(c + 0), _mm_unpacklo_epi16(lo, zero)));
+            _mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_unpackhi_epi16(lo, zero)));
+            _mm_storeu_si128(c + 2, _mm_add_epi32(_mm_loadu_si128(c + 2), _mm_unpacklo_epi16(hi, zero)));
+            _mm_storeu_si128(c + 3, _mm_add_epi32(_mm_loadu_si128(c + 3), _mm_unpackhi_epi16(hi, zero)));
+        }
+    }
+
+    uint64_t lanes64[2];
+    uint32_t lanes32[4];
+    _mm_storeu_si128((__m128i *)lanes64, acc_sum);
+    sum = lanes64[0] + lanes64[1];
+    _mm_storeu_si128((__m128i *)lanes64, acc_sad);
+    sad = lanes64[0] + lanes64[1];
+    _mm_storeu_si128((__m128i *)lanes32, acc_sq);
+    sum_sq = (uint64_t)lanes32[0] + lanes32[1] + lanes32[2] + lanes32[3];
+#endif
+
+    for (; x < width; x++)
+    {
+        uint32_t v = row[x];
+        sum += v;
+        sum_sq += v * v;
+        if (prev)
+            sad += abs((int)v - (int)prev[x]);
+        if (column_sums)
+            column_sums[x] += v;
+    }
+
+    stats->sum = sum;
+    stats->sum_sq = sum_sq;
+    stats->sad = sad;
+}
+
+void luma_row_scan_u16(const uint16_t *row, const uint16_t *prev, int width, int shift, uint32_t *column_sums,
+                       LumaRowStats *stats)
+{
+    uint64_t sum = 0, sum_sq = 0, sad = 0;
+
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t v = row[x] >> shift;
+        sum += v;
+        sum_sq += v * v;
+        if (prev)
+            sad += abs((int)v - (int)(prev[x] >> shift));
+        if (column_sums)
+            column_sums[x] += v;
+    }
+
+    stats->sum = sum;
+    stats->sum_sq = sum_sq;
+    stats->sad = sad;
+}
+
+uint64_t luma_block_sad_u8(const uint8_t *a, ptrdiff_t a_stride, const uint8_t *b, ptrdiff_t b_stride, int width,
+                           int height)
+{
+    uint64_t sad = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+#endif
+
+    for (int y = 0; y < height; y++, a += a_stride, b += b_stride)
+    {
+        int x = 0;
+#if defined(__SSE2__)
+        for (; x + 16 <= width; x += 16)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                                  _mm_loadu_si128((const __m128i *)(b + x))));
+        // the upper halves load as zero in both and add nothing
+        for (; x + 8 <= width; x += 8)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i *)(a + x)),
+                                                  _mm_loadl_epi64((const __m128i *)(b + x))));
+#endif
+        for (; x < width; x++)
+            sad += abs((int)a[x] - (int)b[x]);
+    }
+
+#if defined(__SSE2__)
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sad += lanes[0] + lanes[1];
+#endif
+    return sad;
+}
+
+uint64_t luma_block_sad_u16(const uint16_t *a, ptrdiff_t a_stride, const uint16_t *b, ptrdiff_t b_stride, int width,
+                            int height, int shift)
+{
+    uint64_t sad = 0;
+    for (int y = 0; y < height; y++, a += a_stride, b += b_stride)
+    {
+        for (int x = 0; x < width; x++)
+            sad += abs((int)(a[x] >> shift) - (int)(b[x] >> shift));
+    }
+    return sad;
+}
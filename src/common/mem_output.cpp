@@ -0,0 +1,325 @@
+#include <cstring>
+
+#include "mem_output.h"
+#include "video_debug.h"
+
+#define MEM_OUTPUT_IO_BUFFER (256 * 1024)
+// chunks never move once allocated, so growing the arena copies nothing that was already written
+#define MEM_OUTPUT_CHUNK (4 << 20)
+
+struct MemOutput
+{
+    uint8_t **chunks;
+    int nb_chunks;
+    int64_t size;
+    int64_t cap;
+    int64_t position;
+    MemOutputWrite write;
+    void *write_opaque;
+    AVIOContext *pb;
+    AVFormatContext *avfc;
+    int (*io_open)(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    void (*io_close)(AVFormatContext *s, AVIOContext *pb);
+};
+
+typedef struct MemReader
+{
+    MemOutput *mem;
+    int64_t position;
+} MemReader;
+
+static int arena_reserve(MemOutput *mem, int64_t end)
+{
+    int needed = (end + MEM_OUTPUT_CHUNK - 1) / MEM_OUTPUT_CHUNK;
+    if (needed <= mem->nb_chunks)
+        return 0;
+    uint8_t **chunks = (uint8_t **)av_realloc_array(mem->chunks, needed, sizeof(*chunks));
+    if (!chunks)
+        return AVERROR(ENOMEM);
+    mem->chunks = chunks;
+    for (; mem->nb_chunks < needed; mem->nb_chunks++)
+    {
+        mem->chunks[mem->nb_chunks] = (uint8_t *)av_malloc(MEM_OUTPUT_CHUNK);
+        if (!mem->chunks[mem->nb_chunks])
+            return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+// a NULL buf writes zeros
+static void arena_copy_in(MemOutput *mem, int64_t offset, const uint8_t *buf, int64_t size)
+{
+    while (size > 0)
+    {
+        int64_t chunk_offset = offset % MEM_OUTPUT_CHUNK;
+        int64_t length = FFMIN(size, MEM_OUTPUT_CHUNK - chunk_offset);
+        uint8_t *dst = mem->chunks[offset / MEM_OUTPUT_CHUNK] + chunk_offset;
+        if (buf)
+        {
+            memcpy(dst, buf, length);
+            buf += length;
+        }
+        else
+        {
+            memset(dst, 0, length);
+        }
+        offset += length;
+        size -= length;
+    }
+}
+
+static void arena_copy_out(const MemOutput *mem, int64_t offset, uint8_t *buf, int64_t size)
+{
+    while (size > 0)
+    {
+        int64_t chunk_offset = offset % MEM_OUTPUT_CHUNK;
+        int64_t length = FFMIN(size, MEM_OUTPUT_CHUNK - chunk_offset);
+        memcpy(buf, mem->chunks[offset / MEM_OUTPUT_CHUNK] + chunk_offset, length);
+        buf += length;
+        offset += length;
+        size -= length;
+    }
+}
+
+static int mem_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    MemOutput *mem = (MemOutput *)opaque;
+    int64_t end = mem->position + buf_size;
+    if (end > mem->cap)
+    {
+        logging("in-memory output exceeded its %" PRId64 " byte cap", mem->cap);
+        return AVERROR(ENOSPC);
+    }
+    if (arena_reserve(mem, end) < 0)
+        return AVERROR(ENOMEM);
+    // a seek past the end leaves a hole, files read it back as zeros
+    if (mem->position > mem->size)
+        arena_copy_in(mem, mem->size, NULL, mem->position - mem->size);
+    arena_copy_in(mem, mem->position, buf, buf_size);
+    mem->position = end;
+    mem->size = FFMAX(mem->size, end);
+    return buf_size;
+}
+
+static int callback_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    MemOutput *mem = (MemOutput *)opaque;
+    int ret = mem->write(mem->write_opaque, buf, buf_size);
+    if (ret < 0)
+        return ret;
+    mem->size += buf_size;
+    return buf_size;
+}
+
+static int64_t seek_position(int64_t current, int64_t size, int64_t offset, int whence)
+{
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET:
+        return offset;
+    case SEEK_CUR:
+        return current + offset;
+    case SEEK_END:
+        return size + offset;
+    }
+    return AVERROR(EINVAL);
+}
+
+static int64_t mem_seek(void *opaque, int64_t offset, int whence)
+{
+    MemOutput *mem = (MemOutput *)opaque;
+    if (whence & AVSEEK_SIZE)
+        return mem->size;
+    int64_t position = seek_position(mem->position, mem->size, offset, whence);
+    if (position < 0)
+        return AVERROR(EINVAL);
+    mem->position = position;
+    return position;
+}
+
+static int mem_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MemReader *reader = (MemReader *)opaque;
+    int64_t left = reader->mem->size - reader->position;
+    if (left <= 0)
+        return AVERROR_EOF;
+    int size = FFMIN(left, (int64_t)buf_size);
+    arena_copy_out(reader->mem, reader->position, buf, size);
+    reader->position += size;
+    return size;
+}
+
+static int64_t mem_reader_seek(void *opaque, int64_t offset, int whence)
+{
+    MemReader *reader = (MemReader *)opaque;
+    if (whence & AVSEEK_SIZE)
+        return reader->mem->size;
+    int64_t position = seek_position(reader->position, reader->mem->size, offset, whence);
+    if (position < 0)
+        return AVERROR(EINVAL);
+    reader->position = position;
+    return position;
+}
+
+static int mem_io_open(AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options)
+{
+    MemOutput *mem = (MemOutput *)s->opaque;
+    if (mem->write || !url || !s->url || strcmp(url, s->url) || (flags & AVIO_FLAG_WRITE))
+        return mem->io_open(s, pb, url, flags, options);
+
+    MemReader *reader = (MemReader *)av_mallocz(sizeof(MemReader));
+    unsigned char *buffer = (unsigned char *)av_malloc(MEM_OUTPUT_IO_BUFFER);
+    *pb = reader && buffer
+              ? avio_alloc_context(buffer, MEM_OUTPUT_IO_BUFFER, 0, reader, mem_read, NULL, mem_reader_seek)
+              : NULL;
+    if (!*pb)
+    {
+        av_free(reader);
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    reader->mem = mem;
+    return 0;
+}
+
+static void mem_io_close(AVFormatContext *s, AVIOContext *pb)
+{
+    MemOutput *mem = (MemOutput *)s->opaque;
+    if (!pb || pb->read_packet != mem_read)
+    {
+        mem->io_close(s, pb);
+        return;
+    }
+    av_free(pb->opaque);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+}
+
+static MemOutput *alloc_output(int64_t cap, MemOutputWrite write, void *opaque)
+{
+    MemOutput *mem = (MemOutput *)av_mallocz(sizeof(MemOutput));
+    if (!mem)
+        return NULL;
+    mem->cap = cap > 0 ? cap : INT64_MAX;
+    mem->write = write;
+    mem->write_opaque = opaque;
+
+    unsigned char *buffer = (unsigned char *)av_malloc(MEM_OUTPUT_IO_BUFFER);
+    mem->pb = buffer ? avio_alloc_context(buffer, MEM_OUTPUT_IO_BUFFER, 1, mem, NULL,
+                                          write ? callback_write : mem_write, write ? NULL : mem_seek)
+                     : NULL;
+    if (!mem->pb)
+    {
+        av_free(buffer);
+        av_free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
+MemOutput *mem_output_alloc(int64_t cap)
+{
+    return alloc_output(cap, NULL, NULL);
+}
+
+MemOutput *mem_output_alloc_callback(MemOutputWrite write, void *opaque)
+{
+    return alloc_output(0, write, opaque);
+}
+
+int mem_output_attach(MemOutput *mem, AVFormatContext *avfc)
+{
+    if (avfc->opaque)
+    {
+        logging("output context already carries opaque data");
+        return -1;
+    }
+    mem->avfc = avfc;
+    mem->io_open = avfc->io_open;
+    mem->io_close = avfc->io_close;
+    avfc->opaque = mem;
+    avfc->io_open = mem_io_open;
+    avfc->io_close = mem_io_close;
+    avfc->pb = mem->pb;
+    return 0;
+}
+
+void mem_output_detach(MemOutput *mem)
+{
+    if (!mem->avfc)
+        return;
+    avio_flush(mem->pb);
+    mem->avfc->io_open = mem->io_open;
+    mem->avfc->io_close = mem->io_close;
+    mem->avfc->opaque = NULL;
+    if (mem->avfc->pb == mem->pb)
+        mem->avfc->pb = NULL;
+    mem->avfc = NULL;
+}
+
+int64_t mem_output_size(const MemOutput *mem)
+{
+    return mem->size;
+}
+
+int mem_output_read(MemOutput *mem, int64_t offset, uint8_t *buf, int size)
+{
+    avio_flush(mem->pb);
+    if (mem->write || offset < 0 || offset >= mem->size)
+        return 0;
+    size = FFMIN((int64_t)size, mem->size - offset);
+    arena_copy_out(mem, offset, buf, size);
+    return size;
+}
+
+void mem_output_reset(MemOutput *mem)
+{
+    avio_flush(mem->pb);
+    if (!mem->write)
+        avio_seek(mem->pb, 0, SEEK_SET);
+    mem->pb->error = 0;
+    mem->pb->eof_reached = 0;
+    mem->size = 0;
+    mem->position = 0;
+}
+
+int mem_output_write_file(MemOutput *mem, const char *filename)
+{
+    AVIOContext *pb = NULL;
+    avio_flush(mem->pb);
+    if (mem->write)
+    {
+        logging("a callback output has no file to write");
+        return -1;
+    }
+    if (avio_open(&pb, filename, AVIO_FLAG_WRITE) < 0)
+    {
+        logging("could not open the output file %s", filename);
+        return -1;
+    }
+    for (int64_t offset = 0; offset < mem->size; offset += MEM_OUTPUT_CHUNK)
+        avio_write(pb, mem->chunks[offset / MEM_OUTPUT_CHUNK], FFMIN(mem->size - offset, (int64_t)MEM_OUTPUT_CHUNK));
+    int ret = pb->error;
+    avio_closep(&pb);
+    if (ret < 0)
+    {
+        logging("failed to write %s", filename);
+        return -1;
+    }
+    return 0;
+}
+
+void mem_output_free(MemOutput **mem)
+{
+    MemOutput *m = *mem;
+    if (!m)
+        return;
+
+    mem_output_detach(m);
+    av_freep(&m->pb->buffer);
+    avio_context_free(&m->pb);
+    for (int i = 0; i < m->nb_chunks; i++)
+        av_free(m->chunks[i]);
+    av_free(m->chunks);
+    av_freep(mem);
+}
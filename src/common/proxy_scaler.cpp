@@ -0,0 +1,191 @@
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+#include "proxy_scaler.h"
+#include "video_debug.h"
+
+struct ProxyScaler
+{
+    enum AVPixelFormat format;
+    const AVPixFmtDescriptor *desc;
+    int planes;
+    AVFrame *out;
+    // one buffer per plane for the halved pictures between steps
+    std::vector<uint8_t> steps[2][4];
+    std::vector<int> x0, x1, wx;
+};
+
+int proxy_scaler_supported(enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return 0;
+    for (int i = 0; i < desc->nb_components; i++)
+    {
+        if (desc->comp[i].depth != 8 || desc->comp[i].step != 1)
+            return 0;
+    }
+    return 1;
+}
+
+ProxyScaler *proxy_scaler_alloc(int src_width, int src_height, enum AVPixelFormat format, int width)
+{
+    if (!proxy_scaler_supported(format))
+    {
+        logging("proxy: pixel format %s cannot be scaled", av_get_pix_fmt_name(format));
+        return NULL;
+    }
+
+    ProxyScaler *ps = new ProxyScaler();
+    ps->format = format;
+    ps->desc = av_pix_fmt_desc_get(format);
+    ps->planes = 0;
+    for (int i = 0; i < ps->desc->nb_components; i++)
+        ps->planes = FFMAX(ps->planes, ps->desc->comp[i].plane + 1);
+
+    width = FFMIN(width, src_width) & ~1;
+    ps->out = av_frame_alloc();
+    if (!ps->out)
+    {
+        proxy_scaler_free(&ps);
+        return NULL;
+    }
+    ps->out->format = format;
+    ps->out->width = FFMAX(width, 2);
+    ps->out->height = FFMAX((int)((int64_t)src_height * width / src_width) & ~1, 2);
+    return ps;
+}
+
+void proxy_scaler_size(const ProxyScaler *ps, int *width, int *height)
+{
+    *width = ps->out->width;
+    *height = ps->out->height;
+}
+
+// 2x2 average as two rounding pavgb steps, the scalar tail rounds the same way
+static void halve_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int width, int height)
+{
+    for (int y = 0; y < height; y++, src += 2 * src_stride, dst += dst_stride)
+    {
+        const uint8_t *a = src, *b = src + src_stride;
+        int x = 0;
+#if defined(__SSE2__)
+        const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + 2 * x)),
+                                      _mm_loadu_si128((const __m128i *)(b + 2 * x)));
+            __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + 2 * x + 16)),
+                                      _mm_loadu_si128((const __m128i *)(b + 2 * x + 16)));
+            __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, low_bytes), _mm_srli_epi16(v0, 8));
+            __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, low_bytes), _mm_srli_epi16(v1, 8));
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(h0, h1));
+        }
+#endif
+        for (; x < width; x++)
+        {
+            int left = (a[2 * x] + b[2 * x] + 1) >> 1;
+            int right = (a[2 * x + 1] + b[2 * x + 1] + 1) >> 1;
+            dst[x] = (left + right + 1) >> 1;
+        }
+    }
+}
+
+// sample centres mapped back onto the source, 8 bits of fraction
+static void map_axis(int src, int dst, std::vector<int> &i0, std::vector<int> &i1, std::vector<int> &w)
+{
+    i0.resize(dst);
+    i1.resize(dst);
+    w.resize(dst);
+    for (int i = 0; i < dst; i++)
+    {
+        int64_t pos = FFMAX(((2 * i + 1) * (int64_t)src * 256) / (2 * dst) - 128, 0);
+        i0[i] = FFMIN((int)(pos >> 8), src - 1);
+        i1[i] = FFMIN(i0[i] + 1, src - 1);
+        w[i] = pos & 255;
+    }
+}
+
+static void resize_plane(ProxyScaler *ps, const uint8_t *src, int src_stride, int src_width, int src_height,
+                         uint8_t *dst, int dst_stride, int width, int height)
+{
+    std::vector<int> y0, y1, wy;
+    map_axis(src_width, width, ps->x0, ps->x1, ps->wx);
+    map_axis(src_height, height, y0, y1, wy);
+    for (int y = 0; y < height; y++, dst += dst_stride)
+    {
+        const uint8_t *a = src + (ptrdiff_t)y0[y] * src_stride, *b = src + (ptrdiff_t)y1[y] * src_stride;
+        for (int x = 0; x < width; x++)
+        {
+            int l = ps->x0[x], r = ps->x1[x], f = ps->wx[x];
+            int top = a[l] * (256 - f) + a[r] * f;
+            int bottom = b[l] * (256 - f) + b[r] * f;
+            dst[x] = (top * (256 - wy[y]) + bottom * wy[y] + 32768) >> 16;
+        }
+    }
+}
+
+AVFrame *proxy_scaler_scale(ProxyScaler *ps, const AVFrame *frame)
+{
+    AVFrame *out = ps->out;
+    if (!out->buf[0] && av_frame_get_buffer(out, 32) < 0)
+        return NULL;
+    // the encoder may still hold the previous picture
+    if (av_frame_make_writable(out) < 0)
+        return NULL;
+
+    for (int p = 0; p < ps->planes; p++)
+    {
+        int chroma = (p == 1 || p == 2) && !(ps->desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int shift_w = chroma ? ps->desc->log2_chroma_w : 0, shift_h = chroma ? ps->desc->log2_chroma_h : 0;
+        int width = AV_CEIL_RSHIFT(out->width, shift_w), height = AV_CEIL_RSHIFT(out->height, shift_h);
+
+        const uint8_t *src = frame->data[p];
+        int src_stride = frame->linesize[p];
+        int src_width = AV_CEIL_RSHIFT(frame->width, shift_w), src_height = AV_CEIL_RSHIFT(frame->height, shift_h);
+        int step = 0, done = 0;
+        while (!done && src_width / 2 >= width && src_height / 2 >= height)
+        {
+            int half_width = src_width / 2, half_height = src_height / 2;
+            done = half_width == width && half_height == height;
+            uint8_t *dst = out->data[p];
+            int dst_stride = out->linesize[p];
+            if (!done)
+            {
+                std::vector<uint8_t> &buffer = ps->steps[step][p];
+                buffer.resize((size_t)half_width * half_height);
+                dst = buffer.data();
+                dst_stride = half_width;
+                step ^= 1;
+            }
+            halve_plane(src, src_stride, dst, dst_stride, half_width, half_height);
+            src = dst;
+            src_stride = dst_stride;
+            src_width = half_width;
+            src_height = half_height;
+        }
+        if (!done)
+            resize_plane(ps, src, src_stride, src_width, src_height, out->data[p], out->linesize[p], width, height);
+    }
+
+    av_frame_copy_props(out, frame);
+    return out;
+}
+
+void proxy_scaler_free(ProxyScaler **ps)
+{
+    if (!*ps)
+        return;
+    av_frame_free(&(*ps)->out);
+    delete *ps;
+    *ps = NULL;
+}
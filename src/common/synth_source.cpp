@@ -0,0 +1,355 @@
+#include <cmath>
+#include <cstring>
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "synth_source.h"
+#include "video_debug.h"
+
+#define SYNTH_ALIGN 32
+#define SYNTH_MAX_CHANNELS 8
+#define SYNTH_TONE_LEVEL 0.25
+
+struct SynthSource
+{
+    SynthParams params;
+    AVBufferPool *pool;
+    int planes;
+    int plane_width[4];
+    int plane_height[4];
+    int plane_bytes[4];
+    int plane_max[4];
+    // one triangle wave period plus a row, every row of a gradient is a single copy out of it
+    uint8_t *ramp[4];
+    int period[4];
+    int64_t scene_frames;
+    int64_t video_frames;
+    int64_t video_next;
+    int64_t audio_samples;
+    int64_t audio_next;
+    double phase[SYNTH_MAX_CHANNELS];
+};
+
+void synth_default_params(SynthParams *params)
+{
+    params->width = 1920;
+    params->height = 1080;
+    params->frame_rate = (AVRational){30, 1};
+    params->pix_fmt = AV_PIX_FMT_YUV420P;
+    params->duration = 10;
+    params->noise = 0;
+    params->scene_seconds = 5;
+    params->sample_rate = 48000;
+    params->channels = 2;
+    params->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    params->samples_per_frame = 1024;
+    params->tone_hz = 440;
+}
+
+int synth_is_source(const char *filename)
+{
+    return strncmp(filename, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) == 0;
+}
+
+int synth_parse(const char *spec, SynthParams *params)
+{
+    synth_default_params(params);
+    if (!synth_is_source(spec))
+        return -1;
+
+    const char *query = spec + strlen(SYNTH_PREFIX);
+    if (*query == '?')
+        query++;
+
+    AVDictionary *options = NULL;
+    if (*query && av_dict_parse_string(&options, query, "=", "&", 0) < 0)
+    {
+        logging("could not parse the synth options %s", query);
+        return -1;
+    }
+
+    int ret = 0;
+    AVDictionaryEntry *entry = NULL;
+    while (!ret && (entry = av_dict_get(options, "", entry, AV_DICT_IGNORE_SUFFIX)))
+    {
+        if (!strcmp(entry->key, "size"))
+            ret = av_parse_video_size(&params->width, &params->height, entry->value);
+        else if (!strcmp(entry->key, "rate"))
+            ret = av_parse_video_rate(&params->frame_rate, entry->value);
+        else if (!strcmp(entry->key, "pix_fmt"))
+            ret = (params->pix_fmt = av_get_pix_fmt(entry->value)) == AV_PIX_FMT_NONE ? -1 : 0;
+        else if (!strcmp(entry->key, "duration"))
+            params->duration = atof(entry->value);
+        else if (!strcmp(entry->key, "noise"))
+            params->noise = atoi(entry->value);
+        else if (!strcmp(entry->key, "scene"))
+            params->scene_seconds = atof(entry->value);
+        else if (!strcmp(entry->key, "audio"))
+            params->sample_rate = atoi(entry->value);
+        else if (!strcmp(entry->key, "tone"))
+            params->tone_hz = atof(entry->value);
+        else
+        {
+            logging("unknown synth option %s", entry->key);
+            ret = -1;
+        }
+        if (ret < 0)
+            logging("invalid synth option %s=%s", entry->key, entry->value);
+    }
+    av_dict_free(&options);
+    if (ret < 0)
+        return -1;
+
+    if (params->duration <= 0 || params->frame_rate.num <= 0 || params->frame_rate.den <= 0)
+    {
+        logging("a synth source needs a positive duration and frame rate");
+        return -1;
+    }
+    if (params->sample_rate && (params->channels < 1 || params->channels > SYNTH_MAX_CHANNELS))
+    {
+        logging("a synth source has 1 to %d audio channels", SYNTH_MAX_CHANNELS);
+        return -1;
+    }
+    return 0;
+}
+
+int64_t synth_video_frames(const SynthParams *params)
+{
+    return llrint(params->duration * params->frame_rate.num / params->frame_rate.den);
+}
+
+static int setup_planes(SynthSource *src)
+{
+    const SynthParams *params = &src->params;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(params->pix_fmt);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || (desc->flags & AV_PIX_FMT_FLAG_BE) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)))
+    {
+        logging("the synth source does not generate %s", desc ? desc->name : "this pixel format");
+        return -1;
+    }
+
+    src->planes = av_pix_fmt_count_planes(params->pix_fmt);
+    for (int c = 0; c < desc->nb_components; c++)
+    {
+        const AVComponentDescriptor *comp = &desc->comp[c];
+        int bytes = comp->depth > 8 ? 2 : 1;
+        // one component per plane, no packed or semi-planar layouts
+        if (comp->step != bytes || comp->offset || comp->shift || src->plane_bytes[comp->plane])
+        {
+            logging("the synth source does not generate %s", desc->name);
+            return -1;
+        }
+        int chroma = (c == 1 || c == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        src->plane_width[comp->plane] = chroma ? AV_CEIL_RSHIFT(params->width, desc->log2_chroma_w) : params->width;
+        src->plane_height[comp->plane] =
+            chroma ? AV_CEIL_RSHIFT(params->height, desc->log2_chroma_h) : params->height;
+        src->plane_bytes[comp->plane] = bytes;
+        src->plane_max[comp->plane] = (1 << comp->depth) - 1;
+    }
+
+    for (int p = 0; p < src->planes; p++)
+    {
+        int max = src->plane_max[p];
+        int length = 2 * max + src->plane_width[p];
+        src->period[p] = 2 * max;
+        src->ramp[p] = (uint8_t *)av_malloc((size_t)length * src->plane_bytes[p]);
+        if (!src->ramp[p])
+            return -1;
+        for (int i = 0; i < length; i++)
+        {
+            int v = i % src->period[p];
+            v = v <= max ? v : src->period[p] - v;
+            if (src->plane_bytes[p] == 2)
+                ((uint16_t *)src->ramp[p])[i] = v;
+            else
+                src->ramp[p][i] = v;
+        }
+    }
+
+    int size = av_image_get_buffer_size(params->pix_fmt, params->width, params->height, SYNTH_ALIGN);
+    src->pool = size > 0 ? av_buffer_pool_init(size, NULL) : NULL;
+    return src->pool ? 0 : -1;
+}
+
+SynthSource *synth_source_alloc(const SynthParams *params)
+{
+    SynthSource *src = (SynthSource *)av_mallocz(sizeof(SynthSource));
+    if (!src)
+        return NULL;
+    src->params = *params;
+    src->video_frames = synth_video_frames(params);
+    src->scene_frames = params->scene_seconds > 0
+                            ? FFMAX(llrint(params->scene_seconds * params->frame_rate.num / params->frame_rate.den), 1)
+                            : INT64_MAX;
+    src->audio_samples = params->sample_rate ? llrint(params->duration * params->sample_rate) : 0;
+
+    if (setup_planes(src) < 0)
+        synth_source_free(&src);
+    return src;
+}
+
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void add_noise(SynthSource *src, AVFrame *frame, int64_t n)
+{
+    int bytes = src->plane_bytes[0];
+    int max = src->plane_max[0];
+    int amplitude = src->params.noise << FFMAX(av_log2(max + 1) - 8, 0);
+    uint32_t state = (uint32_t)(n * 2654435761u) | 1;
+    for (int y = 0; y < src->plane_height[0]; y++)
+    {
+        uint8_t *row = frame->data[0] + (size_t)y * frame->linesize[0];
+        for (int x = 0; x < src->plane_width[0]; x++)
+        {
+            int delta = (int)(xorshift(&state) % (2 * amplitude + 1)) - amplitude;
+            if (bytes == 2)
+                ((uint16_t *)row)[x] = av_clip(((uint16_t *)row)[x] + delta, 0, max);
+            else
+                row[x] = av_clip(row[x] + delta, 0, max);
+        }
+    }
+}
+
+static int read_video(SynthSource *src, AVFrame *frame)
+{
+    const SynthParams *params = &src->params;
+    int64_t n = src->video_next++;
+    int64_t scene = n / src->scene_frames;
+
+    frame->buf[0] = av_buffer_pool_get(src->pool);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+    av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, params->pix_fmt, params->width,
+                         params->height, SYNTH_ALIGN);
+    frame->extended_data = frame->data;
+    frame->width = params->width;
+    frame->height = params->height;
+    frame->format = params->pix_fmt;
+    frame->sample_aspect_ratio = (AVRational){1, 1};
+    frame->pts = n;
+    frame->key_frame = n % src->scene_frames == 0;
+
+    // every scene moves its gradients in another direction and speed, chroma runs at twice the angle
+    for (int p = 0; p < src->planes; p++)
+    {
+        int64_t speed = 1 + (scene + p) % 4;
+        int64_t direction = (scene + p) & 1 ? -1 : 1;
+        int64_t phase = scene * 7919 + p * 131 + direction * speed * n;
+        int row_step = p == 0 ? 1 : 2;
+        for (int y = 0; y < src->plane_height[p]; y++)
+        {
+            int64_t offset = (phase + (int64_t)y * row_step) % src->period[p];
+            if (offset < 0)
+                offset += src->period[p];
+            memcpy(frame->data[p] + (size_t)y * frame->linesize[p], src->ramp[p] + offset * src->plane_bytes[p],
+                   (size_t)src->plane_width[p] * src->plane_bytes[p]);
+        }
+    }
+
+    if (params->noise > 0)
+        add_noise(src, frame, n);
+    return 0;
+}
+
+static void put_sample(AVFrame *frame, int channel, int index, double value)
+{
+    enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+    int planar = av_sample_fmt_is_planar(format);
+    uint8_t *data = frame->extended_data[planar ? channel : 0];
+    int position = planar ? index : index * frame->channels + channel;
+    switch (av_get_packed_sample_fmt(format))
+    {
+    case AV_SAMPLE_FMT_U8:
+        data[position] = (uint8_t)lrint(value * 127 + 128);
+        break;
+    case AV_SAMPLE_FMT_S16:
+        ((int16_t *)data)[position] = (int16_t)lrint(value * INT16_MAX);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        ((int32_t *)data)[position] = (int32_t)lrint(value * INT32_MAX);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        ((float *)data)[position] = (float)value;
+        break;
+    case AV_SAMPLE_FMT_DBL:
+        ((double *)data)[position] = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static int read_audio(SynthSource *src, AVFrame *frame)
+{
+    const SynthParams *params = &src->params;
+    int64_t scene = 0;
+    if (params->scene_seconds > 0)
+        scene = (int64_t)(src->audio_next / (params->scene_seconds * params->sample_rate));
+
+    frame->nb_samples = FFMIN((int64_t)params->samples_per_frame, src->audio_samples - src->audio_next);
+    frame->format = params->sample_fmt;
+    frame->channels = params->channels;
+    frame->channel_layout = av_get_default_channel_layout(params->channels);
+    frame->sample_rate = params->sample_rate;
+    frame->pts = src->audio_next;
+    if (av_frame_get_buffer(frame, 0) < 0)
+        return AVERROR(ENOMEM);
+
+    // channel c plays the c+1th harmonic, a cut shifts the whole chord
+    double base = params->tone_hz * (1 + (scene % 4) * 0.25);
+    for (int c = 0; c < params->channels; c++)
+    {
+        double step = 2 * M_PI * base * (c + 1) / params->sample_rate;
+        for (int i = 0; i < frame->nb_samples; i++)
+        {
+            put_sample(frame, c, i, SYNTH_TONE_LEVEL * sin(src->phase[c]));
+            src->phase[c] += step;
+        }
+        src->phase[c] = fmod(src->phase[c], 2 * M_PI);
+    }
+    src->audio_next += frame->nb_samples;
+    return 0;
+}
+
+int synth_source_read(SynthSource *src, AVFrame *frame, enum AVMediaType *type)
+{
+    const SynthParams *params = &src->params;
+    int video_left = src->video_next < src->video_frames;
+    int audio_left = src->audio_next < src->audio_samples;
+    if (!video_left && !audio_left)
+        return AVERROR_EOF;
+
+    if (video_left && (!audio_left || av_compare_ts(src->video_next, av_inv_q(params->frame_rate), src->audio_next,
+                                                    (AVRational){1, params->sample_rate}) <= 0))
+    {
+        *type = AVMEDIA_TYPE_VIDEO;
+        return read_video(src, frame);
+    }
+    *type = AVMEDIA_TYPE_AUDIO;
+    return read_audio(src, frame);
+}
+
+void synth_source_free(SynthSource **src)
+{
+    SynthSource *s = *src;
+    if (!s)
+        return;
+    for (int p = 0; p < 4; p++)
+        av_free(s->ramp[p]);
+    av_buffer_pool_uninit(&s->pool);
+    av_freep(src);
+}
@@ -0,0 +1,119 @@
+#include <mutex>
+#include <thread>
+
+#include <sched.h>
+
+#include "thread_budget.h"
+#include "video_debug.h"
+
+struct ThreadBudget
+{
+    mutable std::mutex lock;
+    int total;
+    int in_use;
+    int expected;
+    int running;
+    // for the report
+    int peak_in_use;
+    int peak_running;
+    int grants;
+    int smallest_share;
+    int largest_share;
+};
+
+ThreadBudget *thread_budget_create(int threads)
+{
+    if (threads <= 0)
+    {
+        cpu_set_t allowed;
+        threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed)
+                                                                        : (int)std::thread::hardware_concurrency();
+    }
+    ThreadBudget *budget = new ThreadBudget();
+    budget->total = threads > 0 ? threads : 1;
+    budget->in_use = 0;
+    budget->expected = 0;
+    budget->running = 0;
+    budget->peak_in_use = 0;
+    budget->peak_running = 0;
+    budget->grants = 0;
+    budget->smallest_share = 0;
+    budget->largest_share = 0;
+    return budget;
+}
+
+int thread_budget_size(const ThreadBudget *budget)
+{
+    return budget->total;
+}
+
+void thread_budget_expect(ThreadBudget *budget, int jobs)
+{
+    std::lock_guard<std::mutex> guard(budget->lock);
+    budget->expected += jobs;
+}
+
+// x265's own choice for a machine of this many threads
+static int frame_threads_for(int threads)
+{
+    if (threads >= 32)
+        return 6;
+    if (threads >= 16)
+        return 5;
+    if (threads >= 8)
+        return 3;
+    if (threads >= 4)
+        return 2;
+    return 1;
+}
+
+void thread_budget_acquire(ThreadBudget *budget, ThreadGrant *grant)
+{
+    std::lock_guard<std::mutex> guard(budget->lock);
+    if (budget->expected > 0)
+        budget->expected--;
+    int available = budget->total - budget->in_use;
+    int share = available / (budget->expected + 1);
+    // every codec gets a thread even when the budget is spent, running late beats not running
+    if (share < 2)
+        share = 2;
+
+    // decoding costs a fraction of encoding, a quarter of the share keeps the encoder fed
+    grant->decoder_threads = share / 4 > 1 ? share / 4 : 1;
+    grant->encoder_threads = share - grant->decoder_threads;
+    grant->encoder_frame_threads = frame_threads_for(grant->encoder_threads);
+
+    budget->in_use += share;
+    budget->running++;
+    budget->grants++;
+    budget->peak_in_use = budget->in_use > budget->peak_in_use ? budget->in_use : budget->peak_in_use;
+    budget->peak_running = budget->running > budget->peak_running ? budget->running : budget->peak_running;
+    budget->smallest_share = budget->grants == 1 || share < budget->smallest_share ? share : budget->smallest_share;
+    budget->largest_share = share > budget->largest_share ? share : budget->largest_share;
+}
+
+void thread_budget_release(ThreadBudget *budget, ThreadGrant *grant)
+{
+    int share = grant->decoder_threads + grant->encoder_threads;
+    if (!share)
+        return;
+    std::lock_guard<std::mutex> guard(budget->lock);
+    budget->in_use -= share;
+    budget->running--;
+    grant->decoder_threads = 0;
+    grant->encoder_threads = 0;
+    grant->encoder_frame_threads = 0;
+}
+
+void thread_budget_report(const ThreadBudget *budget)
+{
+    std::lock_guard<std::mutex> guard(budget->lock);
+    logging("thread budget: %d threads, %d grants of %d to %d threads, peak %d jobs using %d threads", budget->total,
+            budget->grants, budget->smallest_share, budget->largest_share, budget->peak_running, budget->peak_in_use);
+}
+
+void thread_budget_free(ThreadBudget **budget)
+{
+    delete *budget;
+    *budget = NULL;
+}
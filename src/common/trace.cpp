@@ -0,0 +1,197 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "video_debug.h"
+
+// events kept per thread, later ones are counted and dropped
+#define TRACE_MAX_EVENTS (1 << 20)
+
+typedef struct TraceEvent
+{
+    const char *name;
+    int64_t start;
+    int64_t duration;
+    int64_t frame;
+} TraceEvent;
+
+typedef struct TraceThread
+{
+    pid_t tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    int64_t dropped;
+} TraceThread;
+
+std::atomic<int> trace_active;
+
+static std::mutex registry_lock;
+static std::vector<TraceThread *> threads;
+static std::string trace_path;
+static pid_t trace_pid;
+static thread_local TraceThread *current;
+
+int64_t trace_now(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static void before_fork(void)
+{
+    registry_lock.lock();
+}
+
+static void after_fork_parent(void)
+{
+    registry_lock.unlock();
+}
+
+// the parent writes what was recorded so far, the child starts over with only the forking thread
+static void after_fork_child(void)
+{
+    for (TraceThread *thread : threads)
+    {
+        if (thread != current)
+            delete thread;
+    }
+    threads.clear();
+    if (current)
+    {
+        current->tid = syscall(SYS_gettid);
+        current->events.clear();
+        threads.push_back(current);
+    }
+    registry_lock.unlock();
+}
+
+// modes that return from main without trace_stop still write their file
+static void stop_at_exit(void)
+{
+    trace_stop();
+}
+
+int trace_start(const char *path)
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        atexit(stop_at_exit);
+    });
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    trace_path = path;
+    trace_pid = getpid();
+    trace_active.store(1);
+    return 0;
+}
+
+static TraceThread *trace_thread(void)
+{
+    if (current)
+        return current;
+    current = new TraceThread();
+    current->tid = syscall(SYS_gettid);
+    current->dropped = 0;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    threads.push_back(current);
+    return current;
+}
+
+void trace_end(const char *name, int64_t start, int64_t frame)
+{
+    if (!start || !trace_enabled())
+        return;
+    TraceThread *thread = trace_thread();
+    if (thread->events.size() >= TRACE_MAX_EVENTS)
+    {
+        thread->dropped++;
+        return;
+    }
+    thread->events.push_back({name, start, trace_now() - start, frame});
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_enabled())
+        trace_thread()->name = name;
+}
+
+static void write_string(FILE *file, const char *text)
+{
+    fputc('"', file);
+    for (const char *c = text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', file);
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+int trace_stop(void)
+{
+    if (!trace_enabled())
+        return 0;
+    trace_active.store(0);
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    pid_t pid = getpid();
+    std::string path = trace_path;
+    if (pid != trace_pid)
+        path += "." + std::to_string(pid);
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+        logging("could not open trace file %s", path.c_str());
+        return -1;
+    }
+
+    int64_t events = 0, dropped = 0;
+    const char *separator = "\n";
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (const TraceThread *thread : threads)
+    {
+        if (!thread->name.empty())
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    separator, (int)pid, (int)thread->tid);
+            write_string(file, thread->name.c_str());
+            fprintf(file, "}}");
+            separator = ",\n";
+        }
+        for (const TraceEvent &event : thread->events)
+        {
+            fprintf(file, "%s{\"name\":", separator);
+            write_string(file, event.name);
+            fprintf(file, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d", (long long)event.start,
+                    (long long)event.duration, (int)pid, (int)thread->tid);
+            if (event.frame >= 0)
+                fprintf(file, ",\"args\":{\"frame\":%lld}", (long long)event.frame);
+            fprintf(file, "}");
+            separator = ",\n";
+        }
+        events += thread->events.size();
+        dropped += thread->dropped;
+    }
+    fprintf(file, "\n]}\n");
+    int ret = ferror(file) | fclose(file);
+
+    logging("trace: %lld events from %zu threads written to %s", (long long)events, threads.size(), path.c_str());
+    if (dropped)
+        logging("trace: %lld events dropped after %d per thread", (long long)dropped, TRACE_MAX_EVENTS);
+    for (TraceThread *thread : threads)
+        thread->events.clear();
+    return ret ? -1 : 0;
+}
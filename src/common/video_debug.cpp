@@ -3,11 +3,9 @@
 void logging(const char *fmt, ...)
 {
     va_list args;
-    fprintf(stderr, "LOG: ");
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    log_vmessage(LOG_LEVEL_INFO, fmt, args);
     va_end(args);
-    fprintf(stderr, "\n");
 }
 
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
@@ -0,0 +1,102 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "worker_pool.h"
+
+struct WorkerPool
+{
+    std::mutex lock;
+    std::condition_variable has_task;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    int running;
+    bool stopping;
+};
+
+static void worker_loop(WorkerPool *pool)
+{
+    trace_thread_name("worker");
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            pool->has_task.wait(guard, [pool] { return !pool->tasks.empty() || pool->stopping; });
+            if (pool->tasks.empty())
+                return;
+            task = std::move(pool->tasks.front());
+            pool->tasks.pop_front();
+            pool->running++;
+        }
+
+        int64_t start = trace_begin();
+        task();
+        trace_end("job", start, -1);
+
+        {
+            std::lock_guard<std::mutex> guard(pool->lock);
+            pool->running--;
+            if (pool->tasks.empty() && pool->running == 0)
+                pool->idle.notify_all();
+        }
+    }
+}
+
+WorkerPool *worker_pool_create(int threads)
+{
+    WorkerPool *pool = new WorkerPool();
+    pool->running = 0;
+    pool->stopping = false;
+
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+
+    for (int i = 0; i < threads; i++)
+        pool->threads.emplace_back(worker_loop, pool);
+    return pool;
+}
+
+int worker_pool_size(const WorkerPool *pool)
+{
+    return pool->threads.size();
+}
+
+void worker_pool_submit(WorkerPool *pool, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->tasks.push_back(std::move(task));
+    }
+    pool->has_task.notify_one();
+}
+
+void worker_pool_wait(WorkerPool *pool)
+{
+    std::unique_lock<std::mutex> guard(pool->lock);
+    pool->idle.wait(guard, [pool] { return pool->tasks.empty() && pool->running == 0; });
+}
+
+void worker_pool_destroy(WorkerPool **pool)
+{
+    WorkerPool *p = *pool;
+    if (!p)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(p->lock);
+        p->stopping = true;
+    }
+    p->has_task.notify_all();
+    for (std::thread &thread : p->threads)
+        thread.join();
+
+    delete p;
+    *pool = NULL;
+}
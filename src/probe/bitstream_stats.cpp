@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "bitstream_stats.h"
+#include "video_process.h"
+
+#define PICTURE_TYPES 4
+
+typedef struct PacketSizes
+{
+    std::vector<int> sizes;
+    int64_t total;
+} PacketSizes;
+
+typedef struct BitstreamStats
+{
+    // I, P, B and packets the parser could not classify
+    PacketSizes by_type[PICTURE_TYPES];
+
+    std::vector<int> gop_lengths;
+    std::string first_gop;
+    std::string current_gop;
+
+    std::vector<double> keyframe_times;
+
+    std::deque<std::pair<double, int64_t>> window;
+    int64_t window_bits;
+    double window_min;
+    double window_max;
+    double window_max_at;
+    double window_sum;
+    int window_samples;
+
+    double vbv_fullness;
+    double vbv_min_fullness;
+    double vbv_last_time;
+    int vbv_underflows;
+    double vbv_first_underflow;
+
+    int64_t packets;
+    int64_t bytes;
+    double first_time;
+    double last_time;
+} BitstreamStats;
+
+static const char picture_type_names[PICTURE_TYPES] = {'I', 'P', 'B', '?'};
+
+static int picture_type_slot(int pict_type, int key)
+{
+    if (key || pict_type == AV_PICTURE_TYPE_I)
+        return 0;
+    if (pict_type == AV_PICTURE_TYPE_P)
+        return 1;
+    if (pict_type == AV_PICTURE_TYPE_B)
+        return 2;
+    return 3;
+}
+
+static int percentile(std::vector<int> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void update_window(BitstreamStats *stats, const BitstreamParams *params, double time, int bits)
+{
+    stats->window.push_back({time, bits});
+    stats->window_bits += bits;
+    while (!stats->window.empty() && stats->window.front().first <= time - params->window_seconds)
+    {
+        stats->window_bits -= stats->window.front().second;
+        stats->window.pop_front();
+    }
+
+    // only report once a full window of data has been seen
+    if (time - stats->first_time < params->window_seconds)
+        return;
+
+    double rate = stats->window_bits / params->window_seconds;
+    if (!stats->window_samples || rate < stats->window_min)
+        stats->window_min = rate;
+    if (!stats->window_samples || rate > stats->window_max)
+    {
+        stats->window_max = rate;
+        stats->window_max_at = time;
+    }
+    stats->window_sum += rate;
+    stats->window_samples++;
+}
+
+static void update_vbv(BitstreamStats *stats, const BitstreamParams *params, double time, int bits)
+{
+    if (params->vbv_buffer_size <= 0 || params->vbv_max_rate <= 0)
+        return;
+
+    // leaky bucket: fills at max rate up to the buffer size, each packet is removed at its decode time
+    if (stats->packets > 0 && time > stats->vbv_last_time)
+        stats->vbv_fullness += params->vbv_max_rate * (time - stats->vbv_last_time);
+    stats->vbv_fullness = FFMIN(stats->vbv_fullness, (double)params->vbv_buffer_size);
+    stats->vbv_last_time = time;
+
+    stats->vbv_fullness -= bits;
+    if (stats->vbv_fullness < 0)
+    {
+        if (!stats->vbv_underflows)
+            stats->vbv_first_underflow = time;
+        stats->vbv_underflows++;
+        stats->vbv_fullness = 0;
+    }
+    stats->vbv_min_fullness = FFMIN(stats->vbv_min_fullness, stats->vbv_fullness);
+}
+
+static void close_gop(BitstreamStats *stats)
+{
+    if (stats->current_gop.empty())
+        return;
+    stats->gop_lengths.push_back(stats->current_gop.size());
+    if (stats->first_gop.empty())
+        stats->first_gop = stats->current_gop;
+    stats->current_gop.clear();
+}
+
+static void mean_stddev(const std::vector<double> &values, double *mean, double *stddev)
+{
+    *mean = 0;
+    *stddev = 0;
+    if (values.empty())
+        return;
+    for (double v : values)
+        *mean += v;
+    *mean /= values.size();
+    for (double v : values)
+        *stddev += (v - *mean) * (v - *mean);
+    *stddev = sqrt(*stddev / values.size());
+}
+
+static int write_report(BitstreamStats *stats, const BitstreamParams *params, const std::vector<double> &intervals,
+                        double interval_mean, double interval_stddev)
+{
+    FILE *f = fopen(params->report_path, "w");
+    if (!f)
+    {
+        logging("could not open bitstream report %s", params->report_path);
+        return -1;
+    }
+
+    double duration = stats->last_time - stats->first_time;
+    fprintf(f, "{\n  \"packets\": %lld,\n  \"bytes\": %lld,\n  \"duration\": %.6f,\n", (long long)stats->packets,
+            (long long)stats->bytes, duration);
+
+    fprintf(f, "  \"packet_sizes\": {");
+    for (int t = 0; t < PICTURE_TYPES; t++)
+    {
+        std::vector<int> &sizes = stats->by_type[t].sizes;
+        fprintf(f, "%s\n    \"%c\": {\"count\": %zu, \"bytes\": %lld, \"min\": %d, \"p50\": %d, \"p90\": %d, "
+                   "\"p99\": %d, \"max\": %d}",
+                t ? "," : "", picture_type_names[t], sizes.size(), (long long)stats->by_type[t].total,
+                sizes.empty() ? 0 : sizes.front(), percentile(sizes, 0.5), percentile(sizes, 0.9),
+                percentile(sizes, 0.99), sizes.empty() ? 0 : sizes.back());
+    }
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"gop\": {\"count\": %zu, \"pattern\": \"%s\", \"lengths\": [", stats->gop_lengths.size(),
+            stats->first_gop.c_str());
+    for (size_t i = 0; i < stats->gop_lengths.size(); i++)
+        fprintf(f, "%s%d", i ? ", " : "", stats->gop_lengths[i]);
+    fprintf(f, "]},\n");
+
+    fprintf(f, "  \"keyframe_interval\": {\"mean\": %.6f, \"stddev\": %.6f, \"intervals\": [", interval_mean,
+            interval_stddev);
+    for (size_t i = 0; i < intervals.size(); i++)
+        fprintf(f, "%s%.6f", i ? ", " : "", intervals[i]);
+    fprintf(f, "]},\n");
+
+    fprintf(f, "  \"bitrate_window\": {\"seconds\": %.3f, \"min\": %.0f, \"mean\": %.0f, \"max\": %.0f, "
+               "\"max_at\": %.6f},\n",
+            params->window_seconds, stats->window_min,
+            stats->window_samples ? stats->window_sum / stats->window_samples : 0, stats->window_max,
+            stats->window_max_at);
+
+    fprintf(f, "  \"vbv\": {\"buffer_size\": %lld, \"max_rate\": %lld, \"min_fullness\": %.0f, \"underflows\": %d, "
+               "\"first_underflow\": %.6f}\n}\n",
+            (long long)params->vbv_buffer_size, (long long)params->vbv_max_rate, stats->vbv_min_fullness,
+            stats->vbv_underflows, stats->vbv_underflows ? stats->vbv_first_underflow : -1.0);
+
+    fclose(f);
+    return 0;
+}
+
+void bitstream_default_params(BitstreamParams *params)
+{
+    params->window_seconds = 1.0;
+    params->vbv_buffer_size = VIDEO_RC_BUFFER_SIZE;
+    params->vbv_max_rate = VIDEO_RC_MAX_RATE;
+    params->vbv_initial_fullness = 0.9;
+    params->report_path = NULL;
+}
+
+int probe_bitstream(AVFormatContext *avfc, int stream_index, const BitstreamParams *params)
+{
+    AVStream *avs = avfc->streams[stream_index];
+    BitstreamStats stats = {};
+    stats.vbv_fullness = params->vbv_initial_fullness * params->vbv_buffer_size;
+    stats.vbv_min_fullness = stats.vbv_fullness;
+
+    // the demuxer still has to walk the container, but it does not hand us the other streams
+    for (unsigned int i = 0; i < avfc->nb_streams; i++)
+    {
+        if ((int)i != stream_index)
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    AVCodecParserContext *parser = av_parser_init(avs->codecpar->codec_id);
+    AVCodecContext *avcc = avcodec_alloc_context3(NULL);
+    if (!avcc || avcodec_parameters_to_context(avcc, avs->codecpar) < 0)
+    {
+        logging("failed to set up the parser context");
+        av_parser_close(parser);
+        avcodec_free_context(&avcc);
+        return -1;
+    }
+    if (parser)
+        parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+    else
+        logging("no parser for %s, picture types come from the keyframe flag only",
+                avcodec_get_name(avs->codecpar->codec_id));
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+    {
+        logging("failed to allocate memory for AVPacket");
+        av_parser_close(parser);
+        avcodec_free_context(&avcc);
+        return -1;
+    }
+
+    int64_t next_dts = AV_NOPTS_VALUE;
+    while (av_read_frame(avfc, packet) >= 0)
+    {
+        if (packet->stream_index != stream_index)
+        {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        int pict_type = AV_PICTURE_TYPE_NONE;
+        if (parser)
+        {
+            uint8_t *out_data = NULL;
+            int out_size = 0;
+            av_parser_parse2(parser, avcc, &out_data, &out_size, packet->data, packet->size, packet->pts, packet->dts,
+                             packet->pos);
+            pict_type = parser->pict_type;
+        }
+
+        int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : next_dts;
+        if (dts == AV_NOPTS_VALUE)
+            dts = packet->pts != AV_NOPTS_VALUE ? packet->pts : 0;
+        next_dts = dts + packet->duration;
+        double time = dts * av_q2d(avs->time_base);
+
+        int key = packet->flags & AV_PKT_FLAG_KEY;
+        int slot = picture_type_slot(pict_type, key);
+        int bits = packet->size * 8;
+
+        if (!stats.packets)
+            stats.first_time = time;
+
+        stats.by_type[slot].sizes.push_back(packet->size);
+        stats.by_type[slot].total += packet->size;
+
+        if (key)
+        {
+            close_gop(&stats);
+            stats.keyframe_times.push_back(time);
+        }
+        stats.current_gop.push_back(picture_type_names[slot]);
+
+        update_window(&stats, params, time, bits);
+        update_vbv(&stats, params, time, bits);
+
+        stats.packets++;
+        stats.bytes += packet->size;
+        stats.last_time = time;
+        av_packet_unref(packet);
+    }
+    close_gop(&stats);
+
+    av_packet_free(&packet);
+    av_parser_close(parser);
+    avcodec_free_context(&avcc);
+
+    if (!stats.packets)
+    {
+        logging("stream %d has no packets", stream_index);
+        return -1;
+    }
+
+    for (int t = 0; t < PICTURE_TYPES; t++)
+        std::sort(stats.by_type[t].sizes.begin(), stats.by_type[t].sizes.end());
+
+    std::vector<double> intervals;
+    for (size_t i = 1; i < stats.keyframe_times.size(); i++)
+        intervals.push_back(stats.keyframe_times[i] - stats.keyframe_times[i - 1]);
+    double interval_mean, interval_stddev;
+    mean_stddev(intervals, &interval_mean, &interval_stddev);
+
+    double duration = stats.last_time - stats.first_time;
+    logging("bitstream: %lld packets, %lld bytes, %.3f s, average %.0f bit/s", (long long)stats.packets,
+            (long long)stats.bytes, duration, duration > 0 ? stats.bytes * 8 / duration : 0.0);
+
+    for (int t = 0; t < PICTURE_TYPES; t++)
+    {
+        std::vector<int> &sizes = stats.by_type[t].sizes;
+        if (sizes.empty())
+            continue;
+        logging("\t%c: count=%zu mean=%lld min=%d p50=%d p90=%d p99=%d max=%d", picture_type_names[t], sizes.size(),
+                (long long)(stats.by_type[t].total / (int64_t)sizes.size()), sizes.front(), percentile(sizes, 0.5),
+                percentile(sizes, 0.9), percentile(sizes, 0.99), sizes.back());
+    }
+
+    if (!stats.gop_lengths.empty())
+    {
+        std::vector<int> lengths = stats.gop_lengths;
+        std::sort(lengths.begin(), lengths.end());
+        logging("\tGOP: count=%zu min=%d median=%d max=%d first=%s", lengths.size(), lengths.front(),
+                percentile(lengths, 0.5), lengths.back(), stats.first_gop.c_str());
+    }
+
+    if (!intervals.empty())
+        logging("\tkeyframe interval: mean=%.3f s stddev=%.3f s min=%.3f s max=%.3f s", interval_mean,
+                interval_stddev, *std::min_element(intervals.begin(), intervals.end()),
+                *std::max_element(intervals.begin(), intervals.end()));
+
+    if (stats.window_samples)
+        logging("\tbitrate over %.2f s windows: min=%.0f mean=%.0f max=%.0f (at %.3f s)", params->window_seconds,
+                stats.window_min, stats.window_sum / stats.window_samples, stats.window_max, stats.window_max_at);
+
+    if (params->vbv_buffer_size > 0 && params->vbv_max_rate > 0)
+    {
+        logging("\tVBV buffer=%lld maxrate=%lld: min fullness %.1f%%, %d underflows", (long long)params->vbv_buffer_size,
+                (long long)params->vbv_max_rate, 100.0 * stats.vbv_min_fullness / params->vbv_buffer_size,
+                stats.vbv_underflows);
+        if (stats.vbv_underflows)
+            logging("\tVBV first underflow at %.3f s", stats.vbv_first_underflow);
+    }
+
+    if (params->report_path && write_report(&stats, params, intervals, interval_mean, interval_stddev))
+        return -1;
+
+    return stats.vbv_underflows ? 1 : 0;
+}
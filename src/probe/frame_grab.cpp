@@ -0,0 +1,416 @@
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_grab.h"
+#include "video_debug.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#define MAX_SEEK_RETRIES 3
+
+typedef struct GrabTarget
+{
+    int64_t pts;
+    int number;
+} GrabTarget;
+
+// targets that share a keyframe, served by one seek and one forward decode
+typedef struct GrabJob
+{
+    int64_t key;
+    std::vector<GrabTarget> targets;
+} GrabJob;
+
+// a run of consecutive decoded frames in presentation order
+typedef struct CachedRun
+{
+    std::vector<AVFrame *> frames;
+} CachedRun;
+
+typedef struct GrabDecoder
+{
+    AVFormatContext *avfc;
+    AVCodecContext *avcc;
+    AVPacket *packet;
+    AVFrame *frame;
+    AVFrame *prev;
+    int64_t gop_key;
+    int eof;
+} GrabDecoder;
+
+struct FrameGrabService
+{
+    FrameGrabParams params;
+    int stream_index;
+    AVRational time_base;
+    int64_t start;
+    std::vector<GrabDecoder> decoders;
+
+    std::mutex cache_lock;
+    std::list<CachedRun> cache;
+    int cached_frames;
+
+    std::mutex stats_lock;
+    int64_t cache_hits;
+    int64_t seeks;
+    int64_t frames_decoded;
+};
+
+static int64_t frame_pts(const AVFrame *frame)
+{
+    return frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+}
+
+static void free_run(CachedRun *run)
+{
+    for (AVFrame *frame : run->frames)
+        av_frame_free(&frame);
+    run->frames.clear();
+}
+
+static const AVFrame *find_in_run(const CachedRun *run, int64_t pts)
+{
+    const std::vector<AVFrame *> &frames = run->frames;
+    if (frames.empty() || pts < frame_pts(frames.front()))
+        return NULL;
+
+    for (size_t i = 0; i + 1 < frames.size(); i++)
+    {
+        if (frame_pts(frames[i]) <= pts && pts < frame_pts(frames[i + 1]))
+            return frames[i];
+    }
+
+    const AVFrame *last = frames.back();
+    if (pts < frame_pts(last) + FFMAX(last->pkt_duration, (int64_t)1))
+        return last;
+    return NULL;
+}
+
+static int cache_lookup(FrameGrabService *service, const GrabTarget *target, FrameSink *sink)
+{
+    std::lock_guard<std::mutex> guard(service->cache_lock);
+    for (auto it = service->cache.begin(); it != service->cache.end(); ++it)
+    {
+        const AVFrame *frame = find_in_run(&*it, target->pts);
+        if (!frame)
+            continue;
+
+        frame_sink_push(sink, frame, target->number);
+        service->cache.splice(service->cache.begin(), service->cache, it);
+        return 1;
+    }
+    return 0;
+}
+
+static void cache_insert(FrameGrabService *service, CachedRun *run)
+{
+    if (run->frames.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(service->cache_lock);
+    service->cached_frames += run->frames.size();
+    service->cache.push_front(CachedRun());
+    service->cache.front().frames.swap(run->frames);
+
+    while (service->cached_frames > service->params.max_cached_frames && service->cache.size() > 1)
+    {
+        service->cached_frames -= service->cache.back().frames.size();
+        free_run(&service->cache.back());
+        service->cache.pop_back();
+    }
+}
+
+static int64_t keyframe_before(GrabDecoder *d, int stream_index, int64_t pts)
+{
+    AVStream *avs = d->avfc->streams[stream_index];
+    const AVIndexEntry *entry = avformat_index_get_entry_from_timestamp(avs, pts, AVSEEK_FLAG_BACKWARD);
+    return entry ? entry->timestamp : AV_NOPTS_VALUE;
+}
+
+static int open_decoder(const char *filename, int stream_index, FramePool *pool, GrabDecoder *d)
+{
+    if (avformat_open_input(&d->avfc, filename, NULL, NULL) != 0 || avformat_find_stream_info(d->avfc, NULL) < 0)
+    {
+        logging("grab: failed to open %s", filename);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < d->avfc->nb_streams; i++)
+    {
+        if ((int)i != stream_index)
+            d->avfc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    AVStream *avs = d->avfc->streams[stream_index];
+    const AVCodec *avc = avcodec_find_decoder(avs->codecpar->codec_id);
+    d->avcc = avc ? avcodec_alloc_context3(avc) : NULL;
+    if (!d->avcc || avcodec_parameters_to_context(d->avcc, avs->codecpar) < 0)
+    {
+        logging("grab: failed to open the decoder");
+        return -1;
+    }
+    frame_pool_attach(pool, d->avcc);
+    if (avcodec_open2(d->avcc, avc, NULL) < 0)
+    {
+        logging("grab: failed to open the decoder");
+        return -1;
+    }
+
+    d->packet = av_packet_alloc();
+    d->frame = av_frame_alloc();
+    d->prev = av_frame_alloc();
+    d->gop_key = AV_NOPTS_VALUE;
+    d->eof = 1;
+    return d->packet && d->frame && d->prev ? 0 : -1;
+}
+
+static void close_decoder(GrabDecoder *d)
+{
+    avformat_close_input(&d->avfc);
+    avcodec_free_context(&d->avcc);
+    av_packet_free(&d->packet);
+    av_frame_free(&d->frame);
+    av_frame_free(&d->prev);
+}
+
+static int seek_decoder(FrameGrabService *service, GrabDecoder *d, int64_t pts)
+{
+    if (av_seek_frame(d->avfc, service->stream_index, pts, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        logging("grab: seek to %lld failed", (long long)pts);
+        return -1;
+    }
+    avcodec_flush_buffers(d->avcc);
+    av_frame_unref(d->prev);
+    d->eof = 0;
+
+    std::lock_guard<std::mutex> guard(service->stats_lock);
+    service->seeks++;
+    return 0;
+}
+
+// next decoded frame into d->frame, 0 on success, AVERROR_EOF once the decoder is drained
+static int next_frame(FrameGrabService *service, GrabDecoder *d)
+{
+    while (true)
+    {
+        int response = avcodec_receive_frame(d->avcc, d->frame);
+        if (response != AVERROR(EAGAIN))
+            return response;
+
+        if (av_read_frame(d->avfc, d->packet) < 0)
+        {
+            response = avcodec_send_packet(d->avcc, NULL);
+        }
+        else
+        {
+            if (d->packet->stream_index != service->stream_index)
+            {
+                av_packet_unref(d->packet);
+                continue;
+            }
+            response = avcodec_send_packet(d->avcc, d->packet);
+            av_packet_unref(d->packet);
+        }
+
+        if (response < 0 && response != AVERROR_EOF)
+        {
+            logging("grab: error while sending a packet to the decoder");
+            return response;
+        }
+    }
+}
+
+static int run_job(FrameGrabService *service, GrabDecoder *d, GrabJob *job, FrameSink *sink)
+{
+    std::vector<GrabTarget> &targets = job->targets;
+    size_t next = 0;
+    int retries = 0;
+    int fresh_seek = 0;
+    CachedRun run;
+
+    // keep decoding forward when the previous job left this decoder earlier in the same GOP
+    int continue_forward = !d->eof && job->key != AV_NOPTS_VALUE && d->gop_key == job->key && d->prev->buf[0] &&
+                           frame_pts(d->prev) <= targets[0].pts;
+    if (!continue_forward)
+    {
+        if (seek_decoder(service, d, targets[0].pts) < 0)
+            return -1;
+        fresh_seek = 1;
+    }
+
+    while (next < targets.size())
+    {
+        int response = next_frame(service, d);
+        if (response == AVERROR_EOF)
+        {
+            d->eof = 1;
+            break;
+        }
+        if (response < 0)
+        {
+            free_run(&run);
+            return -1;
+        }
+
+        int64_t pts = frame_pts(d->frame);
+        if (fresh_seek && pts > targets[next].pts && retries < MAX_SEEK_RETRIES)
+        {
+            // landed after the target, the index keyframe was not early enough
+            retries++;
+            av_frame_unref(d->frame);
+            if (seek_decoder(service, d, pts - 1) < 0)
+                return -1;
+            continue;
+        }
+        fresh_seek = 0;
+
+        {
+            std::lock_guard<std::mutex> guard(service->stats_lock);
+            service->frames_decoded++;
+        }
+
+        while (next < targets.size() && pts > targets[next].pts)
+        {
+            frame_sink_push(sink, d->prev->buf[0] ? d->prev : d->frame, targets[next].number);
+            next++;
+        }
+
+        if ((int)run.frames.size() >= service->params.max_cached_frames)
+        {
+            av_frame_free(&run.frames.front());
+            run.frames.erase(run.frames.begin());
+        }
+        AVFrame *cached = av_frame_clone(d->frame);
+        if (cached)
+            run.frames.push_back(cached);
+
+        av_frame_unref(d->prev);
+        av_frame_move_ref(d->prev, d->frame);
+
+        while (next < targets.size() && targets[next].pts == pts)
+        {
+            frame_sink_push(sink, d->prev, targets[next].number);
+            next++;
+        }
+    }
+
+    // past the end of the stream the last picture stays on screen
+    for (; next < targets.size() && d->prev->buf[0]; next++)
+        frame_sink_push(sink, d->prev, targets[next].number);
+
+    d->gop_key = job->key;
+    cache_insert(service, &run);
+    return next == targets.size() ? 0 : -1;
+}
+
+static void run_jobs(FrameGrabService *service, GrabDecoder *d, std::vector<GrabJob> *jobs, size_t begin, size_t end,
+                     FrameSink *sink, int *errors)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        if (run_job(service, d, &(*jobs)[i], sink) < 0)
+            (*errors)++;
+    }
+}
+
+void frame_grab_default_params(FrameGrabParams *params)
+{
+    params->decoders = 4;
+    params->max_cached_frames = 64;
+    params->frame_pool = NULL;
+}
+
+FrameGrabService *frame_grab_open(const char *filename, int stream_index, const FrameGrabParams *params)
+{
+    FrameGrabService *service = new FrameGrabService();
+    service->params = *params;
+    service->params.decoders = FFMAX(params->decoders, 1);
+    service->stream_index = stream_index;
+    service->decoders.resize(service->params.decoders);
+
+    for (GrabDecoder &d : service->decoders)
+    {
+        if (open_decoder(filename, stream_index, params->frame_pool, &d) < 0)
+        {
+            frame_grab_close(&service);
+            return NULL;
+        }
+    }
+
+    AVStream *avs = service->decoders[0].avfc->streams[stream_index];
+    service->time_base = avs->time_base;
+    service->start = avs->start_time != AV_NOPTS_VALUE ? avs->start_time : 0;
+    return service;
+}
+
+int frame_grab_request(FrameGrabService *service, const double *times, int count, FrameSink *sink, int first_number)
+{
+    std::vector<GrabTarget> pending;
+    for (int i = 0; i < count; i++)
+    {
+        GrabTarget target;
+        target.pts = service->start + av_rescale_q((int64_t)(times[i] * AV_TIME_BASE), AV_TIME_BASE_Q, service->time_base);
+        target.number = first_number + i;
+        if (cache_lookup(service, &target, sink))
+        {
+            std::lock_guard<std::mutex> guard(service->stats_lock);
+            service->cache_hits++;
+            continue;
+        }
+        pending.push_back(target);
+    }
+
+    std::sort(pending.begin(), pending.end(), [](const GrabTarget &a, const GrabTarget &b) { return a.pts < b.pts; });
+
+    // targets behind the same keyframe become one job
+    std::vector<GrabJob> jobs;
+    for (GrabTarget &target : pending)
+    {
+        int64_t key = keyframe_before(&service->decoders[0], service->stream_index, target.pts);
+        if (jobs.empty() || key == AV_NOPTS_VALUE || jobs.back().key != key)
+            jobs.push_back({key, {}});
+        jobs.back().targets.push_back(target);
+    }
+
+    // contiguous slices keep each decoder moving forward through its part of the file
+    int workers = FFMIN((int)jobs.size(), service->params.decoders);
+    std::vector<std::thread> threads;
+    std::vector<int> errors(FFMAX(workers, 1), 0);
+    for (int w = 0; w < workers; w++)
+    {
+        size_t begin = jobs.size() * w / workers;
+        size_t end = jobs.size() * (w + 1) / workers;
+        threads.emplace_back(run_jobs, service, &service->decoders[w], &jobs, begin, end, sink, &errors[w]);
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    int failed = 0;
+    for (int e : errors)
+        failed += e;
+
+    logging("grab: %d requests, %zu jobs on %d decoders, %lld cache hits, %lld seeks, %lld frames decoded so far",
+            count, jobs.size(), workers, (long long)service->cache_hits, (long long)service->seeks,
+            (long long)service->frames_decoded);
+    return failed ? -1 : 0;
+}
+
+void frame_grab_close(FrameGrabService **service)
+{
+    FrameGrabService *s = *service;
+    if (!s)
+        return;
+    for (GrabDecoder &d : s->decoders)
+        close_decoder(&d);
+    for (CachedRun &run : s->cache)
+        free_run(&run);
+    delete s;
+    *service = NULL;
+}
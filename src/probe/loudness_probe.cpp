@@ -0,0 +1,64 @@
+#include "loudness_probe.h"
+#include "loudness_meter.h"
+#include "video_debug.h"
+
+static int measure_frames(AVCodecContext *avcc, AVFrame *frame, LoudnessMeter *meter)
+{
+    int response;
+    while ((response = avcodec_receive_frame(avcc, frame)) >= 0)
+    {
+        loudness_meter_push(meter, frame);
+        av_frame_unref(frame);
+    }
+    return response == AVERROR(EAGAIN) || response == AVERROR_EOF ? 0 : response;
+}
+
+int probe_loudness(AVFormatContext *avfc, int stream_index, const char *report_path)
+{
+    AVStream *avs = avfc->streams[stream_index];
+    for (unsigned int i = 0; i < avfc->nb_streams; i++)
+    {
+        if ((int)i != stream_index)
+            avfc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    const AVCodec *avc = avcodec_find_decoder(avs->codecpar->codec_id);
+    AVCodecContext *avcc = avc ? avcodec_alloc_context3(avc) : NULL;
+    if (!avcc || avcodec_parameters_to_context(avcc, avs->codecpar) < 0 || avcodec_open2(avcc, avc, NULL) < 0)
+    {
+        logging("failed to open the audio decoder");
+        avcodec_free_context(&avcc);
+        return -1;
+    }
+
+    LoudnessMeter *meter = loudness_meter_alloc(avcc->sample_rate, avcc->channels, avcc->channel_layout);
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int response = meter && packet && frame ? 0 : -1;
+
+    while (response >= 0 && av_read_frame(avfc, packet) >= 0)
+    {
+        if (packet->stream_index == stream_index)
+        {
+            response = avcodec_send_packet(avcc, packet);
+            if (response >= 0)
+                response = measure_frames(avcc, frame, meter);
+            else
+                logging("Error while sending a packet to the decoder");
+        }
+        av_packet_unref(packet);
+    }
+
+    if (response >= 0 && avcodec_send_packet(avcc, NULL) >= 0)
+        response = measure_frames(avcc, frame, meter);
+
+    if (response >= 0)
+        response = loudness_meter_report(meter, report_path);
+
+    if (meter)
+        loudness_meter_free(&meter);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&avcc);
+    return response < 0 ? -1 : 0;
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <vector>
 
 extern "C"
 {
@@ -8,13 +9,21 @@ extern "C"
 #include <libavutil/frame.h>
 }
 
+#include "bitstream_stats.h"
 #include "config.h"
+#include "frame_analysis.h"
+#include "frame_grab.h"
+#include "frame_sink.h"
+#include "loudness_probe.h"
+#include "trace.h"
+#include "video_debug.h"
 
-static void logging(const char *fmt, ...);
+static const char *option_value(const char *arg, const char *name);
 
-static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame);
+static void parse_times(const char *list, std::vector<double> &times);
 
-static void save_gray_frame(unsigned char *buf, int wrap, int xsize, int ysize, char *filename);
+static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame, FrameSink *pSink,
+                         FrameAnalyzer *pAnalyzer);
 
 int main(int argc, char *argv[])
 {
@@ -23,10 +32,126 @@ int main(int argc, char *argv[])
         std::cout << argv[0] << " Version " << Tutorial_VERSION_MAJOR << "." << Tutorial_VERSION_MINOR << std::endl;
         std::cout << "Usage: " << argv[0] << " number" << std::endl;
         std::cout << "You need to pass at least one parameter as the input file path." << std::endl;
+        std::cout << "Options: --mode=frames|bitstream|detect|loudness|grab" << std::endl;
+        std::cout << "  frames:    --format=png|pgm|y4m --frames=N (0 = all) --output=DIR --threads=N" << std::endl;
+        std::cout << "  bitstream: --window=SECONDS --vbv-bufsize=BITS --vbv-maxrate=BITS --report=FILE.json"
+                  << std::endl;
+        std::cout << "  detect:    --frames=N --timeline=FILE.json (- for stdout)" << std::endl;
+        std::cout << "  loudness:  --report=FILE.json" << std::endl;
+        std::cout << "  grab:      --times=SECONDS,... (- reads one burst per line from stdin) --decoders=N "
+                     "--cache-frames=N --format=... --output=DIR"
+                  << std::endl;
+        std::cout << "  any mode:  --log-level=error|warning|info|debug --trace=FILE.json" << std::endl;
+        std::cout << "  decoding:  --frame-pool=off|on|hugepage" << std::endl;
         return -1;
     }
 
     char *filename = argv[1];
+    const char *mode = "frames";
+    int how_many_packets_to_process = -1;
+    const char *timelinePath = "-";
+    const char *reportPath = NULL;
+    const char *grabTimes = NULL;
+    FrameGrabParams grabParams;
+    frame_grab_default_params(&grabParams);
+    FrameSinkParams sinkParams;
+    frame_sink_default_params(&sinkParams);
+    BitstreamParams bitstreamParams;
+    bitstream_default_params(&bitstreamParams);
+    FramePoolMode framePoolMode = FRAME_POOL_ON;
+
+    for (int i = 2; i < argc; i++)
+    {
+        const char *value = NULL;
+        if ((value = option_value(argv[i], "--mode")))
+        {
+            mode = value;
+        }
+        else if ((value = option_value(argv[i], "--format")))
+        {
+            if (frame_sink_parse_format(value, &sinkParams.format) < 0)
+            {
+                logging("ERROR unknown frame format %s", value);
+                return -1;
+            }
+        }
+        else if ((value = option_value(argv[i], "--frames")))
+        {
+            how_many_packets_to_process = atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--output")))
+        {
+            sinkParams.directory = value;
+        }
+        else if ((value = option_value(argv[i], "--threads")))
+        {
+            sinkParams.threads = atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--window")))
+        {
+            bitstreamParams.window_seconds = atof(value);
+            if (bitstreamParams.window_seconds <= 0)
+            {
+                logging("ERROR --window must be a positive number of seconds, got %s", value);
+                return -1;
+            }
+        }
+        else if ((value = option_value(argv[i], "--vbv-bufsize")))
+        {
+            bitstreamParams.vbv_buffer_size = strtoll(value, NULL, 10);
+        }
+        else if ((value = option_value(argv[i], "--vbv-maxrate")))
+        {
+            bitstreamParams.vbv_max_rate = strtoll(value, NULL, 10);
+        }
+        else if ((value = option_value(argv[i], "--report")))
+        {
+            reportPath = value;
+        }
+        else if ((value = option_value(argv[i], "--times")))
+        {
+            grabTimes = value;
+        }
+        else if ((value = option_value(argv[i], "--decoders")))
+        {
+            grabParams.decoders = atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--cache-frames")))
+        {
+            grabParams.max_cached_frames = atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--timeline")))
+        {
+            timelinePath = value;
+        }
+        else if ((value = option_value(argv[i], "--frame-pool")))
+        {
+            if (frame_pool_parse_mode(value, &framePoolMode) < 0)
+            {
+                return -1;
+            }
+        }
+        else if ((value = option_value(argv[i], "--trace")))
+        {
+            trace_start(value);
+            trace_thread_name("probe");
+        }
+        else if ((value = option_value(argv[i], "--log-level")))
+        {
+            LogLevel level;
+            if (log_parse_level(value, &level) < 0)
+            {
+                return -1;
+            }
+            log_set_level(level);
+        }
+        else
+        {
+            logging("ERROR unknown option %s", argv[i]);
+            return -1;
+        }
+    }
+
     logging("Decoding file %s", filename);
     AVFormatContext *pFormatContext = avformat_alloc_context();
     if (!pFormatContext)
@@ -68,7 +193,9 @@ int main(int argc, char *argv[])
 
     const AVCodec *pCodec = NULL;
     AVCodecParameters *pCodecParameters = NULL;
+    int response = 0;
     int video_stream_index = -1;
+    int audio_stream_index = -1;
 
     for (int i = 0; i < pFormatContext->nb_streams; i++)
     {
@@ -103,18 +230,108 @@ int main(int argc, char *argv[])
         }
         else if (pLocalCodecParameters->codec_type == AVMEDIA_TYPE_AUDIO)
         {
+            if (audio_stream_index == -1)
+            {
+                audio_stream_index = i;
+            }
             logging("Audio Codec: %d channels, sample rate %d", pLocalCodecParameters->channels,
                     pLocalCodecParameters->sample_rate);
         }
         logging("Codec %s ID %d bit_rate %lld", pLocalCodec->name, pLocalCodec->id, pLocalCodecParameters->bit_rate);
     }
 
+    if (strcmp(mode, "loudness") == 0)
+    {
+        if (audio_stream_index == -1)
+        {
+            logging("File %s does not contain an audio stream", filename);
+            return -1;
+        }
+        logging("Measuring the loudness of audio stream %d", audio_stream_index);
+        response = probe_loudness(pFormatContext, audio_stream_index, reportPath);
+        avformat_close_input(&pFormatContext);
+        return response;
+    }
+
     if (video_stream_index == -1)
     {
         logging("File %s does not contain a video stream", filename);
         return -1;
     }
 
+    if (strcmp(mode, "bitstream") == 0)
+    {
+        logging("Analyzing the compressed video stream %d", video_stream_index);
+        bitstreamParams.report_path = reportPath;
+        response = probe_bitstream(pFormatContext, video_stream_index, &bitstreamParams);
+        avformat_close_input(&pFormatContext);
+        return response;
+    }
+    else if (strcmp(mode, "grab") == 0)
+    {
+        if (!grabTimes)
+        {
+            logging("ERROR grab mode needs --times");
+            return -1;
+        }
+        avformat_close_input(&pFormatContext);
+
+        grabParams.frame_pool = frame_pool_alloc(framePoolMode);
+        FrameGrabService *pService = frame_grab_open(filename, video_stream_index, &grabParams);
+        sinkParams.prefix = "grab";
+        FrameSink *pSink = pService ? frame_sink_open(&sinkParams) : NULL;
+        if (!pSink)
+        {
+            logging("Failed to start the frame grab service");
+            frame_grab_close(&pService);
+            return -1;
+        }
+
+        std::vector<double> times;
+        int requestCount = 0;
+        response = 0;
+        if (strcmp(grabTimes, "-") == 0)
+        {
+            std::string line;
+            while (std::getline(std::cin, line))
+            {
+                times.clear();
+                parse_times(line.c_str(), times);
+                if (frame_grab_request(pService, times.data(), times.size(), pSink, requestCount) < 0)
+                {
+                    response = -1;
+                }
+                requestCount += times.size();
+            }
+        }
+        else
+        {
+            parse_times(grabTimes, times);
+            response = frame_grab_request(pService, times.data(), times.size(), pSink, requestCount);
+        }
+
+        if (frame_sink_close(&pSink) < 0)
+        {
+            response = -1;
+        }
+        frame_grab_close(&pService);
+        frame_pool_report(grabParams.frame_pool);
+        frame_pool_free(&grabParams.frame_pool);
+        return response;
+    }
+    else if (strcmp(mode, "frames") != 0 && strcmp(mode, "detect") != 0)
+    {
+        logging("ERROR unknown mode %s", mode);
+        return -1;
+    }
+
+    int detect = strcmp(mode, "detect") == 0;
+    if (how_many_packets_to_process < 0)
+    {
+        // the frame dump keeps its historical default, analysis wants the whole file
+        how_many_packets_to_process = detect ? 0 : 8;
+    }
+
     AVCodecContext *pCodecContext = avcodec_alloc_context3(pCodec);
 
     if (!pCodecContext)
@@ -129,6 +346,8 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    FramePool *pFramePool = frame_pool_alloc(framePoolMode);
+    frame_pool_attach(pFramePool, pCodecContext);
     if (avcodec_open2(pCodecContext, pCodec, NULL) < 0)
     {
         logging("Failed to open codec through avcodec_open2");
@@ -149,16 +368,37 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    int response = 0;
-    int how_many_packets_to_process = 8;
+    FrameSink *pSink = NULL;
+    FrameAnalyzer *pAnalyzer = NULL;
+    if (detect)
+    {
+        FrameAnalysisParams analysisParams;
+        frame_analysis_default_params(&analysisParams);
+        pAnalyzer = frame_analyzer_alloc(&analysisParams, pFormatContext->streams[video_stream_index]->time_base);
+    }
+    else
+    {
+        sinkParams.frame_rate = av_guess_frame_rate(pFormatContext, pFormatContext->streams[video_stream_index], NULL);
+        pSink = frame_sink_open(&sinkParams);
+        if (!pSink)
+        {
+            logging("Failed to open the frame sink");
+            return -1;
+        }
+    }
+
     int frame_count = 0;
+    int reached_limit = 0;
 
-    while (av_read_frame(pFormatContext, pPacket) >= 0)
+    int packets_read = 0;
+    int64_t read_start = trace_begin();
+    while (!reached_limit && av_read_frame(pFormatContext, pPacket) >= 0)
     {
+        trace_end("read", read_start, packets_read++);
         if (pPacket->stream_index == video_stream_index)
         {
 
-            response = decode_packet(pPacket, pCodecContext, pFrame);
+            response = decode_packet(pPacket, pCodecContext, pFrame, pSink, pAnalyzer);
             if (response < 0)
             {
                 logging("Failed to decode packet");
@@ -166,42 +406,91 @@ int main(int argc, char *argv[])
             }
             if (response > 0)
             {
-                frame_count++;
-                if (frame_count >= how_many_packets_to_process)
+                frame_count += response;
+                if (how_many_packets_to_process > 0 && frame_count >= how_many_packets_to_process)
                 {
-                    break;
+                    reached_limit = 1;
                 }
             }
         }
         av_packet_unref(pPacket);
+        read_start = trace_begin();
+    }
+
+    if (!reached_limit)
+    {
+        // drain the frames still held by the decoder
+        response = decode_packet(NULL, pCodecContext, pFrame, pSink, pAnalyzer);
+        if (response > 0)
+        {
+            frame_count += response;
+        }
     }
 
     logging("Demux succeeded. %d frames decoded", frame_count);
 
+    if (pSink && frame_sink_close(&pSink) < 0)
+    {
+        logging("Failed to write some of the frames");
+    }
+    trace_stop();
+
+    if (pAnalyzer)
+    {
+        frame_analyzer_finish(pAnalyzer);
+        response = frame_analyzer_write_timeline(pAnalyzer, timelinePath);
+        frame_analyzer_free(&pAnalyzer);
+        if (response < 0)
+        {
+            return -1;
+        }
+    }
+
     logging("Releasing resources");
     avformat_close_input(&pFormatContext);
     av_packet_free(&pPacket);
     av_frame_free(&pFrame);
     avcodec_free_context(&pCodecContext);
+    frame_pool_report(pFramePool);
+    frame_pool_free(&pFramePool);
 
     return 0;
 }
 
-static void logging(const char *fmt, ...)
+static const char *option_value(const char *arg, const char *name)
+{
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=')
+    {
+        return arg + length + 1;
+    }
+    return NULL;
+}
+
+static void parse_times(const char *list, std::vector<double> &times)
 {
-    va_list args;
-    va_start(args, fmt);
-    std::cerr << "[LOG] ";
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    std::cerr << std::endl;
-    return;
+    const char *cursor = list;
+    while (*cursor)
+    {
+        char *end = NULL;
+        double time = strtod(cursor, &end);
+        if (end == cursor)
+        {
+            cursor++;
+            continue;
+        }
+        times.push_back(time);
+        cursor = end;
+    }
 }
 
-static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame)
+static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame, FrameSink *pSink,
+                         FrameAnalyzer *pAnalyzer)
 {
+    int64_t start = trace_begin();
     int response = avcodec_send_packet(pCodecContext, pPacket);
-    char *frame_path = "frame";
+    trace_end("decode", start, pCodecContext->frame_number);
+    int frames = 0;
 
     if (response < 0)
     {
@@ -211,7 +500,9 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFra
 
     while (response >= 0)
     {
+        start = trace_begin();
         response = avcodec_receive_frame(pCodecContext, pFrame);
+        trace_end("decode", start, pCodecContext->frame_number);
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
         {
             break;
@@ -224,38 +515,22 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFra
 
         if (response >= 0)
         {
-            logging("Frame %d (type=%c, size=%d bytes, format=%d) pts %d key_frame %d "
+            log_debug("Frame %d (type=%c, size=%d bytes, format=%d) pts %d key_frame %d "
                     "[DTS %d]",
                     pCodecContext->frame_number, av_get_picture_type_char(pFrame->pict_type), pFrame->pkt_size,
                     pFrame->format, pFrame->pts, pFrame->key_frame, pFrame->coded_picture_number);
 
-            char frame_filename[1024];
-            snprintf(frame_filename, sizeof(frame_filename), "%s/%s-%d.png", frame_path, "frame",
-                     pCodecContext->frame_number);
-
-            if (pFrame->format != AV_PIX_FMT_YUV420P)
+            if (pSink && frame_sink_push(pSink, pFrame, pCodecContext->frame_number) < 0)
+            {
+                return -1;
+            }
+            if (pAnalyzer && frame_analyzer_push(pAnalyzer, pFrame) < 0)
             {
-                logging("Warning: the generated file may not be a grayscale image, but "
-                        "could e.g. be just the R "
-                        "component if the video format is RGB");
+                return -1;
             }
-
-            save_gray_frame(pFrame->data[0], pFrame->linesize[0], pFrame->width, pFrame->height, frame_filename);
+            frames++;
         }
     }
-    return 0;
+    return frames;
 }
 
-static void save_gray_frame(unsigned char *buf, int wrap, int xsize, int ysize, char *filename)
-{
-    FILE *f;
-    int i;
-    f = fopen(filename, "w");
-    fprintf(f, "P5\n%d %d\n%d\n", xsize, ysize, 255);
-    for (i = 0; i < ysize; i++)
-    {
-        fwrite(buf + i * wrap, 1, xsize, f);
-    }
-    fclose(f);
-    return;
-}
\ No newline at end of file
@@ -0,0 +1,162 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "mem_output.h"
+#include "remux_job.h"
+
+static int discard_bytes(void *opaque, const uint8_t *, int size)
+{
+    *(int64_t *)opaque += size;
+    return 0;
+}
+
+static int mux_once(const AVFormatContext *input, const std::vector<AVPacket *> &packets, const char *out_filename,
+                    int fragmented, MemOutput *mem)
+{
+    AVFormatContext *output = NULL;
+    AVPacket *packet = av_packet_alloc();
+    int ret = 0;
+
+    do
+    {
+        avformat_alloc_output_context2(&output, NULL, NULL, out_filename);
+        if (!output || !packet)
+        {
+            std::cerr << "Could not create output context" << std::endl;
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        for (unsigned int i = 0; i < input->nb_streams && ret >= 0; i++)
+        {
+            AVStream *out_stream = avformat_new_stream(output, NULL);
+            ret = out_stream ? avcodec_parameters_copy(out_stream->codecpar, input->streams[i]->codecpar)
+                             : AVERROR(ENOMEM);
+            if (out_stream)
+            {
+                out_stream->codecpar->codec_tag = 0;
+                out_stream->time_base = input->streams[i]->time_base;
+            }
+        }
+        if (ret < 0 || (ret = mem_output_attach(mem, output)) < 0)
+            break;
+
+        AVDictionary *options = NULL;
+        if (fragmented)
+            av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        ret = avformat_write_header(output, &options);
+        av_dict_free(&options);
+        if (ret < 0)
+        {
+            std::cerr << "Error occurred when opening output file" << std::endl;
+            break;
+        }
+
+        for (const AVPacket *source : packets)
+        {
+            AVRational in_time_base = input->streams[source->stream_index]->time_base;
+            AVRational out_time_base = output->streams[source->stream_index]->time_base;
+            if ((ret = av_packet_ref(packet, source)) < 0)
+                break;
+            av_packet_rescale_ts(packet, in_time_base, out_time_base);
+            if ((ret = av_interleaved_write_frame(output, packet)) < 0)
+            {
+                std::cerr << "Error mux packet" << std::endl;
+                break;
+            }
+        }
+        int trailer_ret = av_write_trailer(output);
+        if (ret >= 0)
+            ret = trailer_ret;
+    } while (0);
+
+    if (output)
+        mem_output_detach(mem);
+    avformat_free_context(output);
+    av_packet_free(&packet);
+    return ret;
+}
+
+int remux_bench_mux(const char *in_filename, const char *out_filename, int fragmented, int iterations,
+                    int callback_sink)
+{
+    AVFormatContext *input = NULL;
+    std::vector<AVPacket *> packets;
+    int64_t discarded = 0;
+    MemOutput *mem = NULL;
+    int ret;
+
+    do
+    {
+        if ((ret = avformat_open_input(&input, in_filename, NULL, NULL)) < 0)
+        {
+            std::cerr << "Could not open input file '" << in_filename << "'" << std::endl;
+            break;
+        }
+        if ((ret = avformat_find_stream_info(input, NULL)) < 0)
+        {
+            std::cerr << "Failed to retrieve input stream information" << std::endl;
+            break;
+        }
+
+        // demux once up front, the timed loop only muxes packets that are already in memory
+        AVPacket *packet = av_packet_alloc();
+        while (packet && (ret = av_read_frame(input, packet)) >= 0)
+        {
+            packet->pos = -1;
+            packets.push_back(packet);
+            packet = av_packet_alloc();
+        }
+        av_packet_free(&packet);
+        if (ret != AVERROR_EOF)
+        {
+            std::cerr << "Failed to read '" << in_filename << "'" << std::endl;
+            break;
+        }
+
+        mem = callback_sink ? mem_output_alloc_callback(discard_bytes, &discarded) : mem_output_alloc(0);
+        if (!mem)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+
+        // the first run grows the arena, later runs reuse it
+        if ((ret = mux_once(input, packets, out_filename, fragmented, mem)) < 0)
+            break;
+
+        double total = 0, best = 0;
+        int64_t bytes = callback_sink ? discarded : mem_output_size(mem);
+        for (int i = 0; i < iterations; i++)
+        {
+            mem_output_reset(mem);
+            auto start = std::chrono::steady_clock::now();
+            if ((ret = mux_once(input, packets, out_filename, fragmented, mem)) < 0)
+                break;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            total += seconds;
+            best = i == 0 ? seconds : FFMIN(best, seconds);
+        }
+        if (ret < 0 || iterations <= 0)
+            break;
+
+        double mean = total / iterations;
+        std::cout << std::fixed << std::setprecision(3) << iterations << " runs, " << packets.size() << " packets, "
+                  << bytes << " bytes per run to " << (callback_sink ? "callback" : "arena") << std::endl;
+        std::cout << "mean " << mean * 1000 << " ms, best " << best * 1000 << " ms, "
+                  << (mean > 0 ? packets.size() / mean : 0.0) << " packets/s, "
+                  << (mean > 0 ? bytes / mean / (1 << 20) : 0.0) << " MB/s" << std::endl;
+    } while (0);
+
+    for (AVPacket *packet : packets)
+        av_packet_free(&packet);
+    mem_output_free(&mem);
+    avformat_close_input(&input);
+    return ret < 0 && ret != AVERROR_EOF ? -1 : 0;
+}
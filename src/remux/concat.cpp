@@ -0,0 +1,318 @@
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "remux_job.h"
+
+typedef struct ConcatInput
+{
+    AVFormatContext *format_context;
+    std::vector<int> streams;
+    int ret;
+} ConcatInput;
+
+static ConcatInput open_concat_input(const char *filename)
+{
+    ConcatInput input = {NULL, {}, 0};
+    if ((input.ret = avformat_open_input(&input.format_context, filename, NULL, NULL)) < 0)
+    {
+        std::cerr << "Could not open input file '" << filename << "'" << std::endl;
+        return input;
+    }
+    if ((input.ret = avformat_find_stream_info(input.format_context, NULL)) < 0)
+    {
+        std::cerr << "Failed to retrieve input stream information for '" << filename << "'" << std::endl;
+        return input;
+    }
+
+    for (unsigned int i = 0; i < input.format_context->nb_streams; i++)
+    {
+        AVStream *stream = input.format_context->streams[i];
+        enum AVMediaType type = stream->codecpar->codec_type;
+        if (type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_SUBTITLE)
+            input.streams.push_back(i);
+        else
+            stream->discard = AVDISCARD_ALL;
+    }
+    return input;
+}
+
+// the output carries one sample description per stream, so every input must produce identical ones
+static int compatible(const AVCodecParameters *a, const AVCodecParameters *b, const char **reason)
+{
+    *reason = NULL;
+    if (a->codec_type != b->codec_type || a->codec_id != b->codec_id)
+        *reason = "codec";
+    else if (a->codec_type == AVMEDIA_TYPE_VIDEO &&
+             (a->width != b->width || a->height != b->height || a->format != b->format))
+        *reason = "video size or pixel format";
+    else if (a->codec_type == AVMEDIA_TYPE_AUDIO &&
+             (a->sample_rate != b->sample_rate || a->channels != b->channels || a->format != b->format))
+        *reason = "audio sample rate, channels or sample format";
+    else if (a->profile != b->profile || a->level != b->level)
+        *reason = "profile or level";
+    else if (a->extradata_size != b->extradata_size ||
+             (a->extradata_size && memcmp(a->extradata, b->extradata, a->extradata_size)))
+        *reason = "parameter sets";
+    return *reason == NULL;
+}
+
+static int check_inputs(const char **in_filenames, int count, std::vector<AVCodecParameters *> &reference)
+{
+    for (int n = 0; n < count; n++)
+    {
+        ConcatInput input = open_concat_input(in_filenames[n]);
+        int ret = input.ret;
+        if (ret >= 0 && n == 0)
+        {
+            for (int index : input.streams)
+            {
+                AVCodecParameters *par = avcodec_parameters_alloc();
+                if (!par || avcodec_parameters_copy(par, input.format_context->streams[index]->codecpar) < 0)
+                {
+                    avcodec_parameters_free(&par);
+                    ret = AVERROR(ENOMEM);
+                    break;
+                }
+                reference.push_back(par);
+            }
+        }
+        else if (ret >= 0)
+        {
+            if (input.streams.size() != reference.size())
+            {
+                std::cerr << "'" << in_filenames[n] << "' has " << input.streams.size() << " streams, expected "
+                          << reference.size() << std::endl;
+                ret = AVERROR(EINVAL);
+            }
+            for (size_t i = 0; ret >= 0 && i < reference.size(); i++)
+            {
+                const char *reason;
+                if (!compatible(reference[i], input.format_context->streams[input.streams[i]]->codecpar, &reason))
+                {
+                    std::cerr << "'" << in_filenames[n] << "' stream " << i << " differs from '" << in_filenames[0]
+                              << "' in " << reason << std::endl;
+                    ret = AVERROR(EINVAL);
+                }
+            }
+        }
+        avformat_close_input(&input.format_context);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int remux_concat(const char **in_filenames, int count, const char *out_filename, int fragmented, RemuxStats *stats)
+{
+    AVFormatContext *output_format_context = NULL;
+    std::vector<AVCodecParameters *> reference;
+    std::vector<int64_t> last_dts;
+    ConcatInput current = {NULL, {}, 0};
+    std::future<ConcatInput> next;
+    AVPacket packet;
+    int ret, n;
+    // where the next input starts on the output timeline, in AV_TIME_BASE
+    int64_t segment_start = 0, segment_end = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    memset(stats, 0, sizeof(*stats));
+
+    do
+    {
+        if (count < 1)
+        {
+            std::cerr << "Nothing to concatenate" << std::endl;
+            ret = AVERROR(EINVAL);
+            break;
+        }
+
+        if ((ret = check_inputs(in_filenames, count, reference)) < 0)
+        {
+            break;
+        }
+
+        avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename);
+        if (!output_format_context)
+        {
+            std::cerr << "Could not create output context" << std::endl;
+            ret = AVERROR_UNKNOWN;
+            break;
+        }
+
+        for (AVCodecParameters *par : reference)
+        {
+            AVStream *out_stream = avformat_new_stream(output_format_context, NULL);
+            if (!out_stream)
+            {
+                std::cerr << "Failed allocating output stream" << std::endl;
+                ret = AVERROR_UNKNOWN;
+                break;
+            }
+
+            ret = avcodec_parameters_copy(out_stream->codecpar, par);
+            if (ret < 0)
+            {
+                std::cerr << "Failed to copy codec parameters" << std::endl;
+                break;
+            }
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+        last_dts.assign(reference.size(), AV_NOPTS_VALUE);
+
+        av_dump_format(output_format_context, 0, out_filename, 1);
+
+        if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+        {
+            ret = avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE);
+            if (ret < 0)
+            {
+                std::cerr << "Could not open output file '" << out_filename << "'" << std::endl;
+                break;
+            }
+        }
+
+        AVDictionary *options = NULL;
+        if (fragmented)
+        {
+            av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+
+        ret = avformat_write_header(output_format_context, &options);
+        av_dict_free(&options);
+        if (ret < 0)
+        {
+            std::cerr << "Error occurred when opening output file" << std::endl;
+            break;
+        }
+
+        next = std::async(std::launch::async, open_concat_input, in_filenames[0]);
+        for (n = 0; n < count && ret >= 0; n++)
+        {
+            current = next.get();
+            if ((ret = current.ret) < 0)
+            {
+                break;
+            }
+            // open and probe the following input while this one is copied
+            if (n + 1 < count)
+            {
+                next = std::async(std::launch::async, open_concat_input, in_filenames[n + 1]);
+            }
+
+            AVFormatContext *input_format_context = current.format_context;
+            int64_t input_start =
+                input_format_context->start_time != AV_NOPTS_VALUE ? input_format_context->start_time : 0;
+            std::vector<int> streams_list(input_format_context->nb_streams, -1);
+            for (size_t i = 0; i < current.streams.size(); i++)
+            {
+                streams_list[current.streams[i]] = i;
+            }
+
+            while (true)
+            {
+                AVStream *in_stream, *out_stream;
+
+                ret = av_read_frame(input_format_context, &packet);
+                if (ret < 0)
+                {
+                    break;
+                }
+
+                if (packet.stream_index >= (int)streams_list.size() || streams_list[packet.stream_index] < 0)
+                {
+                    av_packet_unref(&packet);
+                    continue;
+                }
+
+                in_stream = input_format_context->streams[packet.stream_index];
+                packet.stream_index = streams_list[packet.stream_index];
+                out_stream = output_format_context->streams[packet.stream_index];
+
+                int64_t offset = av_rescale_q(segment_start - input_start, AV_TIME_BASE_Q, in_stream->time_base);
+                if (packet.pts != AV_NOPTS_VALUE)
+                    packet.pts += offset;
+                if (packet.dts != AV_NOPTS_VALUE)
+                    packet.dts += offset;
+
+                packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base,
+                                              AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+                packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base,
+                                              AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+                packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
+                packet.pos = -1;
+
+                // rounding at the seam can repeat a dts, the muxer needs it strictly increasing
+                int64_t &previous = last_dts[packet.stream_index];
+                if (packet.dts != AV_NOPTS_VALUE)
+                {
+                    if (previous != AV_NOPTS_VALUE && packet.dts <= previous)
+                    {
+                        int64_t shift = previous + 1 - packet.dts;
+                        packet.dts += shift;
+                        if (packet.pts != AV_NOPTS_VALUE && packet.pts < packet.dts)
+                            packet.pts = packet.dts;
+                    }
+                    previous = packet.dts;
+                }
+
+                int64_t packet_time = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+                if (packet_time != AV_NOPTS_VALUE)
+                {
+                    segment_end = FFMAX(segment_end, av_rescale_q(packet_time + packet.duration,
+                                                                  out_stream->time_base, AV_TIME_BASE_Q));
+                }
+
+                ret = av_interleaved_write_frame(output_format_context, &packet);
+                if (ret < 0)
+                {
+                    std::cerr << "Error mux packet" << std::endl;
+                    break;
+                }
+                av_packet_unref(&packet);
+                stats->packets++;
+            }
+
+            if (ret == AVERROR_EOF)
+            {
+                ret = 0;
+            }
+            stats->bytes_read += avio_size(input_format_context->pb);
+            avformat_close_input(&current.format_context);
+            segment_start = segment_end;
+        }
+        av_write_trailer(output_format_context);
+    } while (0);
+
+    if (next.valid())
+    {
+        current = next.get();
+    }
+    avformat_close_input(&current.format_context);
+    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
+    {
+        if (output_format_context->pb)
+            stats->bytes_written = avio_tell(output_format_context->pb);
+        avio_closep(&output_format_context->pb);
+    }
+    avformat_free_context(output_format_context);
+    for (AVCodecParameters *par : reference)
+    {
+        avcodec_parameters_free(&par);
+    }
+
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats->result = ret < 0 ? ret : 0;
+    return stats->result < 0 ? -1 : 0;
+}
@@ -0,0 +1,587 @@
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "live_remux.h"
+
+// consecutive read errors tolerated before the input is reopened
+#define LIVE_MAX_READ_ERRORS 64
+// a timestamp jump larger than this is a discontinuity rather than jitter
+#define LIVE_DISCONTINUITY_US (5 * AV_TIME_BASE)
+#define LIVE_PROBE_SIZE (1 << 20)
+#define LIVE_ANALYZE_US (2 * AV_TIME_BASE)
+#define LIVE_STATS_SECONDS 10
+
+static volatile sig_atomic_t live_stop = 0;
+
+static void live_signal(int)
+{
+    live_stop = 1;
+}
+
+static int live_interrupt(void *)
+{
+    return live_stop;
+}
+
+typedef struct LiveStream
+{
+    int out_index;
+    AVCodecParameters *par;
+    // 33-bit wraps seen so far, in the input time base
+    int64_t wrap_offset;
+    int64_t last_raw_dts;
+    // input to output timeline shift and the dts the next packet should land on, in AV_TIME_BASE
+    int64_t offset;
+    int64_t next_dts;
+    int64_t last_out_dts;
+} LiveStream;
+
+typedef struct LiveSegment
+{
+    int period;
+    int64_t sequence;
+    double duration;
+    std::string filename;
+} LiveSegment;
+
+typedef struct LiveSession
+{
+    const LiveParams *params;
+    AVFormatContext *output;
+    std::vector<LiveStream> streams;
+    int video_out_index;
+    int period;
+    int64_t sequence;
+    int64_t segment_start;
+    // input dts that became zero on the output timeline
+    int64_t origin;
+    std::deque<LiveSegment> segments;
+    int64_t packets;
+    int64_t corrupt;
+    int64_t read_errors;
+    int64_t discontinuities;
+    int64_t wraps;
+    int64_t reopens;
+} LiveSession;
+
+static std::string live_path(const LiveSession *session, const std::string &name)
+{
+    return std::string(session->params->output_dir) + "/" + name;
+}
+
+static std::string init_name(int period)
+{
+    return "init-" + std::to_string(period) + ".mp4";
+}
+
+static std::string segment_name(int period, int64_t sequence)
+{
+    return "seg-" + std::to_string(period) + "-" + std::to_string(sequence) + ".m4s";
+}
+
+static void write_playlist(LiveSession *session, int ended)
+{
+    double target = session->params->segment_seconds;
+    for (const LiveSegment &segment : session->segments)
+        target = FFMAX(target, segment.duration);
+
+    std::string path = live_path(session, "live.m3u8");
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream playlist(temporary);
+        playlist << "#EXTM3U\n#EXT-X-VERSION:7\n";
+        playlist << "#EXT-X-TARGETDURATION:" << (int)(target + 0.999) << "\n";
+        if (!session->segments.empty())
+        {
+            playlist << "#EXT-X-MEDIA-SEQUENCE:" << session->segments.front().sequence << "\n";
+            playlist << "#EXT-X-DISCONTINUITY-SEQUENCE:" << session->segments.front().period << "\n";
+        }
+        int period = -1;
+        playlist << std::fixed << std::setprecision(3);
+        for (const LiveSegment &segment : session->segments)
+        {
+            if (segment.period != period)
+            {
+                if (period >= 0)
+                    playlist << "#EXT-X-DISCONTINUITY\n";
+                playlist << "#EXT-X-MAP:URI=\"" << init_name(segment.period) << "\"\n";
+                period = segment.period;
+            }
+            playlist << "#EXTINF:" << segment.duration << ",\n" << segment.filename << "\n";
+        }
+        if (ended)
+            playlist << "#EXT-X-ENDLIST\n";
+    }
+    // players never see a half written playlist
+    rename(temporary.c_str(), path.c_str());
+}
+
+static void retire_segments(LiveSession *session)
+{
+    while ((int)session->segments.size() > session->params->keep_segments)
+    {
+        LiveSegment oldest = session->segments.front();
+        session->segments.pop_front();
+        unlink(live_path(session, oldest.filename).c_str());
+        if (session->segments.empty() || session->segments.front().period != oldest.period)
+            unlink(live_path(session, init_name(oldest.period)).c_str());
+    }
+}
+
+static int open_segment(LiveSession *session)
+{
+    std::string path = live_path(session, segment_name(session->period, session->sequence));
+    int ret = avio_open(&session->output->pb, path.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0)
+        std::cerr << "Could not open segment '" << path << "'" << std::endl;
+    return ret;
+}
+
+// ends the running fragment and hands the segment to the playlist
+static int close_segment(LiveSession *session, int64_t end, int ended)
+{
+    AVFormatContext *output = session->output;
+    av_interleaved_write_frame(output, NULL);
+    av_write_frame(output, NULL);
+    avio_closep(&output->pb);
+    if (session->segment_start == AV_NOPTS_VALUE)
+    {
+        // nothing reached this segment, reuse its sequence number
+        unlink(live_path(session, segment_name(session->period, session->sequence)).c_str());
+        if (ended)
+            write_playlist(session, ended);
+        return 0;
+    }
+
+    LiveSegment segment;
+    segment.period = session->period;
+    segment.sequence = session->sequence++;
+    segment.duration = session->segment_start != AV_NOPTS_VALUE && end != AV_NOPTS_VALUE
+                           ? (end - session->segment_start) / (double)AV_TIME_BASE
+                           : session->params->segment_seconds;
+    segment.filename = segment_name(segment.period, segment.sequence);
+    session->segments.push_back(segment);
+    session->segment_start = end;
+
+    retire_segments(session);
+    write_playlist(session, ended);
+    return 0;
+}
+
+static void end_period(LiveSession *session, int ended)
+{
+    if (!session->output)
+        return;
+
+    int64_t end = AV_NOPTS_VALUE;
+    for (const LiveStream &stream : session->streams)
+    {
+        if (stream.out_index >= 0 && stream.next_dts != AV_NOPTS_VALUE)
+            end = end == AV_NOPTS_VALUE ? stream.next_dts : FFMAX(end, stream.next_dts);
+    }
+    close_segment(session, end, ended);
+    // frag_custom output has no trailer worth writing, freeing the context deinitializes the muxer
+    avformat_free_context(session->output);
+    session->output = NULL;
+    session->period++;
+}
+
+static int start_period(LiveSession *session)
+{
+    std::string init_path = live_path(session, init_name(session->period));
+    AVFormatContext *output = NULL;
+    int ret = avformat_alloc_output_context2(&output, NULL, "mp4", init_path.c_str());
+    if (!output)
+    {
+        std::cerr << "Could not create output context" << std::endl;
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+    // keeps the muxer's interleaving queue short when a stream goes quiet
+    output->max_interleave_delta = AV_TIME_BASE;
+    output->avoid_negative_ts = AVFMT_AVOID_NEG_TS_MAKE_NON_NEGATIVE;
+
+    session->video_out_index = -1;
+    for (LiveStream &stream : session->streams)
+    {
+        if (stream.out_index < 0)
+            continue;
+        AVStream *out_stream = avformat_new_stream(output, NULL);
+        if (!out_stream || (ret = avcodec_parameters_copy(out_stream->codecpar, stream.par)) < 0)
+        {
+            std::cerr << "Failed allocating output stream" << std::endl;
+            avformat_free_context(output);
+            return AVERROR_UNKNOWN;
+        }
+        out_stream->codecpar->codec_tag = 0;
+        stream.out_index = out_stream->index;
+        stream.last_out_dts = AV_NOPTS_VALUE;
+        if (stream.par->codec_type == AVMEDIA_TYPE_VIDEO && session->video_out_index < 0)
+            session->video_out_index = out_stream->index;
+    }
+
+    if ((ret = avio_open(&output->pb, init_path.c_str(), AVIO_FLAG_WRITE)) < 0)
+    {
+        std::cerr << "Could not open output file '" << init_path << "'" << std::endl;
+        avformat_free_context(output);
+        return ret;
+    }
+
+    AVDictionary *options = NULL;
+    av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    ret = avformat_write_header(output, &options);
+    av_dict_free(&options);
+    avio_closep(&output->pb);
+    if (ret < 0)
+    {
+        std::cerr << "Error occurred when writing '" << init_path << "'" << std::endl;
+        avformat_free_context(output);
+        return ret;
+    }
+
+    session->output = output;
+    session->segment_start = AV_NOPTS_VALUE;
+    return open_segment(session);
+}
+
+static int open_live_input(const LiveParams *params, AVFormatContext **input)
+{
+    AVDictionary *options = NULL;
+    if (!strncmp(params->input, "udp://", 6))
+    {
+        // a bounded receive FIFO that drops on overrun instead of failing the read
+        av_dict_set(&options, "fifo_size", "50000", 0);
+        av_dict_set(&options, "overrun_nonfatal", "1", 0);
+        av_dict_set(&options, "buffer_size", "4194304", 0);
+        av_dict_set(&options, "timeout", "5000000", 0);
+    }
+
+    *input = avformat_alloc_context();
+    if (!*input)
+        return AVERROR(ENOMEM);
+    (*input)->interrupt_callback.callback = live_interrupt;
+    (*input)->probesize = LIVE_PROBE_SIZE;
+    (*input)->max_analyze_duration = LIVE_ANALYZE_US;
+
+    int ret = avformat_open_input(input, params->input, av_find_input_format("mpegts"), &options);
+    av_dict_free(&options);
+    if (ret < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(*input, NULL)) < 0)
+        avformat_close_input(input);
+    return ret;
+}
+
+static int same_parameters(const AVCodecParameters *a, const AVCodecParameters *b)
+{
+    return a->codec_type == b->codec_type && a->codec_id == b->codec_id && a->width == b->width &&
+           a->height == b->height && a->sample_rate == b->sample_rate && a->channels == b->channels &&
+           a->extradata_size == b->extradata_size &&
+           (!a->extradata_size || !memcmp(a->extradata, b->extradata, a->extradata_size));
+}
+
+static void free_streams(std::vector<LiveStream> &streams)
+{
+    for (LiveStream &stream : streams)
+        avcodec_parameters_free(&stream.par);
+    streams.clear();
+}
+
+// maps the input's audio and video streams, returns 1 when they differ from the running period
+static int map_streams(LiveSession *session, AVFormatContext *input)
+{
+    std::vector<LiveStream> streams(input->nb_streams);
+    int changed = session->streams.size() != input->nb_streams;
+    for (unsigned int i = 0; i < input->nb_streams; i++)
+    {
+        AVStream *in_stream = input->streams[i];
+        enum AVMediaType type = in_stream->codecpar->codec_type;
+        LiveStream &stream = streams[i];
+        stream.out_index = -1;
+        stream.par = avcodec_parameters_alloc();
+        if (!stream.par)
+            type = AVMEDIA_TYPE_UNKNOWN;
+        stream.wrap_offset = 0;
+        stream.last_raw_dts = AV_NOPTS_VALUE;
+        stream.offset = 0;
+        stream.next_dts = AV_NOPTS_VALUE;
+        stream.last_out_dts = AV_NOPTS_VALUE;
+        if (stream.par)
+            avcodec_parameters_copy(stream.par, in_stream->codecpar);
+
+        if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+        {
+            in_stream->discard = AVDISCARD_ALL;
+        }
+        else
+        {
+            stream.out_index = 0;
+        }
+
+        if (!changed)
+        {
+            const LiveStream &previous = session->streams[i];
+            changed = (previous.out_index < 0) != (stream.out_index < 0) ||
+                      (stream.out_index >= 0 && !same_parameters(previous.par, stream.par));
+            if (!changed)
+            {
+                // the same layout keeps its output streams and timelines across the reopen
+                stream.out_index = previous.out_index;
+                stream.offset = previous.offset;
+                stream.next_dts = previous.next_dts;
+                stream.last_out_dts = previous.last_out_dts;
+            }
+        }
+    }
+
+    if (changed && !session->streams.empty())
+    {
+        // a new period restarts each stream right after where the old one ended
+        int64_t end = 0;
+        for (const LiveStream &stream : session->streams)
+        {
+            if (stream.next_dts != AV_NOPTS_VALUE)
+                end = FFMAX(end, stream.next_dts);
+        }
+        for (LiveStream &stream : streams)
+            stream.next_dts = end;
+    }
+    free_streams(session->streams);
+    session->streams = streams;
+    return changed;
+}
+
+// unwraps, splices discontinuities and returns the packet's dts on the output timeline in AV_TIME_BASE
+static int64_t stitch_timestamps(LiveSession *session, LiveStream *stream, AVStream *in_stream, AVPacket *packet)
+{
+    if (packet->dts == AV_NOPTS_VALUE)
+        packet->dts = packet->pts;
+    if (packet->pts == AV_NOPTS_VALUE)
+        packet->pts = packet->dts;
+    if (packet->dts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+
+    int wrap_bits = in_stream->pts_wrap_bits > 0 && in_stream->pts_wrap_bits < 63 ? in_stream->pts_wrap_bits : 33;
+    int64_t wrap = (int64_t)1 << wrap_bits;
+    if (stream->last_raw_dts != AV_NOPTS_VALUE && packet->dts < stream->last_raw_dts - wrap / 2)
+    {
+        stream->wrap_offset += wrap;
+        session->wraps++;
+    }
+    stream->last_raw_dts = packet->dts;
+
+    int64_t dts = av_rescale_q(packet->dts + stream->wrap_offset, in_stream->time_base, AV_TIME_BASE_Q);
+    int64_t pts_delay = av_rescale_q(packet->pts - packet->dts, in_stream->time_base, AV_TIME_BASE_Q);
+    int64_t out_dts = dts + stream->offset;
+    if (stream->next_dts == AV_NOPTS_VALUE)
+    {
+        // the first packet of a session starts the shared timeline at zero
+        if (session->origin == AV_NOPTS_VALUE)
+            session->origin = dts;
+        stream->offset = -session->origin;
+        out_dts = dts + stream->offset;
+    }
+    else if (FFABS(out_dts - stream->next_dts) > LIVE_DISCONTINUITY_US)
+    {
+        stream->offset += stream->next_dts - out_dts;
+        out_dts = stream->next_dts;
+        session->discontinuities++;
+    }
+
+    int64_t duration = av_rescale_q(packet->duration, in_stream->time_base, AV_TIME_BASE_Q);
+    stream->next_dts = out_dts + FFMAX(duration, (int64_t)1);
+    packet->dts = out_dts;
+    packet->pts = out_dts + FFMAX(pts_delay, (int64_t)0);
+    return out_dts;
+}
+
+static int write_live_packet(LiveSession *session, LiveStream *stream, AVPacket *packet, int64_t out_dts)
+{
+    AVFormatContext *output = session->output;
+    int key = packet->flags & AV_PKT_FLAG_KEY;
+    int boundary_stream = session->video_out_index >= 0 ? stream->out_index == session->video_out_index : 1;
+
+    if (session->segment_start == AV_NOPTS_VALUE)
+    {
+        session->segment_start = out_dts;
+    }
+    else if (boundary_stream && key &&
+             out_dts - session->segment_start >= (int64_t)(session->params->segment_seconds * AV_TIME_BASE))
+    {
+        close_segment(session, out_dts, 0);
+        int ret = open_segment(session);
+        if (ret < 0)
+            return ret;
+    }
+
+    AVStream *out_stream = output->streams[stream->out_index];
+    AVRational in_tb = AV_TIME_BASE_Q;
+    packet->stream_index = stream->out_index;
+    packet->pts = av_rescale_q_rnd(packet->pts, in_tb, out_stream->time_base,
+                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    packet->dts = av_rescale_q_rnd(packet->dts, in_tb, out_stream->time_base,
+                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+    if (stream->last_out_dts != AV_NOPTS_VALUE && packet->dts <= stream->last_out_dts)
+    {
+        packet->dts = stream->last_out_dts + 1;
+        packet->pts = FFMAX(packet->pts, packet->dts);
+    }
+    stream->last_out_dts = packet->dts;
+    packet->pos = -1;
+
+    int ret = av_interleaved_write_frame(output, packet);
+    if (ret < 0)
+        std::cerr << "Error mux packet" << std::endl;
+    return ret;
+}
+
+static void log_stats(const LiveSession *session)
+{
+    std::cout << "live: " << session->packets << " packets, " << session->sequence << " segments, "
+              << session->corrupt << " corrupt, " << session->read_errors << " read errors, "
+              << session->discontinuities << " discontinuities, " << session->wraps << " wraps, "
+              << session->reopens << " reopens" << std::endl;
+}
+
+void live_default_params(LiveParams *params)
+{
+    params->input = NULL;
+    params->output_dir = ".";
+    params->segment_seconds = 2;
+    params->keep_segments = 6;
+}
+
+int live_remux(const LiveParams *params)
+{
+    LiveSession session;
+    session.params = params;
+    session.output = NULL;
+    session.video_out_index = -1;
+    session.period = 0;
+    session.sequence = 0;
+    session.segment_start = AV_NOPTS_VALUE;
+    session.origin = AV_NOPTS_VALUE;
+    session.packets = session.corrupt = session.read_errors = 0;
+    session.discontinuities = session.wraps = session.reopens = 0;
+
+    struct sigaction action = {};
+    action.sa_handler = live_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet)
+        return -1;
+
+    auto last_stats = std::chrono::steady_clock::now();
+    int ret = 0;
+    while (!live_stop)
+    {
+        AVFormatContext *input = NULL;
+        if ((ret = open_live_input(params, &input)) < 0)
+        {
+            if (live_stop)
+                break;
+            std::cerr << "Could not open live input '" << params->input << "', retrying" << std::endl;
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+
+        if (map_streams(&session, input))
+        {
+            end_period(&session, 0);
+            ret = start_period(&session);
+        }
+        if (ret < 0)
+        {
+            avformat_close_input(&input);
+            break;
+        }
+
+        int read_errors = 0;
+        while (!live_stop)
+        {
+            ret = av_read_frame(input, packet);
+            if (ret == AVERROR(EAGAIN))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+            if (ret == AVERROR_EOF || ret == AVERROR_EXIT)
+                break;
+            if (ret < 0)
+            {
+                session.read_errors++;
+                if (++read_errors > LIVE_MAX_READ_ERRORS)
+                    break;
+                continue;
+            }
+            read_errors = 0;
+
+            if (packet->stream_index >= (int)session.streams.size() ||
+                session.streams[packet->stream_index].out_index < 0)
+            {
+                av_packet_unref(packet);
+                continue;
+            }
+            if (packet->flags & AV_PKT_FLAG_CORRUPT)
+            {
+                session.corrupt++;
+                av_packet_unref(packet);
+                continue;
+            }
+
+            LiveStream *stream = &session.streams[packet->stream_index];
+            int64_t out_dts = stitch_timestamps(&session, stream, input->streams[packet->stream_index], packet);
+            if (out_dts == AV_NOPTS_VALUE)
+            {
+                session.corrupt++;
+                av_packet_unref(packet);
+                continue;
+            }
+
+            ret = write_live_packet(&session, stream, packet, out_dts);
+            av_packet_unref(packet);
+            if (ret < 0)
+                break;
+            session.packets++;
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_stats >= std::chrono::seconds(LIVE_STATS_SECONDS))
+            {
+                log_stats(&session);
+                last_stats = now;
+            }
+        }
+        avformat_close_input(&input);
+        if (ret < 0 && ret != AVERROR_EOF && ret != AVERROR_EXIT && read_errors <= LIVE_MAX_READ_ERRORS)
+            break;
+        if (!live_stop)
+        {
+            session.reopens++;
+            ret = 0;
+        }
+    }
+
+    end_period(&session, 1);
+    free_streams(session.streams);
+    av_packet_free(&packet);
+    log_stats(&session);
+    return ret < 0 && ret != AVERROR_EOF && ret != AVERROR_EXIT ? -1 : 0;
+}
@@ -1,183 +1,388 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 extern "C"
 {
 #include <libavformat/avformat.h>
 }
 
+#include "async_log.h"
 #include "config.h"
+#include "io_scheduler.h"
+#include "live_remux.h"
+#include "remux_job.h"
+#include "trace.h"
+#include "worker_pool.h"
 
-int main(int argc, char *argv[])
+static const char *option_value(const char *arg, const char *name)
 {
-    if (argc < 2)
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=')
+        return arg + length + 1;
+    return NULL;
+}
+
+typedef struct BatchEntry
+{
+    std::string in_filename;
+    std::string out_filename;
+    int fragmented;
+    double start_time;
+    double end_time;
+    std::string streams;
+    FaststartParams faststart;
+    InterleaverParams interleave;
+} BatchEntry;
+
+// one job per line: <input> <output> [frag] [start=S] [end=S] [streams=v,a], '#' starts a comment
+static int read_batch(const char *path, std::vector<BatchEntry> &entries)
+{
+    std::ifstream list(path);
+    if (!list)
     {
-        // report version
-        std::cout << argv[0] << " Version " << Tutorial_VERSION_MAJOR << "." << Tutorial_VERSION_MINOR << std::endl;
-        std::cout << "Usage: " << argv[0] << " number" << std::endl;
-        std::cout << "You need to pass at least two parameter as the input file path and the output file path."
-                  << std::endl;
+        std::cerr << "Could not open batch file '" << path << "'" << std::endl;
         return -1;
     }
 
-    int fragmented_mp4_options = 0;
-    if (argc < 3)
+    std::string line;
+    int line_number = 0;
+    while (std::getline(list, line))
     {
-        std::cout << "You need to pass at least two parameter as the input file path and the output file path."
-                  << std::endl;
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        BatchEntry entry = {};
+        std::string flag;
+        if (!(fields >> entry.in_filename))
+            continue;
+        if (!(fields >> entry.out_filename))
+        {
+            std::cerr << path << ":" << line_number << ": missing output file" << std::endl;
+            return -1;
+        }
+        while (fields >> flag)
+        {
+            const char *value;
+            if (flag == "frag")
+                entry.fragmented = 1;
+            else if ((value = option_value(flag.c_str(), "start")))
+                entry.start_time = atof(value);
+            else if ((value = option_value(flag.c_str(), "end")))
+                entry.end_time = atof(value);
+            else if ((value = option_value(flag.c_str(), "streams")))
+                entry.streams = value;
+            else
+            {
+                std::cerr << path << ":" << line_number << ": unknown field '" << flag << "'" << std::endl;
+                return -1;
+            }
+        }
+        entries.push_back(entry);
+    }
+    return 0;
+}
+
+// one input path per line, '#' starts a comment
+static int read_concat_list(const char *path, std::vector<std::string> &inputs)
+{
+    std::ifstream list(path);
+    if (!list)
+    {
+        std::cerr << "Could not open concat list '" << path << "'" << std::endl;
         return -1;
     }
-    else if (argc == 4)
+
+    std::string line;
+    while (std::getline(list, line))
     {
-        fragmented_mp4_options = 1;
+        line = line.substr(0, line.find('#'));
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            continue;
+        size_t last = line.find_last_not_of(" \t\r");
+        inputs.push_back(line.substr(first, last - first + 1));
     }
+    return 0;
+}
+
+static int run_concat(const char *path, const char *out_filename, int fragmented)
+{
+    std::vector<std::string> inputs;
+    if (read_concat_list(path, inputs) < 0)
+        return -1;
 
-    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
-    AVPacket packet;
-    const char *in_filename, *out_filename;
-    int ret, i;
-    int stream_index = 0;
-    int *streams_list = NULL;
-    int number_of_streams = 0;
+    std::vector<const char *> in_filenames;
+    for (const std::string &input : inputs)
+        in_filenames.push_back(input.c_str());
 
-    in_filename = argv[1];
-    out_filename = argv[2];
+    RemuxStats stats;
+    int ret = remux_concat(in_filenames.data(), in_filenames.size(), out_filename, fragmented, &stats);
+    std::cout << std::fixed << std::setprecision(2) << inputs.size() << " inputs, " << stats.packets << " packets, "
+              << stats.seconds << "s" << std::endl;
+    return ret;
+}
 
-    do
+static int run_batch(const char *path, int workers, int io_reads, int io_writes, const FaststartParams &faststart,
+                     const InterleaverParams &interleave)
+{
+    std::vector<BatchEntry> entries;
+    if (read_batch(path, entries) < 0)
+        return -1;
+    for (BatchEntry &entry : entries)
     {
-        if ((ret = avformat_open_input(&input_format_context, in_filename, NULL, NULL)) < 0)
-        {
-            std::cerr << "Could not open input file '" << in_filename << "'" << std::endl;
-            break;
-        }
+        entry.faststart = faststart;
+        entry.interleave = interleave;
+    }
 
-        if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0)
-        {
-            std::cerr << "Failed to retrieve input stream information" << std::endl;
-            break;
-        }
+    std::vector<RemuxStats> stats(entries.size());
+    IoScheduler *io = io_scheduler_create(io_reads, io_writes, 1 << 20);
+    WorkerPool *pool = worker_pool_create(workers);
+    auto start = std::chrono::steady_clock::now();
 
-        avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename);
-        if (!output_format_context)
-        {
-            std::cerr << "Could not create output context" << std::endl;
-            ret = AVERROR_UNKNOWN;
-            break;
-        }
+    av_log_set_level(AV_LOG_ERROR);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        worker_pool_submit(pool, [&, i] {
+            const BatchEntry &entry = entries[i];
+            RemuxJob job = {entry.in_filename.c_str(), entry.out_filename.c_str(), entry.fragmented, entry.start_time,
+                            entry.end_time, entry.streams.empty() ? NULL : entry.streams.c_str(), entry.faststart,
+                            entry.interleave};
+            remux_file(&job, io, &stats[i]);
+        });
+    }
+    worker_pool_wait(pool);
 
-        number_of_streams = input_format_context->nb_streams;
-        streams_list = static_cast<int *>(av_malloc_array(number_of_streams, sizeof(*streams_list)));
-        if (!streams_list)
-        {
-            ret = AVERROR(ENOMEM);
-            break;
-        }
-        memset(streams_list, 0, number_of_streams * sizeof(*streams_list));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int threads = worker_pool_size(pool);
+    worker_pool_destroy(&pool);
+    io_scheduler_destroy(&io);
 
-        for (i = 0; i < input_format_context->nb_streams; i++)
-        {
-            AVStream *out_stream;
-            AVStream *in_stream = input_format_context->streams[i];
-            AVCodecParameters *in_codecpar = in_stream->codecpar;
-            if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO && in_codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
-                in_codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE)
-            {
-                streams_list[i] = -1;
-                continue;
-            }
-            streams_list[i] = stream_index++;
+    int64_t total_bytes = 0;
+    int failed = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const RemuxStats &s = stats[i];
+        int64_t bytes = s.bytes_read + s.bytes_written;
+        total_bytes += bytes;
+        failed += s.result < 0;
+        std::cout << (s.result < 0 ? "FAIL " : "ok   ") << entries[i].in_filename << " -> " << entries[i].out_filename
+                  << "  " << s.seconds << "s  " << s.packets << " packets  "
+                  << (s.seconds > 0 ? bytes / s.seconds / (1 << 20) : 0.0) << " MB/s" << std::endl;
+    }
+    std::cout << entries.size() << " jobs, " << failed << " failed, " << threads << " workers, " << seconds << "s, "
+              << (seconds > 0 ? total_bytes / seconds / (1 << 20) : 0.0) << " MB/s aggregate" << std::endl;
+    return failed ? -1 : 0;
+}
 
-            out_stream = avformat_new_stream(output_format_context, NULL);
-            if (!out_stream)
-            {
-                std::cerr << "Failed allocating output stream" << std::endl;
-                ret = AVERROR_UNKNOWN;
-                break;
-            }
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        // report version
+        std::cout << argv[0] << " Version " << Tutorial_VERSION_MAJOR << "." << Tutorial_VERSION_MINOR << std::endl;
+        std::cout << "Usage: " << argv[0] << " number" << std::endl;
+        std::cout << "       " << argv[0] << " input output [frag] [--start=S] [--end=S] [--streams=v,a:0]"
+                  << std::endl;
+        std::cout << "       [--faststart=reserve|memory] [--faststart-cap=MB]" << std::endl;
+        std::cout << "       [--max-interleave-delay=S] [--max-interleave-bytes=MB] [--stall-policy=flush|drop|fail]"
+                  << std::endl;
+        std::cout << "       " << argv[0] << " input --tee=out.mp4 --tee=[f=mpegts]out.ts"
+                  << " --tee=[movflags=frag_keyframe+empty_moov]frag.mp4" << std::endl;
+        std::cout << "       " << argv[0] << " input output [frag] --bench-mux=N [--bench-sink=arena|callback]"
+                  << std::endl;
+        std::cout << "       " << argv[0] << " --concat=inputs.txt output [frag]" << std::endl;
+        std::cout << "       " << argv[0] << " --live=fifo|udp://host:port outdir [--segment=S] [--keep=N]"
+                  << std::endl;
+        std::cout << "       " << argv[0] << " --replay=input.ts fifo|udp://host:port?pkt_size=1316 [--loop]"
+                  << " [--replay-wrap=S]" << std::endl;
+        std::cout << "       " << argv[0] << " --batch=jobs.txt [--workers=N] [--io-reads=N] [--io-writes=N]"
+                  << std::endl;
+        std::cout << "       any mode: [--log-level=error|warning|info|debug] [--trace=trace.json]" << std::endl;
+        std::cout << "You need to pass at least two parameter as the input file path and the output file path."
+                  << std::endl;
+        return -1;
+    }
 
-            ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
-            if (ret < 0)
+    const char *batch_path = NULL, *concat_path = NULL, *streams = NULL;
+    const char *live_input = NULL, *replay_input = NULL;
+    LiveParams live;
+    live_default_params(&live);
+    int loop = 0;
+    double replay_wrap = 0;
+    std::vector<const char *> tee_outputs;
+    const char *positional[3] = {NULL, NULL, NULL};
+    int positional_count = 0;
+    int workers = 0, io_reads = 2, io_writes = 2;
+    int bench_iterations = 0, bench_callback = 0;
+    double start_time = 0, end_time = 0;
+    FaststartParams faststart = {FASTSTART_NONE, (int64_t)2048 << 20};
+    InterleaverParams interleave;
+    interleaver_default_params(&interleave);
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value;
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            if (positional_count == 3)
             {
-                std::cerr << "Failed to copy codec parameters" << std::endl;
-                break;
+                std::cerr << "Unexpected argument '" << argv[i] << "'" << std::endl;
+                return -1;
             }
+            positional[positional_count++] = argv[i];
         }
-
-        if (ret < 0)
+        else if ((value = option_value(argv[i], "--start")))
+            start_time = atof(value);
+        else if ((value = option_value(argv[i], "--end")))
+            end_time = atof(value);
+        else if ((value = option_value(argv[i], "--streams")))
+            streams = value;
+        else if ((value = option_value(argv[i], "--faststart")))
         {
-            break;
+            if (faststart_parse_mode(value, &faststart.mode) < 0)
+                return -1;
         }
-
-        av_dump_format(output_format_context, 0, out_filename, 1);
-
-        if (!(output_format_context->oformat->flags & AVFMT_NOFILE))
+        else if ((value = option_value(argv[i], "--faststart-cap")))
+            faststart.memory_cap = (int64_t)atoi(value) << 20;
+        else if ((value = option_value(argv[i], "--live")))
+            live_input = value;
+        else if ((value = option_value(argv[i], "--segment")))
+            live.segment_seconds = atof(value);
+        else if ((value = option_value(argv[i], "--keep")))
+            live.keep_segments = atoi(value);
+        else if ((value = option_value(argv[i], "--replay")))
+            replay_input = value;
+        else if ((value = option_value(argv[i], "--replay-wrap")))
+            replay_wrap = atof(value);
+        else if (strcmp(argv[i], "--loop") == 0)
+            loop = 1;
+        else if ((value = option_value(argv[i], "--tee")))
+            tee_outputs.push_back(value);
+        else if ((value = option_value(argv[i], "--max-interleave-delay")))
+            interleave.max_delay_us = (int64_t)(atof(value) * AV_TIME_BASE);
+        else if ((value = option_value(argv[i], "--max-interleave-bytes")))
+            interleave.max_bytes = (int64_t)atoi(value) << 20;
+        else if ((value = option_value(argv[i], "--stall-policy")))
         {
-            ret = avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE);
-            if (ret < 0)
+            if (interleaver_parse_policy(value, &interleave.policy) < 0)
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--bench-mux")))
+            bench_iterations = atoi(value);
+        else if ((value = option_value(argv[i], "--bench-sink")))
+        {
+            if (strcmp(value, "arena") && strcmp(value, "callback"))
             {
-                std::cerr << "Could not open output file '" << out_filename << "'" << std::endl;
-                break;
+                std::cerr << "Unknown bench sink '" << value << "', use arena or callback" << std::endl;
+                return -1;
             }
+            bench_callback = strcmp(value, "callback") == 0;
         }
-
-        AVDictionary *options = NULL;
-        if (fragmented_mp4_options)
+        else if ((value = option_value(argv[i], "--concat")))
+            concat_path = value;
+        else if ((value = option_value(argv[i], "--batch")))
+            batch_path = value;
+        else if ((value = option_value(argv[i], "--workers")))
+            workers = atoi(value);
+        else if ((value = option_value(argv[i], "--io-reads")))
+            io_reads = atoi(value);
+        else if ((value = option_value(argv[i], "--io-writes")))
+            io_writes = atoi(value);
+        else if ((value = option_value(argv[i], "--trace")))
         {
-            av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+            trace_start(value);
+            trace_thread_name("remux");
         }
-
-        ret = avformat_write_header(output_format_context, &options);
-        if (ret < 0)
+        else if ((value = option_value(argv[i], "--log-level")))
         {
-            std::cerr << "Error occurred when opening output file" << std::endl;
-            break;
+            LogLevel level;
+            if (log_parse_level(value, &level) < 0)
+                return -1;
+            log_set_level(level);
         }
-
-        while (true)
+        else
         {
-            AVStream *in_stream, *out_stream;
-
-            ret = av_read_frame(input_format_context, &packet);
-            if (ret < 0)
-            {
-                break;
-            }
-
-            in_stream = input_format_context->streams[packet.stream_index];
-            if (packet.stream_index >= number_of_streams || streams_list[packet.stream_index] < 0)
-            {
-                av_packet_unref(&packet);
-                continue;
-            }
+            std::cerr << "Unknown option '" << argv[i] << "'" << std::endl;
+            return -1;
+        }
+    }
+    if (batch_path)
+    {
+        int ret = run_batch(batch_path, workers, io_reads, io_writes, faststart, interleave);
+        trace_stop();
+        return ret;
+    }
 
-            packet.stream_index = streams_list[packet.stream_index];
-            out_stream = output_format_context->streams[packet.stream_index];
+    if (live_input || replay_input)
+    {
+        if (positional_count < 1)
+        {
+            std::cout << "You need to pass the output directory or target." << std::endl;
+            return -1;
+        }
+        if (replay_input)
+            return live_replay(replay_input, positional[0], loop, replay_wrap);
+        live.input = live_input;
+        live.output_dir = positional[0];
+        return live_remux(&live);
+    }
 
-            packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base,
-                                          AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-            packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base,
-                                          AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-            packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
-            packet.pos = -1;
+    if (!tee_outputs.empty())
+    {
+        if (positional_count < 1)
+        {
+            std::cout << "You need to pass the input file path." << std::endl;
+            return -1;
+        }
+        RemuxStats stats;
+        int ret = remux_tee(positional[0], tee_outputs.data(), tee_outputs.size(), &stats);
+        std::cout << std::fixed << std::setprecision(2) << tee_outputs.size() << " outputs, " << stats.packets
+                  << " packets, " << stats.seconds << "s" << std::endl;
+        trace_stop();
+        return ret;
+    }
 
-            ret = av_interleaved_write_frame(output_format_context, &packet);
-            if (ret < 0)
-            {
-                std::cerr << "Error mux packet" << std::endl;
-                break;
-            }
-            av_packet_unref(&packet);
+    if (concat_path)
+    {
+        if (positional_count < 1)
+        {
+            std::cout << "You need to pass the output file path." << std::endl;
+            return -1;
         }
-        av_write_trailer(output_format_context);
-    } while (0);
+        int ret = run_concat(concat_path, positional[0], positional_count >= 2);
+        trace_stop();
+        return ret;
+    }
+
+    int fragmented_mp4_options = 0;
+    if (positional_count < 2)
+    {
+        std::cout << "You need to pass at least two parameter as the input file path and the output file path."
+                  << std::endl;
+        return -1;
+    }
+    else if (positional_count == 3)
+    {
+        fragmented_mp4_options = 1;
+    }
 
-    avformat_close_input(&input_format_context);
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
+    if (bench_iterations > 0)
     {
-        avio_closep(&output_format_context->pb);
+        return remux_bench_mux(positional[0], positional[1], fragmented_mp4_options, bench_iterations, bench_callback);
     }
-    avformat_free_context(output_format_context);
-    av_freep(&streams_list);
-    if (ret < 0 && ret != AVERROR_EOF)
+
+    RemuxJob job = {positional[0], positional[1], fragmented_mp4_options, start_time, end_time, streams, faststart,
+                    interleave};
+    RemuxStats stats;
+    int ret = remux_file(&job, NULL, &stats);
+    trace_stop();
+    if (ret < 0)
     {
         std::cerr << "Error occurred" << std::endl;
         return -1;
@@ -0,0 +1,374 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+}
+
+#include "remux_job.h"
+#include "trace.h"
+
+static int open_input(AVFormatContext **input_format_context, const char *in_filename, IoScheduler *io,
+                      AVIOContext **in_pb)
+{
+    if (!io)
+        return avformat_open_input(input_format_context, in_filename, NULL, NULL);
+
+    int ret = io_scheduler_open(io, in_filename, AVIO_FLAG_READ, in_pb);
+    if (ret < 0)
+        return ret;
+
+    *input_format_context = avformat_alloc_context();
+    if (!*input_format_context)
+        return AVERROR(ENOMEM);
+    (*input_format_context)->pb = *in_pb;
+    (*input_format_context)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    return avformat_open_input(input_format_context, in_filename, NULL, NULL);
+}
+
+static int stream_selected(AVFormatContext *input_format_context, AVStream *in_stream, const char *streams)
+{
+    if (!streams)
+    {
+        enum AVMediaType type = in_stream->codecpar->codec_type;
+        return type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_SUBTITLE;
+    }
+
+    char *list = av_strdup(streams);
+    char *saveptr = NULL;
+    int selected = 0;
+    for (char *spec = av_strtok(list, ",", &saveptr); spec && !selected; spec = av_strtok(NULL, ",", &saveptr))
+    {
+        selected = avformat_match_stream_specifier(input_format_context, in_stream, spec) > 0;
+    }
+    av_free(list);
+    return selected;
+}
+
+int remux_file(const RemuxJob *job, IoScheduler *io, RemuxStats *stats)
+{
+    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
+    AVIOContext *in_pb = NULL;
+    AVPacket packet;
+    const char *in_filename = job->in_filename, *out_filename = job->out_filename;
+    int ret, i;
+    int stream_index = 0;
+    int *streams_list = NULL;
+    int number_of_streams = 0;
+    int64_t start_point = 0, end_point = INT64_MAX;
+    int *stream_done = NULL;
+    int streams_left = 0;
+    FaststartOutput faststart = {FASTSTART_NONE, NULL};
+    Interleaver *interleaver = NULL;
+    auto start = std::chrono::steady_clock::now();
+
+    memset(stats, 0, sizeof(*stats));
+
+    do
+    {
+        if ((ret = open_input(&input_format_context, in_filename, io, &in_pb)) < 0)
+        {
+            std::cerr << "Could not open input file '" << in_filename << "'" << std::endl;
+            break;
+        }
+
+        if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0)
+        {
+            std::cerr << "Failed to retrieve input stream information" << std::endl;
+            break;
+        }
+
+        avformat_alloc_output_context2(&output_format_context, NULL, NULL, out_filename);
+        if (!output_format_context)
+        {
+            std::cerr << "Could not create output context" << std::endl;
+            ret = AVERROR_UNKNOWN;
+            break;
+        }
+
+        number_of_streams = input_format_context->nb_streams;
+        streams_list = static_cast<int *>(av_malloc_array(number_of_streams, sizeof(*streams_list)));
+        if (!streams_list)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        memset(streams_list, 0, number_of_streams * sizeof(*streams_list));
+        stream_done = static_cast<int *>(av_calloc(number_of_streams, sizeof(*stream_done)));
+        if (!stream_done)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+
+        for (i = 0; i < input_format_context->nb_streams; i++)
+        {
+            AVStream *out_stream;
+            AVStream *in_stream = input_format_context->streams[i];
+            AVCodecParameters *in_codecpar = in_stream->codecpar;
+            if (!stream_selected(input_format_context, in_stream, job->streams))
+            {
+                // dropped in the demuxer instead of after every av_read_frame
+                in_stream->discard = AVDISCARD_ALL;
+                streams_list[i] = -1;
+                continue;
+            }
+            streams_list[i] = stream_index++;
+            // subtitles may have no packet past the end point, so only audio and video decide when to stop
+            if (in_codecpar->codec_type == AVMEDIA_TYPE_AUDIO || in_codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            {
+                streams_left++;
+            }
+            else
+            {
+                stream_done[i] = 1;
+            }
+
+            out_stream = avformat_new_stream(output_format_context, NULL);
+            if (!out_stream)
+            {
+                std::cerr << "Failed allocating output stream" << std::endl;
+                ret = AVERROR_UNKNOWN;
+                break;
+            }
+
+            ret = avcodec_parameters_copy(out_stream->codecpar, in_codecpar);
+            if (ret < 0)
+            {
+                std::cerr << "Failed to copy codec parameters" << std::endl;
+                break;
+            }
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+
+        if (streams_left == 0)
+        {
+            for (i = 0; i < number_of_streams; i++)
+            {
+                if (streams_list[i] >= 0)
+                {
+                    stream_done[i] = 0;
+                    streams_left++;
+                }
+            }
+        }
+
+        if (job->start_time > 0 || job->end_time > 0)
+        {
+            int64_t file_start =
+                input_format_context->start_time != AV_NOPTS_VALUE ? input_format_context->start_time : 0;
+            start_point = file_start + (int64_t)(job->start_time * AV_TIME_BASE);
+            if (job->end_time > 0)
+            {
+                end_point = file_start + (int64_t)(job->end_time * AV_TIME_BASE);
+            }
+            if (end_point <= start_point)
+            {
+                std::cerr << "End time must be after start time" << std::endl;
+                ret = AVERROR(EINVAL);
+                break;
+            }
+        }
+
+        if (job->start_time > 0)
+        {
+            // land on the keyframe at or before the start so the first GOP is decodable
+            ret = av_seek_frame(input_format_context, -1, start_point, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0)
+            {
+                std::cerr << "Could not seek to " << job->start_time << "s in '" << in_filename << "'" << std::endl;
+                break;
+            }
+        }
+
+        if (!io)
+        {
+            av_dump_format(output_format_context, 0, out_filename, 1);
+        }
+
+        AVDictionary *options = NULL;
+        if (job->fragmented)
+        {
+            av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+
+        int pb_provided = faststart_setup(&faststart, &job->faststart, output_format_context, input_format_context,
+                                          &options);
+        if (pb_provided < 0)
+        {
+            ret = AVERROR(EINVAL);
+            av_dict_free(&options);
+            break;
+        }
+
+        if (!pb_provided && !(output_format_context->oformat->flags & AVFMT_NOFILE))
+        {
+            ret = io ? io_scheduler_open(io, out_filename, AVIO_FLAG_WRITE, &output_format_context->pb)
+                     : avio_open(&output_format_context->pb, out_filename, AVIO_FLAG_WRITE);
+            if (ret < 0)
+            {
+                std::cerr << "Could not open output file '" << out_filename << "'" << std::endl;
+                av_dict_free(&options);
+                break;
+            }
+        }
+
+        ret = avformat_write_header(output_format_context, &options);
+        av_dict_free(&options);
+        if (ret < 0)
+        {
+            std::cerr << "Error occurred when opening output file" << std::endl;
+            break;
+        }
+        interleaver = interleaver_alloc(output_format_context, &job->interleave);
+
+        while (true)
+        {
+            AVStream *in_stream, *out_stream;
+
+            int64_t span = trace_begin();
+            ret = av_read_frame(input_format_context, &packet);
+            trace_end("read", span, stats->packets);
+            if (ret < 0)
+            {
+                break;
+            }
+
+            in_stream = input_format_context->streams[packet.stream_index];
+            if (packet.stream_index >= number_of_streams || streams_list[packet.stream_index] < 0 ||
+                stream_done[packet.stream_index])
+            {
+                av_packet_unref(&packet);
+                continue;
+            }
+
+            int64_t packet_time = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            // video arrives in decode order, a reordered P-frame's pts passes the end before the B-frames shown
+            // ahead of it
+            int is_video = in_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+            int64_t order_time = is_video && packet.dts != AV_NOPTS_VALUE ? packet.dts : packet_time;
+            if (packet_time != AV_NOPTS_VALUE)
+            {
+                packet_time = av_rescale_q(packet_time, in_stream->time_base, AV_TIME_BASE_Q);
+                if (av_rescale_q(order_time, in_stream->time_base, AV_TIME_BASE_Q) >= end_point)
+                {
+                    stream_done[packet.stream_index] = 1;
+                    ret = interleaver_end_stream(interleaver, streams_list[packet.stream_index]);
+                    av_packet_unref(&packet);
+                    if (ret < 0)
+                    {
+                        std::cerr << "Error mux packet" << std::endl;
+                        break;
+                    }
+                    if (--streams_left <= 0)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                // video keeps the leading GOP, everything else starts at the requested time
+                int64_t packet_end = packet_time + av_rescale_q(packet.duration, in_stream->time_base, AV_TIME_BASE_Q);
+                if (!is_video && packet_end <= start_point)
+                {
+                    av_packet_unref(&packet);
+                    continue;
+                }
+            }
+
+            int ends_stream = packet_ends_stream(in_stream, &packet);
+            if (job->start_time > 0)
+            {
+                int64_t offset = av_rescale_q(start_point, AV_TIME_BASE_Q, in_stream->time_base);
+                if (packet.pts != AV_NOPTS_VALUE)
+                    packet.pts -= offset;
+                if (packet.dts != AV_NOPTS_VALUE)
+                    packet.dts -= offset;
+            }
+
+            packet.stream_index = streams_list[packet.stream_index];
+            out_stream = output_format_context->streams[packet.stream_index];
+
+            packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base,
+                                          AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+            packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base,
+                                          AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+            packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
+            packet.pos = -1;
+
+            span = trace_begin();
+            ret = interleaver_write(interleaver, &packet);
+            if (ret >= 0 && ends_stream)
+                ret = interleaver_end_stream(interleaver, out_stream->index);
+            trace_end("mux", span, stats->packets);
+            if (ret < 0)
+            {
+                std::cerr << "Error mux packet" << std::endl;
+                break;
+            }
+            av_packet_unref(&packet);
+            stats->packets++;
+        }
+        if (ret >= 0 || ret == AVERROR_EOF)
+        {
+            int flush_ret = interleaver_flush(interleaver);
+            if (flush_ret < 0)
+                ret = flush_ret;
+        }
+        if (!io)
+        {
+            interleaver_report(interleaver);
+        }
+
+        // a reserved moov that turned out too small only shows up here
+        int trailer_ret = av_write_trailer(output_format_context);
+        if (trailer_ret < 0)
+        {
+            std::cerr << "Error writing the trailer of '" << out_filename << "'" << std::endl;
+            if (ret >= 0 || ret == AVERROR_EOF)
+                ret = trailer_ret;
+        }
+    } while (0);
+
+    if (!io && input_format_context && input_format_context->pb)
+    {
+        stats->bytes_read = avio_tell(input_format_context->pb);
+    }
+    avformat_close_input(&input_format_context);
+    stats->bytes_read += io_scheduler_close(&in_pb);
+    if (faststart.memory)
+    {
+        stats->bytes_written = mem_output_size(faststart.memory);
+        if (faststart_finish(&faststart, ret < 0 && ret != AVERROR_EOF ? NULL : out_filename) < 0)
+        {
+            ret = AVERROR(EIO);
+        }
+    }
+    else if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE))
+    {
+        if (io)
+        {
+            stats->bytes_written = io_scheduler_close(&output_format_context->pb);
+        }
+        else
+        {
+            if (output_format_context->pb)
+                stats->bytes_written = avio_tell(output_format_context->pb);
+            avio_closep(&output_format_context->pb);
+        }
+    }
+    avformat_free_context(output_format_context);
+    interleaver_free(&interleaver);
+    av_freep(&streams_list);
+    av_freep(&stream_done);
+
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats->result = (ret < 0 && ret != AVERROR_EOF) ? ret : 0;
+    return stats->result < 0 ? -1 : 0;
+}
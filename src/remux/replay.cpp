@@ -0,0 +1,149 @@
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <thread>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "live_remux.h"
+
+static volatile sig_atomic_t replay_stop = 0;
+
+static void replay_signal(int)
+{
+    replay_stop = 1;
+}
+
+static int replay_pass(AVFormatContext *input, AVFormatContext *output)
+{
+    AVPacket packet;
+    int64_t first_dts = AV_NOPTS_VALUE;
+    auto start = std::chrono::steady_clock::now();
+    int ret = 0;
+
+    while (!replay_stop && (ret = av_read_frame(input, &packet)) >= 0)
+    {
+        AVStream *in_stream = input->streams[packet.stream_index];
+        AVStream *out_stream = output->streams[packet.stream_index];
+
+        // paced like -re: a packet leaves no earlier than its dts after the first one
+        if (packet.dts != AV_NOPTS_VALUE)
+        {
+            int64_t dts = av_rescale_q(packet.dts, in_stream->time_base, AV_TIME_BASE_Q);
+            if (first_dts == AV_NOPTS_VALUE)
+                first_dts = dts;
+            std::this_thread::sleep_until(start + std::chrono::microseconds(dts - first_dts));
+        }
+
+        av_packet_rescale_ts(&packet, in_stream->time_base, out_stream->time_base);
+        packet.pos = -1;
+        ret = av_interleaved_write_frame(output, &packet);
+        av_packet_unref(&packet);
+        if (ret < 0)
+        {
+            std::cerr << "Error mux packet" << std::endl;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// a fresh muxer per pass, so the restart of the source timestamps reaches the receiver as a discontinuity
+static int open_replay_output(AVFormatContext *input, AVIOContext *pb, double wrap_seconds, AVFormatContext **output)
+{
+    int ret = avformat_alloc_output_context2(output, NULL, "mpegts", NULL);
+    if (!*output)
+    {
+        std::cerr << "Could not create output context" << std::endl;
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+
+    for (unsigned int i = 0; i < input->nb_streams; i++)
+    {
+        AVStream *out_stream = avformat_new_stream(*output, NULL);
+        if (!out_stream)
+        {
+            std::cerr << "Failed allocating output stream" << std::endl;
+            return AVERROR_UNKNOWN;
+        }
+        ret = avcodec_parameters_copy(out_stream->codecpar, input->streams[i]->codecpar);
+        if (ret < 0)
+        {
+            std::cerr << "Failed to copy codec parameters" << std::endl;
+            return ret;
+        }
+        out_stream->codecpar->codec_tag = 0;
+    }
+
+    if (wrap_seconds > 0)
+    {
+        // the muxer keeps 33 bits, so the timestamps wrap wrap_seconds into the pass
+        (*output)->output_ts_offset =
+            av_rescale(((int64_t)1 << 33) - (int64_t)(wrap_seconds * 90000), AV_TIME_BASE, 90000);
+    }
+
+    (*output)->pb = pb;
+    ret = avformat_write_header(*output, NULL);
+    if (ret < 0)
+        std::cerr << "Error occurred when opening output" << std::endl;
+    return ret;
+}
+
+int live_replay(const char *in_filename, const char *target, int loop, double wrap_seconds)
+{
+    AVFormatContext *input_format_context = NULL, *output_format_context = NULL;
+    AVIOContext *pb = NULL;
+    int ret;
+
+    struct sigaction action = {};
+    action.sa_handler = replay_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    do
+    {
+        if ((ret = avformat_open_input(&input_format_context, in_filename, NULL, NULL)) < 0)
+        {
+            std::cerr << "Could not open input file '" << in_filename << "'" << std::endl;
+            break;
+        }
+
+        if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0)
+        {
+            std::cerr << "Failed to retrieve input stream information" << std::endl;
+            break;
+        }
+
+        // opening a FIFO for writing blocks until the reader side is open
+        ret = avio_open(&pb, target, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            std::cerr << "Could not open output '" << target << "'" << std::endl;
+            break;
+        }
+
+        do
+        {
+            if ((ret = open_replay_output(input_format_context, pb, wrap_seconds, &output_format_context)) < 0)
+                break;
+            ret = replay_pass(input_format_context, output_format_context);
+            av_write_trailer(output_format_context);
+            avformat_free_context(output_format_context);
+            output_format_context = NULL;
+            if (ret >= 0 && loop && !replay_stop)
+            {
+                std::cout << "replay: restarting " << in_filename << std::endl;
+                ret = av_seek_frame(input_format_context, -1, 0, AVSEEK_FLAG_BACKWARD);
+            }
+        } while (loop && !replay_stop && ret >= 0);
+    } while (0);
+
+    avformat_close_input(&input_format_context);
+    avformat_free_context(output_format_context);
+    avio_closep(&pb);
+    return ret < 0 && ret != AVERROR_EOF ? -1 : 0;
+}
@@ -0,0 +1,328 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+#include "remux_job.h"
+#include "trace.h"
+
+// packets buffered per output before the demuxer waits for the slowest writer
+#define TEE_QUEUE_PACKETS 256
+
+typedef struct TeeOutput
+{
+    std::string filename;
+    AVDictionary *options;
+    AVFormatContext *format_context;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable has_packet;
+    std::condition_variable has_room;
+    // a NULL entry tells the writer the input is finished
+    std::deque<AVPacket *> queue;
+    int ret;
+    int64_t packets;
+} TeeOutput;
+
+// "[f=mpegts:movflags=+faststart]out.ts", the bracket holds the muxer name and options
+static int parse_output_spec(const char *spec, TeeOutput *output, const char **format_name, std::string &format)
+{
+    *format_name = NULL;
+    output->options = NULL;
+    if (spec[0] != '[')
+    {
+        output->filename = spec;
+        return 0;
+    }
+
+    const char *close = strchr(spec, ']');
+    if (!close)
+    {
+        std::cerr << "Missing ']' in output '" << spec << "'" << std::endl;
+        return AVERROR(EINVAL);
+    }
+    std::string options(spec + 1, close - spec - 1);
+    output->filename = close + 1;
+    int ret = av_dict_parse_string(&output->options, options.c_str(), "=", ":", 0);
+    if (ret < 0)
+    {
+        std::cerr << "Could not parse the options of output '" << spec << "'" << std::endl;
+        return ret;
+    }
+    AVDictionaryEntry *entry = av_dict_get(output->options, "f", NULL, 0);
+    if (entry)
+    {
+        format = entry->value;
+        *format_name = format.c_str();
+        av_dict_set(&output->options, "f", NULL, 0);
+    }
+    return 0;
+}
+
+static void writer_loop(TeeOutput *output, AVFormatContext *input_format_context, const int *streams_list)
+{
+    trace_thread_name(output->filename.c_str());
+    while (true)
+    {
+        AVPacket *packet;
+        int64_t start = trace_begin();
+        {
+            std::unique_lock<std::mutex> guard(output->lock);
+            output->has_packet.wait(guard, [output] { return !output->queue.empty(); });
+            packet = output->queue.front();
+            output->queue.pop_front();
+        }
+        trace_end("queue wait", start, output->packets);
+        output->has_room.notify_one();
+        if (!packet)
+            break;
+
+        // after a failure the queue is still drained so the demuxer never blocks on this output
+        if (output->ret >= 0)
+        {
+            AVStream *in_stream = input_format_context->streams[packet->stream_index];
+            packet->stream_index = streams_list[packet->stream_index];
+            AVStream *out_stream = output->format_context->streams[packet->stream_index];
+            av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+            packet->pos = -1;
+
+            start = trace_begin();
+            output->ret = av_interleaved_write_frame(output->format_context, packet);
+            trace_end("mux", start, output->packets);
+            if (output->ret < 0)
+                std::cerr << "Error mux packet for '" << output->filename << "'" << std::endl;
+            else
+                output->packets++;
+        }
+        av_packet_free(&packet);
+    }
+
+    if (output->ret >= 0)
+        output->ret = av_write_trailer(output->format_context);
+}
+
+static int push_packet(TeeOutput *output, AVPacket *packet)
+{
+    int64_t start = trace_begin();
+    std::unique_lock<std::mutex> guard(output->lock);
+    output->has_room.wait(guard, [output] { return output->queue.size() < TEE_QUEUE_PACKETS; });
+    trace_end("queue wait", start, -1);
+    output->queue.push_back(packet);
+    guard.unlock();
+    output->has_packet.notify_one();
+    return 0;
+}
+
+int remux_tee(const char *in_filename, const char **output_specs, int count, RemuxStats *stats)
+{
+    AVFormatContext *input_format_context = NULL;
+    std::vector<TeeOutput> outputs(count);
+    AVPacket packet;
+    int ret = 0, i;
+    int stream_index = 0;
+    int *streams_list = NULL;
+    int number_of_streams = 0;
+    int writers = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (TeeOutput &output : outputs)
+    {
+        output.options = NULL;
+        output.format_context = NULL;
+        output.ret = 0;
+        output.packets = 0;
+    }
+
+    do
+    {
+        if ((ret = avformat_open_input(&input_format_context, in_filename, NULL, NULL)) < 0)
+        {
+            std::cerr << "Could not open input file '" << in_filename << "'" << std::endl;
+            break;
+        }
+
+        if ((ret = avformat_find_stream_info(input_format_context, NULL)) < 0)
+        {
+            std::cerr << "Failed to retrieve input stream information" << std::endl;
+            break;
+        }
+
+        number_of_streams = input_format_context->nb_streams;
+        streams_list = static_cast<int *>(av_malloc_array(number_of_streams, sizeof(*streams_list)));
+        if (!streams_list)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+
+        for (i = 0; i < number_of_streams; i++)
+        {
+            AVStream *in_stream = input_format_context->streams[i];
+            enum AVMediaType type = in_stream->codecpar->codec_type;
+            if (type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_SUBTITLE)
+            {
+                in_stream->discard = AVDISCARD_ALL;
+                streams_list[i] = -1;
+                continue;
+            }
+            streams_list[i] = stream_index++;
+        }
+
+        for (i = 0; i < count && ret >= 0; i++)
+        {
+            TeeOutput &output = outputs[i];
+            const char *format_name;
+            std::string format;
+            if ((ret = parse_output_spec(output_specs[i], &output, &format_name, format)) < 0)
+            {
+                break;
+            }
+
+            avformat_alloc_output_context2(&output.format_context, NULL, format_name, output.filename.c_str());
+            if (!output.format_context)
+            {
+                std::cerr << "Could not create output context for '" << output.filename << "'" << std::endl;
+                ret = AVERROR_UNKNOWN;
+                break;
+            }
+
+            for (int j = 0; j < number_of_streams && ret >= 0; j++)
+            {
+                if (streams_list[j] < 0)
+                    continue;
+                AVStream *out_stream = avformat_new_stream(output.format_context, NULL);
+                if (!out_stream)
+                {
+                    std::cerr << "Failed allocating output stream" << std::endl;
+                    ret = AVERROR_UNKNOWN;
+                    break;
+                }
+                ret = avcodec_parameters_copy(out_stream->codecpar, input_format_context->streams[j]->codecpar);
+                if (ret < 0)
+                {
+                    std::cerr << "Failed to copy codec parameters" << std::endl;
+                    break;
+                }
+                // the source tag may not exist in this container
+                out_stream->codecpar->codec_tag = 0;
+            }
+            if (ret < 0)
+            {
+                break;
+            }
+
+            av_dump_format(output.format_context, i, output.filename.c_str(), 1);
+
+            if (!(output.format_context->oformat->flags & AVFMT_NOFILE))
+            {
+                ret = avio_open(&output.format_context->pb, output.filename.c_str(), AVIO_FLAG_WRITE);
+                if (ret < 0)
+                {
+                    std::cerr << "Could not open output file '" << output.filename << "'" << std::endl;
+                    break;
+                }
+            }
+
+            ret = avformat_write_header(output.format_context, &output.options);
+            if (ret < 0)
+            {
+                std::cerr << "Error occurred when opening output file '" << output.filename << "'" << std::endl;
+                break;
+            }
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+
+        for (TeeOutput &output : outputs)
+        {
+            output.writer = std::thread(writer_loop, &output, input_format_context, streams_list);
+            writers++;
+        }
+
+        while (true)
+        {
+            ret = av_read_frame(input_format_context, &packet);
+            if (ret < 0)
+            {
+                break;
+            }
+
+            if (packet.stream_index >= number_of_streams || streams_list[packet.stream_index] < 0)
+            {
+                av_packet_unref(&packet);
+                continue;
+            }
+
+            // every output gets a new reference to the same payload
+            for (TeeOutput &output : outputs)
+            {
+                AVPacket *reference = av_packet_alloc();
+                if (!reference || (ret = av_packet_ref(reference, &packet)) < 0)
+                {
+                    av_packet_free(&reference);
+                    ret = AVERROR(ENOMEM);
+                    break;
+                }
+                push_packet(&output, reference);
+            }
+            av_packet_unref(&packet);
+            if (ret < 0)
+            {
+                break;
+            }
+            stats->packets++;
+        }
+    } while (0);
+
+    for (i = 0; i < writers; i++)
+    {
+        push_packet(&outputs[i], NULL);
+    }
+    for (i = 0; i < writers; i++)
+    {
+        outputs[i].writer.join();
+    }
+
+    if (input_format_context && input_format_context->pb)
+    {
+        stats->bytes_read = avio_tell(input_format_context->pb);
+    }
+    avformat_close_input(&input_format_context);
+    for (TeeOutput &output : outputs)
+    {
+        if (output.ret < 0)
+        {
+            std::cerr << "Failed writing '" << output.filename << "'" << std::endl;
+            if (ret >= 0 || ret == AVERROR_EOF)
+                ret = output.ret;
+        }
+        if (output.format_context && !(output.format_context->oformat->flags & AVFMT_NOFILE))
+        {
+            if (output.format_context->pb)
+                stats->bytes_written += avio_tell(output.format_context->pb);
+            avio_closep(&output.format_context->pb);
+        }
+        avformat_free_context(output.format_context);
+        av_dict_free(&output.options);
+    }
+    av_freep(&streams_list);
+
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats->result = (ret < 0 && ret != AVERROR_EOF) ? ret : 0;
+    return stats->result < 0 ? -1 : 0;
+}
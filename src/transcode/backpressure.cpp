@@ -0,0 +1,262 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "backpressure.h"
+#include "video_process.h"
+
+static const char *level_names[DEGRADE_LEVELS] = {"none", "skip-nonref", "half-rate", "fast-preset"};
+
+typedef struct DegradeEvent
+{
+    double time;
+    double lag;
+    DegradeLevel from;
+    DegradeLevel to;
+} DegradeEvent;
+
+struct Backpressure
+{
+    BackpressureParams params;
+    AVRational time_base;
+    StreamingParams sp;
+    DegradeLevel level;
+    std::chrono::steady_clock::time_point start;
+    int64_t first_pts;
+    int64_t last_pts;
+    // smallest pts step seen, the nominal frame duration
+    int64_t frame_duration;
+    double last_frame_time;
+    double last_change;
+    // since when the lag has been low enough to step down, -1 while it is not
+    double calm_since;
+    int fast_preset;
+    int fast_preset_unavailable;
+    int64_t frames;
+    int64_t dropped;
+    int64_t skipped;
+    double max_lag;
+    double level_seconds[DEGRADE_LEVELS];
+    std::vector<DegradeEvent> events;
+};
+
+void backpressure_default_params(BackpressureParams *params)
+{
+    params->enabled = 0;
+    params->max_lag = 2.0;
+    params->settle = 1.0;
+    params->metrics_path = NULL;
+}
+
+Backpressure *backpressure_alloc(const BackpressureParams *params, AVRational time_base, const StreamingParams *sp)
+{
+    Backpressure *bp = new Backpressure();
+    bp->params = *params;
+    bp->time_base = time_base;
+    bp->sp = *sp;
+    bp->level = DEGRADE_NONE;
+    bp->first_pts = AV_NOPTS_VALUE;
+    bp->last_pts = AV_NOPTS_VALUE;
+    bp->frame_duration = 0;
+    bp->last_frame_time = 0;
+    bp->last_change = 0;
+    bp->calm_since = -1;
+    bp->fast_preset = 0;
+    bp->fast_preset_unavailable = 0;
+    bp->frames = 0;
+    bp->dropped = 0;
+    bp->skipped = 0;
+    bp->max_lag = 0;
+    for (int i = 0; i < DEGRADE_LEVELS; i++)
+        bp->level_seconds[i] = 0;
+    return bp;
+}
+
+static double threshold(const Backpressure *bp, int level)
+{
+    return level >= DEGRADE_FAST_PRESET ? bp->params.max_lag : bp->params.max_lag * level / 4;
+}
+
+// x264 and x265 without B-frames, so the new encoder's first dts comes after the old one's last; libavcodec
+// cannot change their preset in place, so a container that stores the headers once (MP4, MOV, MKV) never
+// gets here, the new encoder's parameter sets would not match them
+static int reopen_fast(Backpressure *bp, StreamingContext *decoder, StreamingContext *encoder)
+{
+    const char *name = encoder->video_avc->name;
+    if (encoder->avfc->oformat->flags & AVFMT_GLOBALHEADER)
+        return 0;
+    const char *params_key = !strcmp(name, "libx264")   ? "x264-params"
+                             : !strcmp(name, "libx265") ? "x265-params"
+                                                        : NULL;
+    if (!params_key)
+    {
+        logging("live: %s has no faster preset to switch to", name);
+        return 0;
+    }
+
+    if (encode_video(decoder, encoder, NULL))
+        return -1;
+    AVRational framerate = av_inv_q(encoder->video_avcc->time_base);
+    encoder->earlier_video_frames += encoder->video_avcc->frame_number;
+    avcodec_free_context(&encoder->video_avcc);
+
+    StreamingParams sp = bp->sp;
+    int merge = sp.codec_priv_key && sp.codec_priv_value && !strcmp(sp.codec_priv_key, params_key);
+    char *value = av_asprintf("%s%sbframes=0", merge ? sp.codec_priv_value : "", merge ? ":" : "");
+    if (!value)
+        return -1;
+    if (!merge && sp.codec_priv_key)
+        logging("live: dropping %s from the reopened encoder", sp.codec_priv_key);
+    sp.codec_priv_key = const_cast<char *>(params_key);
+    sp.codec_priv_value = value;
+    int ret = open_video_encoder(encoder, decoder->video_avcc, framerate, sp, "ultrafast");
+    av_free(value);
+    if (ret < 0)
+        return -1;
+    // the header is written, but the muxer still reads the profile and reorder delay from here
+    avcodec_parameters_from_context(encoder->video_avs->codecpar, encoder->video_avcc);
+    return 1;
+}
+
+static int set_level(Backpressure *bp, StreamingContext *decoder, StreamingContext *encoder, DegradeLevel level,
+                     double now, double lag)
+{
+    if (level == DEGRADE_FAST_PRESET && !bp->fast_preset)
+    {
+        int reopened = bp->fast_preset_unavailable ? 0 : reopen_fast(bp, decoder, encoder);
+        if (reopened < 0)
+            return -1;
+        if (!reopened)
+        {
+            bp->fast_preset_unavailable = 1;
+            return 0;
+        }
+        bp->fast_preset = 1;
+    }
+
+    // leaving the last level keeps the fast preset, reopening the slower one would only cost more
+    decoder->video_avcc->skip_frame = level >= DEGRADE_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    logging("live: %.2f s behind, %s -> %s", lag, level_names[bp->level], level_names[level]);
+    bp->events.push_back({now, lag, bp->level, level});
+    bp->level = level;
+    bp->last_change = now;
+    bp->calm_since = -1;
+    return 0;
+}
+
+int backpressure_frame(Backpressure *bp, StreamingContext *decoder, StreamingContext *encoder, const AVFrame *frame)
+{
+    int64_t pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE)
+        return 0;
+    bp->frames++;
+
+    if (bp->first_pts == AV_NOPTS_VALUE)
+    {
+        bp->first_pts = pts;
+        bp->start = std::chrono::steady_clock::now();
+    }
+    if (bp->last_pts != AV_NOPTS_VALUE && pts > bp->last_pts)
+    {
+        int64_t step = pts - bp->last_pts;
+        // frames the decoder skipped leave gaps in the timestamps
+        if (bp->level >= DEGRADE_SKIP_NONREF && bp->frame_duration && step > bp->frame_duration)
+            bp->skipped += (step + bp->frame_duration / 2) / bp->frame_duration - 1;
+        if (!bp->frame_duration || step < bp->frame_duration)
+            bp->frame_duration = step;
+    }
+    bp->last_pts = pts;
+
+    double media = (pts - bp->first_pts) * av_q2d(bp->time_base);
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - bp->start).count();
+    double lag = now - media;
+    if (lag < 0)
+    {
+        // ahead of the input clock; a timestamp jump restarts the clock instead of stalling
+        if (lag < -bp->params.max_lag)
+            bp->first_pts = pts - (int64_t)(now / av_q2d(bp->time_base));
+        else
+            std::this_thread::sleep_for(std::chrono::duration<double>(-lag));
+        lag = 0;
+    }
+    bp->level_seconds[bp->level] += now - bp->last_frame_time;
+    bp->last_frame_time = now;
+    bp->max_lag = FFMAX(bp->max_lag, lag);
+
+    if (now - bp->last_change >= bp->params.settle)
+    {
+        int next = bp->level + 1;
+        if (next == DEGRADE_FAST_PRESET && bp->fast_preset_unavailable)
+            next = DEGRADE_LEVELS;
+        if (next < DEGRADE_LEVELS && lag > threshold(bp, next))
+        {
+            if (set_level(bp, decoder, encoder, (DegradeLevel)next, now, lag))
+                return -1;
+        }
+        else if (bp->level > DEGRADE_NONE && lag < threshold(bp, DEGRADE_SKIP_NONREF) / 2)
+        {
+            if (bp->calm_since < 0)
+                bp->calm_since = now;
+            else if (now - bp->calm_since >= 2 * bp->params.settle &&
+                     set_level(bp, decoder, encoder, (DegradeLevel)(bp->level - 1), now, lag))
+                return -1;
+        }
+        else
+        {
+            bp->calm_since = -1;
+        }
+    }
+
+    // timestamps are kept, the dropped frame only leaves a longer gap before the next one
+    if (bp->level >= DEGRADE_HALF_RATE && bp->frames % 2)
+    {
+        bp->dropped++;
+        return 1;
+    }
+    return 0;
+}
+
+static int write_metrics(const Backpressure *bp, const char *path)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (!f)
+    {
+        logging("live: could not open metrics %s", path);
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"frames\": %lld,\n  \"dropped\": %lld,\n  \"skipped_nonref\": %lld,\n  \"max_lag\": %.3f,\n",
+            (long long)bp->frames, (long long)bp->dropped, (long long)bp->skipped, bp->max_lag);
+    fprintf(f, "  \"level\": \"%s\",\n  \"fast_preset\": %s,\n  \"seconds_at_level\": {", level_names[bp->level],
+            bp->fast_preset ? "true" : "false");
+    for (int i = 0; i < DEGRADE_LEVELS; i++)
+        fprintf(f, "%s\"%s\": %.3f", i ? ", " : "", level_names[i], bp->level_seconds[i]);
+    fprintf(f, "},\n  \"events\": [");
+    for (size_t i = 0; i < bp->events.size(); i++)
+    {
+        const DegradeEvent &e = bp->events[i];
+        fprintf(f, "%s\n    {\"time\": %.3f, \"lag\": %.3f, \"from\": \"%s\", \"to\": \"%s\"}", i ? "," : "", e.time,
+                e.lag, level_names[e.from], level_names[e.to]);
+    }
+    fprintf(f, "%s]\n}\n", bp->events.empty() ? "" : "\n  ");
+
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
+
+void backpressure_report(const Backpressure *bp)
+{
+    logging("live: %lld frames, %lld dropped, about %lld non-reference frames skipped, %zu level changes, "
+            "max lag %.2f s, ending at %s",
+            (long long)bp->frames, (long long)bp->dropped, (long long)bp->skipped, bp->events.size(), bp->max_lag,
+            level_names[bp->level]);
+    if (bp->params.metrics_path)
+        write_metrics(bp, bp->params.metrics_path);
+}
+
+void backpressure_free(Backpressure **bp)
+{
+    delete *bp;
+    *bp = NULL;
+}
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "transcode_job.h"
+#include "worker_pool.h"
+
+// out.mp4 -> out-3.mp4
+static std::string numbered_output(const char *filename, int index)
+{
+    std::string name(filename);
+    size_t dot = name.find_last_of('.');
+    size_t slash = name.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = name.size();
+    return name.substr(0, dot) + "-" + std::to_string(index) + name.substr(dot);
+}
+
+static int run_concurrent(const TranscodeJob *job, int count, ThreadBudget *budget)
+{
+    std::vector<std::string> outputs;
+    std::vector<TranscodeJob> jobs(count, *job);
+    std::vector<TranscodeStats> stats(count);
+    for (int i = 0; i < count; i++)
+        outputs.push_back(numbered_output(job->out_filename, i));
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].out_filename = outputs[i].c_str();
+        jobs[i].budget = budget;
+        // every copy would hit the first one's output
+        jobs[i].cache.dir = NULL;
+    }
+
+    if (budget)
+        thread_budget_expect(budget, count);
+    WorkerPool *pool = worker_pool_create(count);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+        worker_pool_submit(pool, [&jobs, &stats, i] { transcode_file(&jobs[i], &stats[i]); });
+    worker_pool_wait(pool);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    worker_pool_destroy(&pool);
+
+    int64_t frames = 0;
+    double slowest = 0;
+    int failed = 0;
+    for (const TranscodeStats &s : stats)
+    {
+        frames += s.video_frames;
+        slowest = FFMAX(slowest, s.seconds);
+        failed += s.result < 0;
+    }
+    logging("%d jobs, %s: %.2f s, %" PRId64 " frames, %.1f fps aggregate, %.1f fps per job, slowest job %.2f s%s",
+            count, budget ? "shared budget" : "unmanaged threads", seconds, frames, seconds > 0 ? frames / seconds : 0.0,
+            seconds > 0 ? frames / seconds / count : 0.0, slowest, failed ? ", some jobs failed" : "");
+    return failed ? -1 : 0;
+}
+
+int transcode_bench_jobs(const TranscodeJob *job, const int *counts, int n, int budget_threads)
+{
+    if (job->fanout_count)
+    {
+        logging("--bench-jobs runs its jobs on threads and cannot fork --fanout encoders");
+        return -1;
+    }
+    // every copy would write the same report
+    TranscodeJob base = *job;
+    base.sp.timeline_path = NULL;
+    base.sp.loudness_path = NULL;
+
+    ThreadBudget *budget = thread_budget_create(budget_threads);
+    int ret = 0;
+    for (int i = 0; i < n && ret == 0; i++)
+    {
+        ret = run_concurrent(&base, counts[i], NULL);
+        if (ret == 0)
+            ret = run_concurrent(&base, counts[i], budget);
+    }
+    thread_budget_report(budget);
+    thread_budget_free(&budget);
+    return ret;
+}
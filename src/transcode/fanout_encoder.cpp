@@ -0,0 +1,186 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fanout_encoder.h"
+
+// decoded frames the slowest encoder may fall behind by before decoding waits
+#define FANOUT_RING_SLOTS 16
+
+int fanout_parse_target(const char *spec, FanoutTarget *target)
+{
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon == spec || !colon[1])
+    {
+        logging("fanout target %s is not codec:output", spec);
+        return -1;
+    }
+    target->video_codec = av_strndup(spec, colon - spec);
+    target->filename = av_strdup(colon + 1);
+    target->pid = -1;
+    return target->video_codec && target->filename ? 0 : -1;
+}
+
+static int run_encoder(StreamingContext *decoder, const CropRect *crop, StreamingParams sp, FanoutTarget *target,
+                       int consumer)
+{
+    StreamingContext *encoder = (StreamingContext *)calloc(1, sizeof(StreamingContext));
+    encoder->filename = target->filename;
+    encoder->crop = *crop;
+
+    // codec private options of the main encoder do not carry over to another codec
+    if (strcmp(sp.video_codec, target->video_codec))
+    {
+        sp.codec_priv_key = NULL;
+        sp.codec_priv_value = NULL;
+    }
+    sp.video_codec = target->video_codec;
+
+    avformat_alloc_output_context2(&encoder->avfc, NULL, NULL, encoder->filename);
+    if (!encoder->avfc)
+    {
+        logging("could not allocate memory for output format");
+        return -1;
+    }
+
+    AVRational input_framerate = av_guess_frame_rate(decoder->avfc, decoder->video_avs, NULL);
+    if (prepare_video_encoder(encoder, decoder->video_avcc, input_framerate, sp))
+        return -1;
+
+    if (!(encoder->avfc->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&encoder->avfc->pb, encoder->filename, AVIO_FLAG_WRITE) < 0)
+    {
+        logging("could not open the output file %s", encoder->filename);
+        return -1;
+    }
+
+    if (avformat_write_header(encoder->avfc, NULL) < 0)
+    {
+        logging("an error occurred when opening output file %s", encoder->filename);
+        return -1;
+    }
+
+    // the output carries only the video stream
+    decoder->video_index = 0;
+    trace_thread_name(target->filename);
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return -1;
+
+    int ret;
+    int64_t start = trace_begin();
+    while ((ret = frame_ring_acquire(decoder->frame_ring, consumer, frame)) >= 0)
+    {
+        trace_end("ring wait", start, frame->pts);
+        ret = encode_video(decoder, encoder, frame);
+        av_frame_unref(frame);
+        if (ret)
+            break;
+        start = trace_begin();
+    }
+    av_frame_free(&frame);
+    if (ret != AVERROR_EOF)
+        return -1;
+
+    if (encode_video(decoder, encoder, NULL))
+        return -1;
+    if (av_write_trailer(encoder->avfc) < 0)
+        return -1;
+    avio_closep(&encoder->avfc->pb);
+    return 0;
+}
+
+int fanout_start(StreamingContext *decoder, const CropRect *crop, StreamingParams sp, FanoutTarget *targets,
+                 int count)
+{
+    AVCodecContext *avcc = decoder->video_avcc;
+    int width = crop->width ? crop->width : avcc->width;
+    int height = crop->height ? crop->height : avcc->height;
+
+    decoder->frame_ring = frame_ring_create(FANOUT_RING_SLOTS, count, width, height, avcc->pix_fmt);
+    if (!decoder->frame_ring)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            logging("failed to start the encoder for %s", targets[i].filename);
+            frame_ring_detach(decoder->frame_ring, i);
+            continue;
+        }
+        if (pid == 0)
+        {
+            // nothing has been decoded since the crop detection and run_job opens the decoder without
+            // threads for a fanout, so the child starts from a clean copy and only ever touches the ring
+            // and its own encoder
+            int ret = run_encoder(decoder, crop, sp, &targets[i], i);
+            trace_stop();
+            log_flush();
+            _exit(ret ? 1 : 0);
+        }
+        targets[i].pid = pid;
+        frame_ring_set_consumer_pid(decoder->frame_ring, i, pid);
+        logging("encoding %s with %s in process %d", targets[i].filename, targets[i].video_codec, (int)pid);
+    }
+    return 0;
+}
+
+int fanout_finish(StreamingContext *decoder, FanoutTarget *targets, int count)
+{
+    int failed = 0;
+    if (!decoder->frame_ring)
+        return 0;
+
+    frame_ring_finish(decoder->frame_ring);
+    for (int i = 0; i < count; i++)
+    {
+        int status;
+        if (targets[i].pid <= 0)
+        {
+            logging("encoder for %s never started", targets[i].filename);
+            failed++;
+            continue;
+        }
+        if (waitpid(targets[i].pid, &status, 0) < 0)
+        {
+            logging("could not wait for the encoder of %s", targets[i].filename);
+            failed++;
+        }
+        else if (WIFSIGNALED(status))
+        {
+            logging("encoder for %s crashed with signal %d", targets[i].filename, WTERMSIG(status));
+            failed++;
+        }
+        else if (WEXITSTATUS(status))
+        {
+            logging("encoder for %s failed", targets[i].filename);
+            failed++;
+        }
+    }
+    frame_ring_free(&decoder->frame_ring);
+    return failed;
+}
+
+void fanout_abort(StreamingContext *decoder, FanoutTarget *targets, int count)
+{
+    if (!decoder->frame_ring)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (targets[i].pid <= 0)
+            continue;
+        kill(targets[i].pid, SIGTERM);
+        while (waitpid(targets[i].pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        targets[i].pid = 0;
+    }
+    logging("stopped %d fanout encoders, their outputs are incomplete", count);
+    frame_ring_free(&decoder->frame_ring);
+}
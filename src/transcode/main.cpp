@@ -1,8 +1,17 @@
 #include <iostream>
+#include <vector>
 
 #include "config.h"
+#include "transcode_job.h"
 #include "video_debug.h"
-#include "video_process.h"
+
+static const char *option_value(const char *arg, const char *name)
+{
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=')
+        return arg + length + 1;
+    return NULL;
+}
 
 int main(int argc, char *argv[])
 {
@@ -70,169 +79,217 @@ int main(int argc, char *argv[])
     // sp.audio_codec = "libvorbis";
     // sp.output_extension = ".webm";
 
-    StreamingContext *decoder = (StreamingContext *)calloc(1, sizeof(StreamingContext));
-    decoder->filename = argv[1];
-
-    StreamingContext *encoder = (StreamingContext *)calloc(1, sizeof(StreamingContext));
-    encoder->filename = argv[2];
-
-    if (sp.output_extension)
-        strcat(encoder->filename, sp.output_extension);
+    interleaver_default_params(&sp.interleave);
+    affinity_default_params(&sp.affinity);
+    backpressure_default_params(&sp.backpressure);
+    decimate_default_params(&sp.decimate);
+    sp.preview.width = 640;
+    CacheParams cache;
+    cache_default_params(&cache);
+    FanoutTarget fanout[FANOUT_MAX_TARGETS];
+    int fanout_count = 0;
+    FramePoolMode frame_pool_mode = FRAME_POOL_ON;
+    // -1 leaves every codec to size its own threads, 0 budgets the CPUs this process may use
+    int budget_threads = 0;
+    std::vector<int> bench_counts;
 
-    if (open_media(decoder->filename, &decoder->avfc))
-        return -1;
-    if (prepare_decoder(decoder))
-        return -1;
-
-    avformat_alloc_output_context2(&encoder->avfc, NULL, NULL, encoder->filename);
-    if (!encoder->avfc)
+    for (int i = 3; i < argc; i++)
     {
-        logging("could not allocate memory for output format");
-        return -1;
-    }
-
-    if (!sp.copy_video)
-    {
-        AVRational input_framerate = av_guess_frame_rate(decoder->avfc, decoder->video_avs, NULL);
-        prepare_video_encoder(encoder, decoder->video_avcc, input_framerate, sp);
-    }
-    else
-    {
-        if (prepare_copy(encoder->avfc, &encoder->video_avs, decoder->video_avs->codecpar))
+        const char *value = NULL;
+        if ((value = option_value(argv[i], "--timeline")))
         {
-            return -1;
+            sp.timeline_path = const_cast<char *>(value);
         }
-    }
-
-    if (!sp.copy_audio)
-    {
-        if (prepare_audio_encoder(encoder, decoder->audio_avcc->sample_rate, sp))
+        else if ((value = option_value(argv[i], "--auto-crop")))
         {
-            return -1;
+            sp.auto_crop_seconds = atof(value);
         }
-    }
-    else
-    {
-        if (prepare_copy(encoder->avfc, &encoder->audio_avs, decoder->audio_avs->codecpar))
+        else if ((value = option_value(argv[i], "--loudness")))
         {
-            return -1;
+            sp.loudness_path = const_cast<char *>(value);
         }
-    }
-
-    if (encoder->avfc->oformat->flags & AVFMT_GLOBALHEADER)
-        encoder->avfc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-    if (!(encoder->avfc->oformat->flags & AVFMT_NOFILE))
-    {
-        if (avio_open(&encoder->avfc->pb, encoder->filename, AVIO_FLAG_WRITE) < 0)
+        else if ((value = option_value(argv[i], "--faststart")))
         {
-            logging("could not open the output file");
-            return -1;
+            if (faststart_parse_mode(value, &sp.faststart.mode))
+                return -1;
         }
-    }
-
-    AVDictionary *muxer_opts = NULL;
-
-    if (sp.muxer_opt_key && sp.muxer_opt_value)
-    {
-        av_dict_set(&muxer_opts, sp.muxer_opt_key, sp.muxer_opt_value, 0);
-    }
-
-    if (avformat_write_header(encoder->avfc, &muxer_opts) < 0)
-    {
-        logging("an error occurred when opening output file");
-        return -1;
-    }
-
-    AVFrame *input_frame = av_frame_alloc();
-    if (!input_frame)
-    {
-        logging("failed to allocated memory for AVFrame");
-        return -1;
-    }
-
-    AVPacket *input_packet = av_packet_alloc();
-    if (!input_packet)
-    {
-        logging("failed to allocated memory for AVPacket");
-        return -1;
-    }
-
-    while (av_read_frame(decoder->avfc, input_packet) >= 0)
-    {
-        if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        else if ((value = option_value(argv[i], "--faststart-cap")))
+        {
+            sp.faststart.memory_cap = (int64_t)atoi(value) << 20;
+        }
+        else if ((value = option_value(argv[i], "--max-interleave-delay")))
+        {
+            sp.interleave.max_delay_us = (int64_t)(atof(value) * AV_TIME_BASE);
+        }
+        else if ((value = option_value(argv[i], "--max-interleave-bytes")))
+        {
+            sp.interleave.max_bytes = (int64_t)atoi(value) << 20;
+        }
+        else if ((value = option_value(argv[i], "--stall-policy")))
+        {
+            if (interleaver_parse_policy(value, &sp.interleave.policy))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--fanout")))
         {
-            if (!sp.copy_video)
+            if (fanout_count == FANOUT_MAX_TARGETS)
             {
-                // TODO: refactor to be generic for audio and video (receiving a function pointer to the differences)
-                if (transcode_video(decoder, encoder, input_packet, input_frame))
-                    return -1;
-                av_packet_unref(input_packet);
+                logging("at most %d --fanout targets", FANOUT_MAX_TARGETS);
+                return -1;
             }
-            else
+            if (fanout_parse_target(value, &fanout[fanout_count++]))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--frame-pool")))
+        {
+            if (frame_pool_parse_mode(value, &frame_pool_mode))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--affinity")))
+        {
+            if (affinity_parse_mode(value, &sp.affinity.mode))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--numa-node")))
+        {
+            if (affinity_parse_node(value, &sp.affinity.node))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--decimate-max")))
+        {
+            sp.decimate.enabled = 1;
+            sp.decimate.max_drops = atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--preview")))
+        {
+            sp.preview.enabled = 1;
+            sp.preview.width = atoi(value);
+            if (sp.preview.width < 16)
             {
-                if (remux(&input_packet, &encoder->avfc, decoder->video_avs->time_base, encoder->video_avs->time_base))
-                    return -1;
+                logging("--preview takes a proxy width of at least 16");
+                return -1;
             }
         }
-        else if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        else if ((value = option_value(argv[i], "--roi")))
         {
-            if (!sp.copy_audio)
+            CropRect *roi = &sp.roi;
+            if (sscanf(value, "%dx%d+%d+%d", &roi->width, &roi->height, &roi->x, &roi->y) != 4 || roi->width <= 0 ||
+                roi->height <= 0 || roi->x < 0 || roi->y < 0)
             {
-                if (transcode_audio(decoder, encoder, input_packet, input_frame))
-                    return -1;
-                av_packet_unref(input_packet);
+                logging("--roi takes WxH+X+Y");
+                return -1;
             }
-            else
+        }
+        else if ((value = option_value(argv[i], "--cache")))
+        {
+            cache.dir = value;
+        }
+        else if ((value = option_value(argv[i], "--cache-hash")))
+        {
+            if (cache_parse_hash(value, &cache.hash))
+                return -1;
+        }
+        else if ((value = option_value(argv[i], "--cache-max")))
+        {
+            cache.max_bytes = (int64_t)atoi(value) << 20;
+        }
+        else if ((value = option_value(argv[i], "--live-max-lag")))
+        {
+            sp.backpressure.max_lag = atof(value);
+        }
+        else if ((value = option_value(argv[i], "--live-metrics")))
+        {
+            sp.backpressure.metrics_path = value;
+        }
+        else if ((value = option_value(argv[i], "--thread-budget")))
+        {
+            budget_threads = !strcmp(value, "off") ? -1 : !strcmp(value, "auto") ? 0 : atoi(value);
+        }
+        else if ((value = option_value(argv[i], "--bench-jobs")))
+        {
+            for (const char *count = value; *count; count = strchr(count, ',') ? strchr(count, ',') + 1 : "")
             {
-                if (remux(&input_packet, &encoder->avfc, decoder->audio_avs->time_base, encoder->audio_avs->time_base))
+                if (atoi(count) <= 0)
+                {
+                    logging("--bench-jobs takes a list of job counts like 1,2,4");
                     return -1;
+                }
+                bench_counts.push_back(atoi(count));
             }
         }
+        else if ((value = option_value(argv[i], "--trace")))
+        {
+            trace_start(value);
+            trace_thread_name("transcode");
+        }
+        else if ((value = option_value(argv[i], "--log-level")))
+        {
+            LogLevel level;
+            if (log_parse_level(value, &level))
+                return -1;
+            log_set_level(level);
+        }
+        else if (strcmp(argv[i], "--auto-crop") == 0)
+        {
+            sp.auto_crop_seconds = 10;
+        }
+        else if (strcmp(argv[i], "--decimate") == 0)
+        {
+            sp.decimate.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--preview") == 0)
+        {
+            sp.preview.enabled = 1;
+        }
+        else if (strcmp(argv[i], "--live") == 0)
+        {
+            // skip-nonref, half-rate and, for in-band header outputs such as MPEG-TS only, fast-preset
+            sp.backpressure.enabled = 1;
+        }
         else
         {
-            logging("ignoring all non video or audio packets");
+            logging("unknown option %s", argv[i]);
+            return -1;
         }
     }
-    // TODO: should I also flush the audio encoder?
-    if (encode_video(decoder, encoder, NULL))
-        return -1;
 
-    av_write_trailer(encoder->avfc);
-
-    if (muxer_opts != NULL)
+    // a cheap proxy: fast decoding, small frames, short GOPs so scrubbing stays quick
+    if (sp.preview.enabled)
     {
-        av_dict_free(&muxer_opts);
-        muxer_opts = NULL;
+        sp.video_codec = "libx264";
+        sp.codec_priv_key = "x264-params";
+        sp.codec_priv_value = "keyint=15:min-keyint=15:scenecut=0";
     }
 
-    if (input_frame != NULL)
+    TranscodeJob job;
+    job.in_filename = argv[1];
+    job.out_filename = argv[2];
+    job.sp = sp;
+    job.fanout = fanout;
+    job.fanout_count = fanout_count;
+    job.frame_pool_mode = frame_pool_mode;
+    job.budget = NULL;
+    job.cache = cache;
+
+    int ret;
+    if (bench_counts.size())
     {
-        av_frame_free(&input_frame);
-        input_frame = NULL;
+        ret = transcode_bench_jobs(&job, bench_counts.data(), bench_counts.size(), budget_threads);
     }
-
-    if (input_packet != NULL)
+    else
     {
-        av_packet_free(&input_packet);
-        input_packet = NULL;
+        if (budget_threads >= 0)
+            job.budget = thread_budget_create(budget_threads);
+        TranscodeStats stats;
+        ret = transcode_file(&job, &stats);
+        if (job.budget)
+        {
+            logging("%" PRId64 " frames in %.2f s with %d decoder and %d encoder threads", stats.video_frames,
+                    stats.seconds, stats.threads.decoder_threads, stats.threads.encoder_threads);
+            thread_budget_free(&job.budget);
+        }
     }
 
-    avformat_close_input(&decoder->avfc);
-
-    avformat_free_context(decoder->avfc);
-    decoder->avfc = NULL;
-    avformat_free_context(encoder->avfc);
-    encoder->avfc = NULL;
-
-    avcodec_free_context(&decoder->video_avcc);
-    decoder->video_avcc = NULL;
-    avcodec_free_context(&decoder->audio_avcc);
-    decoder->audio_avcc = NULL;
-
-    free(decoder);
-    decoder = NULL;
-    free(encoder);
-    encoder = NULL;
-    return 0;
-}
\ No newline at end of file
+    trace_stop();
+    return ret;
+}
@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "transcode_cache.h"
+
+#define CACHE_SAMPLE_EDGE (1 << 20)
+#define CACHE_SAMPLE_BLOCK (64 << 10)
+#define CACHE_SAMPLE_BLOCKS 32
+// temporary files of a publish that died halfway
+#define CACHE_STALE_SECONDS 3600
+
+// two independent 64-bit lanes, not cryptographic: keys only need to tell honest inputs apart
+typedef struct CacheHash
+{
+    uint64_t a;
+    uint64_t b;
+} CacheHash;
+
+typedef struct CacheEntry
+{
+    std::string path;
+    int64_t size;
+    // the mtime, bumped on every hit
+    int64_t used;
+} CacheEntry;
+
+void cache_default_params(CacheParams *params)
+{
+    params->dir = NULL;
+    params->hash = CACHE_HASH_SAMPLED;
+    params->max_bytes = (int64_t)10240 << 20;
+}
+
+int cache_parse_hash(const char *name, CacheHashMode *mode)
+{
+    if (!strcmp(name, "sampled"))
+        *mode = CACHE_HASH_SAMPLED;
+    else if (!strcmp(name, "full"))
+        *mode = CACHE_HASH_FULL;
+    else
+    {
+        logging("unknown cache hash '%s', use sampled or full", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void hash_init(CacheHash *h)
+{
+    h->a = 0x243f6a8885a308d3ULL;
+    h->b = 0x13198a2e03707344ULL;
+}
+
+static void hash_word(CacheHash *h, uint64_t k)
+{
+    uint64_t a = h->a ^ k, b = h->b ^ ((k << 29) | (k >> 35));
+    a = (a ^ (a >> 33)) * 0xff51afd7ed558ccdULL;
+    a = (a ^ (a >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    b = (b ^ (b >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    b = (b ^ (b >> 27)) * 0x94d049bb133111ebULL;
+    h->a = a ^ (a >> 33);
+    h->b = b ^ (b >> 31);
+}
+
+static void hash_update(CacheHash *h, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, bytes + i, 8);
+        hash_word(h, k);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    hash_word(h, tail);
+    hash_word(h, size);
+}
+
+static int hash_range(int fd, int64_t offset, int64_t size, CacheHash *h, std::vector<uint8_t> &buffer)
+{
+    while (size > 0)
+    {
+        size_t chunk = FFMIN((int64_t)buffer.size(), size), done = 0;
+        while (done < chunk)
+        {
+            ssize_t n = pread(fd, buffer.data() + done, chunk - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            done += n;
+        }
+        hash_update(h, buffer.data(), chunk);
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int hash_input(const CacheParams *params, const char *path, std::string &text)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        logging("cache: could not read %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    CacheHash h;
+    hash_init(&h);
+    std::vector<uint8_t> buffer(CACHE_SAMPLE_EDGE);
+    int64_t size = st.st_size;
+    int ret;
+    if (params->hash == CACHE_HASH_FULL || size <= 2 * CACHE_SAMPLE_EDGE + CACHE_SAMPLE_BLOCKS * CACHE_SAMPLE_BLOCK)
+    {
+        ret = hash_range(fd, 0, size, &h, buffer);
+    }
+    else
+    {
+        // the headers and the index live at the ends, the blocks catch edits in the middle
+        ret = hash_range(fd, 0, CACHE_SAMPLE_EDGE, &h, buffer);
+        int64_t span = size - 2 * CACHE_SAMPLE_EDGE - CACHE_SAMPLE_BLOCK;
+        for (int i = 0; i < CACHE_SAMPLE_BLOCKS && !ret; i++)
+            ret = hash_range(fd, CACHE_SAMPLE_EDGE + span * i / (CACHE_SAMPLE_BLOCKS - 1), CACHE_SAMPLE_BLOCK, &h,
+                             buffer);
+        if (!ret)
+            ret = hash_range(fd, size - CACHE_SAMPLE_EDGE, CACHE_SAMPLE_EDGE, &h, buffer);
+    }
+    close(fd);
+    if (ret)
+    {
+        logging("cache: reading %s failed", path);
+        return -1;
+    }
+
+    char line[160];
+    if (params->hash == CACHE_HASH_FULL)
+        snprintf(line, sizeof(line), "input=full:%016llx%016llx size=%lld\n", (unsigned long long)h.a,
+                 (unsigned long long)h.b, (long long)size);
+    else
+        snprintf(line, sizeof(line), "input=sampled:%016llx%016llx size=%lld mtime=%lld.%09ld\n",
+                 (unsigned long long)h.a, (unsigned long long)h.b, (long long)size, (long long)st.st_mtim.tv_sec,
+                 st.st_mtim.tv_nsec);
+    text += line;
+    return 0;
+}
+
+static void add_string(std::string &text, const char *name, const char *value)
+{
+    text += name;
+    text += value ? "=" : "!";
+    if (value)
+        text += value;
+    text += '\n';
+}
+
+static void add_number(std::string &text, const char *name, double value)
+{
+    char line[96];
+    snprintf(line, sizeof(line), "%s=%.17g\n", name, value);
+    text += line;
+}
+
+// every field that changes the bytes written; placement, threads and side outputs do not
+static void add_params(std::string &text, const StreamingParams *sp)
+{
+    add_number(text, "copy_video", sp->copy_video);
+    add_number(text, "copy_audio", sp->copy_audio);
+    add_string(text, "output_extension", sp->output_extension);
+    add_string(text, "muxer_opt_key", sp->muxer_opt_key);
+    add_string(text, "muxer_opt_value", sp->muxer_opt_value);
+    add_string(text, "video_codec", sp->video_codec);
+    add_string(text, "audio_codec", sp->audio_codec);
+    add_string(text, "codec_priv_key", sp->codec_priv_key);
+    add_string(text, "codec_priv_value", sp->codec_priv_value);
+    add_number(text, "auto_crop_seconds", sp->auto_crop_seconds);
+    add_number(text, "faststart.mode", sp->faststart.mode);
+    add_number(text, "interleave.max_delay_us", sp->interleave.max_delay_us);
+    add_number(text, "interleave.max_bytes", sp->interleave.max_bytes);
+    add_number(text, "interleave.policy", sp->interleave.policy);
+    add_number(text, "decimate.enabled", sp->decimate.enabled);
+    add_number(text, "decimate.block_max", sp->decimate.block_max);
+    add_number(text, "decimate.block_changed", sp->decimate.block_changed);
+    add_number(text, "decimate.changed_fraction", sp->decimate.changed_fraction);
+    add_number(text, "decimate.max_drops", sp->decimate.max_drops);
+    add_number(text, "preview.enabled", sp->preview.enabled);
+    add_number(text, "preview.width", sp->preview.width);
+    char roi[96];
+    snprintf(roi, sizeof(roi), "%dx%d+%d+%d", sp->roi.width, sp->roi.height, sp->roi.x, sp->roi.y);
+    add_string(text, "roi", roi);
+}
+
+int transcode_cache_key(const CacheParams *params, const char *in_filename, const StreamingParams *sp,
+                        const char *out_filename, char *key)
+{
+    if (sp->timeline_path || sp->loudness_path)
+    {
+        logging("cache: not used, --timeline and --loudness need the input decoded");
+        return 0;
+    }
+    if (sp->backpressure.enabled)
+    {
+        logging("cache: not used, a --live output depends on how fast it ran");
+        return 0;
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "transcode-cache 1 tool=%d.%d avcodec=%u avformat=%u\n", Tutorial_VERSION_MAJOR,
+             Tutorial_VERSION_MINOR, avcodec_version(), avformat_version());
+    std::string text = line;
+    if (synth_is_source(in_filename))
+        add_string(text, "input", in_filename);
+    else if (hash_input(params, in_filename, text) < 0)
+        return -1;
+
+    // the container comes from the output extension
+    const char *slash = strrchr(out_filename, '/');
+    const char *dot = strrchr(slash ? slash : out_filename, '.');
+    add_string(text, "container", dot);
+    add_params(text, sp);
+
+    CacheHash h;
+    hash_init(&h);
+    hash_update(&h, text.data(), text.size());
+    snprintf(key, TRANSCODE_CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long)h.a, (unsigned long long)h.b);
+    return 1;
+}
+
+// in the kernel where it can, which is a reflink on filesystems that share extents
+static int copy_file(int in, int out)
+{
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+        ;
+    if (n == 0)
+        return 0;
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+        return -1;
+
+    std::vector<char> buffer(1 << 20);
+    while ((n = read(in, buffer.data(), buffer.size())) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        for (ssize_t done = 0; done < n;)
+        {
+            ssize_t written = write(out, buffer.data() + done, n - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return -1;
+            done += written;
+        }
+    }
+    return 0;
+}
+
+// writes a temporary file next to path and renames it over path, readers never see half a file
+static int copy_atomic(int in, const char *path)
+{
+    std::string temp = std::string(path);
+    size_t slash = temp.rfind('/');
+    temp.insert(slash == std::string::npos ? 0 : slash + 1, ".tmp-");
+    temp += "-XXXXXX";
+    std::vector<char> name(temp.begin(), temp.end());
+    name.push_back(0);
+
+    int out = mkostemp(name.data(), O_CLOEXEC);
+    if (out < 0)
+        return -1;
+    int ret = fchmod(out, 0644) || copy_file(in, out) ? -1 : 0;
+    if (close(out))
+        ret = -1;
+    if (!ret && rename(name.data(), path))
+        ret = -1;
+    if (ret)
+        unlink(name.data());
+    return ret;
+}
+
+int transcode_cache_fetch(const CacheParams *params, const char *key, const char *out_filename)
+{
+    std::string entry = std::string(params->dir) + "/" + key;
+    int in = open(entry.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return 0;
+
+    int ret = copy_atomic(in, out_filename);
+    if (ret)
+        logging("cache: could not copy %s to %s", entry.c_str(), out_filename);
+    else
+        futimens(in, NULL);
+    close(in);
+    return ret ? 0 : 1;
+}
+
+// oldest mtime first until the rest fits; an entry removed while another process copies it stays readable there
+static void evict(const CacheParams *params)
+{
+    DIR *dir = opendir(params->dir);
+    if (!dir)
+        return;
+
+    std::vector<CacheEntry> entries;
+    int64_t total = 0;
+    time_t now = time(NULL);
+    while (struct dirent *file = readdir(dir))
+    {
+        std::string path = std::string(params->dir) + "/" + file->d_name;
+        struct stat st;
+        if (file->d_name[0] == '.' && strncmp(file->d_name, ".tmp-", 5))
+            continue;
+        if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+        if (!strncmp(file->d_name, ".tmp-", 5))
+        {
+            if (now - st.st_mtime > CACHE_STALE_SECONDS)
+                unlink(path.c_str());
+            continue;
+        }
+        entries.push_back({path, (int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec});
+        total += st.st_size;
+    }
+    closedir(dir);
+    if (total <= params->max_bytes)
+        return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const CacheEntry &x, const CacheEntry &y) { return x.used < y.used; });
+    int evicted = 0;
+    for (size_t i = 0; i < entries.size() && total > params->max_bytes; i++)
+    {
+        if (unlink(entries[i].path.c_str()) && errno != ENOENT)
+            continue;
+        total -= entries[i].size;
+        evicted++;
+    }
+    logging("cache: evicted %d entries, %.1f MiB left", evicted, total / (double)(1 << 20));
+}
+
+int transcode_cache_publish(const CacheParams *params, const char *key, const char *out_filename)
+{
+    if (mkdir(params->dir, 0755) && errno != EEXIST)
+    {
+        logging("cache: could not create %s", params->dir);
+        return -1;
+    }
+    int in = open(out_filename, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        logging("cache: could not read %s", out_filename);
+        return -1;
+    }
+    struct stat st;
+    if (!fstat(in, &st) && st.st_size > params->max_bytes)
+    {
+        logging("cache: %s is larger than the whole cache, not stored", out_filename);
+        close(in);
+        return 0;
+    }
+    std::string entry = std::string(params->dir) + "/" + key;
+    int ret = copy_atomic(in, entry.c_str());
+    close(in);
+    if (ret)
+    {
+        logging("cache: could not store %s", entry.c_str());
+        return -1;
+    }
+    evict(params);
+    return 0;
+}
@@ -0,0 +1,518 @@
+#include <chrono>
+
+#include "transcode_job.h"
+
+// everything a job allocates, so every way out of run_job frees the same things
+typedef struct TranscodeRun
+{
+    StreamingContext *decoder;
+    StreamingContext *encoder;
+    AVFrame *input_frame;
+    AVPacket *input_packet;
+    AVDictionary *muxer_opts;
+    SynthSource *synth_source;
+    FaststartOutput faststart;
+    Placement placement;
+    ThreadGrant threads;
+    int fanout_failed;
+} TranscodeRun;
+
+static int run_job(const TranscodeJob *job, TranscodeRun *t)
+{
+    StreamingParams sp = job->sp;
+    StreamingContext *decoder = t->decoder;
+    StreamingContext *encoder = t->encoder;
+
+    SynthParams synth;
+    int synthetic = synth_is_source(job->in_filename);
+    if (synthetic)
+    {
+        if (synth_parse(job->in_filename, &synth))
+            return -1;
+        if (sp.copy_video)
+        {
+            logging("a synth source has no video stream to copy");
+            return -1;
+        }
+        // generated audio is raw and always goes through an encoder
+        if (sp.copy_audio)
+        {
+            sp.copy_audio = 0;
+            sp.audio_codec = "aac";
+        }
+    }
+
+    decoder->filename = const_cast<char *>(job->in_filename);
+    encoder->filename = av_asprintf("%s%s", job->out_filename, sp.output_extension ? sp.output_extension : "");
+    if (!encoder->filename)
+        return -1;
+
+    // before any decoder, encoder or fanout child exists, they all inherit the node
+    if (affinity_place_job(&sp.affinity, &t->placement))
+        return -1;
+
+    if (job->budget)
+    {
+        thread_budget_acquire(job->budget, &t->threads);
+        decoder->threads = t->threads;
+        encoder->threads = t->threads;
+    }
+    // the fanout forks after the decoder is open, a threaded decoder would leave its workers' locks behind
+    if (job->fanout_count)
+        decoder->threads.decoder_threads = 1;
+
+    if (synthetic)
+    {
+        if (prepare_synth_decoder(decoder, &synth))
+            return -1;
+        // a file's frames are left to the encoder as before, generated ones would only make garbage
+        const AVCodec *codec = avcodec_find_encoder_by_name(sp.video_codec);
+        if (codec && !encoder_accepts_pix_fmt(codec, decoder->video_avcc->pix_fmt))
+        {
+            logging("synth: %s cannot encode %s frames, pick a pix_fmt it supports", sp.video_codec,
+                    av_get_pix_fmt_name(decoder->video_avcc->pix_fmt));
+            return -1;
+        }
+    }
+    else
+    {
+        decoder->frame_pool = frame_pool_alloc(job->frame_pool_mode);
+        if (sp.preview.enabled && !sp.copy_video)
+            decoder->preview_width = sp.preview.width;
+        if (open_media(decoder->filename, &decoder->avfc))
+            return -1;
+        if (prepare_decoder(decoder))
+            return -1;
+    }
+
+    avformat_alloc_output_context2(&encoder->avfc, NULL, NULL, encoder->filename);
+    if (!encoder->avfc)
+    {
+        logging("could not allocate memory for output format");
+        return -1;
+    }
+
+    if (sp.timeline_path && sp.copy_video)
+    {
+        logging("ignoring --timeline, the video stream is copied");
+    }
+    else if (sp.timeline_path)
+    {
+        FrameAnalysisParams analysis_params;
+        frame_analysis_default_params(&analysis_params);
+        decoder->video_analyzer = frame_analyzer_alloc(&analysis_params, decoder->video_avs->time_base);
+    }
+
+    if (sp.decimate.enabled && sp.copy_video)
+    {
+        logging("ignoring --decimate, the video stream is copied");
+    }
+    else if (sp.decimate.enabled)
+    {
+        decoder->decimator = frame_decimator_alloc(&sp.decimate);
+        if (!decoder->decimator)
+            return -1;
+    }
+
+    if (sp.loudness_path && decoder->audio_avcc)
+    {
+        decoder->loudness_meter = loudness_meter_alloc(decoder->audio_avcc->sample_rate, decoder->audio_avcc->channels,
+                                                       decoder->audio_avcc->channel_layout);
+    }
+
+    if (sp.auto_crop_seconds > 0)
+    {
+        if (sp.copy_video)
+        {
+            logging("ignoring --auto-crop, the video stream is copied");
+        }
+        else if (synthetic)
+        {
+            logging("ignoring --auto-crop, a synth source has no bars");
+        }
+        else if (detect_crop(decoder, sp.auto_crop_seconds, &encoder->crop))
+        {
+            return -1;
+        }
+    }
+
+    if (sp.roi.width && sp.copy_video)
+    {
+        logging("ignoring --roi, the video stream is copied");
+    }
+    else if (sp.roi.width)
+    {
+        // the decoder may already deliver a reduced picture
+        int lowres = decoder->video_avcc->lowres;
+        CropRect roi = {sp.roi.x >> lowres, sp.roi.y >> lowres, sp.roi.width >> lowres, sp.roi.height >> lowres};
+        if (roi.width <= 0 || roi.height <= 0 || roi.x + roi.width > decoder->video_avcc->width ||
+            roi.y + roi.height > decoder->video_avcc->height)
+        {
+            logging("--roi %dx%d+%d+%d is outside the %dx%d picture", sp.roi.width, sp.roi.height, sp.roi.x, sp.roi.y,
+                    decoder->video_avcc->width << lowres, decoder->video_avcc->height << lowres);
+            return -1;
+        }
+        encoder->crop = roi;
+    }
+
+    if (job->fanout_count)
+    {
+        if (sp.copy_video)
+        {
+            logging("--fanout needs decoded video, the video stream is copied");
+            return -1;
+        }
+        if (fanout_start(decoder, &encoder->crop, sp, job->fanout, job->fanout_count))
+            return -1;
+    }
+
+    if (sp.preview.enabled && !sp.copy_video)
+    {
+        int width = encoder->crop.width ? encoder->crop.width : decoder->video_avcc->width;
+        int height = encoder->crop.height ? encoder->crop.height : decoder->video_avcc->height;
+        if (width > sp.preview.width)
+        {
+            encoder->scaler = proxy_scaler_alloc(width, height, decoder->video_avcc->pix_fmt, sp.preview.width);
+            if (!encoder->scaler)
+                logging("preview: encoding at %dx%d", width, height);
+        }
+        if (encoder->scaler)
+        {
+            int proxy_width, proxy_height;
+            proxy_scaler_size(encoder->scaler, &proxy_width, &proxy_height);
+            logging("preview: %dx%d decoded at lowres %d, encoding %dx%d", width, height,
+                    decoder->video_avcc->lowres, proxy_width, proxy_height);
+        }
+    }
+
+    if (!sp.copy_video)
+    {
+        AVRational input_framerate = av_guess_frame_rate(decoder->avfc, decoder->video_avs, NULL);
+        if (prepare_video_encoder(encoder, decoder->video_avcc, input_framerate, sp))
+            return -1;
+        if (synthetic && encoder->video_avcc->pix_fmt != decoder->video_avcc->pix_fmt)
+        {
+            logging("synth: the encoder opened as %s for %s frames", av_get_pix_fmt_name(encoder->video_avcc->pix_fmt),
+                    av_get_pix_fmt_name(decoder->video_avcc->pix_fmt));
+            return -1;
+        }
+        if (sp.backpressure.enabled)
+        {
+            encoder->backpressure = backpressure_alloc(&sp.backpressure, decoder->video_avs->time_base, &sp);
+            if (encoder->avfc->oformat->flags & AVFMT_GLOBALHEADER)
+                logging("live: %s keeps the codec headers in the file header, only an in-band header output such "
+                        "as MPEG-TS gets the fast-preset step",
+                        encoder->avfc->oformat->name);
+        }
+    }
+    else
+    {
+        if (sp.backpressure.enabled)
+            logging("ignoring --live, the video stream is copied");
+        if (prepare_copy(encoder->avfc, &encoder->video_avs, decoder->video_avs->codecpar))
+        {
+            return -1;
+        }
+    }
+
+    if (!decoder->audio_avs)
+    {
+        logging("the input has no audio");
+    }
+    else if (!sp.copy_audio)
+    {
+        if (prepare_audio_encoder(encoder, decoder->audio_avcc->sample_rate, sp))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (prepare_copy(encoder->avfc, &encoder->audio_avs, decoder->audio_avs->codecpar))
+        {
+            return -1;
+        }
+    }
+
+    if (encoder->avfc->oformat->flags & AVFMT_GLOBALHEADER)
+        encoder->avfc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (affinity_pin_demux(&t->placement))
+        return -1;
+
+    if (sp.muxer_opt_key && sp.muxer_opt_value)
+    {
+        av_dict_set(&t->muxer_opts, sp.muxer_opt_key, sp.muxer_opt_value, 0);
+    }
+
+    int pb_provided = faststart_setup(&t->faststart, &sp.faststart, encoder->avfc, decoder->avfc, &t->muxer_opts);
+    if (pb_provided < 0)
+        return -1;
+
+    if (!pb_provided && !(encoder->avfc->oformat->flags & AVFMT_NOFILE))
+    {
+        if (avio_open(&encoder->avfc->pb, encoder->filename, AVIO_FLAG_WRITE) < 0)
+        {
+            logging("could not open the output file");
+            return -1;
+        }
+    }
+
+    if (avformat_write_header(encoder->avfc, &t->muxer_opts) < 0)
+    {
+        logging("an error occurred when opening output file");
+        return -1;
+    }
+
+    encoder->interleaver = interleaver_alloc(encoder->avfc, &sp.interleave);
+
+    AVFrame *input_frame = t->input_frame = av_frame_alloc();
+    if (!input_frame)
+    {
+        logging("failed to allocated memory for AVFrame");
+        return -1;
+    }
+
+    AVPacket *input_packet = t->input_packet = av_packet_alloc();
+    if (!input_packet)
+    {
+        logging("failed to allocated memory for AVPacket");
+        return -1;
+    }
+
+    if (synthetic)
+    {
+        if (encoder->audio_avcc)
+        {
+            synth.sample_fmt = encoder->audio_avcc->sample_fmt;
+            if (encoder->audio_avcc->frame_size)
+                synth.samples_per_frame = encoder->audio_avcc->frame_size;
+        }
+        t->synth_source = synth_source_alloc(&synth);
+        if (!t->synth_source)
+            return -1;
+    }
+
+    enum AVMediaType synth_type;
+    int synth_ret;
+    int64_t read_start = trace_begin();
+    while (t->synth_source && (synth_ret = synth_source_read(t->synth_source, input_frame, &synth_type)) >= 0)
+    {
+        trace_end("generate", read_start, input_frame->pts);
+        if (synth_type == AVMEDIA_TYPE_VIDEO ? process_video_frame(decoder, encoder, input_frame)
+                                             : process_audio_frame(decoder, encoder, input_frame))
+            return -1;
+        av_frame_unref(input_frame);
+        read_start = trace_begin();
+    }
+    if (t->synth_source)
+    {
+        synth_source_free(&t->synth_source);
+        if (synth_ret != AVERROR_EOF)
+        {
+            logging("failed to generate a frame");
+            return -1;
+        }
+    }
+
+    int64_t packets_read = 0;
+    read_start = trace_begin();
+    while (!synthetic && av_read_frame(decoder->avfc, input_packet) >= 0)
+    {
+        trace_end("read", read_start, packets_read++);
+        int ends_stream = packet_ends_stream(decoder->avfc->streams[input_packet->stream_index], input_packet);
+        if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            if (!sp.copy_video)
+            {
+                // TODO: refactor to be generic for audio and video (receiving a function pointer to the differences)
+                if (transcode_video(decoder, encoder, input_packet, input_frame))
+                    return -1;
+                av_packet_unref(input_packet);
+            }
+            else
+            {
+                if (remux(&input_packet, encoder, decoder->video_avs->time_base, encoder->video_avs->time_base))
+                    return -1;
+            }
+            // the encoder may still hold frames, they are written without waiting on the other streams
+            if (ends_stream && interleaver_end_stream(encoder->interleaver, encoder->video_avs->index) < 0)
+                return -1;
+        }
+        else if (decoder->avfc->streams[input_packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        {
+            if (!sp.copy_audio)
+            {
+                if (transcode_audio(decoder, encoder, input_packet, input_frame))
+                    return -1;
+                av_packet_unref(input_packet);
+            }
+            else
+            {
+                // the copied audio is still decoded when metering so loudness comes out of the same pass
+                if (decoder->loudness_meter && measure_audio(decoder, input_packet, input_frame))
+                    return -1;
+                if (remux(&input_packet, encoder, decoder->audio_avs->time_base, encoder->audio_avs->time_base))
+                    return -1;
+            }
+            if (ends_stream && interleaver_end_stream(encoder->interleaver, encoder->audio_avs->index) < 0)
+                return -1;
+        }
+        else
+        {
+            logging("ignoring all non video or audio packets");
+        }
+        read_start = trace_begin();
+    }
+    // the decoder's last buffered frames still go to the meter and the encoder, copied audio is drained below
+    if (!synthetic && decoder->audio_avs && !sp.copy_audio && transcode_audio(decoder, encoder, NULL, input_frame))
+        return -1;
+    AVFrame *held = decoder->decimator ? frame_decimator_flush(decoder->decimator) : NULL;
+    // analysed, cropped and handed to the fanout when it was decoded, it only still needs encoding
+    if (held && encode_video_frame(decoder, encoder, held))
+        return -1;
+    // TODO: should I also flush the audio encoder?
+    if (!sp.copy_video && encode_video(decoder, encoder, NULL))
+        return -1;
+
+    if (interleaver_flush(encoder->interleaver) < 0)
+        return -1;
+    interleaver_report(encoder->interleaver);
+    interleaver_free(&encoder->interleaver);
+
+    int64_t trailer_start = trace_begin();
+    if (av_write_trailer(encoder->avfc) < 0)
+    {
+        logging("an error occurred when finishing the output file");
+        return -1;
+    }
+    trace_end("trailer", trailer_start, -1);
+    if (faststart_finish(&t->faststart, encoder->filename))
+        return -1;
+
+    // the main output is complete before the fanout is waited for, a crashed encoder only loses its own
+    t->fanout_failed = job->fanout_count ? fanout_finish(decoder, job->fanout, job->fanout_count) : 0;
+    if (t->fanout_failed)
+    {
+        logging("%d of %d fanout outputs failed, %s is complete", t->fanout_failed, job->fanout_count,
+                encoder->filename);
+        return -1;
+    }
+
+    if (decoder->loudness_meter)
+    {
+        if (sp.copy_audio)
+            measure_audio(decoder, NULL, input_frame);
+        loudness_meter_report(decoder->loudness_meter, sp.loudness_path);
+    }
+
+    if (decoder->video_analyzer)
+    {
+        frame_analyzer_finish(decoder->video_analyzer);
+        frame_analyzer_write_timeline(decoder->video_analyzer, sp.timeline_path);
+    }
+
+    if (decoder->decimator)
+        frame_decimator_report(decoder->decimator);
+    if (encoder->backpressure)
+        backpressure_report(encoder->backpressure);
+    return 0;
+}
+
+static int transcode_uncached(const TranscodeJob *job, TranscodeStats *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    TranscodeRun t;
+    memset(&t, 0, sizeof(t));
+    t.faststart.mode = FASTSTART_NONE;
+    t.placement.node = -1;
+    t.decoder = (StreamingContext *)calloc(1, sizeof(StreamingContext));
+    t.encoder = (StreamingContext *)calloc(1, sizeof(StreamingContext));
+
+    int ret = t.decoder && t.encoder ? run_job(job, &t) : -1;
+
+    StreamingContext *decoder = t.decoder, *encoder = t.encoder;
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = t.threads;
+    stats->result = ret;
+    stats->fanout_failed = t.fanout_failed;
+
+    av_dict_free(&t.muxer_opts);
+    av_frame_free(&t.input_frame);
+    av_packet_free(&t.input_packet);
+    synth_source_free(&t.synth_source);
+
+    if (decoder)
+    {
+        // still set when the job failed between fanout_start and fanout_finish
+        fanout_abort(decoder, job->fanout, job->fanout_count);
+        loudness_meter_free(&decoder->loudness_meter);
+        frame_analyzer_free(&decoder->video_analyzer);
+        frame_decimator_free(&decoder->decimator);
+        avformat_close_input(&decoder->avfc);
+        avformat_free_context(decoder->avfc);
+        avcodec_free_context(&decoder->video_avcc);
+        avcodec_free_context(&decoder->audio_avcc);
+        frame_pool_report(decoder->frame_pool);
+        frame_pool_free(&decoder->frame_pool);
+    }
+    if (encoder)
+    {
+        interleaver_free(&encoder->interleaver);
+        backpressure_free(&encoder->backpressure);
+        proxy_scaler_free(&encoder->scaler);
+        if (encoder->video_avcc)
+            stats->video_frames = encoder->earlier_video_frames + encoder->video_avcc->frame_number;
+        // a failed job still holds the in-memory output, a finished one has written it already
+        if (t.faststart.mode == FASTSTART_MEMORY)
+            faststart_finish(&t.faststart, NULL);
+        else if (encoder->avfc && !(encoder->avfc->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&encoder->avfc->pb);
+        avformat_free_context(encoder->avfc);
+        avcodec_free_context(&encoder->video_avcc);
+        avcodec_free_context(&encoder->audio_avcc);
+        av_free(encoder->filename);
+    }
+
+    if (job->budget)
+        thread_budget_release(job->budget, &t.threads);
+    affinity_report(&t.placement);
+    affinity_release(&t.placement);
+
+    free(decoder);
+    free(encoder);
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return ret;
+}
+
+int transcode_file(const TranscodeJob *job, TranscodeStats *stats)
+{
+    if (!job->cache.dir)
+        return transcode_uncached(job, stats);
+    if (job->fanout_count)
+    {
+        logging("cache: not used, --fanout outputs are not cached");
+        return transcode_uncached(job, stats);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    const char *extension = job->sp.output_extension ? job->sp.output_extension : "";
+    char *out_filename = av_asprintf("%s%s", job->out_filename, extension);
+    char key[TRANSCODE_CACHE_KEY_SIZE];
+    // an unreadable input runs anyway and fails with the usual error
+    int cacheable = out_filename && transcode_cache_key(&job->cache, job->in_filename, &job->sp, out_filename, key) > 0;
+    if (cacheable && transcode_cache_fetch(&job->cache, key, out_filename))
+    {
+        memset(stats, 0, sizeof(*stats));
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        logging("cache: hit %s, %s ready in %.2f s", key, out_filename, stats->seconds);
+        av_free(out_filename);
+        return 0;
+    }
+
+    int ret = transcode_uncached(job, stats);
+    if (cacheable && ret >= 0)
+        transcode_cache_publish(&job->cache, key, out_filename);
+    av_free(out_filename);
+    return ret;
+}
@@ -1,6 +1,6 @@
 #include "video_process.h"
 
-int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc)
+int fill_stream_info(StreamingContext *sc, AVStream *avs, AVCodec **avc, AVCodecContext **avcc)
 {
     *avc = const_cast<AVCodec *>(avcodec_find_decoder(avs->codecpar->codec_id));
     if (!*avc)
@@ -22,6 +22,23 @@ int fill_stream_info(AVStream *avs, AVCodec **avc, AVCodecContext **avcc)
         return -1;
     }
 
+    if (avs->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+        if (sc->threads.decoder_threads)
+            (*avcc)->thread_count = sc->threads.decoder_threads;
+        if (sc->preview_width)
+        {
+            // only a few decoders (JPEG, JPEG 2000, some DV and MPEG-4 variants) can decode at reduced size
+            int lowres = 0;
+            while (lowres < (*avc)->max_lowres && ((*avcc)->width >> (lowres + 1)) >= sc->preview_width)
+                lowres++;
+            (*avcc)->lowres = lowres;
+            (*avcc)->skip_loop_filter = AVDISCARD_ALL;
+            (*avcc)->flags2 |= AV_CODEC_FLAG2_FAST;
+        }
+        // audio frames are small, left to the default allocator they do not count as pool fallbacks
+        frame_pool_attach(sc->frame_pool, *avcc);
+    }
     if (avcodec_open2(*avcc, *avc, NULL) < 0)
     {
         logging("failed to open codec");
@@ -62,7 +79,7 @@ int prepare_decoder(StreamingContext *sc)
             sc->video_avs = sc->avfc->streams[i];
             sc->video_index = i;
 
-            if (fill_stream_info(sc->video_avs, &sc->video_avc, &sc->video_avcc))
+            if (fill_stream_info(sc, sc->video_avs, &sc->video_avc, &sc->video_avcc))
             {
                 return -1;
             }
@@ -72,7 +89,7 @@ int prepare_decoder(StreamingContext *sc)
             sc->audio_avs = sc->avfc->streams[i];
             sc->audio_index = i;
 
-            if (fill_stream_info(sc->audio_avs, &sc->audio_avc, &sc->audio_avcc))
+            if (fill_stream_info(sc, sc->audio_avs, &sc->audio_avc, &sc->audio_avcc))
             {
                 return -1;
             }
@@ -86,11 +103,148 @@ int prepare_decoder(StreamingContext *sc)
     return 0;
 }
 
-int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate,
-                          StreamingParams sp)
+int prepare_synth_decoder(StreamingContext *sc, const SynthParams *params)
 {
+    sc->avfc = avformat_alloc_context();
+    if (!sc->avfc)
+    {
+        logging("failed to alloc memory for format");
+        return -1;
+    }
+    sc->avfc->duration = (int64_t)(params->duration * AV_TIME_BASE);
+
+    // the streams only describe the generated frames, nothing is ever demuxed from them
     sc->video_avs = avformat_new_stream(sc->avfc, NULL);
+    if (!sc->video_avs)
+        return -1;
+    sc->video_index = sc->video_avs->index;
+    sc->video_avs->time_base = av_inv_q(params->frame_rate);
+    sc->video_avs->avg_frame_rate = params->frame_rate;
+    sc->video_avs->r_frame_rate = params->frame_rate;
+    sc->video_avs->nb_frames = synth_video_frames(params);
+    sc->video_avs->duration = sc->video_avs->nb_frames;
+    sc->video_avs->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    sc->video_avs->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+    sc->video_avs->codecpar->width = params->width;
+    sc->video_avs->codecpar->height = params->height;
+    sc->video_avs->codecpar->format = params->pix_fmt;
+    sc->video_avs->codecpar->sample_aspect_ratio = (AVRational){1, 1};
+
+    sc->video_avcc = avcodec_alloc_context3(NULL);
+    if (!sc->video_avcc || avcodec_parameters_to_context(sc->video_avcc, sc->video_avs->codecpar) < 0)
+    {
+        logging("failed to fill codec context");
+        return -1;
+    }
 
+    if (!params->sample_rate)
+        return 0;
+
+    sc->audio_avs = avformat_new_stream(sc->avfc, NULL);
+    if (!sc->audio_avs)
+        return -1;
+    sc->audio_index = sc->audio_avs->index;
+    sc->audio_avs->time_base = (AVRational){1, params->sample_rate};
+    sc->audio_avs->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+    sc->audio_avs->codecpar->codec_id = AV_CODEC_ID_PCM_F32LE;
+    sc->audio_avs->codecpar->format = params->sample_fmt;
+    sc->audio_avs->codecpar->sample_rate = params->sample_rate;
+    sc->audio_avs->codecpar->channels = params->channels;
+    sc->audio_avs->codecpar->channel_layout = av_get_default_channel_layout(params->channels);
+
+    sc->audio_avcc = avcodec_alloc_context3(NULL);
+    if (!sc->audio_avcc || avcodec_parameters_to_context(sc->audio_avcc, sc->audio_avs->codecpar) < 0)
+    {
+        logging("failed to fill codec context");
+        return -1;
+    }
+    return 0;
+}
+
+int detect_crop(StreamingContext *decoder, double seconds, CropRect *crop)
+{
+    const int sample_points = 5;
+    AVRational time_base = decoder->video_avs->time_base;
+
+    FrameAnalysisParams params;
+    frame_analysis_default_params(&params);
+    FrameAnalyzer *fa = frame_analyzer_alloc(&params, time_base);
+
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!packet || !frame)
+    {
+        logging("failed to allocate memory for crop detection");
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        frame_analyzer_free(&fa);
+        return -1;
+    }
+
+    // sample a few spots spread over the file so an intro or a black opening does not decide the crop
+    int64_t start = decoder->avfc->start_time != AV_NOPTS_VALUE ? decoder->avfc->start_time : 0;
+    int64_t duration = decoder->avfc->duration > 0 ? decoder->avfc->duration : 0;
+    int64_t sample_length = av_rescale_q((int64_t)(seconds / sample_points * AV_TIME_BASE), AV_TIME_BASE_Q, time_base);
+
+    for (int point = 0; point < sample_points; point++)
+    {
+        int64_t target = start + duration * (2 * point + 1) / (2 * sample_points);
+        if (av_seek_frame(decoder->avfc, -1, target, AVSEEK_FLAG_BACKWARD) < 0 && point > 0)
+            break;
+        avcodec_flush_buffers(decoder->video_avcc);
+
+        int64_t first_pts = AV_NOPTS_VALUE;
+        int done = 0;
+        while (!done && av_read_frame(decoder->avfc, packet) >= 0)
+        {
+            if (packet->stream_index == decoder->video_index && avcodec_send_packet(decoder->video_avcc, packet) >= 0)
+            {
+                while (avcodec_receive_frame(decoder->video_avcc, frame) >= 0)
+                {
+                    if (frame_analyzer_push(fa, frame) < 0)
+                        done = 1;
+                    if (first_pts == AV_NOPTS_VALUE)
+                        first_pts = frame->best_effort_timestamp;
+                    else if (frame->best_effort_timestamp - first_pts >= sample_length)
+                        done = 1;
+                    av_frame_unref(frame);
+                }
+            }
+            av_packet_unref(packet);
+        }
+    }
+
+    avcodec_flush_buffers(decoder->video_avcc);
+    if (av_seek_frame(decoder->avfc, -1, start, AVSEEK_FLAG_BACKWARD) < 0)
+        logging("failed to seek back to the start after crop detection");
+
+    int found = frame_analyzer_crop(fa, crop);
+    if (found)
+        logging("detected crop %dx%d+%d+%d", crop->width, crop->height, crop->x, crop->y);
+    else
+        logging("no black bars detected");
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    frame_analyzer_free(&fa);
+    return 0;
+}
+
+int encoder_accepts_pix_fmt(const AVCodec *codec, enum AVPixelFormat format)
+{
+    if (!codec->pix_fmts)
+        return 1;
+    for (const enum AVPixelFormat *fmt = codec->pix_fmts; *fmt != AV_PIX_FMT_NONE; fmt++)
+    {
+        if (*fmt == format)
+            return 1;
+    }
+    return 0;
+}
+
+int open_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate,
+                       StreamingParams sp, const char *preset)
+{
     sc->video_avc = const_cast<AVCodec *>(avcodec_find_encoder_by_name(sp.video_codec));
     if (!sc->video_avc)
     {
@@ -105,31 +259,61 @@ int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVR
         return -1;
     }
 
-    av_opt_set(sc->video_avcc->priv_data, "preset", "fast", 0);
+    av_opt_set(sc->video_avcc->priv_data, "preset", preset, 0);
+
+    char *x265_params = NULL;
+    if (sc->threads.encoder_threads)
+    {
+        sc->video_avcc->thread_count = sc->threads.encoder_threads;
+        // x265 ignores thread_count and sizes its pools to the whole machine unless told otherwise
+        if (!strcmp(sc->video_avc->name, "libx265"))
+        {
+            int merge = sp.codec_priv_key && sp.codec_priv_value && !strcmp(sp.codec_priv_key, "x265-params");
+            x265_params = av_asprintf("%s%spools=%d:frame-threads=%d", merge ? sp.codec_priv_value : "",
+                                      merge ? ":" : "", sc->threads.encoder_threads,
+                                      sc->threads.encoder_frame_threads);
+            if (merge)
+                sp.codec_priv_value = x265_params;
+            else
+                av_opt_set(sc->video_avcc->priv_data, "x265-params", x265_params, 0);
+        }
+    }
     if (sp.codec_priv_key && sp.codec_priv_value)
         av_opt_set(sc->video_avcc->priv_data, sp.codec_priv_key, sp.codec_priv_value, 0);
+    av_free(x265_params);
 
-    sc->video_avcc->height = decoder_ctx->height;
-    sc->video_avcc->width = decoder_ctx->width;
+    sc->video_avcc->height = sc->crop.height ? sc->crop.height : decoder_ctx->height;
+    sc->video_avcc->width = sc->crop.width ? sc->crop.width : decoder_ctx->width;
+    if (sc->scaler)
+        proxy_scaler_size(sc->scaler, &sc->video_avcc->width, &sc->video_avcc->height);
     sc->video_avcc->sample_aspect_ratio = decoder_ctx->sample_aspect_ratio;
-    if (sc->video_avc->pix_fmts)
-        sc->video_avcc->pix_fmt = sc->video_avc->pix_fmts[0];
-    else
+    if (encoder_accepts_pix_fmt(sc->video_avc, decoder_ctx->pix_fmt))
         sc->video_avcc->pix_fmt = decoder_ctx->pix_fmt;
+    else
+        sc->video_avcc->pix_fmt = sc->video_avc->pix_fmts[0];
 
-    sc->video_avcc->bit_rate = 2 * 1000 * 1000;
-    sc->video_avcc->rc_buffer_size = 4 * 1000 * 1000;
-    sc->video_avcc->rc_max_rate = 2 * 1000 * 1000;
+    sc->video_avcc->bit_rate = VIDEO_BIT_RATE;
+    sc->video_avcc->rc_buffer_size = VIDEO_RC_BUFFER_SIZE;
+    sc->video_avcc->rc_max_rate = VIDEO_RC_MAX_RATE;
     sc->video_avcc->rc_min_rate = 2.5 * 1000 * 1000;
 
     sc->video_avcc->time_base = av_inv_q(input_framerate);
-    sc->video_avs->time_base = sc->video_avcc->time_base;
 
     if (avcodec_open2(sc->video_avcc, sc->video_avc, NULL) < 0)
     {
         logging("could not open the codec");
         return -1;
     }
+    return 0;
+}
+
+int prepare_video_encoder(StreamingContext *sc, AVCodecContext *decoder_ctx, AVRational input_framerate,
+                          StreamingParams sp)
+{
+    sc->video_avs = avformat_new_stream(sc->avfc, NULL);
+    if (open_video_encoder(sc, decoder_ctx, input_framerate, sp, sp.preview.enabled ? "ultrafast" : "fast"))
+        return -1;
+    sc->video_avs->time_base = sc->video_avcc->time_base;
     avcodec_parameters_from_context(sc->video_avs->codecpar, sc->video_avcc);
     return 0;
 }
@@ -181,10 +365,21 @@ int prepare_copy(AVFormatContext *avfc, AVStream **avs, AVCodecParameters *decod
     return 0;
 }
 
-int remux(AVPacket **pkt, AVFormatContext **avfc, AVRational decoder_tb, AVRational encoder_tb)
+int write_packet(StreamingContext *encoder, AVPacket *pkt, int64_t frame)
 {
+    int64_t start = trace_begin();
+    int ret = encoder->interleaver ? interleaver_write(encoder->interleaver, pkt)
+                                   : av_interleaved_write_frame(encoder->avfc, pkt);
+    trace_end("mux", start, frame);
+    return ret;
+}
+
+int remux(AVPacket **pkt, StreamingContext *encoder, AVRational decoder_tb, AVRational encoder_tb)
+{
+    int is_video = encoder->video_avs && (*pkt)->stream_index == encoder->video_avs->index;
+    int64_t frame = is_video ? encoder->video_copied++ : encoder->audio_copied++;
     av_packet_rescale_ts(*pkt, decoder_tb, encoder_tb);
-    if (av_interleaved_write_frame(*avfc, *pkt) < 0)
+    if (write_packet(encoder, *pkt, frame) < 0)
     {
         logging("error while copying stream packet");
         return -1;
@@ -204,11 +399,15 @@ int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
         return -1;
     }
 
+    int64_t start = trace_begin();
     int response = avcodec_send_frame(encoder->video_avcc, input_frame);
+    trace_end("encode video", start, encoder->video_avcc->frame_number);
 
     while (response >= 0)
     {
+        start = trace_begin();
         response = avcodec_receive_packet(encoder->video_avcc, output_packet);
+        trace_end("encode video", start, encoder->video_avcc->frame_number);
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
         {
             break;
@@ -224,7 +423,8 @@ int encode_video(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
                                   decoder->video_avs->avg_frame_rate.num * decoder->video_avs->avg_frame_rate.den;
 
         av_packet_rescale_ts(output_packet, decoder->video_avs->time_base, encoder->video_avs->time_base);
-        response = av_interleaved_write_frame(encoder->avfc, output_packet);
+        response =
+            write_packet(encoder, output_packet, encoder->earlier_video_frames + encoder->video_avcc->frame_number);
         if (response != 0)
         {
             logging("Error %d while receiving packet from decoder", response);
@@ -245,11 +445,15 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
         return -1;
     }
 
+    int64_t start = trace_begin();
     int response = avcodec_send_frame(encoder->audio_avcc, input_frame);
+    trace_end("encode audio", start, encoder->audio_avcc->frame_number);
 
     while (response >= 0)
     {
+        start = trace_begin();
         response = avcodec_receive_packet(encoder->audio_avcc, output_packet);
+        trace_end("encode audio", start, encoder->audio_avcc->frame_number);
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
         {
             break;
@@ -263,7 +467,7 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
         output_packet->stream_index = decoder->audio_index;
 
         av_packet_rescale_ts(output_packet, decoder->audio_avs->time_base, encoder->audio_avs->time_base);
-        response = av_interleaved_write_frame(encoder->avfc, output_packet);
+        response = write_packet(encoder, output_packet, encoder->audio_avcc->frame_number);
         if (response != 0)
         {
             logging("Error %d while receiving packet from decoder", response);
@@ -275,9 +479,92 @@ int encode_audio(StreamingContext *decoder, StreamingContext *encoder, AVFrame *
     return 0;
 }
 
+int measure_audio(StreamingContext *decoder, AVPacket *input_packet, AVFrame *input_frame)
+{
+    int response = avcodec_send_packet(decoder->audio_avcc, input_packet);
+    if (response < 0)
+    {
+        logging("Error while sending packet to decoder");
+        return response;
+    }
+
+    while ((response = avcodec_receive_frame(decoder->audio_avcc, input_frame)) >= 0)
+    {
+        loudness_meter_push(decoder->loudness_meter, input_frame);
+        av_frame_unref(input_frame);
+    }
+
+    if (response != AVERROR(EAGAIN) && response != AVERROR_EOF)
+    {
+        logging("Error while receiving frame from decoder");
+        return response;
+    }
+    return 0;
+}
+
+int process_audio_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame)
+{
+    if (decoder->loudness_meter)
+        loudness_meter_push(decoder->loudness_meter, input_frame);
+
+    return encode_audio(decoder, encoder, input_frame);
+}
+
+int process_video_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame)
+{
+    if (decoder->video_analyzer && frame_analyzer_push(decoder->video_analyzer, input_frame) < 0)
+        return -1;
+
+    if (encoder->crop.width)
+    {
+        input_frame->crop_left = encoder->crop.x;
+        input_frame->crop_top = encoder->crop.y;
+        input_frame->crop_right = input_frame->width - encoder->crop.x - encoder->crop.width;
+        input_frame->crop_bottom = input_frame->height - encoder->crop.y - encoder->crop.height;
+        if (av_frame_apply_cropping(input_frame, AV_FRAME_CROP_UNALIGNED) < 0)
+        {
+            logging("failed to crop frame");
+            return -1;
+        }
+    }
+
+    // the fanout encoders keep their own rate, the drops below only concern the main encoder
+    if (decoder->frame_ring && frame_ring_publish(decoder->frame_ring, input_frame) < 0)
+        return -1;
+
+    if (decoder->decimator && frame_decimator_push(decoder->decimator, input_frame))
+        return 0;
+    return encode_video_frame(decoder, encoder, input_frame);
+}
+
+int encode_video_frame(StreamingContext *decoder, StreamingContext *encoder, AVFrame *input_frame)
+{
+    if (encoder->backpressure)
+    {
+        int drop = backpressure_frame(encoder->backpressure, decoder, encoder, input_frame);
+        if (drop)
+            return drop < 0 ? -1 : 0;
+    }
+
+    if (encoder->scaler)
+    {
+        AVFrame *proxy = proxy_scaler_scale(encoder->scaler, input_frame);
+        if (!proxy)
+        {
+            logging("failed to scale the frame down");
+            return -1;
+        }
+        return encode_video(decoder, encoder, proxy);
+    }
+
+    return encode_video(decoder, encoder, input_frame);
+}
+
 int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame)
 {
+    int64_t start = trace_begin();
     int response = avcodec_send_packet(decoder->audio_avcc, input_packet);
+    trace_end("decode audio", start, decoder->audio_avcc->frame_number);
     if (response < 0)
     {
         logging("Error while sending packet to decoder");
@@ -286,7 +573,9 @@ int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
     while (response >= 0)
     {
+        start = trace_begin();
         response = avcodec_receive_frame(decoder->audio_avcc, input_frame);
+        trace_end("decode audio", start, decoder->audio_avcc->frame_number);
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
         {
             break;
@@ -299,7 +588,7 @@ int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
         if (response >= 0)
         {
-            if (encode_audio(decoder, encoder, input_frame))
+            if (process_audio_frame(decoder, encoder, input_frame))
                 return -1;
         }
         av_frame_unref(input_frame);
@@ -309,7 +598,9 @@ int transcode_audio(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
 int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPacket *input_packet, AVFrame *input_frame)
 {
+    int64_t start = trace_begin();
     int response = avcodec_send_packet(decoder->video_avcc, input_packet);
+    trace_end("decode video", start, decoder->video_avcc->frame_number);
     if (response < 0)
     {
         logging("Error while sending packet to decoder");
@@ -318,7 +609,9 @@ int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
     while (response >= 0)
     {
+        start = trace_begin();
         response = avcodec_receive_frame(decoder->video_avcc, input_frame);
+        trace_end("decode video", start, decoder->video_avcc->frame_number);
         if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
         {
             break;
@@ -331,7 +624,7 @@ int transcode_video(StreamingContext *decoder, StreamingContext *encoder, AVPack
 
         if (response >= 0)
         {
-            if (encode_video(decoder, encoder, input_frame))
+            if (process_video_frame(decoder, encoder, input_frame))
                 return -1;
         }
         av_frame_unref(input_frame);
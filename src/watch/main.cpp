@@ -0,0 +1,93 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <limits.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+#include "video_debug.h"
+#include "watch_folder.h"
+
+static const char *option_value(const char *arg, const char *name)
+{
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=')
+        return arg + length + 1;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    WatchParams params;
+    watch_default_params(&params);
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value;
+        if ((value = option_value(argv[i], "--rules")))
+            params.rules_path = value;
+        else if ((value = option_value(argv[i], "--journal")))
+            params.journal_path = value;
+        else if ((value = option_value(argv[i], "--tools")))
+            params.tools_dir = value;
+        else if ((value = option_value(argv[i], "--workers")))
+            params.workers = atoi(value);
+        else if ((value = option_value(argv[i], "--settle")))
+            params.settle = atof(value);
+        else if ((value = option_value(argv[i], "--rescan")))
+            params.rescan = atof(value);
+        else if ((value = option_value(argv[i], "--trace")))
+        {
+            trace_start(value);
+            trace_thread_name("watch");
+        }
+        else if ((value = option_value(argv[i], "--log-level")))
+        {
+            LogLevel level;
+            if (log_parse_level(value, &level) < 0)
+                return -1;
+            log_set_level(level);
+        }
+        else
+        {
+            std::cerr << "Unknown option '" << argv[i] << "'" << std::endl;
+            return -1;
+        }
+    }
+
+    if (!params.rules_path)
+    {
+        std::cout << argv[0] << " Version " << Tutorial_VERSION_MAJOR << "." << Tutorial_VERSION_MINOR << std::endl;
+        std::cout << "Usage: " << argv[0] << " --rules=rules.txt [--journal=watch.journal] [--workers=N]"
+                  << " [--settle=S] [--rescan=S] [--tools=DIR]" << std::endl;
+        std::cout << "       rules: <folder> <probe|remux|transcode> <output dir> [tool options...]" << std::endl;
+        std::cout << "       any mode: [--log-level=error|warning|info|debug] [--trace=trace.json]" << std::endl;
+        return -1;
+    }
+
+    // the other tools are built next to this one
+    std::string tools_dir;
+    if (!params.tools_dir)
+    {
+        char self[PATH_MAX];
+        ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (length <= 0)
+        {
+            std::cerr << "Could not find the tools directory, pass --tools=DIR" << std::endl;
+            return -1;
+        }
+        self[length] = 0;
+        tools_dir = self;
+        tools_dir = tools_dir.substr(0, tools_dir.rfind('/'));
+        params.tools_dir = tools_dir.c_str();
+    }
+
+    std::vector<WatchRule> rules;
+    if (watch_read_rules(params.rules_path, rules) < 0)
+        return -1;
+    int ret = watch_folders(&params, rules);
+    trace_stop();
+    return ret;
+}
@@ -0,0 +1,531 @@
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "video_debug.h"
+#include "watch_folder.h"
+#include "watch_journal.h"
+#include "worker_pool.h"
+
+extern char **environ;
+
+static const char *tool_names[] = {"probe", "remux", "transcode"};
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal(int)
+{
+    watch_stop = 1;
+}
+
+typedef struct PendingFile
+{
+    size_t rule;
+    // wall clock seconds
+    double first_seen;
+    int64_t size;
+    int64_t mtime_ns;
+    // steady clock seconds of the last size or mtime change
+    double changed;
+    // a close-write or a rename into the folder said the writer is done
+    int complete;
+} PendingFile;
+
+typedef struct Watcher
+{
+    WatchParams params;
+    std::vector<WatchRule> rules;
+    int inotify_fd;
+    std::map<int, size_t> watches;
+    // only touched by the watching thread
+    std::map<std::string, PendingFile> pending;
+
+    // everything below is shared with the jobs
+    std::mutex lock;
+    std::map<std::string, JournalEntry> entries;
+    std::set<std::string> inflight;
+    WatchJournal *journal;
+    WorkerPool *pool;
+    int64_t jobs;
+    int64_t failed;
+    double available_total;
+    double available_max;
+} Watcher;
+
+void watch_default_params(WatchParams *params)
+{
+    params->rules_path = NULL;
+    params->journal_path = "watch.journal";
+    params->tools_dir = NULL;
+    params->workers = 2;
+    params->settle = 5.0;
+    params->rescan = 60.0;
+}
+
+static double wall_seconds(void)
+{
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static double steady_seconds(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t mtime_ns(const struct stat &st)
+{
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// hidden files and the usual partial-upload names, including the outputs this tool is still writing
+static int ignored_name(const char *name)
+{
+    static const char *suffixes[] = {".part", ".partial", ".tmp", ".crdownload", "~"};
+    if (name[0] == '.')
+        return 1;
+    size_t length = strlen(name);
+    for (const char *suffix : suffixes)
+    {
+        size_t suffix_length = strlen(suffix);
+        if (length >= suffix_length && !strcmp(name + length - suffix_length, suffix))
+            return 1;
+    }
+    return 0;
+}
+
+static int parse_tool(const std::string &name, WatchTool *tool)
+{
+    for (int i = 0; i <= WATCH_TRANSCODE; i++)
+    {
+        if (name == tool_names[i])
+        {
+            *tool = (WatchTool)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int watch_read_rules(const char *path, std::vector<WatchRule> &rules)
+{
+    std::ifstream list(path);
+    if (!list)
+    {
+        logging("watch: could not open rules %s", path);
+        return -1;
+    }
+
+    std::string line, tool, option;
+    int line_number = 0;
+    while (std::getline(list, line))
+    {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        WatchRule rule;
+        if (!(fields >> rule.folder))
+            continue;
+        if (!(fields >> tool) || parse_tool(tool, &rule.tool) || !(fields >> rule.output_dir))
+        {
+            logging("watch: %s:%d: expected <folder> <probe|remux|transcode> <output dir>", path, line_number);
+            return -1;
+        }
+        while (fields >> option)
+            rule.options.push_back(option);
+        while (rule.folder.size() > 1 && rule.folder.back() == '/')
+            rule.folder.pop_back();
+        while (rule.output_dir.size() > 1 && rule.output_dir.back() == '/')
+            rule.output_dir.pop_back();
+        rules.push_back(rule);
+    }
+    return 0;
+}
+
+static int check_rules(const std::vector<WatchRule> &rules)
+{
+    std::set<std::string> folders;
+    for (const WatchRule &rule : rules)
+    {
+        char folder[PATH_MAX], output[PATH_MAX];
+        if (mkdir(rule.output_dir.c_str(), 0755) && errno != EEXIST)
+        {
+            logging("watch: could not create %s", rule.output_dir.c_str());
+            return -1;
+        }
+        if (!realpath(rule.folder.c_str(), folder) || !realpath(rule.output_dir.c_str(), output))
+        {
+            logging("watch: %s or %s does not exist", rule.folder.c_str(), rule.output_dir.c_str());
+            return -1;
+        }
+        if (!strcmp(folder, output))
+        {
+            logging("watch: %s would pick up its own outputs, give it another output directory", rule.folder.c_str());
+            return -1;
+        }
+        if (!folders.insert(folder).second)
+        {
+            logging("watch: %s has more than one rule", rule.folder.c_str());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_tool(const Watcher *w, const WatchRule &rule, const std::string &input, const std::string &output)
+{
+    std::string tool = std::string(w->params.tools_dir) + "/" + tool_names[rule.tool];
+    std::vector<std::string> args = {tool, input};
+    if (rule.tool != WATCH_PROBE)
+        args.push_back(output);
+    args.insert(args.end(), rule.options.begin(), rule.options.end());
+    std::vector<char *> argv;
+    for (std::string &arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(NULL);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (rule.tool == WATCH_PROBE)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // its own process group, so a Ctrl-C stops the watcher and lets the running jobs finish
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    pid_t pid;
+    int ret = posix_spawn(&pid, tool.c_str(), &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (ret)
+    {
+        logging("watch: could not start %s: %s", tool.c_str(), strerror(ret));
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (WIFSIGNALED(status))
+        logging("watch: %s killed by signal %d on %s", tool_names[rule.tool], WTERMSIG(status), input.c_str());
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void run_job(Watcher *w, size_t rule_index, const std::string &input, JournalEntry entry)
+{
+    const WatchRule &rule = w->rules[rule_index];
+    struct stat st;
+    // left queued in the journal when stopping, a vanished input drops out when the journal is compacted
+    if (watch_stop || stat(input.c_str(), &st))
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->inflight.erase(input);
+        if (!watch_stop)
+            w->entries.erase(input);
+        return;
+    }
+
+    double start = wall_seconds();
+    entry.size = st.st_size;
+    entry.mtime_ns = mtime_ns(st);
+    std::string name = input.substr(input.rfind('/') + 1) + (rule.tool == WATCH_PROBE ? ".txt" : "");
+    // the hidden name keeps the extension the muxer picks the container from
+    std::string partial = rule.output_dir + "/." + name, output = rule.output_dir + "/" + name;
+    int ret = run_tool(w, rule, input, partial);
+    if (!ret && rename(partial.c_str(), output.c_str()))
+    {
+        logging("watch: could not move %s into place", partial.c_str());
+        ret = -1;
+    }
+    if (ret)
+        unlink(partial.c_str());
+    double finished = wall_seconds();
+
+    std::lock_guard<std::mutex> guard(w->lock);
+    w->inflight.erase(input);
+    entry.ok = !ret;
+    entry.done = 1;
+    w->entries[input] = entry;
+    watch_journal_done(w->journal, input, entry);
+    double available = finished - entry.landed;
+    w->jobs++;
+    w->failed += ret < 0;
+    w->available_total += available;
+    w->available_max = FFMAX(w->available_max, available);
+    logging("watch: %s %s %s, %.1f s run, available %.1f s after landing", ret < 0 ? "FAIL" : "ok",
+            tool_names[rule.tool], input.c_str(), finished - start, available);
+}
+
+static void enqueue(Watcher *w, size_t rule, const std::string &path, double landed, const struct stat &st)
+{
+    std::lock_guard<std::mutex> guard(w->lock);
+    if (w->inflight.count(path))
+        return;
+    auto known = w->entries.find(path);
+    if (known != w->entries.end() && known->second.done && known->second.size == st.st_size &&
+        known->second.mtime_ns == mtime_ns(st))
+        return;
+
+    JournalEntry entry = {};
+    entry.landed = landed;
+    w->entries[path] = entry;
+    w->inflight.insert(path);
+    watch_journal_queued(w->journal, path, entry);
+    worker_pool_submit(w->pool, [w, rule, path, entry] { run_job(w, rule, path, entry); });
+}
+
+// a file being written by a job is not tracked again; its rewrite is caught by the next scan
+static void track(Watcher *w, size_t rule, const std::string &path, int complete)
+{
+    auto it = w->pending.find(path);
+    if (it != w->pending.end())
+    {
+        it->second.complete |= complete;
+        return;
+    }
+
+    struct stat st;
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+        return;
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        auto known = w->entries.find(path);
+        if (w->inflight.count(path) || (known != w->entries.end() && known->second.done &&
+                                        known->second.size == st.st_size && known->second.mtime_ns == mtime_ns(st)))
+            return;
+    }
+    w->pending[path] = {rule, wall_seconds(), (int64_t)st.st_size, mtime_ns(st), steady_seconds(), complete};
+}
+
+static void scan(Watcher *w)
+{
+    for (size_t i = 0; i < w->rules.size(); i++)
+    {
+        DIR *dir = opendir(w->rules[i].folder.c_str());
+        if (!dir)
+        {
+            logging("watch: could not scan %s", w->rules[i].folder.c_str());
+            continue;
+        }
+        while (struct dirent *file = readdir(dir))
+        {
+            if (!ignored_name(file->d_name))
+                track(w, i, w->rules[i].folder + "/" + file->d_name, 0);
+        }
+        closedir(dir);
+    }
+}
+
+static void check_pending(Watcher *w)
+{
+    double now = steady_seconds();
+    for (auto it = w->pending.begin(); it != w->pending.end();)
+    {
+        PendingFile &file = it->second;
+        struct stat st;
+        if (stat(it->first.c_str(), &st) || !S_ISREG(st.st_mode))
+        {
+            it = w->pending.erase(it);
+            continue;
+        }
+        if (st.st_size != file.size || mtime_ns(st) != file.mtime_ns)
+        {
+            file.size = st.st_size;
+            file.mtime_ns = mtime_ns(st);
+            file.changed = now;
+        }
+        if (!file.complete && now - file.changed < w->params.settle)
+        {
+            ++it;
+            continue;
+        }
+        // the last write, unless the writer kept an older mtime (cp -p, rsync -t)
+        double landed = FFMAX(file.first_seen, st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9);
+        enqueue(w, file.rule, it->first, landed, st);
+        it = w->pending.erase(it);
+    }
+}
+
+static int read_events(Watcher *w, int *rescan)
+{
+    alignas(struct inotify_event) char buffer[16384];
+    while (true)
+    {
+        ssize_t n = read(w->inotify_fd, buffer, sizeof(buffer));
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        for (char *p = buffer; p < buffer + n;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                logging("watch: inotify queue overflowed, rescanning");
+                *rescan = 1;
+                continue;
+            }
+            auto watch = w->watches.find(event->wd);
+            if (watch == w->watches.end())
+                continue;
+            const WatchRule &rule = w->rules[watch->second];
+            if (event->mask & IN_IGNORED)
+            {
+                logging("watch: %s went away, no longer watching it", rule.folder.c_str());
+                w->watches.erase(watch);
+                continue;
+            }
+            if (!event->len || (event->mask & IN_ISDIR) || ignored_name(event->name))
+                continue;
+            track(w, watch->second, rule.folder + "/" + event->name,
+                  !!(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)));
+        }
+    }
+}
+
+static int watch_loop(Watcher *w)
+{
+    // unfinished jobs from the last run go first, they were complete when queued; a failed one gets another
+    // try, within a run it is only picked up again once the file changes
+    for (auto &it : w->entries)
+    {
+        if (it.second.done && it.second.ok)
+            continue;
+        it.second.done = 0;
+        std::string folder = it.first.substr(0, it.first.rfind('/'));
+        size_t rule = 0;
+        while (rule < w->rules.size() && w->rules[rule].folder != folder)
+            rule++;
+        struct stat st;
+        if (rule == w->rules.size())
+            logging("watch: no rule for %s any more, leaving it", it.first.c_str());
+        else if (!stat(it.first.c_str(), &st))
+            enqueue(w, rule, it.first, it.second.landed, st);
+    }
+    scan(w);
+
+    double last_scan = steady_seconds();
+    while (!watch_stop)
+    {
+        struct pollfd fd = {w->inotify_fd, POLLIN, 0};
+        int n = poll(&fd, 1, 500);
+        if (n < 0 && errno != EINTR)
+        {
+            logging("watch: poll failed: %s", strerror(errno));
+            return -1;
+        }
+
+        int rescan = 0;
+        if (n > 0 && read_events(w, &rescan) < 0)
+        {
+            logging("watch: reading inotify events failed: %s", strerror(errno));
+            return -1;
+        }
+        if (rescan || (w->params.rescan > 0 && steady_seconds() - last_scan >= w->params.rescan))
+        {
+            scan(w);
+            last_scan = steady_seconds();
+        }
+        check_pending(w);
+    }
+    return 0;
+}
+
+// watched before the first scan, so nothing lands unseen in between
+static int add_watches(Watcher *w)
+{
+    w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->inotify_fd < 0)
+    {
+        logging("watch: inotify_init1 failed: %s", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < w->rules.size(); i++)
+    {
+        int wd = inotify_add_watch(w->inotify_fd, w->rules[i].folder.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY | IN_ONLYDIR);
+        if (wd < 0)
+        {
+            logging("watch: could not watch %s: %s", w->rules[i].folder.c_str(), strerror(errno));
+            return -1;
+        }
+        w->watches[wd] = i;
+    }
+    return 0;
+}
+
+int watch_folders(const WatchParams *params, const std::vector<WatchRule> &rules)
+{
+    if (rules.empty())
+    {
+        logging("watch: no rules");
+        return -1;
+    }
+    if (check_rules(rules) < 0)
+        return -1;
+
+    Watcher *w = new Watcher();
+    w->params = *params;
+    w->rules = rules;
+    w->inotify_fd = -1;
+    w->journal = NULL;
+    w->pool = NULL;
+    w->jobs = 0;
+    w->failed = 0;
+    w->available_total = 0;
+    w->available_max = 0;
+
+    int ret = add_watches(w);
+    if (!ret)
+    {
+        w->journal = watch_journal_open(params->journal_path, w->entries);
+        ret = w->journal ? 0 : -1;
+    }
+    if (!ret)
+    {
+        struct sigaction action = {};
+        action.sa_handler = watch_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+
+        w->pool = worker_pool_create(params->workers);
+        logging("watch: %zu folders, %d workers, %zu files in the journal", rules.size(), worker_pool_size(w->pool),
+                w->entries.size());
+        ret = watch_loop(w);
+        watch_stop = 1;
+        {
+            std::lock_guard<std::mutex> guard(w->lock);
+            logging("watch: stopping, waiting for the running jobs, %zu not finished", w->inflight.size());
+        }
+        worker_pool_wait(w->pool);
+        logging("watch: %lld jobs, %lld failed, available %.1f s after landing on average, %.1f s at most",
+                (long long)w->jobs, (long long)w->failed, w->jobs ? w->available_total / w->jobs : 0.0,
+                w->available_max);
+    }
+
+    worker_pool_destroy(&w->pool);
+    watch_journal_close(&w->journal);
+    if (w->inotify_fd >= 0)
+        close(w->inotify_fd);
+    delete w;
+    return ret;
+}
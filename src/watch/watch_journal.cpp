@@ -0,0 +1,137 @@
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "video_debug.h"
+#include "watch_journal.h"
+
+struct WatchJournal
+{
+    FILE *file;
+};
+
+// queued <landed> <path>
+// done <ok|failed> <size> <mtime_ns> <path>
+static void replay(const char *path, std::map<std::string, JournalEntry> &entries)
+{
+    std::ifstream journal(path);
+    std::string line;
+    while (std::getline(journal, line))
+    {
+        std::istringstream fields(line);
+        std::string kind, status, input;
+        JournalEntry entry = {};
+        if (!(fields >> kind))
+            continue;
+        if (kind == "queued" && fields >> entry.landed)
+        {
+            std::getline(fields >> std::ws, input);
+            if (!input.empty())
+                entries[input] = entry;
+        }
+        else if (kind == "done" && fields >> status >> entry.size >> entry.mtime_ns)
+        {
+            std::getline(fields >> std::ws, input);
+            if (input.empty())
+                continue;
+            entry.landed = entries.count(input) ? entries[input].landed : 0;
+            entry.done = 1;
+            entry.ok = status == "ok";
+            entries[input] = entry;
+        }
+        // a line cut short by a crash is skipped, the job runs again
+    }
+}
+
+static int write_entry(FILE *file, const std::string &path, const JournalEntry &entry)
+{
+    if (entry.done)
+        return fprintf(file, "done %s %lld %lld %s\n", entry.ok ? "ok" : "failed", (long long)entry.size,
+                       (long long)entry.mtime_ns, path.c_str());
+    return fprintf(file, "queued %.3f %s\n", entry.landed, path.c_str());
+}
+
+static int sync_file(FILE *file)
+{
+    if (fflush(file) || fsync(fileno(file)))
+        return -1;
+    return 0;
+}
+
+WatchJournal *watch_journal_open(const char *path, std::map<std::string, JournalEntry> &entries)
+{
+    replay(path, entries);
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        struct stat st;
+        if (stat(it->first.c_str(), &st))
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+
+    std::string compacted = std::string(path) + ".tmp";
+    FILE *file = fopen(compacted.c_str(), "w");
+    if (!file)
+    {
+        logging("watch: could not write journal %s", compacted.c_str());
+        return NULL;
+    }
+    int failed = 0;
+    for (const auto &it : entries)
+        failed |= write_entry(file, it.first, it.second) < 0;
+    failed |= sync_file(file);
+    fclose(file);
+    if (failed || rename(compacted.c_str(), path))
+    {
+        logging("watch: could not replace journal %s", path);
+        unlink(compacted.c_str());
+        return NULL;
+    }
+
+    WatchJournal *wj = new WatchJournal();
+    // not inherited by the tools the jobs start
+    wj->file = fopen(path, "ae");
+    if (!wj->file)
+    {
+        logging("watch: could not open journal %s", path);
+        delete wj;
+        return NULL;
+    }
+    return wj;
+}
+
+static int append(WatchJournal *wj, const std::string &path, const JournalEntry &entry)
+{
+    if (write_entry(wj->file, path, entry) < 0 || sync_file(wj->file))
+    {
+        logging("watch: could not append to the journal");
+        return -1;
+    }
+    return 0;
+}
+
+int watch_journal_queued(WatchJournal *wj, const std::string &path, const JournalEntry &entry)
+{
+    JournalEntry queued = entry;
+    queued.done = 0;
+    return append(wj, path, queued);
+}
+
+int watch_journal_done(WatchJournal *wj, const std::string &path, const JournalEntry &entry)
+{
+    JournalEntry done = entry;
+    done.done = 1;
+    return append(wj, path, done);
+}
+
+void watch_journal_close(WatchJournal **wj)
+{
+    if (!*wj)
+        return;
+    fclose((*wj)->file);
+    delete *wj;
+    *wj = NULL;
+}